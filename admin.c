@@ -0,0 +1,625 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifdef _MSC_VER
+#if _MSC_VER < 1900
+#define inline __inline
+#define snprintf _snprintf
+#endif
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#endif
+
+#include "admin.h"
+#include <uv.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#define UVSOCKS_ADMIN_LINE_MAX        256
+#define UVSOCKS_ADMIN_OUT_MIN         4096
+
+/* tunnels or sessions listed per loop iteration */
+#define UVSOCKS_ADMIN_PAGE            64
+
+typedef struct _UvSocksAdminClient UvSocksAdminClient;
+struct _UvSocksAdminClient
+{
+  UvSocksAdmin          *admin;
+  UvSocksAdminClient    *next;
+  UvSocksAdminClient   **prev;
+
+  uv_pipe_t              pipe;
+  char                   in[UVSOCKS_ADMIN_LINE_MAX];
+  size_t                 in_len;
+  int                    reading;
+
+  /* the reply being built or written, reused for every page */
+  char                  *out;
+  size_t                 out_size;
+  size_t                 out_len;
+  uv_write_t             write_req;
+  int                    writing;
+
+  /* a table still going out, a page at a time, and where it is at */
+  void                 (*listing) (UvSocksAdminClient *client);
+  int                    list_tunnel;
+  int                    list_last;
+  int                    list_cursor;
+};
+
+struct _UvSocksAdmin
+{
+  uv_loop_t             *loop;
+  UvSocks               *socks;
+  UvSocksAlloc          *alloc;
+  uv_pipe_t              server;
+  char                   path[128];
+  int                    bound;
+  UvSocksAdminClient    *clients;
+  int                    close;
+
+  void                 (*func) (void *data);
+  void                  *data;
+};
+
+static void
+uvsocks_admin_process (UvSocksAdminClient *client);
+
+static void
+uvsocks_admin_free_real (UvSocksAdmin *admin)
+{
+  if (admin->clients || !admin->close)
+    return;
+
+  /* closing the listener leaves the socket file behind */
+  if (admin->bound)
+    {
+      uv_fs_t req;
+
+      uv_fs_unlink (admin->loop, &req, admin->path, NULL);
+      uv_fs_req_cleanup (&req);
+    }
+
+  if (admin->func)
+    admin->func (admin->data);
+  uvsocks_alloc_free (admin);
+}
+
+static void
+uvsocks_admin_close_server (uv_handle_t *handle)
+{
+  UvSocksAdmin *admin = handle->data;
+
+  admin->close = 1;
+  uvsocks_admin_free_real (admin);
+}
+
+static void
+uvsocks_admin_close_client (uv_handle_t *handle)
+{
+  UvSocksAdminClient *client = handle->data;
+  UvSocksAdmin *admin = client->admin;
+
+  *client->prev = client->next;
+  if (client->next)
+    client->next->prev = client->prev;
+
+  uvsocks_alloc_free (client->out);
+  uvsocks_alloc_free (client);
+
+  if (admin->close)
+    uvsocks_admin_free_real (admin);
+}
+
+static void
+uvsocks_admin_close (UvSocksAdminClient *client)
+{
+  if (!uv_is_closing ((uv_handle_t *) &client->pipe))
+    uv_close ((uv_handle_t *) &client->pipe, uvsocks_admin_close_client);
+}
+
+static void
+uvsocks_admin_printf (UvSocksAdminClient *client,
+                      const char         *format,
+                      ...)
+{
+  va_list args;
+  size_t room;
+  size_t size;
+  char *out;
+  int n;
+
+  while (1)
+    {
+      room = client->out_size - client->out_len;
+
+      va_start (args, format);
+      n = vsnprintf (&client->out[client->out_len], room, format, args);
+      va_end (args);
+
+      if (n < 0)
+        return;
+
+      if ((size_t) n < room)
+        {
+          client->out_len += n;
+          return;
+        }
+
+      size = client->out_size * 2;
+      while (size - client->out_len <= (size_t) n)
+        size *= 2;
+
+      out = uvsocks_alloc_realloc (client->admin->alloc, client->out, size);
+      if (!out)
+        return;
+
+      client->out = out;
+      client->out_size = size;
+    }
+}
+
+/* A port, or the range of them a tunnel forwards, as first-last. */
+static void
+uvsocks_admin_ports (char   *buf,
+                      size_t  size,
+                      int     port,
+                      int     n_ports)
+{
+  if (n_ports > 1)
+    snprintf (buf, size, "%d-%d", port, port + n_ports - 1);
+  else
+    snprintf (buf, size, "%d", port);
+}
+
+static const char *
+uvsocks_admin_kind (const UvSocksParam *param)
+{
+  if (param->frontend == UVSOCKS_FRONTEND_SOCKS5)
+    return "dynamic";
+  if (param->frontend == UVSOCKS_FRONTEND_HTTP)
+    return "http";
+  return param->is_forward ? "local" : "remote";
+}
+
+/* Lists up to a page of tunnels, picking up where the last page ended. */
+static void
+uvsocks_admin_tunnels_page (UvSocksAdminClient *client)
+{
+  UvSocksStats stats[UVSOCKS_ADMIN_PAGE];
+  UvSocks *socks = client->admin->socks;
+  int tunnel;
+  int n;
+  int i;
+
+  tunnel = client->list_cursor;
+  n = uvsocks_get_tunnels (socks,
+                           &client->list_cursor,
+                           stats,
+                           NULL,
+                           UVSOCKS_ADMIN_PAGE);
+  for (i = 0; i < n; i++)
+    {
+      const UvSocksParam *param = uvsocks_get_param (socks, tunnel + i);
+      uint64_t sessions;
+      char listen_ports[16];
+      char destination_ports[16];
+      int s;
+
+      sessions = 0;
+      for (s = 0; s < UVSOCKS_STAGE_MAX; s++)
+        sessions += stats[i].active[s];
+
+      uvsocks_admin_ports (listen_ports,
+                           sizeof (listen_ports),
+                           param->listen_port,
+                           param->n_ports);
+      uvsocks_admin_ports (destination_ports,
+                           sizeof (destination_ports),
+                           param->destination_port,
+                           param->range_destination ? param->n_ports : 1);
+      uvsocks_admin_printf (client,
+                            "%d %s %s:%s %s:%s %llu %d %llu %llu\n",
+                            tunnel + i,
+                            uvsocks_admin_kind (param),
+                            param->listen_host,
+                            listen_ports,
+                            param->destination_host,
+                            destination_ports,
+                            (unsigned long long) sessions,
+                            param->session_limit,
+                            (unsigned long long) stats[i].bytes_in,
+                            (unsigned long long) stats[i].bytes_out);
+    }
+
+  if (n == UVSOCKS_ADMIN_PAGE)
+    return;
+
+  client->listing = NULL;
+  uvsocks_admin_printf (client, "ok\n");
+}
+
+/* Lists up to a page of sessions, picking up where the last page ended. */
+static void
+uvsocks_admin_sessions_page (UvSocksAdminClient *client)
+{
+  UvSocksSessionInfo infos[UVSOCKS_ADMIN_PAGE];
+  UvSocks *socks = client->admin->socks;
+  int n;
+  int i;
+
+  n = 0;
+  while (client->list_tunnel <= client->list_last)
+    {
+      int got;
+
+      got = uvsocks_get_sessions (socks,
+                                  client->list_tunnel,
+                                  &client->list_cursor,
+                                  infos,
+                                  UVSOCKS_ADMIN_PAGE - n);
+      for (i = 0; i < got; i++)
+        uvsocks_admin_printf (client,
+                              "%u %d %llu %d %llu %llu %llu %llu %s\n",
+                              infos[i].id,
+                              infos[i].tunnel,
+                              (unsigned long long) (infos[i].age_usec / 1000),
+                              infos[i].hop,
+                              (unsigned long long) infos[i].bytes_in,
+                              (unsigned long long) infos[i].bytes_out,
+                              (unsigned long long) infos[i].buffered_in,
+                              (unsigned long long) infos[i].buffered_out,
+                              uvsocks_get_stage_string (infos[i].stage));
+
+      n += got;
+      if (n == UVSOCKS_ADMIN_PAGE)
+        return;
+
+      client->list_tunnel++;
+      client->list_cursor = 0;
+    }
+
+  client->listing = NULL;
+  uvsocks_admin_printf (client, "ok\n");
+}
+
+static void
+uvsocks_admin_command (UvSocksAdminClient *client,
+                       const char         *line)
+{
+  UvSocks *socks = client->admin->socks;
+  char command[16];
+  long long a;
+  long long b;
+  int n;
+
+  n = sscanf (line, "%15s %lld %lld", command, &a, &b);
+  if (n <= 0)
+    return;
+
+  if (!strcmp (command, "tunnels") && n == 1)
+    {
+      client->listing = uvsocks_admin_tunnels_page;
+      client->list_cursor = 0;
+
+      uvsocks_admin_printf (client,
+                            "# tunnel kind listen destination sessions limit "
+                            "bytes_in bytes_out\n");
+      uvsocks_admin_tunnels_page (client);
+    }
+  else if (!strcmp (command, "sessions") && n <= 2)
+    {
+      if (n == 2 && (a < 0 || a >= uvsocks_get_n_tunnels (socks)))
+        {
+          uvsocks_admin_printf (client, "error: no tunnel %lld\n", a);
+          return;
+        }
+
+      client->listing = uvsocks_admin_sessions_page;
+      client->list_tunnel = n == 2 ? (int) a : 0;
+      client->list_last = n == 2 ? (int) a : uvsocks_get_n_tunnels (socks) - 1;
+      client->list_cursor = 0;
+
+      uvsocks_admin_printf (client,
+                            "# session tunnel age_msec hop bytes_in bytes_out "
+                            "buffered_in buffered_out stage\n");
+      uvsocks_admin_sessions_page (client);
+    }
+  else if (!strcmp (command, "kill") && n == 2)
+    {
+      if (a <= 0 || a > UINT32_MAX ||
+          uvsocks_kill_session (socks, (uint32_t) a))
+        uvsocks_admin_printf (client, "error: no session %lld\n", a);
+      else
+        uvsocks_admin_printf (client, "ok\n");
+    }
+  else if (!strcmp (command, "limit") && n == 3)
+    {
+      if (b < 0 || b > INT32_MAX)
+        uvsocks_admin_printf (client, "error: bad limit %lld\n", b);
+      else if (a < 0 || a > INT32_MAX ||
+               uvsocks_set_session_limit (socks, (int) a, (int) b))
+        uvsocks_admin_printf (client, "error: no forward tunnel %lld\n", a);
+      else
+        uvsocks_admin_printf (client, "ok\n");
+    }
+  else
+    uvsocks_admin_printf (client,
+                          "error: commands are tunnels, sessions [tunnel], "
+                          "kill <session> and limit <tunnel> <sessions>\n");
+}
+
+static void
+uvsocks_admin_written (uv_write_t *req,
+                       int         status)
+{
+  UvSocksAdminClient *client = req->data;
+
+  client->writing = 0;
+  client->out_len = 0;
+
+  if (status < 0)
+    {
+      uvsocks_admin_close (client);
+      return;
+    }
+
+  if (client->listing)
+    client->listing (client);
+
+  uvsocks_admin_process (client);
+}
+
+static void
+uvsocks_admin_alloc_buffer (uv_handle_t *handle,
+                            size_t       suggested_size,
+                            uv_buf_t    *buf)
+{
+  UvSocksAdminClient *client = handle->data;
+
+  buf->base = &client->in[client->in_len];
+  buf->len = (unsigned int) (sizeof (client->in) - client->in_len);
+}
+
+static void
+uvsocks_admin_read (uv_stream_t    *stream,
+                    ssize_t         nread,
+                    const uv_buf_t *buf)
+{
+  UvSocksAdminClient *client = stream->data;
+
+  if (nread == 0)
+    return;
+
+  if (nread < 0)
+    {
+      uvsocks_admin_close (client);
+      return;
+    }
+
+  client->in_len += nread;
+  uvsocks_admin_process (client);
+}
+
+static int
+uvsocks_admin_flush (UvSocksAdminClient *client)
+{
+  uv_buf_t buf;
+
+  buf = uv_buf_init (client->out, (unsigned int) client->out_len);
+  client->write_req.data = client;
+  if (uv_write (&client->write_req,
+                (uv_stream_t *) &client->pipe,
+                &buf,
+                1,
+                uvsocks_admin_written))
+    return 1;
+
+  client->writing = 1;
+  return 0;
+}
+
+/* Runs the commands read so far with one reply in flight at a time, so the
+   next page of a table is built only once the last one is written.
+   Reading waits meanwhile, which keeps a client from queueing up work. */
+static void
+uvsocks_admin_process (UvSocksAdminClient *client)
+{
+  while (!client->writing)
+    {
+      if (client->out_len == 0)
+        {
+          char *end;
+          size_t len;
+
+          end = memchr (client->in, '\n', client->in_len);
+          if (end)
+            {
+              len = end - client->in + 1;
+              *end = '\0';
+              if (end > client->in && end[-1] == '\r')
+                end[-1] = '\0';
+
+              uvsocks_admin_command (client, client->in);
+
+              client->in_len -= len;
+              memmove (client->in, &client->in[len], client->in_len);
+            }
+          else if (client->in_len == sizeof (client->in))
+            {
+              client->in_len = 0;
+              uvsocks_admin_printf (client, "error: line too long\n");
+            }
+          else
+            break;
+
+          if (client->out_len == 0)
+            continue;
+        }
+
+      if (uvsocks_admin_flush (client))
+        {
+          uvsocks_admin_close (client);
+          return;
+        }
+    }
+
+  if (client->writing)
+    {
+      if (client->reading)
+        uv_read_stop ((uv_stream_t *) &client->pipe);
+      client->reading = 0;
+    }
+  else if (!client->reading)
+    {
+      if (uv_read_start ((uv_stream_t *) &client->pipe,
+                         uvsocks_admin_alloc_buffer,
+                         uvsocks_admin_read))
+        {
+          uvsocks_admin_close (client);
+          return;
+        }
+      client->reading = 1;
+    }
+}
+
+static void
+uvsocks_admin_new_connection (uv_stream_t *stream,
+                              int          status)
+{
+  UvSocksAdmin *admin = stream->data;
+  UvSocksAdminClient *client;
+
+  if (status < 0)
+    return;
+
+  client = uvsocks_alloc_calloc (admin->alloc, 1, sizeof (UvSocksAdminClient));
+  if (!client)
+    return;
+
+  client->out_size = UVSOCKS_ADMIN_OUT_MIN;
+  client->out = uvsocks_alloc_malloc (admin->alloc, client->out_size);
+  if (!client->out)
+    {
+      uvsocks_alloc_free (client);
+      return;
+    }
+
+  client->admin = admin;
+  client->pipe.data = client;
+  uv_pipe_init (admin->loop, &client->pipe, 0);
+
+  client->next = admin->clients;
+  if (client->next)
+    client->next->prev = &client->next;
+  client->prev = &admin->clients;
+  admin->clients = client;
+
+  if (uv_accept (stream, (uv_stream_t *) &client->pipe))
+    {
+      uvsocks_admin_close (client);
+      return;
+    }
+
+  uvsocks_admin_process (client);
+}
+
+void
+uvsocks_unlink_stale_socket (const char *path)
+{
+#ifndef _WIN32
+  struct sockaddr_un addr;
+  struct stat st;
+  int fd;
+  int r;
+
+  if (lstat (path, &st) || !S_ISSOCK (st.st_mode) ||
+      strlen (path) >= sizeof (addr.sun_path))
+    return;
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+  r = connect (fd, (struct sockaddr *) &addr, sizeof (addr));
+  if (r < 0 && errno == ECONNREFUSED)
+    unlink (path);
+  close (fd);
+#endif
+}
+
+UvSocksAdmin *
+uvsocks_admin_new (void         *uv_loop,
+                   UvSocks      *socks,
+                   const char   *path,
+                   UvSocksAlloc *alloc)
+{
+  UvSocksAdmin *admin;
+
+  if (!uv_loop || !socks || !path)
+    return NULL;
+
+  if (strlen (path) >= sizeof (admin->path))
+    return NULL;
+
+  admin = uvsocks_alloc_calloc (alloc, 1, sizeof (UvSocksAdmin));
+  if (!admin)
+    return NULL;
+
+  admin->loop = uv_loop;
+  admin->socks = socks;
+  admin->alloc = alloc;
+  strcpy (admin->path, path);
+
+  uv_pipe_init (admin->loop, &admin->server, 0);
+  admin->server.data = admin;
+  uvsocks_unlink_stale_socket (admin->path);
+  if (uv_pipe_bind (&admin->server, admin->path))
+    {
+      uv_close ((uv_handle_t *) &admin->server, uvsocks_admin_close_server);
+      return NULL;
+    }
+
+  admin->bound = 1;
+  if (uv_listen ((uv_stream_t *) &admin->server,
+                 16,
+                 uvsocks_admin_new_connection))
+    {
+      uv_close ((uv_handle_t *) &admin->server, uvsocks_admin_close_server);
+      return NULL;
+    }
+
+  return admin;
+}
+
+void
+uvsocks_admin_free (UvSocksAdmin  *admin,
+                    void         (*func) (void *data),
+                    void          *data)
+{
+  UvSocksAdminClient *client;
+
+  if (!admin)
+    return;
+
+  admin->func = func;
+  admin->data = data;
+
+  for (client = admin->clients; client; client = client->next)
+    uvsocks_admin_close (client);
+
+  uv_close ((uv_handle_t *) &admin->server, uvsocks_admin_close_server);
+}
@@ -0,0 +1,44 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifndef __ADMIN_H__
+#define __ADMIN_H__
+
+#include "uvsocks.h"
+#include "alloc.h"
+
+typedef struct _UvSocksAdmin UvSocksAdmin;
+
+/* Serves line commands on the Unix domain socket, or named pipe, at path:
+
+     tunnels                    one line per tunnel
+     sessions [tunnel]          one line per session, of one tunnel or all
+     kill <session>             closes a session
+     limit <tunnel> <sessions>  caps the sessions of a tunnel, 0 for none
+
+   Every reply ends with a line that is either "ok" or starts with
+   "error: ".  Long tables go out a page per loop iteration, each once the
+   previous one is written.  uv_loop must be the loop of uvsocks,
+   and this must be called from the thread running it; memory comes from
+   alloc. */
+UvSocksAdmin *
+uvsocks_admin_new (void         *uv_loop,
+                   UvSocks      *uvsocks,
+                   const char   *path,
+                   UvSocksAlloc *alloc);
+
+/* Closes the listener and every client, removes path and calls func with
+   data once all is closed. */
+void
+uvsocks_admin_free (UvSocksAdmin  *admin,
+                    void         (*func) (void *data),
+                    void          *data);
+
+/* Removes the Unix domain socket at path when nothing listens on it any
+   more, as left behind by a process that died, so that it can be bound
+   again.  Anything else at path, or a socket still listened on, is left
+   alone.  Does nothing on Windows. */
+void
+uvsocks_unlink_stale_socket (const char *path);
+
+#endif /* __ADMIN_H__ */
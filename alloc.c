@@ -0,0 +1,313 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#include "alloc.h"
+#include <uv.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined (__GNUC__) || defined (__clang__)
+#define UVSOCKS_ALLOC_GET(c)        __atomic_load_n (&(c), __ATOMIC_RELAXED)
+#define UVSOCKS_ALLOC_SET(c, v)     __atomic_store_n (&(c), (v), __ATOMIC_RELAXED)
+#define UVSOCKS_ALLOC_ADD(c, n)     __atomic_add_fetch (&(c), (n), __ATOMIC_RELAXED)
+#define UVSOCKS_ALLOC_SUB(c, n)     __atomic_sub_fetch (&(c), (n), __ATOMIC_RELAXED)
+#define UVSOCKS_ALLOC_CAS(c, o, n)                                      \
+  __atomic_compare_exchange_n (&(c), &(o), (n), 1,                      \
+                               __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+#define UVSOCKS_ALLOC_GET(c)        (*(volatile uint64_t *) &(c))
+#define UVSOCKS_ALLOC_SET(c, v)     (*(volatile uint64_t *) &(c) = (v))
+#define UVSOCKS_ALLOC_ADD(c, n)                                         \
+  ((uint64_t) InterlockedAdd64 ((volatile LONG64 *) &(c), (LONG64) (n)))
+#define UVSOCKS_ALLOC_SUB(c, n)                                         \
+  ((uint64_t) InterlockedAdd64 ((volatile LONG64 *) &(c), -(LONG64) (n)))
+#define UVSOCKS_ALLOC_CAS(c, o, n)  uvsocks_alloc_cas (&(c), &(o), (n))
+
+static int
+uvsocks_alloc_cas (uint64_t *c,
+                   uint64_t *old,
+                   uint64_t  value)
+{
+  uint64_t prev;
+
+  prev = (uint64_t) InterlockedCompareExchange64 ((volatile LONG64 *) c,
+                                                  (LONG64) value,
+                                                  (LONG64) *old);
+  if (prev == *old)
+    return 1;
+  *old = prev;
+  return 0;
+}
+#endif
+
+/* Right in front of every block handed out; its size keeps what follows
+   as aligned as malloc () would. */
+typedef struct _UvSocksAllocHeader UvSocksAllocHeader;
+struct _UvSocksAllocHeader
+{
+  UvSocksAlloc *alloc;
+  size_t        size;         /* of the whole block, this included */
+  size_t        offset;       /* from the start of the block to past this */
+  size_t        pad;
+};
+
+static void *
+uvsocks_alloc_default_malloc (size_t  size,
+                              void   *data)
+{
+  return malloc (size);
+}
+
+static void
+uvsocks_alloc_default_free (void   *ptr,
+                            size_t  size,
+                            void   *data)
+{
+  free (ptr);
+}
+
+void
+uvsocks_alloc_init (UvSocksAlloc           *alloc,
+                    const UvSocksAllocator *allocator,
+                    uint64_t                limit)
+{
+  memset (alloc, 0, sizeof (*alloc));
+  if (allocator && allocator->malloc && allocator->free)
+    memcpy (&alloc->allocator, allocator, sizeof (UvSocksAllocator));
+  else
+    {
+      alloc->allocator.malloc = uvsocks_alloc_default_malloc;
+      alloc->allocator.free = uvsocks_alloc_default_free;
+    }
+  alloc->limit = limit;
+}
+
+/* Counts size in before it is allocated, so threads racing for the last
+   bytes below the limit cannot both get them. */
+static int
+uvsocks_alloc_reserve (UvSocksAlloc *alloc,
+                       size_t        size)
+{
+  uint64_t limit;
+  uint64_t bytes;
+  uint64_t peak;
+
+  limit = UVSOCKS_ALLOC_GET (alloc->limit);
+  bytes = UVSOCKS_ALLOC_ADD (alloc->bytes, size);
+  if (limit && bytes > limit)
+    {
+      UVSOCKS_ALLOC_SUB (alloc->bytes, size);
+      UVSOCKS_ALLOC_ADD (alloc->refused, 1);
+      return -1;
+    }
+
+  peak = UVSOCKS_ALLOC_GET (alloc->peak);
+  while (bytes > peak && !UVSOCKS_ALLOC_CAS (alloc->peak, peak, bytes))
+    ;
+
+  return 0;
+}
+
+static void
+uvsocks_alloc_unreserve (UvSocksAlloc *alloc,
+                         size_t        size)
+{
+  UVSOCKS_ALLOC_SUB (alloc->bytes, size);
+  UVSOCKS_ALLOC_ADD (alloc->refused, 1);
+}
+
+static void *
+uvsocks_alloc_block (UvSocksAlloc *alloc,
+                     char         *base,
+                     size_t        size,
+                     size_t        offset)
+{
+  UvSocksAllocHeader *header;
+
+  header = (UvSocksAllocHeader *) &base[offset] - 1;
+  header->alloc = alloc;
+  header->size = size;
+  header->offset = offset;
+
+  return &base[offset];
+}
+
+void *
+uvsocks_alloc_malloc (UvSocksAlloc *alloc,
+                      size_t        size)
+{
+  char *base;
+
+  if (size > SIZE_MAX - sizeof (UvSocksAllocHeader))
+    return NULL;
+
+  size += sizeof (UvSocksAllocHeader);
+  if (uvsocks_alloc_reserve (alloc, size))
+    return NULL;
+
+  base = alloc->allocator.malloc (size, alloc->allocator.data);
+  if (!base)
+    {
+      uvsocks_alloc_unreserve (alloc, size);
+      return NULL;
+    }
+
+  return uvsocks_alloc_block (alloc, base, size, sizeof (UvSocksAllocHeader));
+}
+
+void *
+uvsocks_alloc_calloc (UvSocksAlloc *alloc,
+                      size_t        n,
+                      size_t        size)
+{
+  void *ptr;
+
+  if (size && n > SIZE_MAX / size)
+    return NULL;
+
+  ptr = uvsocks_alloc_malloc (alloc, n * size);
+  if (ptr)
+    memset (ptr, 0, n * size);
+
+  return ptr;
+}
+
+void *
+uvsocks_alloc_aligned (UvSocksAlloc *alloc,
+                       size_t        alignment,
+                       size_t        size)
+{
+  char *base;
+  size_t total;
+  size_t offset;
+
+  /* the header takes the first alignment bytes, or those in front of the
+     first aligned address past it */
+  if (alignment < sizeof (UvSocksAllocHeader))
+    alignment = sizeof (UvSocksAllocHeader);
+  if (size > SIZE_MAX / 2 - alignment)
+    return NULL;
+
+  if (alloc->allocator.aligned_alloc)
+    {
+      total = alignment + ((size + alignment - 1) & ~(alignment - 1));
+      if (uvsocks_alloc_reserve (alloc, total))
+        return NULL;
+
+      base = alloc->allocator.aligned_alloc (alignment,
+                                             total,
+                                             alloc->allocator.data);
+      offset = alignment;
+    }
+  else
+    {
+      total = sizeof (UvSocksAllocHeader) + alignment + size;
+      if (uvsocks_alloc_reserve (alloc, total))
+        return NULL;
+
+      base = alloc->allocator.malloc (total, alloc->allocator.data);
+      offset = 0;
+      if (base)
+        offset = ((((uintptr_t) base + sizeof (UvSocksAllocHeader) +
+                    alignment - 1) & ~(uintptr_t) (alignment - 1)) -
+                  (uintptr_t) base);
+    }
+
+  if (!base)
+    {
+      uvsocks_alloc_unreserve (alloc, total);
+      return NULL;
+    }
+
+  return uvsocks_alloc_block (alloc, base, total, offset);
+}
+
+void *
+uvsocks_alloc_realloc (UvSocksAlloc *alloc,
+                       void         *ptr,
+                       size_t        size)
+{
+  UvSocksAllocHeader *header;
+  size_t old_size;
+  void *moved;
+
+  if (!ptr)
+    return uvsocks_alloc_malloc (alloc, size);
+
+  header = (UvSocksAllocHeader *) ptr - 1;
+  old_size = header->size - header->offset;
+
+  moved = uvsocks_alloc_malloc (alloc, size);
+  if (!moved)
+    return NULL;
+
+  memcpy (moved, ptr, old_size < size ? old_size : size);
+  uvsocks_alloc_free (ptr);
+
+  return moved;
+}
+
+void
+uvsocks_alloc_free (void *ptr)
+{
+  UvSocksAllocHeader *header;
+  UvSocksAllocator allocator;
+  UvSocksAlloc *alloc;
+  size_t size;
+  char *base;
+
+  if (!ptr)
+    return;
+
+  header = (UvSocksAllocHeader *) ptr - 1;
+  alloc = header->alloc;
+  size = header->size;
+  base = (char *) ptr - header->offset;
+
+  /* alloc may live in the very block being freed */
+  memcpy (&allocator, &alloc->allocator, sizeof (UvSocksAllocator));
+  UVSOCKS_ALLOC_SUB (alloc->bytes, size);
+  allocator.free (base, size, allocator.data);
+}
+
+void *
+uvsocks_alloc_new (const UvSocksAllocator *allocator,
+                   uint64_t                limit,
+                   size_t                  size,
+                   size_t                  offset)
+{
+  UvSocksAllocHeader *header;
+  UvSocksAlloc first;
+  UvSocksAlloc *alloc;
+  char *ptr;
+
+  uvsocks_alloc_init (&first, allocator, limit);
+  ptr = uvsocks_alloc_calloc (&first, 1, size);
+  if (!ptr)
+    return NULL;
+
+  alloc = (UvSocksAlloc *) &ptr[offset];
+  memcpy (alloc, &first, sizeof (UvSocksAlloc));
+  header = (UvSocksAllocHeader *) ptr - 1;
+  header->alloc = alloc;
+
+  return ptr;
+}
+
+void
+uvsocks_alloc_set_limit (UvSocksAlloc *alloc,
+                         uint64_t      limit)
+{
+  UVSOCKS_ALLOC_SET (alloc->limit, limit);
+}
+
+void
+uvsocks_alloc_get (UvSocksAlloc  *alloc,
+                   UvSocksMemory *memory)
+{
+  memory->bytes = UVSOCKS_ALLOC_GET (alloc->bytes);
+  memory->peak = UVSOCKS_ALLOC_GET (alloc->peak);
+  memory->limit = UVSOCKS_ALLOC_GET (alloc->limit);
+  memory->refused = UVSOCKS_ALLOC_GET (alloc->refused);
+}
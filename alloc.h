@@ -0,0 +1,80 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifndef __ALLOC_H__
+#define __ALLOC_H__
+
+#include "uvsocks.h"
+
+/* The memory of one uvsocks: every block comes from allocator and is
+   counted in bytes, header included.  Each block starts with a small
+   header naming its UvSocksAlloc, so a block is freed without knowing
+   where it came from, e.g. from a libuv close or write callback.  Blocks
+   may be allocated and freed from any thread. */
+typedef struct _UvSocksAlloc UvSocksAlloc;
+struct _UvSocksAlloc
+{
+  UvSocksAllocator allocator;
+
+  uint64_t         bytes;
+  uint64_t         peak;
+  uint64_t         limit;       /* 0 for none */
+  uint64_t         refused;
+};
+
+/* Takes the functions of allocator, or malloc () and free () when it is
+   NULL. */
+void
+uvsocks_alloc_init (UvSocksAlloc           *alloc,
+                    const UvSocksAllocator *allocator,
+                    uint64_t                limit);
+
+/* Allocates a zeroed block of size that holds the UvSocksAlloc it comes
+   from offset bytes into it, such as a struct with one as a member, and
+   initializes that as above.  The block is counted in it like any other
+   and freed by uvsocks_alloc_free () last. */
+void *
+uvsocks_alloc_new (const UvSocksAllocator *allocator,
+                   uint64_t                limit,
+                   size_t                  size,
+                   size_t                  offset);
+
+/* Returns NULL when the allocator fails, or when size would take alloc
+   past its limit. */
+void *
+uvsocks_alloc_malloc (UvSocksAlloc *alloc,
+                      size_t        size);
+
+void *
+uvsocks_alloc_calloc (UvSocksAlloc *alloc,
+                      size_t        n,
+                      size_t        size);
+
+/* Aligns to alignment, a power of two, using allocator.aligned_alloc when
+   there is one, or else a block from allocator.malloc large enough to
+   align within. */
+void *
+uvsocks_alloc_aligned (UvSocksAlloc *alloc,
+                       size_t        alignment,
+                       size_t        size);
+
+/* Like realloc (), except that a block is never grown in place: the
+   allocator has no realloc (), so it moves. */
+void *
+uvsocks_alloc_realloc (UvSocksAlloc *alloc,
+                       void         *ptr,
+                       size_t        size);
+
+/* Frees a block of any UvSocksAlloc, or nothing when ptr is NULL. */
+void
+uvsocks_alloc_free (void *ptr);
+
+void
+uvsocks_alloc_set_limit (UvSocksAlloc *alloc,
+                         uint64_t      limit);
+
+void
+uvsocks_alloc_get (UvSocksAlloc  *alloc,
+                   UvSocksMemory *memory);
+
+#endif /* __ALLOC_H__ */
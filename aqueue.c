@@ -56,15 +56,24 @@ aqueue_pop_unlocked (AQueue *aqueue)
 }
 
 AQueue *
-aqueue_new (int max_elements)
+aqueue_new (int           max_elements,
+            UvSocksAlloc *alloc)
 {
   AQueue *aqueue;
 
   if (max_elements <= 0)
     max_elements = 512;
 
-  aqueue = malloc (sizeof (AQueue));
-  aqueue->elements = calloc (max_elements, sizeof (void *));
+  aqueue = uvsocks_alloc_malloc (alloc, sizeof (AQueue));
+  if (!aqueue)
+    return NULL;
+
+  aqueue->elements = uvsocks_alloc_calloc (alloc, max_elements, sizeof (void *));
+  if (!aqueue->elements)
+    {
+      uvsocks_alloc_free (aqueue);
+      return NULL;
+    }
   aqueue->max = max_elements;
   aqueue->head = 0;
   aqueue->tail = 0;
@@ -93,11 +102,11 @@ aqueue_destroy (AQueue *aqueue,
         if (element)
           destroy (element);
       }
-  free (aqueue->elements);
+  uvsocks_alloc_free (aqueue->elements);
 
   uv_mutex_destroy (&aqueue->mutex);
   uv_cond_destroy (&aqueue->cond);
-  free (aqueue);
+  uvsocks_alloc_free (aqueue);
 }
 
 int
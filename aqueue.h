@@ -4,10 +4,14 @@
 #ifndef __AQUEUE_H__
 #define __AQUEUE_H__
 
+#include "alloc.h"
+
 typedef struct _AQueue AQueue;
 
+/* Returns NULL when alloc has no memory for it. */
 AQueue *
-aqueue_new (int max_elements);
+aqueue_new (int           max_elements,
+            UvSocksAlloc *alloc);
 
 void
 aqueue_destroy (AQueue *aqueue,
@@ -0,0 +1,166 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+/* Echoes every connection back to itself, or with -s only reads and
+   discards, for uvsocks benchmarks on loopback. */
+
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define ECHO_BUF_MAX            (64 * 1024)
+
+typedef struct _EchoConn EchoConn;
+struct _EchoConn
+{
+  uv_tcp_t              tcp;
+  char                  buf[ECHO_BUF_MAX];
+  uv_write_t            write_req;
+};
+
+static uv_loop_t *echo_loop;
+static int echo_sink;
+
+static void
+echo_read (uv_stream_t    *stream,
+           ssize_t         nread,
+           const uv_buf_t *buf);
+
+static void
+echo_close_handle (uv_handle_t *handle)
+{
+  free (handle->data);
+}
+
+static void
+echo_close (EchoConn *conn)
+{
+  if (!uv_is_closing ((uv_handle_t *) &conn->tcp))
+    uv_close ((uv_handle_t *) &conn->tcp, echo_close_handle);
+}
+
+static void
+echo_alloc_buffer (uv_handle_t *handle,
+                   size_t       suggested_size,
+                   uv_buf_t    *buf)
+{
+  EchoConn *conn = handle->data;
+
+  buf->base = conn->buf;
+  buf->len = sizeof (conn->buf);
+}
+
+static void
+echo_written (uv_write_t *req,
+              int         status)
+{
+  EchoConn *conn = req->data;
+
+  if (status < 0)
+    {
+      echo_close (conn);
+      return;
+    }
+
+  uv_read_start ((uv_stream_t *) &conn->tcp, echo_alloc_buffer, echo_read);
+}
+
+static void
+echo_read (uv_stream_t    *stream,
+           ssize_t         nread,
+           const uv_buf_t *buf)
+{
+  EchoConn *conn = stream->data;
+  uv_buf_t rest;
+  int ret;
+
+  if (nread < 0)
+    {
+      echo_close (conn);
+      return;
+    }
+
+  if (nread == 0 || echo_sink)
+    return;
+
+  rest = uv_buf_init (conn->buf, (unsigned int) nread);
+  ret = uv_try_write (stream, &rest, 1);
+  if (ret == nread)
+    return;
+  if (ret < 0 && ret != UV_EAGAIN)
+    {
+      echo_close (conn);
+      return;
+    }
+  if (ret < 0)
+    ret = 0;
+
+  /* the buffer is reused by the next read, so wait for the write */
+  uv_read_stop (stream);
+  rest = uv_buf_init (&conn->buf[ret], (unsigned int) (nread - ret));
+  conn->write_req.data = conn;
+  if (uv_write (&conn->write_req, stream, &rest, 1, echo_written))
+    echo_close (conn);
+}
+
+static void
+echo_new_connection (uv_stream_t *server,
+                     int          status)
+{
+  EchoConn *conn;
+
+  if (status < 0)
+    return;
+
+  conn = malloc (sizeof (*conn));
+  if (!conn)
+    return;
+
+  conn->tcp.data = conn;
+  uv_tcp_init (echo_loop, &conn->tcp);
+  if (uv_accept (server, (uv_stream_t *) &conn->tcp) ||
+      uv_read_start ((uv_stream_t *) &conn->tcp, echo_alloc_buffer, echo_read))
+    echo_close (conn);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  struct sockaddr_in addr;
+  uv_tcp_t server;
+  int port;
+  int c;
+
+  port = 7000;
+  while ((c = getopt (argc, argv, "p:s")) != -1)
+    switch (c)
+      {
+      case 'p':
+        port = atoi (optarg);
+        break;
+      case 's':
+        echo_sink = 1;
+        break;
+      default:
+        fprintf (stderr, "usage: echo-server [-p port] [-s]\n");
+        return 1;
+      }
+
+  /* peers reset on purpose; a write must fail, not kill us */
+  signal (SIGPIPE, SIG_IGN);
+  echo_loop = uv_default_loop ();
+  uv_ip4_addr ("127.0.0.1", port, &addr);
+  uv_tcp_init (echo_loop, &server);
+  if (uv_tcp_bind (&server, (const struct sockaddr *) &addr, 0) ||
+      uv_listen ((uv_stream_t *) &server, 1024, echo_new_connection))
+    {
+      fprintf (stderr, "echo-server: cannot listen on port %d\n", port);
+      return 1;
+    }
+
+  return uv_run (echo_loop, UV_RUN_DEFAULT);
+}
@@ -0,0 +1,130 @@
+#!/bin/sh
+# Runs uvsocks on loopback against bench/socks-server playing a bad proxy
+# (slow handshakes, throttled reads, tiny windows, partial writes and
+# resets), then against a good one again, and prints the results as one
+# JSON object.  Fails when uvsocks dies, its peak resident set grows more
+# than RSS_LIMIT_KIB over idle, or throughput does not recover to half of
+# the baseline.
+#
+# usage: bench/faults.sh [seconds]
+#
+# Run from the build directory after "ninja bench".  Ports 17100-17101,
+# 11100-11101 and 18100-18102 must be free.
+
+seconds=${1:-5}
+dir=$(pwd)
+rss_limit=${RSS_LIMIT_KIB:-65536}
+
+ulimit -n "$(ulimit -Hn)" 2>/dev/null
+
+pids=""
+proxy=""
+cleanup ()
+{
+  [ -n "$pids$proxy" ] && kill $pids $proxy 2>/dev/null
+  wait 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+
+start_proxy ()
+{
+  if [ -n "$proxy" ]; then
+    kill "$proxy" 2>/dev/null
+    wait "$proxy" 2>/dev/null
+  fi
+  "$dir/bench/socks-server" -p 11100 -u bench -w bench "$@" &
+  proxy=$!
+  sleep 0.2
+}
+
+field ()
+{
+  echo "$1" | sed -n "s/.*\"$2\": \([0-9.-]*\).*/\1/p"
+}
+
+"$dir/bench/echo-server" -p 17100 &
+pids="$pids $!"
+"$dir/bench/echo-server" -p 17101 -s &
+pids="$pids $!"
+start_proxy
+
+"$dir/uvsocks" -q -L 18100:127.0.0.1:17100 -L 18101:127.0.0.1:17101 \
+  bench:bench@127.0.0.1:11100 2>/dev/null &
+uvsocks=$!
+pids="$pids $uvsocks"
+sleep 0.5
+
+rss_idle=$(sed -n 's/^VmRSS:[^0-9]*\([0-9]*\).*/\1/p' "/proc/$uvsocks/status")
+results=""
+failed=""
+
+# scenario name "proxy options" loadgen options...
+scenario ()
+{
+  name=$1
+  faults=$2
+  shift 2
+
+  start_proxy $faults
+  out=$("$dir/bench/loadgen" -d "$seconds" -P "$uvsocks" "$@")
+  if [ -z "$out" ]; then
+    failed="$failed $name"
+    out="null"
+  fi
+  if ! kill -0 "$uvsocks" 2>/dev/null; then
+    failed="$failed $name:uvsocks-died"
+  fi
+
+  rss=$(field "$out" rss_max_kib)
+  if [ -n "$rss" ] && [ "$rss" -gt $((rss_idle + rss_limit)) ]; then
+    failed="$failed $name:rss"
+  fi
+
+  results="$results${results:+,
+}  \"$name\": {\"faults\": \"$faults\", \"result\": $out}"
+  eval "out_$(echo "$name" | tr - _)=\$out"
+}
+
+scenario baseline "" -p 18100 -m throughput -c 4
+scenario slow-handshake "-d greeting:20 -d auth:20 -d reply:100" \
+  -p 18100 -m connect -c 32
+scenario throttled "-t 1048576" -p 18100 -m throughput -c 16
+scenario throttled-upload "-t 1048576" -p 18101 -m upload -c 16
+scenario tiny-windows "-b 4096" -p 18100 -m throughput -c 4
+scenario partial-writes "-x 100" -p 18100 -m throughput -c 4
+scenario resets "-r 4194304" -p 18100 -m throughput -c 8
+scenario recovery "" -p 18100 -m throughput -c 4
+
+# the longest names a tunnel takes, all sent in one go with -P: 63 byte
+# credentials and a 127 byte destination, 127.0.0.1 spelt out in hex
+long_user=$(printf 'u%.0s' $(seq 63))
+long_password=$(printf 'p%.0s' $(seq 63))
+long_host=0x$(printf '0%.0s' $(seq 117))7f.0.0.1
+"$dir/bench/socks-server" -p 11101 -u "$long_user" -w "$long_password" &
+pids="$pids $!"
+"$dir/uvsocks" -q -P -L "18102:$long_host:17100" \
+  "$long_user:$long_password@127.0.0.1:11101" 2>/dev/null &
+pids="$pids $!"
+sleep 0.5
+out_long_names=$("$dir/bench/loadgen" -d 1 -p 18102 -m connect -c 4)
+results="$results,
+  \"long-names\": {\"faults\": \"\", \"result\": ${out_long_names:-null}}"
+if [ "$(field "$out_long_names" completed)" = "0" ] ||
+   [ -z "$out_long_names" ]; then
+  failed="$failed long-names"
+fi
+
+baseline=$(field "$out_baseline" gbit_per_sec)
+recovery=$(field "$out_recovery" gbit_per_sec)
+if [ -z "$baseline" ] || [ -z "$recovery" ] ||
+   awk "BEGIN { exit !($recovery < $baseline / 2) }"; then
+  failed="$failed recovery:throughput"
+fi
+if [ "$(field "$out_slow_handshake" completed)" = "0" ]; then
+  failed="$failed slow-handshake:completed"
+fi
+
+printf '{\n  "rss_idle_kib": %s,\n%s,\n  "failed": "%s"\n}\n' \
+  "$rss_idle" "$results" "${failed# }"
+
+[ -z "$failed" ]
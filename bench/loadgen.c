@@ -0,0 +1,701 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+/* Drives load through a uvsocks tunnel on loopback and prints the result
+   as one JSON object:
+
+     throughput  streams data through an echo server, counting what comes
+                 back, with a bounded window in flight per connection
+     upload      streams data to a sink server, counting what is written
+     connect     opens, pings once and closes connections, timing each
+                 from connect until the echo arrives
+     sessions    holds -n sessions open and reports how much the resident
+                 set of process -P grew per thousand of them
+     ping        bounces a small message off an echo server over and over,
+                 timing each round trip; run it next to a throughput run
+                 to see how a busy tunnel delays a quiet one
+
+   Streams that break are opened again, so a run survives a proxy that
+   resets connections.  With -P, the peak resident set of that process
+   during the run is reported as well, and for streams the CPU time it
+   spent and so the cycles it took per byte counted, at the clock rate in
+   /proc/cpuinfo. */
+
+#include "../histogram.h"
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define LOAD_CHUNK              (64 * 1024)
+#define LOAD_WINDOW             (1024 * 1024)
+#define LOAD_BUF_MAX            (64 * 1024)
+#define LOAD_RSS_INTERVAL       100
+#define LOAD_PING_SIZE          64
+
+typedef enum _LoadMode
+{
+  LOAD_THROUGHPUT,
+  LOAD_UPLOAD,
+  LOAD_CONNECT,
+  LOAD_SESSIONS,
+  LOAD_PING,
+} LoadMode;
+
+typedef struct _LoadConn LoadConn;
+struct _LoadConn
+{
+  uv_tcp_t              tcp;
+  uv_connect_t          connect;
+  uv_write_t            write_req;
+  int                   writing;
+  int                   established;
+  uint64_t              start;
+  uint64_t              sent;
+  uint64_t              received;
+  char                  buf[LOAD_BUF_MAX];
+};
+
+static uv_loop_t *load_loop;
+static LoadMode load_mode;
+static const char *load_mode_name = "throughput";
+static struct sockaddr_in load_addr;
+static int load_port = 18100;
+static int load_concurrency = 4;
+static int load_seconds = 5;
+static int load_sessions = 1000;
+static int load_pid;
+static char load_chunk[LOAD_CHUNK];
+static uv_timer_t load_timer;
+static uv_timer_t load_rss_timer;
+static int load_stopping;
+
+static uint64_t load_start;
+static int load_n_connected;
+static uint64_t load_sent;
+static uint64_t load_received;
+static uint64_t load_bytes_start;
+static uint64_t load_reconnects;
+
+static int load_started;
+static int load_pending;
+static uint64_t load_completed;
+static uint64_t load_failed;
+static Histogram load_latency;
+static long load_rss_before;
+static long load_rss_max = -1;
+static double load_cpu_start;
+
+static void
+load_start_one (void);
+
+static void
+load_read (uv_stream_t    *stream,
+           ssize_t         nread,
+           const uv_buf_t *buf);
+
+static long
+load_read_rss (int pid)
+{
+  char path[64];
+  char line[256];
+  long rss;
+  FILE *file;
+
+  snprintf (path, sizeof (path), "/proc/%d/status", pid);
+  file = fopen (path, "r");
+  if (!file)
+    return -1;
+
+  rss = -1;
+  while (fgets (line, sizeof (line), file))
+    if (!strncmp (line, "VmRSS:", 6))
+      {
+        rss = strtol (&line[6], NULL, 10);
+        break;
+      }
+
+  fclose (file);
+  return rss;
+}
+
+/* User and system time of process pid so far, in seconds. */
+static double
+load_read_cpu (int pid)
+{
+  char path[64];
+  char line[1024];
+  unsigned long long utime;
+  unsigned long long stime;
+  char *p;
+  FILE *file;
+  int ok;
+
+  snprintf (path, sizeof (path), "/proc/%d/stat", pid);
+  file = fopen (path, "r");
+  if (!file)
+    return -1;
+
+  ok = fgets (line, sizeof (line), file) != NULL;
+  fclose (file);
+
+  /* the fields after the command name, which may hold anything */
+  p = ok ? strrchr (line, ')') : NULL;
+  if (!p ||
+      sscanf (p + 2,
+              "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+              &utime,
+              &stime) != 2)
+    return -1;
+
+  return (double) (utime + stime) / sysconf (_SC_CLK_TCK);
+}
+
+static double
+load_read_cpu_hz (void)
+{
+  char line[256];
+  double mhz;
+  FILE *file;
+
+  file = fopen ("/proc/cpuinfo", "r");
+  if (!file)
+    return -1;
+
+  mhz = -1;
+  while (fgets (line, sizeof (line), file))
+    if (!strncmp (line, "cpu MHz", 7) &&
+        sscanf (strchr (line, ':') + 1, "%lf", &mhz) == 1)
+      break;
+
+  fclose (file);
+  return mhz > 0 ? mhz * 1e6 : -1;
+}
+
+static void
+load_sample_rss (uv_timer_t *timer)
+{
+  long rss = load_read_rss (load_pid);
+
+  if (rss > load_rss_max)
+    load_rss_max = rss;
+}
+
+static void
+load_close_handle (uv_handle_t *handle)
+{
+  LoadConn *conn = handle->data;
+
+  free (conn);
+
+  /* every mode but sessions keeps load_concurrency connections going */
+  if (load_mode == LOAD_SESSIONS || load_stopping)
+    return;
+
+  /* a stream only ends when something broke it */
+  if (load_mode != LOAD_CONNECT)
+    load_reconnects++;
+  load_start_one ();
+}
+
+static void
+load_close (LoadConn *conn)
+{
+  if (!uv_is_closing ((uv_handle_t *) &conn->tcp))
+    uv_close ((uv_handle_t *) &conn->tcp, load_close_handle);
+}
+
+static void
+load_alloc_buffer (uv_handle_t *handle,
+                   size_t       suggested_size,
+                   uv_buf_t    *buf)
+{
+  LoadConn *conn = handle->data;
+
+  buf->base = conn->buf;
+  buf->len = sizeof (conn->buf);
+}
+
+static double
+load_elapsed (void)
+{
+  return (uv_hrtime () - load_start) / 1e9;
+}
+
+static void
+load_report_stream (void)
+{
+  double seconds = load_elapsed ();
+  double cpu = -1;
+  double cycles = -1;
+  double hz;
+  uint64_t bytes;
+
+  bytes = (load_mode == LOAD_UPLOAD ? load_sent : load_received) -
+          load_bytes_start;
+
+  if (load_pid > 0 && load_cpu_start >= 0)
+    {
+      cpu = load_read_cpu (load_pid) - load_cpu_start;
+      hz = load_read_cpu_hz ();
+      if (cpu >= 0 && hz > 0 && bytes)
+        cycles = cpu * hz / bytes;
+    }
+
+  printf ("{\"mode\": \"%s\", \"port\": %d, \"connections\": %d, "
+          "\"seconds\": %.3f, \"bytes\": %llu, \"gbit_per_sec\": %.3f, "
+          "\"reconnects\": %llu, \"rss_max_kib\": %ld, "
+          "\"cpu_sec\": %.3f, \"cycles_per_byte\": %.3f}\n",
+          load_mode_name,
+          load_port,
+          load_concurrency,
+          seconds,
+          (unsigned long long) bytes,
+          bytes * 8 / seconds / 1e9,
+          (unsigned long long) load_reconnects,
+          load_rss_max,
+          cpu,
+          cycles);
+}
+
+static void
+load_report_connect (void)
+{
+  double seconds = load_elapsed ();
+
+  printf ("{\"mode\": \"connect\", \"port\": %d, \"connections\": %d, "
+          "\"seconds\": %.3f, \"completed\": %llu, \"failed\": %llu, "
+          "\"conn_per_sec\": %.1f, \"handshake_p50_usec\": %llu, "
+          "\"handshake_p99_usec\": %llu, \"handshake_max_usec\": %llu, "
+          "\"rss_max_kib\": %ld}\n",
+          load_port,
+          load_concurrency,
+          seconds,
+          (unsigned long long) load_completed,
+          (unsigned long long) load_failed,
+          load_completed / seconds,
+          (unsigned long long) histogram_percentile (&load_latency, 50),
+          (unsigned long long) histogram_percentile (&load_latency, 99),
+          (unsigned long long) load_latency.max,
+          load_rss_max);
+}
+
+static void
+load_report_sessions (void)
+{
+  long rss_after = load_read_rss (load_pid);
+
+  printf ("{\"mode\": \"sessions\", \"port\": %d, \"sessions\": %d, "
+          "\"established\": %llu, \"failed\": %llu, "
+          "\"handshake_p50_usec\": %llu, \"handshake_p99_usec\": %llu, "
+          "\"rss_before_kib\": %ld, \"rss_after_kib\": %ld, "
+          "\"rss_kib_per_1k\": %.1f}\n",
+          load_port,
+          load_sessions,
+          (unsigned long long) load_completed,
+          (unsigned long long) load_failed,
+          (unsigned long long) histogram_percentile (&load_latency, 50),
+          (unsigned long long) histogram_percentile (&load_latency, 99),
+          load_rss_before,
+          rss_after,
+          load_completed && load_rss_before >= 0 && rss_after >= 0 ?
+          (rss_after - load_rss_before) * 1000.0 / load_completed : 0.0);
+}
+
+static void
+load_report_ping (void)
+{
+  double seconds = load_elapsed ();
+
+  printf ("{\"mode\": \"ping\", \"port\": %d, \"connections\": %d, "
+          "\"seconds\": %.3f, \"pings\": %llu, \"pings_per_sec\": %.1f, "
+          "\"rtt_p50_usec\": %llu, \"rtt_p99_usec\": %llu, "
+          "\"rtt_max_usec\": %llu, \"reconnects\": %llu}\n",
+          load_port,
+          load_concurrency,
+          seconds,
+          (unsigned long long) load_completed,
+          load_completed / seconds,
+          (unsigned long long) histogram_percentile (&load_latency, 50),
+          (unsigned long long) histogram_percentile (&load_latency, 99),
+          (unsigned long long) load_latency.max,
+          (unsigned long long) load_reconnects);
+}
+
+static void
+load_stop (uv_timer_t *timer)
+{
+  load_stopping = 1;
+
+  switch (load_mode)
+    {
+    case LOAD_THROUGHPUT:
+    case LOAD_UPLOAD:
+      load_report_stream ();
+      break;
+    case LOAD_CONNECT:
+      load_report_connect ();
+      break;
+    case LOAD_SESSIONS:
+      load_report_sessions ();
+      break;
+    case LOAD_PING:
+      load_report_ping ();
+      break;
+    }
+
+  fflush (stdout);
+  uv_stop (load_loop);
+}
+
+static void
+load_pump (LoadConn *conn);
+
+static void
+load_written (uv_write_t *req,
+              int         status)
+{
+  LoadConn *conn = req->data;
+
+  conn->writing = 0;
+  if (status < 0)
+    {
+      load_close (conn);
+      return;
+    }
+
+  load_sent += LOAD_CHUNK;
+  conn->sent += LOAD_CHUNK;
+  load_pump (conn);
+}
+
+/* Keeps one chunk being written, and for echoes at most a window of bytes
+   a connection that has not come back yet. */
+static void
+load_pump (LoadConn *conn)
+{
+  uv_buf_t buf;
+
+  if (load_stopping || conn->writing)
+    return;
+
+  if (load_mode == LOAD_THROUGHPUT &&
+      conn->sent - conn->received > LOAD_WINDOW)
+    return;
+
+  buf = uv_buf_init (load_chunk, LOAD_CHUNK);
+  conn->write_req.data = conn;
+  if (uv_write (&conn->write_req,
+                (uv_stream_t *) &conn->tcp,
+                &buf,
+                1,
+                load_written))
+    {
+      load_close (conn);
+      return;
+    }
+  conn->writing = 1;
+}
+
+/* Sends the next ping of conn, once the last one came back whole. */
+static void
+load_ping (LoadConn *conn)
+{
+  uv_buf_t buf;
+
+  if (load_stopping)
+    return;
+
+  conn->start = uv_hrtime ();
+  conn->received = 0;
+  buf = uv_buf_init (load_chunk, LOAD_PING_SIZE);
+  if (uv_try_write ((uv_stream_t *) &conn->tcp, &buf, 1) != LOAD_PING_SIZE)
+    load_close (conn);
+}
+
+static void
+load_established (LoadConn *conn)
+{
+  histogram_record (&load_latency, (uv_hrtime () - conn->start) / 1000);
+  load_completed++;
+
+  if (load_mode == LOAD_CONNECT)
+    {
+      load_close (conn);
+      return;
+    }
+
+  /* sessions stay open until the process exits */
+  conn->established = 1;
+  load_pending--;
+  if (load_completed + load_failed == (uint64_t) load_sessions)
+    {
+      /* give the allocator a moment to settle before reading the RSS */
+      uv_timer_start (&load_timer, load_stop, 500, 0);
+      return;
+    }
+  while (load_pending < load_concurrency && load_started < load_sessions)
+    load_start_one ();
+}
+
+static void
+load_failed_one (LoadConn *conn)
+{
+  load_failed++;
+  load_close (conn);
+
+  if (load_mode != LOAD_SESSIONS)
+    return;
+
+  load_pending--;
+  if (load_completed + load_failed == (uint64_t) load_sessions)
+    uv_timer_start (&load_timer, load_stop, 500, 0);
+  else if (load_started < load_sessions)
+    load_start_one ();
+}
+
+static void
+load_read (uv_stream_t    *stream,
+           ssize_t         nread,
+           const uv_buf_t *buf)
+{
+  LoadConn *conn = stream->data;
+
+  if (nread < 0)
+    {
+      if (load_mode == LOAD_THROUGHPUT || load_mode == LOAD_UPLOAD ||
+          load_mode == LOAD_PING || conn->established)
+        load_close (conn);
+      else
+        load_failed_one (conn);
+      return;
+    }
+
+  if (nread == 0)
+    return;
+
+  if (load_mode == LOAD_THROUGHPUT)
+    {
+      load_received += nread;
+      conn->received += nread;
+      load_pump (conn);
+      return;
+    }
+
+  if (load_mode == LOAD_PING)
+    {
+      conn->received += nread;
+      if (conn->received < LOAD_PING_SIZE)
+        return;
+
+      /* only pings sent once every connection is up count */
+      if (load_n_connected >= load_concurrency)
+        {
+          histogram_record (&load_latency,
+                            (uv_hrtime () - conn->start) / 1000);
+          load_completed++;
+        }
+      load_ping (conn);
+      return;
+    }
+
+  if (!conn->established)
+    load_established (conn);
+}
+
+static void
+load_connected (uv_connect_t *req,
+                int           status)
+{
+  LoadConn *conn = req->data;
+  uv_buf_t buf;
+
+  if (status < 0)
+    {
+      if ((load_mode == LOAD_THROUGHPUT || load_mode == LOAD_UPLOAD ||
+           load_mode == LOAD_PING) &&
+          load_n_connected < load_concurrency)
+        {
+          fprintf (stderr, "loadgen: connect: %s\n", uv_strerror (status));
+          exit (1);
+        }
+      if (load_mode == LOAD_THROUGHPUT || load_mode == LOAD_UPLOAD ||
+          load_mode == LOAD_PING)
+        {
+          load_close (conn);
+          return;
+        }
+      load_failed_one (conn);
+      return;
+    }
+
+  if (uv_read_start ((uv_stream_t *) &conn->tcp, load_alloc_buffer, load_read))
+    {
+      load_failed_one (conn);
+      return;
+    }
+
+  if (load_mode == LOAD_THROUGHPUT || load_mode == LOAD_UPLOAD)
+    {
+      /* measure once every stream is going */
+      if (++load_n_connected == load_concurrency)
+        {
+          load_start = uv_hrtime ();
+          load_bytes_start = load_mode == LOAD_UPLOAD ? load_sent :
+                                                        load_received;
+          if (load_pid > 0)
+            load_cpu_start = load_read_cpu (load_pid);
+          uv_timer_start (&load_timer, load_stop, load_seconds * 1000, 0);
+        }
+      load_pump (conn);
+      return;
+    }
+
+  if (load_mode == LOAD_PING)
+    {
+      if (++load_n_connected == load_concurrency)
+        {
+          load_start = uv_hrtime ();
+          uv_timer_start (&load_timer, load_stop, load_seconds * 1000, 0);
+        }
+      load_ping (conn);
+      return;
+    }
+
+  /* one byte through the echo server proves the tunnel is up */
+  buf = uv_buf_init (load_chunk, 1);
+  conn->write_req.data = conn;
+  if (uv_try_write ((uv_stream_t *) &conn->tcp, &buf, 1) != 1)
+    load_failed_one (conn);
+}
+
+static void
+load_start_one (void)
+{
+  LoadConn *conn;
+
+  conn = calloc (1, sizeof (*conn));
+  if (!conn)
+    return;
+
+  load_started++;
+  load_pending++;
+  conn->tcp.data = conn;
+  conn->connect.data = conn;
+  conn->start = uv_hrtime ();
+  uv_tcp_init (load_loop, &conn->tcp);
+  uv_tcp_nodelay (&conn->tcp, 1);
+  if (uv_tcp_connect (&conn->connect,
+                      &conn->tcp,
+                      (const struct sockaddr *) &load_addr,
+                      load_connected))
+    load_failed_one (conn);
+}
+
+static void
+load_usage (void)
+{
+  fprintf (stderr,
+           "usage: loadgen [-m throughput|upload|connect|sessions|ping]\n"
+           "               [-p port]\n"
+           "               [-c concurrency] [-d seconds] [-n sessions]\n"
+           "               [-P pid]\n");
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  int c;
+  int i;
+
+  while ((c = getopt (argc, argv, "m:p:c:d:n:P:")) != -1)
+    switch (c)
+      {
+      case 'm':
+        load_mode_name = optarg;
+        break;
+      case 'p':
+        load_port = atoi (optarg);
+        break;
+      case 'c':
+        load_concurrency = atoi (optarg);
+        break;
+      case 'd':
+        load_seconds = atoi (optarg);
+        break;
+      case 'n':
+        load_sessions = atoi (optarg);
+        break;
+      case 'P':
+        load_pid = atoi (optarg);
+        break;
+      default:
+        load_usage ();
+        return 1;
+      }
+
+  if (!strcmp (load_mode_name, "throughput"))
+    load_mode = LOAD_THROUGHPUT;
+  else if (!strcmp (load_mode_name, "upload"))
+    load_mode = LOAD_UPLOAD;
+  else if (!strcmp (load_mode_name, "connect"))
+    load_mode = LOAD_CONNECT;
+  else if (!strcmp (load_mode_name, "sessions"))
+    load_mode = LOAD_SESSIONS;
+  else if (!strcmp (load_mode_name, "ping"))
+    load_mode = LOAD_PING;
+  else
+    {
+      load_usage ();
+      return 1;
+    }
+
+  if (load_concurrency <= 0 || load_seconds <= 0 || load_sessions <= 0 ||
+      (load_mode == LOAD_SESSIONS && load_pid <= 0))
+    {
+      load_usage ();
+      return 1;
+    }
+
+  memset (load_chunk, 'x', sizeof (load_chunk));
+
+  /* peers reset on purpose; a write must fail, not kill us */
+  signal (SIGPIPE, SIG_IGN);
+  load_loop = uv_default_loop ();
+  uv_timer_init (load_loop, &load_timer);
+  if (load_pid > 0)
+    {
+      uv_timer_init (load_loop, &load_rss_timer);
+      uv_timer_start (&load_rss_timer,
+                      load_sample_rss,
+                      LOAD_RSS_INTERVAL,
+                      LOAD_RSS_INTERVAL);
+    }
+  uv_ip4_addr ("127.0.0.1", load_port, &load_addr);
+
+  load_start = uv_hrtime ();
+  switch (load_mode)
+    {
+    case LOAD_THROUGHPUT:
+    case LOAD_UPLOAD:
+    case LOAD_CONNECT:
+    case LOAD_PING:
+      for (i = 0; i < load_concurrency; i++)
+        load_start_one ();
+      if (load_mode == LOAD_CONNECT)
+        uv_timer_start (&load_timer, load_stop, load_seconds * 1000, 0);
+      break;
+    case LOAD_SESSIONS:
+      load_rss_before = load_read_rss (load_pid);
+      for (i = 0; i < load_concurrency && i < load_sessions; i++)
+        load_start_one ();
+      break;
+    }
+
+  uv_run (load_loop, UV_RUN_DEFAULT);
+
+  return 0;
+}
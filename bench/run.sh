@@ -0,0 +1,104 @@
+#!/bin/sh
+# Benchmarks uvsocks on loopback through bench/socks-server and
+# bench/echo-server, and prints the results as one JSON object.
+#
+# usage: bench/run.sh [seconds]
+#
+# Forward and upload throughput are also measured through a second uvsocks
+# relaying with --io-uring; they are null when it cannot.  The round trips
+# of a quiet session next to sixteen busy ones are measured through the
+# first uvsocks, through a third one scheduling with -Q, and through a
+# fourth one where the quiet session is on a tunnel of a higher priority
+# class, given with -C, than the busy ones.  Last, bench/startup brings up
+# ten thousand tunnels, a tenth of them reverse, in one uvsocks.
+#
+# Run from the build directory after "ninja bench".  Ports 17100-17101,
+# 11100, 18100-18107 and 20000-28999 must be free.
+
+seconds=${1:-5}
+dir=$(pwd)
+
+ulimit -n "$(ulimit -Hn)" 2>/dev/null
+
+pids=""
+cleanup ()
+{
+  [ -n "$pids" ] && kill $pids 2>/dev/null
+  wait 2>/dev/null
+}
+trap cleanup EXIT INT TERM
+
+"$dir/bench/echo-server" -p 17100 &
+pids="$pids $!"
+"$dir/bench/echo-server" -p 17101 -s &
+pids="$pids $!"
+"$dir/bench/socks-server" -p 11100 -u bench -w bench &
+pids="$pids $!"
+sleep 0.2
+
+"$dir/uvsocks" -q \
+  -L 18100:127.0.0.1:17100 \
+  -L 18101:127.0.0.1:17101 \
+  -R 18102:127.0.0.1:17100 \
+  bench:bench@127.0.0.1:11100 2>/dev/null &
+uvsocks=$!
+pids="$pids $uvsocks"
+
+uring_log=$(mktemp)
+"$dir/uvsocks" -q --io-uring \
+  -L 18103:127.0.0.1:17100 \
+  -L 18104:127.0.0.1:17101 \
+  bench:bench@127.0.0.1:11100 2>"$uring_log" &
+uvsocks_uring=$!
+pids="$pids $uvsocks_uring"
+
+"$dir/uvsocks" -q -Q 65536 \
+  -L 18105:127.0.0.1:17100 \
+  bench:bench@127.0.0.1:11100 2>/dev/null &
+pids="$pids $!"
+
+"$dir/uvsocks" -q \
+  -L 18106:127.0.0.1:17100 \
+  -L 18107:127.0.0.1:17100 -C 3 \
+  bench:bench@127.0.0.1:11100 2>/dev/null &
+pids="$pids $!"
+sleep 0.5
+
+loadgen="$dir/bench/loadgen"
+
+# sessions first, while the heap of uvsocks is fresh
+sessions=$("$loadgen" -m sessions -p 18100 -n 1000 -c 64 -P "$uvsocks") || exit 1
+connect=$("$loadgen" -m connect -p 18100 -c 32 -d "$seconds") || exit 1
+forward=$("$loadgen" -m throughput -p 18100 -c 4 -P "$uvsocks" -d "$seconds") || exit 1
+upload=$("$loadgen" -m upload -p 18101 -c 4 -P "$uvsocks" -d "$seconds") || exit 1
+# a reverse tunnel carries a single connection
+reverse=$("$loadgen" -m throughput -p 18102 -c 1 -P "$uvsocks" -d "$seconds") || exit 1
+
+forward_uring=null
+upload_uring=null
+if ! grep -q "io_uring error" "$uring_log"; then
+  forward_uring=$("$loadgen" -m throughput -p 18103 -c 4 -P "$uvsocks_uring" -d "$seconds") || exit 1
+  upload_uring=$("$loadgen" -m upload -p 18104 -c 4 -P "$uvsocks_uring" -d "$seconds") || exit 1
+fi
+rm -f "$uring_log"
+
+# bulk streams through port $1, pings through port $2, or $1 as well
+interactive ()
+{
+  "$loadgen" -m throughput -p "$1" -c 16 -d $((seconds + 1)) >/dev/null &
+  bulk=$!
+  sleep 0.5
+  "$loadgen" -m ping -p "${2:-$1}" -c 2 -d "$seconds" || return 1
+  wait "$bulk"
+}
+
+interactive=$(interactive 18100) || exit 1
+interactive_quantum=$(interactive 18105) || exit 1
+interactive_priority=$(interactive 18106 18107) || exit 1
+
+startup=$("$dir/bench/startup" -n 10000 -r 1000 -l 20000 -p 11100) || exit 1
+
+printf '{\n  "sessions": %s,\n  "connect": %s,\n  "forward": %s,\n  "upload": %s,\n  "reverse": %s,\n  "forward_io_uring": %s,\n  "upload_io_uring": %s,\n  "interactive": %s,\n  "interactive_quantum": %s,\n  "interactive_priority": %s,\n  "startup": %s\n}\n' \
+  "$sessions" "$connect" "$forward" "$upload" "$reverse" \
+  "$forward_uring" "$upload_uring" "$interactive" "$interactive_quantum" \
+  "$interactive_priority" "$startup"
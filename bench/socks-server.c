@@ -0,0 +1,892 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+/* A SOCKS5 server for benchmarking uvsocks on loopback: no auth or
+   user/password, CONNECT and BIND.  A BIND listens on 127.0.0.1 at the
+   port asked for, so the load generator knows where to connect.
+
+   It can also play a bad proxy, to put uvsocks under backpressure:
+
+     -d stage:ms   hold the greeting, auth or reply answer back for ms
+     -t bytes      read no faster than bytes a second on each side
+     -b bytes      shrink the socket buffers, and so the TCP windows
+     -x bytes      write no more than bytes in one go
+     -r bytes      reset both ends once a connection relayed bytes */
+
+#include "../socks5.h"
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define SERVER_BUF_MAX          (64 * 1024)
+
+typedef enum _ServerDelay
+{
+  SERVER_DELAY_GREETING,
+  SERVER_DELAY_AUTH,
+  SERVER_DELAY_REPLY,
+  SERVER_DELAY_MAX,
+} ServerDelay;
+
+typedef enum _ServerStage
+{
+  SERVER_STAGE_GREETING,
+  SERVER_STAGE_AUTH,
+  SERVER_STAGE_REQUEST,
+  SERVER_STAGE_WAIT,
+  SERVER_STAGE_RELAY,
+} ServerStage;
+
+typedef struct _ServerConn ServerConn;
+typedef struct _ServerSide ServerSide;
+
+struct _ServerSide
+{
+  ServerConn           *conn;
+  ServerSide           *peer;
+  uv_tcp_t              tcp;
+  int                   open;
+  char                  buf[SERVER_BUF_MAX];
+  size_t                len;
+  size_t                off;
+  size_t                pending;
+  int                   paused;
+  uv_write_t            write_req;
+  uv_timer_t            throttle;
+  int                   throttled;
+};
+
+struct _ServerConn
+{
+  ServerSide            client;
+  ServerSide            remote;
+  uv_tcp_t              bind;
+  int                   bind_open;
+  uv_connect_t          connect;
+  uv_getaddrinfo_t      resolver;
+  ServerStage           stage;
+  int                   n_handles;
+  int                   closing;
+  uint64_t              reply_due;
+  uint64_t              relayed;
+};
+
+typedef struct _ServerPacket ServerPacket;
+struct _ServerPacket
+{
+  uv_write_t            req;
+  uv_timer_t            timer;
+  ServerSide           *side;
+  size_t                len;
+  int                   relay;
+  char                  data[32];
+};
+
+static uv_loop_t *server_loop;
+static const char *server_user;
+static const char *server_password;
+static const char *server_delay_names[SERVER_DELAY_MAX] =
+  { "greeting", "auth", "reply" };
+static int server_delay[SERVER_DELAY_MAX];
+static int server_rate;
+static int server_buffer_size;
+static size_t server_max_write;
+static uint64_t server_reset_after;
+
+static void
+server_read (uv_stream_t    *stream,
+             ssize_t         nread,
+             const uv_buf_t *buf);
+
+static void
+server_close_handle (uv_handle_t *handle)
+{
+  ServerConn *conn = handle->data;
+
+  if (--conn->n_handles == 0)
+    free (conn);
+}
+
+static void
+server_close_side (uv_handle_t *handle)
+{
+  ServerSide *side = handle->data;
+
+  if (--side->conn->n_handles == 0)
+    free (side->conn);
+}
+
+static void
+server_close_side_tcp (ServerSide *side,
+                       int         reset)
+{
+  if (side->throttle.data)
+    uv_close ((uv_handle_t *) &side->throttle, server_close_side);
+  if (!side->open)
+    return;
+
+  if (!reset ||
+      uv_tcp_close_reset (&side->tcp, server_close_side))
+    uv_close ((uv_handle_t *) &side->tcp, server_close_side);
+}
+
+/* Closes every handle of conn; with reset, the streams end with an RST. */
+static void
+server_close_real (ServerConn *conn,
+                   int         reset)
+{
+  if (conn->closing)
+    return;
+
+  conn->closing = 1;
+  server_close_side_tcp (&conn->client, reset);
+  server_close_side_tcp (&conn->remote, reset);
+  if (conn->bind_open)
+    uv_close ((uv_handle_t *) &conn->bind, server_close_handle);
+}
+
+static void
+server_close (ServerConn *conn)
+{
+  server_close_real (conn, 0);
+}
+
+static void
+server_set_buffers (ServerSide *side)
+{
+  int size = server_buffer_size;
+
+  if (!size)
+    return;
+
+  uv_send_buffer_size ((uv_handle_t *) &side->tcp, &size);
+  size = server_buffer_size;
+  uv_recv_buffer_size ((uv_handle_t *) &side->tcp, &size);
+}
+
+static void
+server_init_side (ServerConn *conn,
+                  ServerSide *side,
+                  ServerSide *peer)
+{
+  side->conn = conn;
+  side->peer = peer;
+  side->tcp.data = side;
+  uv_tcp_init (server_loop, &side->tcp);
+  uv_tcp_nodelay (&side->tcp, 1);
+  side->open = 1;
+  conn->n_handles++;
+
+  if (server_rate)
+    {
+      side->throttle.data = side;
+      uv_timer_init (server_loop, &side->throttle);
+      conn->n_handles++;
+    }
+}
+
+static void
+server_start_relay (ServerConn *conn);
+
+static void
+server_free_packet (uv_write_t *req,
+                    int         status)
+{
+  free (req->data);
+}
+
+static int
+server_write_packet (ServerPacket *packet)
+{
+  ServerSide *side = packet->side;
+  uv_buf_t buf;
+
+  buf = uv_buf_init (packet->data, (unsigned int) packet->len);
+  packet->req.data = packet;
+  if (uv_write (&packet->req,
+                (uv_stream_t *) &side->tcp,
+                &buf,
+                1,
+                server_free_packet))
+    {
+      free (packet);
+      server_close (side->conn);
+      return -1;
+    }
+
+  if (packet->relay)
+    server_start_relay (side->conn);
+  return 0;
+}
+
+static void
+server_send_delayed (uv_handle_t *handle)
+{
+  ServerPacket *packet = handle->data;
+  ServerConn *conn = packet->side->conn;
+
+  /* the timer held a reference on conn */
+  if (conn->closing)
+    free (packet);
+  else
+    server_write_packet (packet);
+
+  if (--conn->n_handles == 0)
+    free (conn);
+}
+
+static void
+server_packet_due (uv_timer_t *timer)
+{
+  uv_close ((uv_handle_t *) timer, server_send_delayed);
+}
+
+/* Writes data to side in pieces of at most server_max_write, after delay
+   ms and behind whatever is still held back; with relay, the relay starts
+   once the last piece is queued. */
+static void
+server_send (ServerSide *side,
+             const char *data,
+             size_t      len,
+             int         delay,
+             int         relay)
+{
+  ServerConn *conn = side->conn;
+  uint64_t now = uv_now (server_loop);
+  size_t off;
+
+  if (delay || conn->reply_due > now)
+    {
+      if (conn->reply_due < now + delay)
+        conn->reply_due = now + delay;
+    }
+
+  for (off = 0; off < len; )
+    {
+      ServerPacket *packet;
+      size_t n;
+
+      n = len - off;
+      if (server_max_write && n > server_max_write)
+        n = server_max_write;
+
+      packet = malloc (sizeof (*packet));
+      if (!packet)
+        {
+          server_close (conn);
+          return;
+        }
+
+      packet->side = side;
+      packet->len = n;
+      memcpy (packet->data, &data[off], n);
+      off += n;
+      packet->relay = relay && off == len;
+
+      if (conn->reply_due <= now)
+        {
+          if (server_write_packet (packet))
+            return;
+          continue;
+        }
+
+      packet->timer.data = packet;
+      uv_timer_init (server_loop, &packet->timer);
+      uv_timer_start (&packet->timer,
+                      server_packet_due,
+                      conn->reply_due - now,
+                      0);
+      conn->n_handles++;
+    }
+}
+
+static void
+server_reply (ServerConn *conn,
+              int         code,
+              int         port,
+              int         relay)
+{
+  char reply[10] = { 0x05, 0x00, 0x00, 0x01, 127, 0, 0, 1, 0, 0 };
+
+  reply[1] = (char) code;
+  reply[8] = (char) (port >> 8);
+  reply[9] = (char) port;
+  server_send (&conn->client,
+               reply,
+               sizeof (reply),
+               server_delay[SERVER_DELAY_REPLY],
+               relay);
+}
+
+static void
+server_alloc_buffer (uv_handle_t *handle,
+                     size_t       suggested_size,
+                     uv_buf_t    *buf)
+{
+  ServerSide *side = handle->data;
+
+  buf->base = &side->buf[side->len];
+  buf->len = sizeof (side->buf) - side->len;
+}
+
+static void
+server_resume (ServerSide *side)
+{
+  if (side->conn->closing || !side->paused || side->throttled)
+    return;
+
+  side->paused = 0;
+  uv_read_start ((uv_stream_t *) &side->tcp, server_alloc_buffer, server_read);
+}
+
+static void
+server_pause (ServerSide *side)
+{
+  side->paused = 1;
+  uv_read_stop ((uv_stream_t *) &side->tcp);
+}
+
+static void
+server_unthrottle (uv_timer_t *timer)
+{
+  ServerSide *side = timer->data;
+
+  side->throttled = 0;
+  server_resume (side);
+}
+
+/* Called once side passed len bytes on: resets the connection when it
+   relayed enough, or holds the next read back to keep to the rate. */
+static void
+server_relayed (ServerSide *side,
+                size_t      len)
+{
+  ServerConn *conn = side->conn;
+
+  conn->relayed += len;
+  if (server_reset_after && conn->relayed >= server_reset_after)
+    {
+      server_close_real (conn, 1);
+      return;
+    }
+
+  if (server_rate && len)
+    {
+      uint64_t ms = (uint64_t) len * 1000 / server_rate;
+
+      server_pause (side);
+      side->throttled = 1;
+      uv_timer_start (&side->throttle, server_unthrottle, ms ? ms : 1, 0);
+      return;
+    }
+
+  server_resume (side);
+}
+
+static void
+server_relay (ServerSide *side);
+
+static void
+server_relay_written (uv_write_t *req,
+                      int         status)
+{
+  ServerSide *side = req->data;
+
+  if (status < 0)
+    {
+      server_close (side->conn);
+      return;
+    }
+
+  side->off += side->pending;
+  side->pending = 0;
+  if (!side->conn->closing)
+    server_relay (side);
+}
+
+/* Writes what side read to its peer, a piece of at most server_max_write
+   at a time, and stops reading while the peer does not keep up. */
+static void
+server_relay (ServerSide *side)
+{
+  size_t len;
+
+  while (side->off < side->len)
+    {
+      uv_buf_t buf;
+      size_t n;
+      int ret;
+
+      n = side->len - side->off;
+      if (server_max_write && n > server_max_write)
+        n = server_max_write;
+
+      buf = uv_buf_init (&side->buf[side->off], (unsigned int) n);
+      ret = uv_try_write ((uv_stream_t *) &side->peer->tcp, &buf, 1);
+      if (ret == UV_EAGAIN)
+        ret = 0;
+      else if (ret < 0)
+        {
+          server_close (side->conn);
+          return;
+        }
+
+      side->off += ret;
+      if ((size_t) ret == n)
+        continue;
+
+      server_pause (side);
+      side->pending = n - ret;
+      buf = uv_buf_init (&side->buf[side->off], (unsigned int) side->pending);
+      side->write_req.data = side;
+      if (uv_write (&side->write_req,
+                    (uv_stream_t *) &side->peer->tcp,
+                    &buf,
+                    1,
+                    server_relay_written))
+        server_close (side->conn);
+      return;
+    }
+
+  len = side->len;
+  side->len = 0;
+  side->off = 0;
+  server_relayed (side, len);
+}
+
+static void
+server_start_relay (ServerConn *conn)
+{
+  conn->stage = SERVER_STAGE_RELAY;
+
+  if (uv_read_start ((uv_stream_t *) &conn->remote.tcp,
+                     server_alloc_buffer,
+                     server_read) ||
+      uv_read_start ((uv_stream_t *) &conn->client.tcp,
+                     server_alloc_buffer,
+                     server_read))
+    {
+      server_close (conn);
+      return;
+    }
+
+  /* the client may have sent data right behind its request */
+  server_relay (&conn->client);
+}
+
+static void
+server_connected (uv_connect_t *req,
+                  int           status)
+{
+  ServerConn *conn = req->data;
+
+  if (conn->closing)
+    return;
+
+  if (status < 0)
+    {
+      server_reply (conn, 0x05, 0, 0);
+      server_close (conn);
+      return;
+    }
+
+  server_set_buffers (&conn->remote);
+  server_reply (conn, 0x00, 0, 1);
+}
+
+static void
+server_connect (ServerConn            *conn,
+                const struct sockaddr *addr)
+{
+  server_init_side (conn, &conn->remote, &conn->client);
+  conn->connect.data = conn;
+  if (uv_tcp_connect (&conn->connect, &conn->remote.tcp, addr, server_connected))
+    {
+      server_reply (conn, 0x01, 0, 0);
+      server_close (conn);
+    }
+}
+
+static void
+server_resolved (uv_getaddrinfo_t *req,
+                 int               status,
+                 struct addrinfo  *res)
+{
+  ServerConn *conn = req->data;
+
+  if (conn->closing || status < 0)
+    {
+      if (!conn->closing)
+        {
+          server_reply (conn, 0x04, 0, 0);
+          server_close (conn);
+        }
+      /* the resolver holds a reference of its own */
+      if (--conn->n_handles == 0)
+        free (conn);
+      uv_freeaddrinfo (res);
+      return;
+    }
+
+  conn->n_handles--;
+  server_connect (conn, res->ai_addr);
+  uv_freeaddrinfo (res);
+}
+
+static void
+server_bind_accepted (uv_stream_t *stream,
+                      int          status)
+{
+  ServerConn *conn = stream->data;
+  struct sockaddr_in peer;
+  int len;
+
+  if (status < 0)
+    {
+      server_close (conn);
+      return;
+    }
+
+  server_init_side (conn, &conn->remote, &conn->client);
+  if (uv_accept (stream, (uv_stream_t *) &conn->remote.tcp))
+    {
+      server_close (conn);
+      return;
+    }
+
+  /* one connection per BIND */
+  uv_close ((uv_handle_t *) &conn->bind, server_close_handle);
+  conn->bind_open = 0;
+
+  len = sizeof (peer);
+  memset (&peer, 0, sizeof (peer));
+  uv_tcp_getpeername (&conn->remote.tcp, (struct sockaddr *) &peer, &len);
+  server_set_buffers (&conn->remote);
+  server_reply (conn, 0x00, ntohs (peer.sin_port), 1);
+}
+
+static void
+server_bind (ServerConn *conn,
+             int         port)
+{
+  struct sockaddr_in addr;
+  struct sockaddr_in name;
+  int len;
+
+  uv_ip4_addr ("127.0.0.1", port, &addr);
+  conn->bind.data = conn;
+  uv_tcp_init (server_loop, &conn->bind);
+  conn->bind_open = 1;
+  conn->n_handles++;
+  if (uv_tcp_bind (&conn->bind, (const struct sockaddr *) &addr, 0) ||
+      uv_listen ((uv_stream_t *) &conn->bind, 1, server_bind_accepted))
+    {
+      server_reply (conn, 0x01, 0, 0);
+      server_close (conn);
+      return;
+    }
+
+  len = sizeof (name);
+  uv_tcp_getsockname (&conn->bind, (struct sockaddr *) &name, &len);
+  server_reply (conn, 0x00, ntohs (name.sin_port), 0);
+}
+
+static int
+server_request (ServerConn *conn,
+                const char *data,
+                size_t      len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  struct sockaddr_storage addr;
+  char host[256];
+  char port_s[8];
+  int port;
+
+  port = (p[len - 2] << 8) | p[len - 1];
+  conn->stage = SERVER_STAGE_WAIT;
+  uv_read_stop ((uv_stream_t *) &conn->client.tcp);
+
+  if (p[1] == 0x02)
+    {
+      server_bind (conn, port);
+      return 0;
+    }
+
+  if (p[1] != 0x01)
+    {
+      server_reply (conn, 0x07, 0, 0);
+      return -1;
+    }
+
+  switch (p[3])
+    {
+    case 0x01:
+      memset (&addr, 0, sizeof (addr));
+      ((struct sockaddr_in *) &addr)->sin_family = AF_INET;
+      memcpy (&((struct sockaddr_in *) &addr)->sin_addr, &p[4], 4);
+      ((struct sockaddr_in *) &addr)->sin_port = htons (port);
+      server_connect (conn, (const struct sockaddr *) &addr);
+      return 0;
+    case 0x04:
+      memset (&addr, 0, sizeof (addr));
+      ((struct sockaddr_in6 *) &addr)->sin6_family = AF_INET6;
+      memcpy (&((struct sockaddr_in6 *) &addr)->sin6_addr, &p[4], 16);
+      ((struct sockaddr_in6 *) &addr)->sin6_port = htons (port);
+      server_connect (conn, (const struct sockaddr *) &addr);
+      return 0;
+    default:
+      memcpy (host, &p[5], p[4]);
+      host[p[4]] = '\0';
+      snprintf (port_s, sizeof (port_s), "%d", port);
+      conn->resolver.data = conn;
+      conn->n_handles++;
+      if (uv_getaddrinfo (server_loop,
+                          &conn->resolver,
+                          server_resolved,
+                          host,
+                          port_s,
+                          NULL))
+        {
+          conn->n_handles--;
+          server_reply (conn, 0x04, 0, 0);
+          return -1;
+        }
+      return 0;
+    }
+}
+
+/* Takes the handshake packets at the head of the client buffer; returns
+   the length used, 0 when more is needed or -1 to give up. */
+static int
+server_handshake (ServerConn *conn)
+{
+  ServerSide *client = &conn->client;
+  const unsigned char *p = (const unsigned char *) client->buf;
+  char reply[2];
+  int len;
+
+  switch (conn->stage)
+    {
+    case SERVER_STAGE_GREETING:
+      len = socks5_server_parse_greeting (client->buf, client->len);
+      if (len <= 0)
+        return len;
+
+      reply[0] = 0x05;
+      reply[1] = (char) (server_user ? 0x02 : 0x00);
+      if (!memchr (&p[2], reply[1], len - 2))
+        {
+          reply[1] = (char) 0xff;
+          server_send (client, reply, 2, 0, 0);
+          return -1;
+        }
+      server_send (client,
+                   reply,
+                   2,
+                   server_delay[SERVER_DELAY_GREETING],
+                   0);
+      conn->stage = server_user ? SERVER_STAGE_AUTH : SERVER_STAGE_REQUEST;
+      return len;
+    case SERVER_STAGE_AUTH:
+      if (client->len < 2 || client->len < 3 + (size_t) p[1] ||
+          client->len < 3 + (size_t) p[1] + p[2 + p[1]])
+        return 0;
+
+      len = 3 + p[1] + p[2 + p[1]];
+      reply[0] = 0x01;
+      reply[1] = (char) (p[1] == strlen (server_user) &&
+                         !memcmp (&p[2], server_user, p[1]) &&
+                         p[2 + p[1]] == strlen (server_password) &&
+                         !memcmp (&p[3 + p[1]], server_password, p[2 + p[1]]) ?
+                         0x00 : 0x01);
+      server_send (client, reply, 2, server_delay[SERVER_DELAY_AUTH], 0);
+      if (reply[1])
+        return -1;
+      conn->stage = SERVER_STAGE_REQUEST;
+      return len;
+    case SERVER_STAGE_REQUEST:
+      len = socks5_server_parse_request (client->buf, client->len);
+      if (len <= 0)
+        return len;
+      if (server_request (conn, client->buf, len))
+        return -1;
+      return len;
+    default:
+      return 0;
+    }
+}
+
+static void
+server_read (uv_stream_t    *stream,
+             ssize_t         nread,
+             const uv_buf_t *buf)
+{
+  ServerSide *side = stream->data;
+  ServerConn *conn = side->conn;
+
+  if (nread < 0)
+    {
+      server_close (conn);
+      return;
+    }
+
+  side->len += nread;
+  if (conn->stage == SERVER_STAGE_RELAY)
+    {
+      server_relay (side);
+      return;
+    }
+
+  while (conn->stage < SERVER_STAGE_WAIT)
+    {
+      int len;
+
+      len = server_handshake (conn);
+      if (len < 0)
+        {
+          server_close (conn);
+          return;
+        }
+      if (len == 0)
+        {
+          if (side->len == sizeof (side->buf))
+            server_close (conn);
+          return;
+        }
+
+      side->len -= len;
+      memmove (side->buf, &side->buf[len], side->len);
+    }
+}
+
+static void
+server_new_connection (uv_stream_t *server,
+                       int          status)
+{
+  ServerConn *conn;
+
+  if (status < 0)
+    return;
+
+  conn = calloc (1, sizeof (*conn));
+  if (!conn)
+    return;
+
+  server_init_side (conn, &conn->client, &conn->remote);
+  if (uv_accept (server, (uv_stream_t *) &conn->client.tcp))
+    {
+      server_close (conn);
+      return;
+    }
+
+  server_set_buffers (&conn->client);
+  if (uv_read_start ((uv_stream_t *) &conn->client.tcp,
+                     server_alloc_buffer,
+                     server_read))
+    server_close (conn);
+}
+
+static void
+server_usage (void)
+{
+  fprintf (stderr,
+           "usage: socks-server [-p port] [-u user -w password]\n"
+           "                    [-d greeting|auth|reply:ms] [-t bytes/s]\n"
+           "                    [-b bytes] [-x bytes] [-r bytes]\n");
+}
+
+/* Parses stage:ms for -d. */
+static int
+server_parse_delay (const char *arg)
+{
+  const char *colon;
+  int i;
+
+  colon = strchr (arg, ':');
+  if (!colon)
+    return -1;
+
+  for (i = 0; i < SERVER_DELAY_MAX; i++)
+    if (strlen (server_delay_names[i]) == (size_t) (colon - arg) &&
+        !strncmp (arg, server_delay_names[i], colon - arg))
+      {
+        server_delay[i] = atoi (colon + 1);
+        return server_delay[i] < 0 ? -1 : 0;
+      }
+
+  return -1;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  struct sockaddr_in addr;
+  uv_tcp_t server;
+  int port;
+  int c;
+
+  port = 1080;
+  while ((c = getopt (argc, argv, "b:d:p:r:t:u:w:x:")) != -1)
+    switch (c)
+      {
+      case 'b':
+        server_buffer_size = atoi (optarg);
+        break;
+      case 'd':
+        if (server_parse_delay (optarg))
+          {
+            server_usage ();
+            return 1;
+          }
+        break;
+      case 'p':
+        port = atoi (optarg);
+        break;
+      case 'r':
+        server_reset_after = strtoull (optarg, NULL, 10);
+        break;
+      case 't':
+        server_rate = atoi (optarg);
+        break;
+      case 'u':
+        server_user = optarg;
+        break;
+      case 'w':
+        server_password = optarg;
+        break;
+      case 'x':
+        server_max_write = strtoul (optarg, NULL, 10);
+        break;
+      default:
+        server_usage ();
+        return 1;
+      }
+
+  if (server_user && !server_password)
+    server_password = "";
+  if ((server_user && strlen (server_user) > 255) ||
+      (server_password && strlen (server_password) > 255) ||
+      server_rate < 0 || server_buffer_size < 0)
+    {
+      server_usage ();
+      return 1;
+    }
+
+  /* peers reset on purpose; a write must fail, not kill us */
+  signal (SIGPIPE, SIG_IGN);
+  server_loop = uv_default_loop ();
+  uv_ip4_addr ("127.0.0.1", port, &addr);
+  uv_tcp_init (server_loop, &server);
+  if (uv_tcp_bind (&server, (const struct sockaddr *) &addr, 0) ||
+      uv_listen ((uv_stream_t *) &server, 1024, server_new_connection))
+    {
+      fprintf (stderr, "socks-server: cannot listen on port %d\n", port);
+      return 1;
+    }
+
+  return uv_run (server_loop, UV_RUN_DEFAULT);
+}
@@ -0,0 +1,157 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+/* Times the SOCKS5 client codec on canned handshakes, with no sockets in
+   the way, and prints handshakes a second as one JSON object:
+
+     encode      greeting, authentication and CONNECT packed
+     decode      method, authentication and IPv4 reply fed at once
+     domain      the same with a reply naming a host
+     bytewise    the IPv4 handshake fed a byte at a time */
+
+#include "../socks5.h"
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_ROUNDS            2000000
+
+static const char bench_ipv4[] =
+  {
+    0x05, 0x02,
+    0x01, 0x00,
+    0x05, 0x00, 0x00, 0x01, 127, 0, 0, 1, 0x1f, 0x90,
+  };
+
+static const char bench_domain[] =
+  {
+    0x05, 0x02,
+    0x01, 0x00,
+    0x05, 0x00, 0x00, 0x03, 11,
+    'e', 'x', 'a', 'm', 'p', 'l', 'e', '.', 'c', 'o', 'm',
+    0x1f, 0x90,
+  };
+
+/* Keeps the compiler from dropping the work being timed. */
+static volatile int bench_sink;
+
+static double
+bench_per_sec (uint64_t start,
+               int      rounds)
+{
+  return rounds / ((uv_hrtime () - start) / 1e9);
+}
+
+/* Decodes one handshake from data in pieces of chunk bytes; returns 0 once
+   the reply is done. */
+static int
+bench_decode (const char *data,
+              size_t      len,
+              size_t      chunk)
+{
+  Socks5Client client;
+  Socks5ClientEvent event;
+  size_t off;
+
+  socks5_client_init (&client, 0x02);
+  for (off = 0; off < len; )
+    {
+      size_t n = len - off < chunk ? len - off : chunk;
+      size_t consumed;
+
+      event = socks5_client_decode (&client, &data[off], n, &consumed);
+      if (event == SOCKS5_CLIENT_ERROR)
+        return -1;
+      off += consumed;
+      if (event == SOCKS5_CLIENT_REPLY_DONE)
+        {
+          bench_sink += client.port;
+          return 0;
+        }
+    }
+
+  return -1;
+}
+
+static double
+bench_encode (int rounds)
+{
+  char buf[SOCKS5_PACKET_MAX * 3];
+  uint64_t start;
+  int i;
+
+  start = uv_hrtime ();
+  for (i = 0; i < rounds; i++)
+    {
+      int len;
+
+      len = socks5_client_greeting (buf, sizeof (buf), 0x02);
+      len += socks5_client_auth (&buf[len], sizeof (buf) - len,
+                                 "user", "password");
+      len += socks5_client_request (&buf[len], sizeof (buf) - len,
+                                    0x01, "192.168.0.231", 8000);
+      bench_sink += len;
+    }
+
+  return bench_per_sec (start, rounds);
+}
+
+static double
+bench_run (const char *data,
+           size_t      len,
+           size_t      chunk,
+           int         rounds)
+{
+  uint64_t start;
+  int i;
+
+  start = uv_hrtime ();
+  for (i = 0; i < rounds; i++)
+    if (bench_decode (data, len, chunk))
+      {
+        fprintf (stderr, "socks5-bench: handshake failed to decode\n");
+        exit (1);
+      }
+
+  return bench_per_sec (start, rounds);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  int rounds = BENCH_ROUNDS;
+  int c;
+
+  while ((c = getopt (argc, argv, "n:")) != -1)
+    switch (c)
+      {
+      case 'n':
+        rounds = atoi (optarg);
+        break;
+      default:
+        fprintf (stderr, "usage: socks5-bench [-n rounds]\n");
+        return 1;
+      }
+
+  if (rounds <= 0)
+    {
+      fprintf (stderr, "usage: socks5-bench [-n rounds]\n");
+      return 1;
+    }
+
+  printf ("{\"rounds\": %d, \"encode_per_sec\": %.0f, "
+          "\"decode_per_sec\": %.0f, \"domain_per_sec\": %.0f, "
+          "\"bytewise_per_sec\": %.0f}\n",
+          rounds,
+          bench_encode (rounds),
+          bench_run (bench_ipv4, sizeof (bench_ipv4), sizeof (bench_ipv4),
+                     rounds),
+          bench_run (bench_domain, sizeof (bench_domain),
+                     sizeof (bench_domain), rounds),
+          bench_run (bench_ipv4, sizeof (bench_ipv4), 1, rounds));
+
+  return 0;
+}
@@ -0,0 +1,206 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+/* Times bringing up and tearing down many tunnels in one uvsocks, and
+   prints the results as one JSON object:
+
+     parse       the configuration of every tunnel parsed from one buffer
+     startup     from uvsocks_run () until every listener is up and every
+                 reverse tunnel bound, or failed
+     shutdown    from uvsocks_free () until its loop ran dry
+     memory      what uvsocks had allocated once every tunnel was up
+
+   Forward tunnels listen on 127.0.0.1 from the first listen port on;
+   reverse tunnels BIND through the SOCKS5 server, which must be
+   bench/socks-server -u bench -w bench or one like it. */
+
+#include "../config.h"
+#include "../uvsocks.h"
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define BENCH_TUNNELS           10000
+#define BENCH_LINE_MAX          64
+
+static uv_loop_t *bench_loop;
+static UvSocks   *bench_socks;
+static uv_idle_t  bench_idle;
+static int        bench_tunnels;
+static int        bench_up;
+static int        bench_failed;
+static uint64_t   bench_start;
+static uint64_t   bench_done;
+static UvSocksMemory bench_memory;
+
+/* Frees uvsocks once every tunnel came up, outside of its callback. */
+static void
+bench_free (uv_idle_t *handle)
+{
+  uvsocks_get_memory (bench_socks, &bench_memory);
+  uv_close ((uv_handle_t *) handle, NULL);
+  uvsocks_free (bench_socks);
+}
+
+static void
+bench_notify (UvSocks       *socks,
+              UvSocksStatus  status,
+              UvSocksParam  *param,
+              void          *data)
+{
+  int count;
+
+  count = param && param->count > 1 ? param->count : 1;
+  if (status == UVSOCKS_OK_TCP_LOCAL_SERVER ||
+      status == UVSOCKS_OK_SOCKS_BIND)
+    bench_up += count;
+  else if (status >= UVSOCKS_ERROR)
+    bench_failed += count;
+
+  if (bench_up + bench_failed >= bench_tunnels && !bench_done)
+    {
+      bench_done = uv_hrtime ();
+      uv_idle_start (&bench_idle, bench_free);
+    }
+}
+
+
+static double
+bench_msec (uint64_t start,
+            uint64_t end)
+{
+  return (end - start) / 1e6;
+}
+
+static void
+bench_usage (void)
+{
+  fprintf (stderr,
+           "usage: startup [-n tunnels] [-r reverse_tunnels] "
+           "[-l first_listen_port] [-p socks_port]\n");
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  UvSocksConfig config;
+  UvSocksOptions options;
+  struct rlimit limit;
+  uint64_t parse_start;
+  uint64_t parse_end;
+  uint64_t shutdown;
+  char *buf;
+  size_t len;
+  int tunnels = BENCH_TUNNELS;
+  int reverse = 0;
+  int listen_port = 20000;
+  int socks_port = 11100;
+  int c;
+  int i;
+
+  while ((c = getopt (argc, argv, "l:n:p:r:")) != -1)
+    switch (c)
+      {
+      case 'l':
+        listen_port = atoi (optarg);
+        break;
+      case 'n':
+        tunnels = atoi (optarg);
+        break;
+      case 'p':
+        socks_port = atoi (optarg);
+        break;
+      case 'r':
+        reverse = atoi (optarg);
+        break;
+      default:
+        bench_usage ();
+        return 1;
+      }
+
+  if (tunnels <= 0 || reverse < 0 || reverse > tunnels ||
+      listen_port <= 0 || listen_port + tunnels - reverse > 65536)
+    {
+      bench_usage ();
+      return 1;
+    }
+
+  /* a descriptor for every listener */
+  if (getrlimit (RLIMIT_NOFILE, &limit) == 0)
+    {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit (RLIMIT_NOFILE, &limit);
+    }
+
+  buf = malloc ((size_t) tunnels * BENCH_LINE_MAX);
+  if (!buf)
+    return 1;
+  len = 0;
+  for (i = 0; i < tunnels; i++)
+    if (i < tunnels - reverse)
+      len += snprintf (&buf[len], BENCH_LINE_MAX,
+                       "-L 127.0.0.1:%d:127.0.0.1:17100\n",
+                       listen_port + i);
+    else
+      len += snprintf (&buf[len], BENCH_LINE_MAX,
+                       "-R 0:127.0.0.1:17100\n");
+
+  uvsocks_config_init (&config);
+  parse_start = uv_hrtime ();
+  if (uvsocks_config_parse (&config, buf, len))
+    {
+      fprintf (stderr, "startup: line %d: %s\n", config.line, config.error);
+      return 1;
+    }
+  parse_end = uv_hrtime ();
+  free (buf);
+
+  bench_loop = uv_default_loop ();
+  bench_tunnels = config.n_params;
+
+  uvsocks_options_init (&options);
+  options.event_mask = UVSOCKS_EVENT_ERRORS |
+                       UVSOCKS_EVENT (UVSOCKS_OK_TCP_LOCAL_SERVER) |
+                       UVSOCKS_EVENT (UVSOCKS_OK_SOCKS_BIND);
+  bench_socks = uvsocks_new_full (bench_loop,
+                                  "127.0.0.1",
+                                  socks_port,
+                                  "bench",
+                                  "bench",
+                                  config.n_params,
+                                  config.params,
+                                  &options,
+                                  bench_notify,
+                                  NULL);
+  if (!bench_socks)
+    return 1;
+
+  uv_idle_init (bench_loop, &bench_idle);
+
+  bench_start = uv_hrtime ();
+  uvsocks_run (bench_socks);
+  uv_run (bench_loop, UV_RUN_DEFAULT);
+  shutdown = uv_hrtime ();
+
+  printf ("{\"tunnels\": %d, \"reverse\": %d, \"failed\": %d, "
+          "\"parse_ms\": %.3f, \"parse_lines_per_sec\": %.0f, "
+          "\"startup_ms\": %.1f, \"shutdown_ms\": %.1f, "
+          "\"memory_kib\": %llu}\n",
+          config.n_params,
+          reverse,
+          bench_failed,
+          bench_msec (parse_start, parse_end),
+          config.n_params / (bench_msec (parse_start, parse_end) / 1e3),
+          bench_msec (bench_start, bench_done),
+          bench_msec (bench_done, shutdown),
+          (unsigned long long) bench_memory.bytes / 1024);
+
+  uvsocks_config_clear (&config);
+  uv_loop_close (bench_loop);
+
+  return 0;
+}
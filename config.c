@@ -0,0 +1,656 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifdef _MSC_VER
+#if _MSC_VER < 1900
+#define inline __inline
+#define snprintf _snprintf
+#endif
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#endif
+
+#include "config.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UVSOCKS_CONFIG_FIELDS_MAX   4
+#define UVSOCKS_CONFIG_PARAMS_MIN   16
+#define UVSOCKS_CONFIG_READ_MIN     (64 * 1024)
+
+/* A piece of an argument, which is not terminated. */
+typedef struct _UvSocksConfigSpan UvSocksConfigSpan;
+struct _UvSocksConfigSpan
+{
+  const char *str;
+  size_t      len;
+};
+
+/* Splits span at every c into at most max spans, returning how many there
+   were, which is above max when some did not fit. */
+static int
+uvsocks_config_split (UvSocksConfigSpan  span,
+                      int                c,
+                      UvSocksConfigSpan *spans,
+                      int                max)
+{
+  const char *end;
+  const char *s;
+  int n;
+
+  end = span.str + span.len;
+  for (n = 0; ; n++)
+    {
+      s = memchr (span.str, c, end - span.str);
+      if (n < max)
+        {
+          spans[n].str = span.str;
+          spans[n].len = (s ? s : end) - span.str;
+        }
+      if (!s)
+        break;
+      span.str = s + 1;
+    }
+
+  return n + 1;
+}
+
+static int
+uvsocks_config_copy (char              *dest,
+                     size_t             size,
+                     UvSocksConfigSpan  span)
+{
+  if (span.len >= size)
+    return -1;
+
+  memcpy (dest, span.str, span.len);
+  dest[span.len] = '\0';
+  return 0;
+}
+
+static int
+uvsocks_config_number (UvSocksConfigSpan  span,
+                       uint64_t           max,
+                       uint64_t          *value)
+{
+  uint64_t v;
+  size_t i;
+
+  if (span.len == 0)
+    return -1;
+
+  v = 0;
+  for (i = 0; i < span.len; i++)
+    {
+      if (span.str[i] < '0' || span.str[i] > '9')
+        return -1;
+      v = v * 10 + (span.str[i] - '0');
+      if (v > max)
+        return -1;
+    }
+
+  *value = v;
+  return 0;
+}
+
+static int
+uvsocks_config_port (UvSocksConfigSpan  span,
+                     int               *port)
+{
+  uint64_t v;
+
+  if (uvsocks_config_number (span, 65535, &v))
+    return -1;
+
+  *port = (int) v;
+  return 0;
+}
+
+/* A port, or a range of them as first-last, of n ports. */
+static int
+uvsocks_config_ports (UvSocksConfigSpan  span,
+                      int               *port,
+                      int               *n)
+{
+  UvSocksConfigSpan ends[2];
+  int last;
+
+  *n = 1;
+  if (uvsocks_config_split (span, '-', ends, 2) == 1)
+    return uvsocks_config_port (span, port);
+
+  if (uvsocks_config_split (span, '-', ends, 2) > 2 ||
+      uvsocks_config_port (ends[0], port) ||
+      uvsocks_config_port (ends[1], &last) ||
+      *port == 0 || last < *port)
+    return -1;
+
+  *n = last - *port + 1;
+  return 0;
+}
+
+/* A byte count with an optional k, m or g suffix. */
+static int
+uvsocks_config_bytes (UvSocksConfigSpan  span,
+                      uint64_t          *bytes)
+{
+  int shift;
+
+  shift = 0;
+  if (span.len > 0)
+    switch (span.str[span.len - 1])
+      {
+      case 'g': case 'G':
+        shift += 10;
+        /* fall through */
+      case 'm': case 'M':
+        shift += 10;
+        /* fall through */
+      case 'k': case 'K':
+        shift += 10;
+        span.len--;
+        break;
+      }
+
+  if (uvsocks_config_number (span, UINT64_MAX >> 31, bytes))
+    return -1;
+
+  *bytes <<= shift;
+  return 0;
+}
+
+static int
+uvsocks_config_is (UvSocksConfigSpan  span,
+                   const char        *str)
+{
+  return span.len == strlen (str) && !memcmp (span.str, str, span.len);
+}
+
+static UvSocksParam *
+uvsocks_config_add (UvSocksConfig *config)
+{
+  UvSocksParam *param;
+
+  if (config->n_params == config->max_params)
+    {
+      UvSocksParam *params;
+      int max;
+
+      max = config->max_params ?
+            config->max_params * 2 : UVSOCKS_CONFIG_PARAMS_MIN;
+      params = realloc (config->params, max * sizeof (UvSocksParam));
+      if (!params)
+        return NULL;
+      config->params = params;
+      config->max_params = max;
+    }
+
+  param = &config->params[config->n_params];
+  memset (param, 0, sizeof (UvSocksParam));
+  return param;
+}
+
+/* [listen:]port:destination:port, where an absolute path stands for a
+   host:port pair, and either port may be a range; the ports of a listen
+   range go to as many destination ports, or all to one. */
+static const char *
+uvsocks_config_forward (UvSocksParam      *param,
+                        UvSocksConfigSpan  arg)
+{
+  UvSocksConfigSpan fields[UVSOCKS_CONFIG_FIELDS_MAX];
+  UvSocksConfigSpan any = { "0.0.0.0", 7 };
+  int listen_n;
+  int destination_n;
+  int n;
+  int m;
+
+  n = uvsocks_config_split (arg, ':', fields, UVSOCKS_CONFIG_FIELDS_MAX);
+  if (n > UVSOCKS_CONFIG_FIELDS_MAX)
+    return "too many fields";
+
+  if (fields[n-1].len > 0 && fields[n-1].str[0] == '/')
+    {
+      if (uvsocks_config_copy (param->destination_host,
+                               sizeof (param->destination_host),
+                               fields[n-1]))
+        return "destination too long";
+      param->destination_port = UVSOCKS_PORT_STREAMLOCAL;
+      destination_n = 1;
+      m = n - 1;
+    }
+  else
+    {
+      if (uvsocks_config_copy (param->destination_host,
+                               sizeof (param->destination_host),
+                               n >= 2 ? fields[n-2] : any))
+        return "destination too long";
+      if (uvsocks_config_ports (fields[n-1],
+                                &param->destination_port,
+                                &destination_n))
+        return "bad destination port";
+      m = n - 2;
+    }
+
+  if (m >= 1 && fields[m-1].len > 0 && fields[m-1].str[0] == '/')
+    {
+      if (m > 1)
+        return "too many fields";
+      if (uvsocks_config_copy (param->listen_host,
+                               sizeof (param->listen_host),
+                               fields[m-1]))
+        return "listen path too long";
+      param->listen_port = UVSOCKS_PORT_STREAMLOCAL;
+      listen_n = 1;
+    }
+  else
+    {
+      if (m > 2)
+        return "too many fields";
+      if (uvsocks_config_copy (param->listen_host,
+                               sizeof (param->listen_host),
+                               m >= 2 ? fields[m-2] : any))
+        return "listen host too long";
+      param->listen_port = 0;
+      listen_n = 1;
+      if (m >= 1 &&
+          uvsocks_config_ports (fields[m-1], &param->listen_port, &listen_n))
+        return "bad listen port";
+    }
+
+  if (destination_n > 1 && destination_n != listen_n)
+    return "port ranges differ";
+  if (listen_n > 1)
+    param->n_ports = listen_n;
+  param->range_destination = destination_n > 1;
+
+  return NULL;
+}
+
+/* [listen:]port of a proxy frontend, where port may be a range. */
+static const char *
+uvsocks_config_frontend (UvSocksParam      *param,
+                         UvSocksConfigSpan  arg)
+{
+  UvSocksConfigSpan fields[2];
+  UvSocksConfigSpan local = { "127.0.0.1", 9 };
+  int listen_n;
+  int n;
+
+  n = uvsocks_config_split (arg, ':', fields, 2);
+  if (n > 2)
+    return "too many fields";
+
+  if (uvsocks_config_copy (param->listen_host,
+                           sizeof (param->listen_host),
+                           n >= 2 ? fields[0] : local))
+    return "listen host too long";
+  if (uvsocks_config_ports (fields[n-1], &param->listen_port, &listen_n))
+    return "bad listen port";
+  if (listen_n > 1)
+    param->n_ports = listen_n;
+
+  return NULL;
+}
+
+/* [in:|out:]bytes_per_sec[:burst], both ways when no direction is
+   given. */
+static const char *
+uvsocks_config_rate (UvSocksRate       *rates,
+                     UvSocksConfigSpan  arg)
+{
+  UvSocksConfigSpan fields[3];
+  UvSocksRate rate;
+  int first;
+  int d;
+  int n;
+
+  n = uvsocks_config_split (arg, ':', fields, 3);
+  if (n > 3)
+    return "too many fields";
+
+  d = -1;
+  if (uvsocks_config_is (fields[0], "in"))
+    d = UVSOCKS_DIRECTION_IN;
+  else if (uvsocks_config_is (fields[0], "out"))
+    d = UVSOCKS_DIRECTION_OUT;
+  first = d >= 0 ? 1 : 0;
+
+  if (first >= n || n - first > 2)
+    return "bad rate";
+  if (uvsocks_config_bytes (fields[first], &rate.bytes_per_sec))
+    return "bad rate";
+  rate.burst = 0;
+  if (first + 1 < n &&
+      uvsocks_config_bytes (fields[first + 1], &rate.burst))
+    return "bad burst";
+
+  if (d >= 0)
+    rates[d] = rate;
+  else
+    rates[UVSOCKS_DIRECTION_IN] = rates[UVSOCKS_DIRECTION_OUT] = rate;
+
+  return NULL;
+}
+
+void
+uvsocks_config_init (UvSocksConfig *config)
+{
+  memset (config, 0, sizeof (UvSocksConfig));
+}
+
+void
+uvsocks_config_clear (UvSocksConfig *config)
+{
+  free (config->params);
+  uvsocks_config_init (config);
+}
+
+int
+uvsocks_config_option (UvSocksConfig *config,
+                       int            opt,
+                       const char    *arg,
+                       size_t         len)
+{
+  UvSocksConfigSpan span;
+  UvSocksParam *param;
+  uint64_t priority;
+
+  span.str = arg;
+  span.len = len;
+  config->error = NULL;
+
+  switch (opt)
+    {
+    case 'L':
+    case 'R':
+    case 'D':
+    case 'H':
+      param = uvsocks_config_add (config);
+      if (!param)
+        {
+          config->error = "out of memory";
+          return -1;
+        }
+      if (opt == 'L' || opt == 'R')
+        {
+          config->error = uvsocks_config_forward (param, span);
+          param->is_forward = (opt == 'L');
+          if (!config->error && opt == 'R' && param->n_ports > 1)
+            config->error = "port ranges need -L";
+        }
+      else
+        {
+          config->error = uvsocks_config_frontend (param, span);
+          param->is_forward = 1;
+          param->frontend = (opt == 'D') ?
+                            UVSOCKS_FRONTEND_SOCKS5 : UVSOCKS_FRONTEND_HTTP;
+        }
+      if (config->error)
+        return -1;
+      config->n_params++;
+      return 0;
+    case 'B':
+    case 'b':
+    case 'C':
+      if (config->n_params == 0)
+        {
+          config->error = "no tunnel before it";
+          return -1;
+        }
+      param = &config->params[config->n_params - 1];
+      if (opt == 'C')
+        {
+          if (uvsocks_config_number (span, UVSOCKS_PRIORITY_MAX - 1, &priority))
+            config->error = "bad priority";
+          else
+            param->priority = (int) priority;
+        }
+      else
+        config->error = uvsocks_config_rate (opt == 'B' ?
+                                             param->tunnel_rate :
+                                             param->session_rate,
+                                             span);
+      return config->error ? -1 : 0;
+    default:
+      config->error = "unknown option";
+      return -1;
+    }
+}
+
+static int
+uvsocks_config_space (char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+int
+uvsocks_config_parse (UvSocksConfig *config,
+                      const char    *buf,
+                      size_t         len)
+{
+  const char *end;
+  const char *s;
+  int line;
+
+  config->error = NULL;
+  config->line = 0;
+
+  end = buf + len;
+  s = buf;
+  for (line = 1; s < end; line++)
+    {
+      int n_params;
+
+      n_params = config->n_params;
+      while (s < end && *s != '\n')
+        {
+          const char *arg;
+          int opt;
+
+          if (uvsocks_config_space (*s))
+            {
+              s++;
+              continue;
+            }
+          if (*s == '#')
+            {
+              while (s < end && *s != '\n')
+                s++;
+              break;
+            }
+
+          /* an option, then its argument */
+          if (*s != '-' || end - s < 2 ||
+              (end - s > 2 && !uvsocks_config_space (s[2]) && s[2] != '\n'))
+            {
+              config->error = "expected an option";
+              goto fail;
+            }
+          opt = s[1];
+          s += 2;
+          while (s < end && uvsocks_config_space (*s))
+            s++;
+          arg = s;
+          while (s < end && *s != '\n' && !uvsocks_config_space (*s))
+            s++;
+          if (s == arg)
+            {
+              config->error = "missing argument";
+              goto fail;
+            }
+
+          if ((opt == 'L' || opt == 'R' || opt == 'D' || opt == 'H') &&
+              config->n_params > n_params)
+            {
+              config->error = "one tunnel per line";
+              goto fail;
+            }
+          if ((opt == 'B' || opt == 'b' || opt == 'C') &&
+              config->n_params == n_params)
+            {
+              config->error = "no tunnel before it";
+              goto fail;
+            }
+          if (uvsocks_config_option (config, opt, arg, s - arg))
+            goto fail;
+        }
+      if (s < end)
+        s++;
+    }
+
+  return 0;
+
+fail:
+  config->line = line;
+  return -1;
+}
+
+int
+uvsocks_config_load (UvSocksConfig *config,
+                     const char    *path)
+{
+  FILE *file;
+  char *buf;
+  size_t size;
+  size_t len;
+  int ret;
+
+  config->error = NULL;
+  config->line = 0;
+
+  file = fopen (path, "rb");
+  if (!file)
+    {
+      config->error = strerror (errno);
+      return -1;
+    }
+
+  /* the whole file goes into one buffer, which also takes pipes */
+  buf = NULL;
+  size = 0;
+  len = 0;
+  for (;;)
+    {
+      size_t n;
+
+      if (len == size)
+        {
+          char *b;
+
+          size = size ? size * 2 : UVSOCKS_CONFIG_READ_MIN;
+          b = realloc (buf, size);
+          if (!b)
+            {
+              config->error = "out of memory";
+              goto fail;
+            }
+          buf = b;
+        }
+
+      n = fread (buf + len, 1, size - len, file);
+      len += n;
+      if (n == 0)
+        break;
+    }
+  if (ferror (file))
+    {
+      config->error = "read failed";
+      goto fail;
+    }
+
+  fclose (file);
+  ret = uvsocks_config_parse (config, buf, len);
+  free (buf);
+  return ret;
+
+fail:
+  fclose (file);
+  free (buf);
+  return -1;
+}
+
+int
+uvsocks_config_address (const char *spec,
+                        char       *host,
+                        size_t      host_size,
+                        int        *port)
+{
+  UvSocksConfigSpan fields[2];
+  UvSocksConfigSpan span;
+  int n;
+
+  span.str = spec;
+  span.len = strlen (spec);
+  n = uvsocks_config_split (span, ':', fields, 2);
+  if (n > 2)
+    return -1;
+
+  if (n == 2 && uvsocks_config_copy (host, host_size, fields[0]))
+    return -1;
+  return uvsocks_config_port (fields[n-1], port);
+}
+
+int
+uvsocks_config_proxy (const char *spec,
+                      char       *host,
+                      size_t      host_size,
+                      int        *port,
+                      char       *user,
+                      size_t      user_size,
+                      char       *password,
+                      size_t      password_size)
+{
+  UvSocksConfigSpan fields[2];
+  UvSocksConfigSpan span;
+  const char *at;
+
+  span.str = spec;
+  span.len = strlen (spec);
+
+  /* a password may hold an @, a host never does */
+  at = NULL;
+  if (span.len > 0)
+    {
+      const char *s;
+
+      for (s = spec + span.len; s > spec; s--)
+        if (s[-1] == '@')
+          {
+            at = s - 1;
+            break;
+          }
+    }
+  if (at)
+    {
+      const char *colon;
+
+      /* user[:password] */
+      colon = memchr (spec, ':', at - spec);
+      fields[0].str = spec;
+      fields[0].len = (colon ? colon : at) - spec;
+      if (uvsocks_config_copy (user, user_size, fields[0]))
+        return -1;
+      if (colon)
+        {
+          fields[1].str = colon + 1;
+          fields[1].len = at - fields[1].str;
+          if (uvsocks_config_copy (password, password_size, fields[1]))
+            return -1;
+        }
+      span.str = at + 1;
+      span.len -= at + 1 - spec;
+    }
+
+  if (uvsocks_config_split (span, ':', fields, 2) > 2)
+    return -1;
+  if (uvsocks_config_copy (host, host_size, fields[0]))
+    return -1;
+  if (fields[0].str + fields[0].len < span.str + span.len)
+    return uvsocks_config_port (fields[1], port);
+
+  return 0;
+}
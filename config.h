@@ -0,0 +1,84 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include "uvsocks.h"
+#include <stddef.h>
+
+/* Tunnels read from the command line and from configuration files, one
+   tunnel per line, each given as on the command line:
+
+     # comments run to the end of the line
+     -L 1234:192.168.0.231:8000 -C 3
+     -R 5824:192.168.0.231:8000 -b in:1m -b out:256k
+     -L 20000-20999:192.168.0.231:30000-30999
+     -D 1081
+
+   -L, -R, -D and -H add a tunnel, and -B, -b and -C set the caps and the
+   priority class of the tunnel on their line.  A range of listen ports
+   makes one tunnel, see UvSocksParam.n_ports.  Files are parsed in one
+   pass over a single buffer; nothing is allocated for a token, and the
+   params only grow by doubling. */
+typedef struct _UvSocksConfig UvSocksConfig;
+struct _UvSocksConfig
+{
+  UvSocksParam    *params;
+  int              n_params;
+  int              max_params;
+
+  /* what went wrong, and on which line of a file, 0 for none */
+  const char      *error;
+  int              line;
+};
+
+void
+uvsocks_config_init (UvSocksConfig *config);
+
+void
+uvsocks_config_clear (UvSocksConfig *config);
+
+/* Applies the option opt with the argument of len bytes at arg: 'L', 'R',
+   'D' and 'H' add a tunnel, 'B', 'b' and 'C' change the last one added.
+   Returns 0, or -1 with config->error set. */
+int
+uvsocks_config_option (UvSocksConfig *config,
+                       int            opt,
+                       const char    *arg,
+                       size_t         len);
+
+/* Adds the tunnels of the len bytes of a file at buf.  Returns 0, or -1
+   with config->error and config->line set; the tunnels of the lines
+   before it are kept. */
+int
+uvsocks_config_parse (UvSocksConfig *config,
+                      const char    *buf,
+                      size_t         len);
+
+/* Reads the file at path in one go and adds its tunnels. */
+int
+uvsocks_config_load (UvSocksConfig *config,
+                     const char    *path);
+
+/* Splits [user[:password]@]host[:port] into fields of the given sizes,
+   leaving those it lacks as they were.  Returns 0, or -1 when a part does
+   not fit or the port is no number. */
+int
+uvsocks_config_proxy (const char *spec,
+                      char       *host,
+                      size_t      host_size,
+                      int        *port,
+                      char       *user,
+                      size_t      user_size,
+                      char       *password,
+                      size_t      password_size);
+
+/* Splits [host:]port likewise. */
+int
+uvsocks_config_address (const char *spec,
+                        char       *host,
+                        size_t      host_size,
+                        int        *port);
+
+#endif /* __CONFIG_H__ */
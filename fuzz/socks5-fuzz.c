@@ -0,0 +1,99 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+/* libFuzzer target for socks5.c.  The first input byte picks the method
+   offered and the size of the pieces the rest is fed to the client decoder
+   in; the rest also goes through the server parsers and, as a host name,
+   through the request encoder.  Build with "ninja fuzz" and run with
+   fuzz/socks5-fuzz. */
+
+#include "../socks5.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_CHECK(expr)                                                \
+  do {                                                                  \
+    if (!(expr))                                                        \
+      abort ();                                                         \
+  } while (0)
+
+static void
+fuzz_decode (const char    *data,
+             size_t         len,
+             unsigned char  method,
+             size_t         chunk)
+{
+  Socks5Client client;
+  size_t off;
+
+  socks5_client_init (&client, method);
+  for (off = 0; off < len; )
+    {
+      Socks5ClientEvent event;
+      size_t n = len - off < chunk ? len - off : chunk;
+      size_t consumed;
+
+      event = socks5_client_decode (&client, &data[off], n, &consumed);
+      FUZZ_CHECK (consumed <= n);
+      FUZZ_CHECK (client.len <= SOCKS5_PACKET_MAX);
+      off += consumed;
+
+      switch (event)
+        {
+        case SOCKS5_CLIENT_NEED_MORE:
+          FUZZ_CHECK (consumed == n);
+          break;
+        case SOCKS5_CLIENT_ERROR:
+          FUZZ_CHECK (client.error != SOCKS5_CLIENT_ERROR_NONE);
+          return;
+        case SOCKS5_CLIENT_REPLY_DONE:
+          FUZZ_CHECK (client.addr >= client.packet);
+          FUZZ_CHECK (client.addr + client.addr_len + 2 <=
+                      client.packet + client.len);
+          FUZZ_CHECK (client.port >= 0 && client.port <= 0xffff);
+          break;
+        default:
+          FUZZ_CHECK (consumed > 0);
+          break;
+        }
+    }
+}
+
+int
+LLVMFuzzerTestOneInput (const uint8_t *data,
+                        size_t         size)
+{
+  char host[SOCKS5_PACKET_MAX];
+  char buf[SOCKS5_PACKET_MAX];
+  const char *rest;
+  size_t len;
+  int ret;
+
+  if (size < 1)
+    return 0;
+
+  rest = (const char *) &data[1];
+  len = size - 1;
+
+  fuzz_decode (rest, len, data[0] & 0x80 ? 0x02 : 0x00, (data[0] & 0x7f) + 1);
+
+  ret = socks5_server_parse_greeting (rest, len);
+  FUZZ_CHECK (ret <= (int) len);
+  ret = socks5_server_parse_request (rest, len);
+  FUZZ_CHECK (ret <= (int) len);
+  ret = socks5_parse_reply (rest, len);
+  FUZZ_CHECK (ret <= (int) len);
+
+  if (len < sizeof (host))
+    {
+      memcpy (host, rest, len);
+      host[len] = '\0';
+      ret = socks5_client_request (buf, sizeof (buf), 0x01, host, data[0]);
+      FUZZ_CHECK (ret <= (int) sizeof (buf));
+      ret = socks5_client_auth (buf, sizeof (buf), host, host);
+      FUZZ_CHECK (ret <= (int) sizeof (buf));
+    }
+
+  return 0;
+}
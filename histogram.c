@@ -0,0 +1,148 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifdef _MSC_VER
+#if _MSC_VER < 1900
+#define inline __inline
+#endif
+#endif
+
+#include "histogram.h"
+
+#if defined (__GNUC__) || defined (__clang__)
+#define HISTOGRAM_GET(c)      __atomic_load_n (&(c), __ATOMIC_RELAXED)
+#define HISTOGRAM_SET(c, v)   __atomic_store_n (&(c), (v), __ATOMIC_RELAXED)
+#else
+#define HISTOGRAM_GET(c)      (c)
+#define HISTOGRAM_SET(c, v)   ((c) = (v))
+#endif
+
+static inline int
+histogram_log2 (uint64_t value)
+{
+#if defined (__GNUC__) || defined (__clang__)
+  return 63 - __builtin_clzll (value);
+#else
+  int e;
+
+  for (e = 0; value >>= 1; e++)
+    ;
+  return e;
+#endif
+}
+
+static inline int
+histogram_index (uint64_t value)
+{
+  int e;
+
+  if (value < HISTOGRAM_SUB_COUNT)
+    return (int) value;
+
+  e = histogram_log2 (value);
+  if (e >= HISTOGRAM_EXP_MAX)
+    return HISTOGRAM_BUCKETS - 1;
+
+  return (e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT +
+         (int) ((value >> (e - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_COUNT - 1));
+}
+
+/* the middle of the values bucket index stands for */
+static uint64_t
+histogram_value (int index)
+{
+  uint64_t width;
+  int group;
+
+  if (index < HISTOGRAM_SUB_COUNT)
+    return (uint64_t) index;
+
+  group = index / HISTOGRAM_SUB_COUNT;
+  width = (uint64_t) 1 << (group - 1);
+
+  return (uint64_t) (HISTOGRAM_SUB_COUNT + index % HISTOGRAM_SUB_COUNT) *
+         width + width / 2;
+}
+
+void
+histogram_record (Histogram *histogram,
+                  uint64_t   value)
+{
+  int index;
+
+  index = histogram_index (value);
+  HISTOGRAM_SET (histogram->buckets[index], histogram->buckets[index] + 1);
+  HISTOGRAM_SET (histogram->count, histogram->count + 1);
+  HISTOGRAM_SET (histogram->sum, histogram->sum + value);
+  if (value > histogram->max)
+    HISTOGRAM_SET (histogram->max, value);
+}
+
+void
+histogram_copy (Histogram       *dest,
+                const Histogram *src)
+{
+  int i;
+
+  dest->count = 0;
+  dest->sum = HISTOGRAM_GET (src->sum);
+  dest->max = HISTOGRAM_GET (src->max);
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+      dest->buckets[i] = HISTOGRAM_GET (src->buckets[i]);
+      dest->count += dest->buckets[i];
+    }
+}
+
+void
+histogram_merge (Histogram       *dest,
+                 const Histogram *src)
+{
+  Histogram copy;
+  int i;
+
+  histogram_copy (&copy, src);
+
+  dest->count += copy.count;
+  dest->sum += copy.sum;
+  if (copy.max > dest->max)
+    dest->max = copy.max;
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    dest->buckets[i] += copy.buckets[i];
+}
+
+uint64_t
+histogram_percentile (const Histogram *histogram,
+                      double           percentile)
+{
+  uint64_t rank;
+  uint64_t seen;
+  uint64_t value;
+  int i;
+
+  if (histogram->count == 0)
+    return 0;
+
+  if (percentile < 0.0)
+    percentile = 0.0;
+  if (percentile > 100.0)
+    percentile = 100.0;
+
+  rank = (uint64_t) (percentile / 100.0 * histogram->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+
+  seen = 0;
+  for (i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+      seen += histogram->buckets[i];
+      if (seen >= rank)
+        break;
+    }
+
+  value = histogram_value (i < HISTOGRAM_BUCKETS ? i : HISTOGRAM_BUCKETS - 1);
+  if (histogram->max && value > histogram->max)
+    value = histogram->max;
+
+  return value;
+}
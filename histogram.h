@@ -0,0 +1,49 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+
+/* Log-linear buckets: values below HISTOGRAM_SUB_COUNT get a bucket each,
+   and every power of two above is split into HISTOGRAM_SUB_COUNT equal
+   buckets, so any value is kept to within 1/HISTOGRAM_SUB_COUNT of itself.
+   Values from 2^HISTOGRAM_EXP_MAX on share the last bucket. */
+#define HISTOGRAM_SUB_BITS    4
+#define HISTOGRAM_SUB_COUNT   (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_EXP_MAX     36
+#define HISTOGRAM_BUCKETS     ((HISTOGRAM_EXP_MAX - HISTOGRAM_SUB_BITS + 1) * \
+                               HISTOGRAM_SUB_COUNT)
+
+/* A histogram has a single writer and may be copied from any thread while
+   it is being written; a copy may miss the values being recorded. */
+typedef struct _Histogram Histogram;
+struct _Histogram
+{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint32_t buckets[HISTOGRAM_BUCKETS];
+};
+
+void
+histogram_record (Histogram *histogram,
+                  uint64_t   value);
+
+void
+histogram_copy (Histogram       *dest,
+                const Histogram *src);
+
+/* Adds src into dest, which no other thread may be using. */
+void
+histogram_merge (Histogram       *dest,
+                 const Histogram *src);
+
+/* Returns the value below which percentile (0 to 100) of the values fall,
+   as the middle of its bucket, or 0 when the histogram is empty. */
+uint64_t
+histogram_percentile (const Histogram *histogram,
+                      double           percentile);
+
+#endif /* __HISTOGRAM_H__ */
@@ -0,0 +1,123 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#include "http.h"
+#include <uv.h>
+#include <string.h>
+#include <stdlib.h>
+
+int
+http_parse_head (const char *data,
+                 size_t      len,
+                 size_t     *scan)
+{
+  size_t i;
+
+  for (i = *scan; i + 3 < len; i++)
+    if (data[i] == '\r' &&
+        data[i + 1] == '\n' &&
+        data[i + 2] == '\r' &&
+        data[i + 3] == '\n')
+      return (int) (i + 4);
+
+  *scan = i;
+
+  if (len >= HTTP_HEAD_MAX)
+    return -1;
+
+  return 0;
+}
+
+int
+http_connect_to_socks5 (const char *head,
+                        size_t      head_len,
+                        char       *request)
+{
+  const char *end;
+  const char *host;
+  const char *host_end;
+  const char *port;
+  const char *p;
+  char name[256];
+  size_t name_len;
+  size_t request_len;
+  unsigned long number;
+  int bracket;
+
+  end = memchr (head, '\r', head_len);
+  if (!end)
+    return -1;
+
+  if ((size_t) (end - head) < 8 || memcmp (head, "CONNECT ", 8) != 0)
+    return -2;
+
+  host = head + 8;
+  p = memchr (host, ' ', end - host);
+  if (!p || (size_t) (end - p) < 9 || memcmp (p + 1, "HTTP/1.", 7) != 0)
+    return -1;
+
+  /* authority-form: host:port or [v6]:port */
+  bracket = host[0] == '[';
+  if (bracket)
+    {
+      host++;
+      host_end = memchr (host, ']', p - host);
+      if (!host_end || host_end + 1 >= p || host_end[1] != ':')
+        return -1;
+      port = host_end + 2;
+    }
+  else
+    {
+      for (host_end = p; host_end > host && host_end[-1] != ':'; host_end--)
+        ;
+      if (host_end == host)
+        return -1;
+      port = host_end;
+      host_end--;
+    }
+
+  name_len = host_end - host;
+  if (name_len == 0 || name_len >= sizeof (name) || port == p)
+    return -1;
+
+  number = 0;
+  for (; port < p; port++)
+    {
+      if (*port < '0' || *port > '9')
+        return -1;
+      number = number * 10 + (*port - '0');
+      if (number > 65535)
+        return -1;
+    }
+
+  memcpy (name, host, name_len);
+  name[name_len] = '\0';
+
+  request_len = 0;
+  request[request_len++] = 0x05;
+  request[request_len++] = 0x01;
+  request[request_len++] = 0x00;
+  if (uv_inet_pton (AF_INET, name, &request[request_len + 1]) == 0)
+    {
+      request[request_len++] = 0x01;
+      request_len += 4;
+    }
+  else if (uv_inet_pton (AF_INET6, name, &request[request_len + 1]) == 0)
+    {
+      request[request_len++] = 0x04;
+      request_len += 16;
+    }
+  else
+    {
+      if (bracket)
+        return -1;
+      request[request_len++] = 0x03;
+      request[request_len++] = (char) name_len;
+      memcpy (&request[request_len], name, name_len);
+      request_len += name_len;
+    }
+  request[request_len++] = (char) (number >> 8);
+  request[request_len++] = (char) (number & 0xff);
+
+  return (int) request_len;
+}
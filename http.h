@@ -0,0 +1,32 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+
+/* Largest request head accepted from a proxy client. */
+#define HTTP_HEAD_MAX 8192
+
+/* Largest SOCKS5 CONNECT request http_connect_to_socks5 () produces. */
+#define HTTP_SOCKS5_REQUEST_MAX (4 + 1 + 255 + 2)
+
+/* Looks for the blank line ending the request head.  *scan remembers how far
+   earlier calls got, so bytes arriving in small pieces are examined once.
+   Returns the head length, 0 when more bytes are needed, or -1 when the head
+   is too long. */
+int
+http_parse_head (const char *data,
+                 size_t      len,
+                 size_t     *scan);
+
+/* Turns the "CONNECT host:port HTTP/1.x" request line at the start of a
+   complete head into a SOCKS5 CONNECT request.  Returns the request length,
+   -1 for a malformed request line, or -2 for a method other than CONNECT. */
+int
+http_connect_to_socks5 (const char *head,
+                        size_t      head_len,
+                        char       *request);
+
+#endif /* __HTTP_H__ */
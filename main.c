@@ -14,6 +14,8 @@
 #endif
 
 #include "uvsocks.h"
+#include "metrics.h"
+#include "config.h"
 #include <uv.h>
 #include <stdio.h>
 #include <memory.h>
@@ -30,16 +32,32 @@
 #include <string.h>
 #include <limits.h>
 #include <locale.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 
 /* Fake port to indicate that host field is really a path. */
-#define PORT_STREAMLOCAL	-2
+#define PORT_STREAMLOCAL	UVSOCKS_PORT_STREAMLOCAL
 #define PATH_MAX_SUN 1024
 
+/* unistd.h has the rest */
+#ifdef _WIN32
 extern char *optarg;
 extern int optind;
+#endif
 extern int optreset;
 
-#define UVSOCKS_PARAM_MAX 64
+#define UVSOCKS_JUMP_MAX  7
+
+typedef struct _MainJump MainJump;
+struct _MainJump
+{
+  char host[64];
+  int  port;
+  char user[64];
+  char password[64];
+};
 
 static uv_loop_t   *main_loop;
 static UvSocks     *main_uvsocks;
@@ -47,26 +65,82 @@ static char         main_host[64];
 static int          main_port;
 static char         main_user[64];
 static char         main_password[64];
-static int          main_n_params;
-static UvSocksParam main_params[UVSOCKS_PARAM_MAX];
+static UvSocksConfig main_config;
+static int          main_n_jumps;
+static MainJump     main_jumps[UVSOCKS_JUMP_MAX];
+static int          main_pipelined;
+static char         main_metrics_host[64];
+static int          main_metrics_port = -1;
+static UvSocksMetrics *main_metrics;
+static int          main_quiet;
+static int          main_coalesce_msec;
+static char         main_trace_path[PATH_MAX_SUN] = "uvsocks.trace";
+static char         main_admin_path[PATH_MAX_SUN];
+static int          main_io_uring;
+static size_t       main_zerocopy;
+static size_t       main_quantum;
+static uint64_t     main_memory_limit;
+static int          main_drain_msec = 30000;
+static int          main_max_dials;
+static int          main_max_waiting;
+static int          main_max_wait_msec;
+static char       **main_argv;
 
 static uv_signal_t sigint;
 static uv_signal_t sigterm;
 static uv_signal_t sighup;
+#ifdef SIGUSR2
+static uv_signal_t sigusr2;
+#endif
+
+#ifdef SIGUSR1
+extern char **environ;
+
+/* upgrading: the executable started afresh, the pipe the new process
+   reports on once its tunnels are up, and the end of it handed to it */
+static uv_signal_t sigusr1;
+static uv_signal_t sigchld;
+static char        main_exe[PATH_MAX_SUN];
+static int         main_upgrading;
+static uv_pipe_t   main_upgrade_pipe;
+static int         main_upgrade_fd = -1;
+static uv_async_t  main_drained;
+
+/* taking over: the listening sockets and the pipe handed down */
+static int        *main_listen_fds;
+static int         main_n_listen_fds;
+static int         main_started_fd = -1;
+#endif
 
 static void main_exit (void);
 
+#ifdef _WIN32
 int
 getopt (int         nargc,
         char *const nargv[],
         const char *ostr);
+#endif
 
 void
 main_usage (void)
 {
 	fprintf (stderr,
           "usage: uvsocks [-R listen:port:destination:port]\n"
+          "               [-R listen:port:/destination.sock]\n"
           "               [-L listen:port:destination:port]\n"
+          "               [-L /listen.sock:destination:port]\n"
+          "               [-L listen:port-port:destination:port[-port]]\n"
+          "               [-D [listen:]port]\n"
+          "               [-H [listen:]port]\n"
+          "               [-J [user:password@]hostname:port]\n"
+          "               [-P] [-q] [-U] [--io-uring] [-s msec] [-T trace_file]\n"
+          "               [-Q quantum_bytes] [-Z zerocopy_bytes] [-m memory_bytes]\n"
+          "               [-B [in:|out:]tunnel_bytes_per_sec[:burst]]\n"
+          "               [-b [in:|out:]session_bytes_per_sec[:burst]]\n"
+          "               [-C priority] [-F tunnels_file]\n"
+          "               [-A admin.sock] [-W drain_msec]\n"
+          "               [-N dials[:waiting[:wait_msec]]]\n"
+          "               [-M [listen:]port] [--metrics [listen:]port]\n"
           "               [-l login_name]\n"
           "               [-a password]\n"
           "               [-p port]\n"
@@ -79,6 +153,21 @@ main_usage (void)
           "  uvsocks -L 1234:192.168.0.231:8000 \\\n"
           "          -R 5824:192.168.0.231:8000 \\\n"
           "          192.168.0.15 -l user -a password -p 1080\n"
+          "  uvsocks -D 1081 user:password@192.168.0.15:1080\n"
+          "  uvsocks -H 3128 user:password@192.168.0.15:1080\n"
+          "  uvsocks -D 1081 --metrics 9180 user:password@192.168.0.15:1080\n"
+          "  uvsocks -L 1234:192.168.0.231:8000 -B out:10m -b 1m:256k \\\n"
+          "          user:password@192.168.0.15:1080\n"
+          "  uvsocks -L 2222:192.168.0.231:22 -C 3 \\\n"
+          "          -L 5140:192.168.0.231:514 -B 1m \\\n"
+          "          user:password@192.168.0.15:1080\n"
+          "  uvsocks -L 20000-20999:192.168.0.231:30000-30999 \\\n"
+          "          user:password@192.168.0.15:1080\n"
+          "  uvsocks -F tunnels.conf user:password@192.168.0.15:1080\n"
+          "  uvsocks -D 1081 -N 64:4096:5000 user:password@192.168.0.15:1080\n"
+          "  uvsocks -L 1234:192.168.0.231:8000 -P \\\n"
+          "          -J user:password@10.0.0.1:1080 \\\n"
+          "          user:password@192.168.0.15:1080\n"
 	        );
 }
 
@@ -88,10 +177,243 @@ main_handle_signals (uv_signal_t *handle,
 {
   fprintf (stderr, "main: signal[%d] received\n", signum);
 
+  uvsocks_metrics_free (main_metrics);
+  main_metrics = NULL;
   uvsocks_free (main_uvsocks);
+  main_uvsocks = NULL;
   uv_stop (main_loop);
 }
 
+#ifdef SIGUSR1
+/* Takes what the process being replaced handed down, as systemd does:
+   LISTEN_FDS listening sockets from fd 3 on, and right past them the pipe
+   to report on once the tunnels are up. */
+static void
+main_inherit (void)
+{
+  const char *env;
+  int i;
+
+  env = getenv ("LISTEN_PID");
+  if (env && strtol (env, (char **) NULL, 10) != (long) getpid ())
+    return;
+
+  env = getenv ("LISTEN_FDS");
+  if (env)
+    main_n_listen_fds = (int) strtol (env, (char **) NULL, 10);
+  if (main_n_listen_fds > 0)
+    main_listen_fds = malloc (main_n_listen_fds * sizeof (int));
+  if (!main_listen_fds)
+    main_n_listen_fds = 0;
+  for (i = 0; i < main_n_listen_fds; i++)
+    {
+      main_listen_fds[i] = 3 + i;
+      fcntl (3 + i, F_SETFD, FD_CLOEXEC);
+    }
+
+  env = getenv ("UVSOCKS_UPGRADE_FD");
+  if (env)
+    {
+      main_started_fd = (int) strtol (env, (char **) NULL, 10);
+      fcntl (main_started_fd, F_SETFD, FD_CLOEXEC);
+    }
+
+  unsetenv ("LISTEN_PID");
+  unsetenv ("LISTEN_FDS");
+  unsetenv ("LISTEN_FDNAMES");
+  unsetenv ("UVSOCKS_UPGRADE_FD");
+}
+
+/* From the callback thread: the tunnels are up, and the process being
+   replaced may stop accepting. */
+static void
+main_started (void)
+{
+  if (main_started_fd < 0)
+    return;
+
+  if (write (main_started_fd, "1", 1) != 1)
+    fprintf (stderr, "main: failed to report to the old process\n");
+  close (main_started_fd);
+  main_started_fd = -1;
+}
+
+/* From the uvsocks thread, with the listening sockets: starts the new
+   process on them.  The environment is put together beforehand, as only
+   async-signal-safe calls may follow fork () in a threaded process. */
+static void
+main_handover (UvSocks   *uvsocks,
+               const int *fds,
+               int        n_fds,
+               void      *data)
+{
+  char listen_fds[32];
+  char upgrade_fd[32];
+  char **env;
+  int *moved;
+  pid_t pid;
+  int n_env;
+  int i;
+  int e;
+
+  for (n_env = 0; environ[n_env]; n_env++)
+    ;
+  env = malloc ((n_env + 3) * sizeof (char *));
+  moved = malloc ((n_fds + 1) * sizeof (int));
+  if (n_fds < 0 || !env || !moved)
+    {
+      fprintf (stderr, "main: out of memory for the upgrade\n");
+      goto done;
+    }
+
+  snprintf (listen_fds, sizeof (listen_fds), "LISTEN_FDS=%d", n_fds);
+  snprintf (upgrade_fd, sizeof (upgrade_fd), "UVSOCKS_UPGRADE_FD=%d", 3 + n_fds);
+  for (i = 0, e = 0; i < n_env; i++)
+    if (strncmp (environ[i], "LISTEN_", 7) != 0 &&
+        strncmp (environ[i], "UVSOCKS_UPGRADE_FD=", 19) != 0)
+      env[e++] = environ[i];
+  env[e++] = listen_fds;
+  env[e++] = upgrade_fd;
+  env[e] = NULL;
+
+  pid = fork ();
+  if (pid == 0)
+    {
+      /* out of the way first, as a socket may sit where another goes;
+         dup2 () clears close-on-exec on the ones kept */
+      for (i = 0; i < n_fds; i++)
+        moved[i] = fcntl (fds[i], F_DUPFD_CLOEXEC, 4 + n_fds);
+      moved[n_fds] = fcntl (main_upgrade_fd, F_DUPFD_CLOEXEC, 4 + n_fds);
+      for (i = 0; i <= n_fds; i++)
+        if (moved[i] < 0 || dup2 (moved[i], 3 + i) < 0)
+          _exit (127);
+
+      execve (main_exe, main_argv, env);
+      _exit (127);
+    }
+
+  if (pid < 0)
+    fprintf (stderr, "main: fork failed: %s\n", strerror (errno));
+  else
+    fprintf (stderr,
+             "main: upgrading to %s as %d with %d listeners\n",
+             main_exe,
+             (int) pid,
+             n_fds);
+
+done:
+
+  /* the new process holds the only end left, or none when it failed */
+  close (main_upgrade_fd);
+  main_upgrade_fd = -1;
+  free (moved);
+  free (env);
+}
+
+static void
+main_upgrade_alloc (uv_handle_t *handle,
+                    size_t       suggested_size,
+                    uv_buf_t    *buf)
+{
+  static char byte;
+
+  buf->base = &byte;
+  buf->len = 1;
+}
+
+static void
+main_metrics_start (void);
+
+/* The new process is up, or gone without a word. */
+static void
+main_upgrade_read (uv_stream_t    *stream,
+                   ssize_t         nread,
+                   const uv_buf_t *buf)
+{
+  if (nread == 0)
+    return;
+
+  uv_close ((uv_handle_t *) &main_upgrade_pipe, NULL);
+
+  if (nread > 0)
+    {
+      fprintf (stderr, "main: new process is up, draining\n");
+      uvsocks_drain (main_uvsocks, main_drain_msec);
+      return;
+    }
+
+  /* it can be tried again */
+  fprintf (stderr, "main: new process failed, serving on\n");
+  uvsocks_resume (main_uvsocks);
+  main_upgrading = 0;
+  main_metrics_start ();
+}
+
+/* Reaps a new process that failed, without waiting on one that closed
+   the pipe but lingers; the only children are those of upgrades. */
+static void
+main_reap (uv_signal_t *handle,
+           int          signum)
+{
+  while (waitpid (-1, NULL, WNOHANG) > 0)
+    ;
+}
+
+static void
+main_upgrade (uv_signal_t *handle,
+              int          signum)
+{
+  int fds[2];
+
+  if (main_upgrading || !main_uvsocks)
+    return;
+
+  if (pipe (fds))
+    {
+      fprintf (stderr, "main: upgrade failed: %s\n", strerror (errno));
+      return;
+    }
+  fcntl (fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl (fds[1], F_SETFD, FD_CLOEXEC);
+
+  uv_pipe_init (main_loop, &main_upgrade_pipe, 0);
+  uv_pipe_open (&main_upgrade_pipe, fds[0]);
+  uv_read_start ((uv_stream_t *) &main_upgrade_pipe,
+                 main_upgrade_alloc,
+                 main_upgrade_read);
+  main_upgrade_fd = fds[1];
+  main_upgrading = 1;
+
+  /* the new process listens on the metrics port anew */
+  uvsocks_metrics_free (main_metrics);
+  main_metrics = NULL;
+
+  uvsocks_handover (main_uvsocks, main_handover, NULL);
+}
+
+static void
+main_drained_async (uv_async_t *handle)
+{
+  fprintf (stderr, "main: drained\n");
+
+  uvsocks_free (main_uvsocks);
+  main_uvsocks = NULL;
+  uv_stop (main_loop);
+}
+#endif
+
+#ifdef SIGUSR2
+static void
+main_dump_trace (uv_signal_t *handle,
+                 int          signum)
+{
+  if (uvsocks_dump_trace (main_uvsocks, main_trace_path))
+    fprintf (stderr, "main: failed to write trace to %s\n", main_trace_path);
+  else
+    fprintf (stderr, "main: trace written to %s\n", main_trace_path);
+}
+#endif
+
 static void
 main_setup (uv_loop_t *loop)
 {
@@ -103,6 +425,24 @@ main_setup (uv_loop_t *loop)
 
   uv_signal_init (loop, &sighup);
   uv_signal_start (&sighup, main_handle_signals, SIGHUP);
+
+#ifdef SIGUSR2
+  uv_signal_init (loop, &sigusr2);
+  uv_signal_start (&sigusr2, main_dump_trace, SIGUSR2);
+#endif
+
+#ifdef SIGUSR1
+  uv_signal_init (loop, &sigusr1);
+  uv_signal_start (&sigusr1, main_upgrade, SIGUSR1);
+  uv_signal_init (loop, &sigchld);
+  uv_signal_start (&sigchld, main_reap, SIGCHLD);
+  uv_async_init (loop, &main_drained, main_drained_async);
+#endif
+
+#ifdef SIGPIPE
+  /* a peer closing with data in flight must fail the write, not kill us */
+  signal (SIGPIPE, SIG_IGN);
+#endif
 }
 
 static void
@@ -111,6 +451,14 @@ main_cleanup (void)
   uv_signal_stop (&sigint);
   uv_signal_stop (&sigterm);
   uv_signal_stop (&sighup);
+#ifdef SIGUSR2
+  uv_signal_stop (&sigusr2);
+#endif
+#ifdef SIGUSR1
+  uv_signal_stop (&sigusr1);
+  uv_signal_stop (&sigchld);
+  uv_close ((uv_handle_t *) &main_drained, NULL);
+#endif
 }
 
 static void
@@ -119,6 +467,41 @@ main_uvsocks_notify (UvSocks       *uvsocks,
                      UvSocksParam  *param,
                      void          *data)
 {
+  if (status == UVSOCKS_OK_STARTED || status == UVSOCKS_OK_DRAINED)
+    {
+      fprintf (stderr, "main[%s]\n", uvsocks_get_status_string (status));
+#ifdef SIGUSR1
+      if (status == UVSOCKS_OK_STARTED)
+        main_started ();
+      else
+        uv_async_send (&main_drained);
+#endif
+      return;
+    }
+
+  if (status == UVSOCKS_OK_SOCKS_HOP)
+    {
+      fprintf (stderr,
+               "main[%s] %d %dus\n",
+               uvsocks_get_status_string (status),
+               param->hop,
+               param->hop_latency);
+      return;
+    }
+
+  if (param && param->count > 1)
+    {
+      fprintf (stderr,
+               "main[%s] %s:%d -> %s:%d (%d more)\n",
+               uvsocks_get_status_string (status),
+               param->destination_host,
+               param->destination_port,
+               param->listen_host,
+               param->listen_port,
+               param->count);
+      return;
+    }
+
 	fprintf (stderr,
 				  "main[%s] %s:%d -> %s:%d\n",
            uvsocks_get_status_string (status),
@@ -128,84 +511,17 @@ main_uvsocks_notify (UvSocks       *uvsocks,
            param->listen_port);
 }
 
-char **
-main_split_string (const char *string,
-                   const char *delimiter,
-                   int        *n_strings)
+static int
+main_tunnel_option (int         opt,
+                    const char *arg)
 {
-  const char *str;
-  char      **strings;
-  size_t      delimiter_len;
-  int         n;
-
-  if (n_strings)
-    *n_strings = 0;
-
-  if (!string || !delimiter)
-    return NULL;
-
-  delimiter_len = strlen (delimiter);
-
-  n = 1;
-  for (str = string; *str; n++)
+  if (uvsocks_config_option (&main_config, opt, arg, strlen (arg)))
     {
-      char *s;
-
-      s = strstr (str, delimiter);
-      if (!s)
-        break;
-      str = s + delimiter_len;
-    }
-
-  strings = calloc (n + 1, sizeof (char *));
-
-  n = 0;
-  str = string;
-  do
-    {
-      char *s;
-      char *a;
-      size_t len;
-
-      s = strstr (str, delimiter);
-      if (s)
-        len = s - str;
-      else
-        len = strlen (str);
-
-      if (s || len > 0)
-        {
-          a = malloc (len + 1);
-          if (len > 0)
-            memcpy (a, str, len);
-          a[len] = '\0';
-          strings[n] = a;
-          n++;
-        }
-
-      if (!s)
-        break;
-      str = s + delimiter_len;
+      fprintf (stderr, "main: -%c %s: %s\n", opt, arg, main_config.error);
+      return -1;
     }
-  while (*str);
-
-  if (n_strings)
-    *n_strings = n;
 
-  return strings;
-}
-
-void
-main_free_strings (char **strings)
-{
-  int n;
-
-  if (!strings)
-    return;
-
-  for (n = 0; strings[n]; n++)
-    free (strings[n]);
-  free (strings);
+  return 0;
 }
 
 static int
@@ -214,17 +530,24 @@ main_get_param (int    ac,
 {
 	int opt;
 
-  main_n_params = 0;
+  uvsocks_config_init (&main_config);
   main_host[0] = '\0';
   main_port = 1080;
   main_user[0] = '\0';
   main_password[0] = '\0';
 
+  /* getopt () knows no long options */
+  for (opt = 1; opt < ac; opt++)
+    if (strcmp (av[opt], "--metrics") == 0)
+      av[opt] = "-M";
+    else if (strcmp (av[opt], "--io-uring") == 0)
+      av[opt] = "-U";
+
 again:
   while ((opt = getopt (ac,
                         av,
                        "a:l:p:"
-	                     "L:R:")) != -1)
+	                     "A:B:C:D:F:H:J:L:M:N:PQ:R:T:UW:Z:b:m:qs:")) != -1)
   {
 		switch (opt)
       {
@@ -232,89 +555,137 @@ again:
 			  main_port = (int) strtol (optarg, (char **) NULL, 10);
 			  break;
 		  case 'l':
-        strcpy (main_user, optarg);
+			  snprintf (main_user, sizeof (main_user), "%s", optarg);
 			  break;
 		  case 'a':
-			  strcpy (main_password, optarg);
+			  snprintf (main_password, sizeof (main_password), "%s", optarg);
 			  break;
 		  case 'L':
 		  case 'R':
+		  case 'D':
+		  case 'H':
+		  case 'B':
+		  case 'b':
+		  case 'C':
+        if (main_tunnel_option (opt, optarg))
+          return 1;
+			  break;
+		  case 'F':
+        if (uvsocks_config_load (&main_config, optarg))
+          {
+            if (main_config.line > 0)
+              fprintf (stderr,
+                       "main: %s:%d: %s\n",
+                       optarg,
+                       main_config.line,
+                       main_config.error);
+            else
+              fprintf (stderr, "main: %s: %s\n", optarg, main_config.error);
+            return 1;
+          }
+			  break;
+		  case 'J':
         {
-          char **strs;
-          int n;
+          MainJump *jump;
 
-          n = 0;
-          strs = main_split_string (optarg, ":", &n);
-          if (n > 0)
+          if (main_n_jumps >= UVSOCKS_JUMP_MAX)
+            {
+              fprintf (stderr,
+                       "main: too many jump proxies, at most %d: %s\n",
+                       UVSOCKS_JUMP_MAX,
+                       optarg);
+              return 1;
+            }
+
+          jump = &main_jumps[main_n_jumps++];
+          jump->port = 1080;
+          if (uvsocks_config_proxy (optarg,
+                                    jump->host, sizeof (jump->host),
+                                    &jump->port,
+                                    jump->user, sizeof (jump->user),
+                                    jump->password, sizeof (jump->password)))
+            {
+              fprintf (stderr, "main: bad jump proxy: %s\n", optarg);
+              return 1;
+            }
+        }
+			  break;
+		  case 'P':
+			  main_pipelined = 1;
+			  break;
+		  case 'A':
+			  snprintf (main_admin_path, sizeof (main_admin_path), "%s", optarg);
+			  break;
+		  case 'T':
+			  snprintf (main_trace_path, sizeof (main_trace_path), "%s", optarg);
+			  break;
+		  case 'q':
+			  main_quiet = 1;
+			  break;
+		  case 'U':
+			  main_io_uring = 1;
+			  break;
+		  case 'Q':
+			  main_quantum = (size_t) strtoul (optarg, (char **) NULL, 10);
+			  break;
+		  case 'Z':
+			  main_zerocopy = (size_t) strtoul (optarg, (char **) NULL, 10);
+			  break;
+		  case 'm':
+			  main_memory_limit = strtoull (optarg, (char **) NULL, 10);
+			  break;
+		  case 'W':
+			  main_drain_msec = (int) strtol (optarg, (char **) NULL, 10);
+			  break;
+		  case 'N':
+        {
+          char *end;
+
+          main_max_dials = (int) strtol (optarg, &end, 10);
+          if (*end == ':')
+            main_max_waiting = (int) strtol (end + 1, &end, 10);
+          if (*end == ':')
+            main_max_wait_msec = (int) strtol (end + 1, &end, 10);
+          if (*end != '\0' ||
+              main_max_dials < 0 ||
+              main_max_waiting < 0 ||
+              main_max_wait_msec < 0)
             {
-              strcpy (main_params[main_n_params].listen_host,
-                      (n >= 4) ? strs[n-4] : "0.0.0.0");
-              main_params[main_n_params].listen_port =
-                (int) strtol ((n >= 3) ? strs[n-3] : "0", (char **) NULL, 10);
-              strcpy (main_params[main_n_params].destination_host,
-                      (n >= 2) ? strs[n-2] : "0.0.0.0");
-              main_params[main_n_params].destination_port =
-                (int) strtol ((n >= 1) ? strs[n-1] : "0", (char **) NULL, 10);
-
-              main_params[main_n_params].is_forward = (opt == 'L');
-              main_n_params++;
+              fprintf (stderr, "main: bad admission: %s\n", optarg);
+              return 1;
             }
-          main_free_strings (strs);
         }
 			  break;
+		  case 's':
+			  main_coalesce_msec = (int) strtol (optarg, (char **) NULL, 10);
+			  break;
+		  case 'M':
+        snprintf (main_metrics_host, sizeof (main_metrics_host), "127.0.0.1");
+        if (uvsocks_config_address (optarg,
+                                    main_metrics_host,
+                                    sizeof (main_metrics_host),
+                                    &main_metrics_port))
+          {
+            fprintf (stderr, "main: bad metrics address: %s\n", optarg);
+            return 1;
+          }
+			  break;
 		  }
   }
   ac -= optind;
 	av += optind;
 	if (ac > 0)
     {
-      char *socks_host;
-      char **socks_hosts;
-      int n_socks_hosts;
-
-      n_socks_hosts = 0;
-      socks_hosts = main_split_string (*av, "@", &n_socks_hosts);
-      if (n_socks_hosts > 1)
+      if (uvsocks_config_proxy (*av,
+                                main_host, sizeof (main_host),
+                                &main_port,
+                                main_user, sizeof (main_user),
+                                main_password, sizeof (main_password)))
         {
-          char **user;
-          int user_n;
-
-          user_n = 0;
-          user = main_split_string (socks_hosts[0], ":", &user_n);
-          if (user_n > 1)
-            {
-                strcpy (main_user, user[0]);
-                strcpy (main_password, user[1]);
-            }
-          else
-            strcpy (main_user, user[0]);
-
-          main_free_strings (user);
-          socks_host = socks_hosts[1];
-        }
-      else
-        socks_host = socks_hosts[0];
-
-      if (socks_host)
-        {
-          char **host;
-          int host_n;
-
-          host_n = 0;
-          host = main_split_string (socks_host, ":", &host_n);
-          if (host_n > 1)
-            {
-                strcpy (main_host, host[0]);
-                main_port = (int) strtol (host[1], (char **) NULL, 10);
-            }
-          else
-            strcpy (main_host, host[0]);
-
-          main_free_strings (host);
+          fprintf (stderr, "main: bad proxy: %s\n", *av);
+          return 1;
         }
 
-      main_free_strings (socks_hosts);
-
 		  if (ac > 1)
         {
 			    optind = optreset = 1;
@@ -324,7 +695,7 @@ again:
       av++;
 	  }
 
-  if (main_n_params == 0 ||
+  if (main_config.n_params == 0 ||
       main_port <= 0 ||
       main_user == '\0' ||
       main_password == '\0')
@@ -336,39 +707,145 @@ again:
   return 0;
 }
 
+static void
+main_metrics_start (void)
+{
+  if (main_metrics_port < 0)
+    return;
+
+  main_metrics = uvsocks_metrics_new (main_loop,
+                                      main_uvsocks,
+                                      main_metrics_host,
+                                      main_metrics_port);
+  if (!main_metrics)
+    fprintf (stderr,
+             "main: metrics listen failed on %s:%d\n",
+             main_metrics_host,
+             main_metrics_port);
+}
+
 void
 main_exit (void)
 {
   main_cleanup ();
+  uvsocks_config_clear (&main_config);
 }
 
 int
 main (int    argc,
       char **argv)
 {
+  UvSocksOptions options;
+
   /* Some uv_fs_*() functions use WIN32 API initialized at uv__once_init() in
      WIN32. Call uv_hrtime() to execute uv_once_init() internally. */
   uv_hrtime ();
   main_loop = uv_default_loop ();
   main_setup (main_loop);
 
+  main_argv = argv;
+#ifdef SIGUSR1
+  main_inherit ();
+
+  /* the path run now, which holds the new binary by the time of an
+     upgrade */
+  if (readlink ("/proc/self/exe", main_exe, sizeof (main_exe) - 1) <= 0)
+    snprintf (main_exe, sizeof (main_exe), "%s", argv[0]);
+#endif
+
   if (main_get_param (argc, argv))
     goto fail;
 
-  main_uvsocks = uvsocks_new (NULL,
-                              main_host,
-                              main_port,
-                              main_user,
-                              main_password,
-                              main_n_params,
-                              main_params,
-                              main_uvsocks_notify,
-                              NULL);
+  /* printing to stderr must not hold up the relay */
+  uvsocks_options_init (&options);
+  options.threaded = 1;
+  options.coalesce_msec = main_coalesce_msec;
+  options.memory_limit = main_memory_limit;
+  if (main_quiet)
+    options.event_mask = UVSOCKS_EVENT_ERRORS |
+                         UVSOCKS_EVENT (UVSOCKS_OK_TCP_LOCAL_SERVER) |
+                         UVSOCKS_EVENT (UVSOCKS_OK_SOCKS_BIND) |
+                         UVSOCKS_EVENT (UVSOCKS_OK_STARTED) |
+                         UVSOCKS_EVENT (UVSOCKS_OK_DRAINED);
+
+  /* jump proxies come first, the proxy on the command line is the last hop */
+  if (main_n_jumps > 0)
+    main_uvsocks = uvsocks_new_full (NULL,
+                                     main_jumps[0].host,
+                                     main_jumps[0].port,
+                                     main_jumps[0].user,
+                                     main_jumps[0].password,
+                                     main_config.n_params,
+                                     main_config.params,
+                                     &options,
+                                     main_uvsocks_notify,
+                                     NULL);
+  else
+    main_uvsocks = uvsocks_new_full (NULL,
+                                     main_host,
+                                     main_port,
+                                     main_user,
+                                     main_password,
+                                     main_config.n_params,
+                                     main_config.params,
+                                     &options,
+                                     main_uvsocks_notify,
+                                     NULL);
   if (!main_uvsocks)
     goto fail;
 
+  if (main_n_jumps > 0)
+    {
+      int j;
+
+      for (j = 1; j < main_n_jumps; j++)
+        uvsocks_add_hop (main_uvsocks,
+                         main_jumps[j].host,
+                         main_jumps[j].port,
+                         main_jumps[j].user,
+                         main_jumps[j].password);
+
+      uvsocks_add_hop (main_uvsocks,
+                       main_host,
+                       main_port,
+                       main_user,
+                       main_password);
+    }
+
+  uvsocks_set_pipelined (main_uvsocks, main_pipelined);
+  uvsocks_set_io_uring (main_uvsocks, main_io_uring);
+  uvsocks_set_quantum (main_uvsocks, main_quantum);
+  uvsocks_set_zerocopy (main_uvsocks, main_zerocopy);
+  uvsocks_set_admission (main_uvsocks,
+                         main_max_dials,
+                         main_max_waiting,
+                         main_max_wait_msec);
+
+  if (main_admin_path[0] &&
+      uvsocks_set_admin (main_uvsocks, main_admin_path))
+    fprintf (stderr, "main: admin path too long: %s\n", main_admin_path);
+
+#ifdef SIGUSR1
+  if (main_n_listen_fds > 0 &&
+      uvsocks_set_listen_fds (main_uvsocks,
+                              main_listen_fds,
+                              main_n_listen_fds))
+    {
+      int i;
+
+      /* nobody would accept on them */
+      fprintf (stderr, "main: failed to take the listening sockets\n");
+      for (i = 0; i < main_n_listen_fds; i++)
+        close (main_listen_fds[i]);
+    }
+  free (main_listen_fds);
+  main_listen_fds = NULL;
+#endif
+
   uvsocks_run (main_uvsocks);
 
+  main_metrics_start ();
+
   uv_run (main_loop, UV_RUN_DEFAULT);
 
 fail:
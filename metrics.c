@@ -0,0 +1,877 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifdef _MSC_VER
+#if _MSC_VER < 1900
+#define inline __inline
+#define snprintf _snprintf
+#endif
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#endif
+
+#include "metrics.h"
+#include "http.h"
+#include <uv.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UVSOCKS_METRICS_BUF_MIN       (16 * 1024)
+#define UVSOCKS_METRICS_REQUEST_MAX   1024
+#define UVSOCKS_METRICS_LABEL_MAX     640
+
+typedef struct _UvSocksMetricsClient UvSocksMetricsClient;
+struct _UvSocksMetricsClient
+{
+  UvSocksMetrics        *metrics;
+  UvSocksMetricsClient  *next;
+  UvSocksMetricsClient **prev;
+
+  uv_tcp_t               tcp;
+  char                   buf[UVSOCKS_METRICS_REQUEST_MAX];
+  size_t                 len;
+  size_t                 scan;
+  uv_write_t             write_req;
+  int                    rendered;
+};
+
+static void
+uvsocks_metrics_snapshot (UvSocks            *socks,
+                          int                 tunnel,
+                          int                 n_tunnels,
+                          const UvSocksStats *stats,
+                          const UvSocksParam *params,
+                          void               *data);
+
+struct _UvSocksMetrics
+{
+  uv_loop_t             *loop;
+  UvSocks               *socks;
+  uv_tcp_t               server;
+  UvSocksMetricsClient  *clients;
+  int                    close;
+
+  /* one scrape renders at a time into buf, which only ever grows */
+  char                  *buf;
+  size_t                 buf_size;
+  size_t                 buf_len;
+  int                    buf_busy;
+
+  /* the client of that scrape while the loop of uvsocks copies the
+     counters into stats and the tunnel params, which the labels come
+     from, into params, which wakes snapshot_async once done */
+  UvSocksMetricsClient  *scraping;
+  int                    snapshotting;
+  uv_async_t             snapshot_async;
+
+  int                    n_tunnels;
+  UvSocksStats          *stats;
+  UvSocksParam          *params;
+  UvSocksLatencyStats   *latency;
+  int                    n_hops;
+  UvSocksLatencyStats   *hop_latency;
+  UvSocksLatencyStats    queue_delay[UVSOCKS_PRIORITY_MAX];
+  UvSocksAdmission       admission;
+  UvSocksMemory          memory;
+};
+
+static const char *uvsocks_metrics_latency_names[UVSOCKS_LATENCY_MAX] =
+  { "dns", "connect", "greeting", "auth", "reply" };
+
+static const char uvsocks_metrics_method_reply[] =
+  "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\nConnection: close\r\n\r\n";
+static const char uvsocks_metrics_bad_request_reply[] =
+  "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+static const char uvsocks_metrics_busy_reply[] =
+  "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n\r\n";
+
+static void
+uvsocks_metrics_close_async (uv_handle_t *handle)
+{
+  UvSocksMetrics *metrics = handle->data;
+
+  free (metrics->stats);
+  free (metrics->params);
+  free (metrics->latency);
+  free (metrics->hop_latency);
+  free (metrics->buf);
+  free (metrics);
+}
+
+/* The loop of uvsocks may still be writing into a snapshot in flight. */
+static void
+uvsocks_metrics_free_real (UvSocksMetrics *metrics)
+{
+  if (metrics->clients || !metrics->close || metrics->snapshotting ||
+      uv_is_closing ((uv_handle_t *) &metrics->snapshot_async))
+    return;
+
+  uv_close ((uv_handle_t *) &metrics->snapshot_async,
+            uvsocks_metrics_close_async);
+}
+
+static void
+uvsocks_metrics_close_server (uv_handle_t *handle)
+{
+  UvSocksMetrics *metrics = handle->data;
+
+  metrics->close = 1;
+  uvsocks_metrics_free_real (metrics);
+}
+
+static void
+uvsocks_metrics_close_client (uv_handle_t *handle)
+{
+  UvSocksMetricsClient *client = handle->data;
+  UvSocksMetrics *metrics = client->metrics;
+
+  *client->prev = client->next;
+  if (client->next)
+    client->next->prev = client->prev;
+
+  if (client->rendered)
+    metrics->buf_busy = 0;
+  if (metrics->scraping == client)
+    metrics->scraping = NULL;
+
+  free (client);
+
+  if (metrics->close)
+    uvsocks_metrics_free_real (metrics);
+}
+
+static void
+uvsocks_metrics_printf (UvSocksMetrics *metrics,
+                        const char     *format,
+                        ...)
+{
+  va_list args;
+  size_t room;
+  int n;
+
+  room = 0;
+  if (metrics->buf_len < metrics->buf_size)
+    room = metrics->buf_size - metrics->buf_len;
+
+  va_start (args, format);
+  n = vsnprintf (room ? &metrics->buf[metrics->buf_len] : NULL,
+                 room,
+                 format,
+                 args);
+  va_end (args);
+
+  /* keep counting past the end so the next pass knows the size needed */
+  if (n > 0)
+    metrics->buf_len += n;
+}
+
+static void
+uvsocks_metrics_escape (char       *out,
+                        size_t      size,
+                        const char *in)
+{
+  size_t o;
+
+  for (o = 0; *in && o + 2 < size; in++)
+    {
+      if (*in == '\\' || *in == '"')
+        out[o++] = '\\';
+      else if (*in == '\n')
+        {
+          out[o++] = '\\';
+          out[o++] = 'n';
+          continue;
+        }
+      out[o++] = *in;
+    }
+  out[o] = '\0';
+}
+
+/* A port, or the range of them a tunnel forwards, as first-last. */
+static void
+uvsocks_metrics_ports (char   *buf,
+                        size_t  size,
+                        int     port,
+                        int     n_ports)
+{
+  if (n_ports > 1)
+    snprintf (buf, size, "%d-%d", port, port + n_ports - 1);
+  else
+    snprintf (buf, size, "%d", port);
+}
+
+static void
+uvsocks_metrics_label (char               *label,
+                       size_t              size,
+                       const UvSocksParam *param,
+                       int                 tunnel)
+{
+  char listen[260];
+  char destination[260];
+  char listen_ports[16];
+  char destination_ports[16];
+  const char *kind;
+
+  uvsocks_metrics_escape (listen, sizeof (listen), param->listen_host);
+  uvsocks_metrics_escape (destination,
+                          sizeof (destination),
+                          param->destination_host);
+
+  if (param->frontend == UVSOCKS_FRONTEND_SOCKS5)
+    kind = "dynamic";
+  else if (param->frontend == UVSOCKS_FRONTEND_HTTP)
+    kind = "http";
+  else
+    kind = param->is_forward ? "local" : "remote";
+
+  uvsocks_metrics_ports (listen_ports,
+                         sizeof (listen_ports),
+                         param->listen_port,
+                         param->n_ports);
+  uvsocks_metrics_ports (destination_ports,
+                         sizeof (destination_ports),
+                         param->destination_port,
+                         param->range_destination ? param->n_ports : 1);
+  snprintf (label,
+            size,
+            "tunnel=\"%d\",kind=\"%s\",listen=\"%s:%s\",destination=\"%s:%s\"",
+            tunnel,
+            kind,
+            listen,
+            listen_ports,
+            destination,
+            destination_ports);
+}
+
+static void
+uvsocks_metrics_family (UvSocksMetrics *metrics,
+                        const char     *name,
+                        const char     *help,
+                        const char     *type)
+{
+  uvsocks_metrics_printf (metrics,
+                          "# HELP %s %s\n"
+                          "# TYPE %s %s\n",
+                          name,
+                          help,
+                          name,
+                          type);
+}
+
+static void
+uvsocks_metrics_latency (UvSocksMetrics            *metrics,
+                         const char                *name,
+                         const char                *labels,
+                         const UvSocksLatencyStats *latency)
+{
+  int l;
+
+  for (l = 0; l < UVSOCKS_LATENCY_MAX; l++, latency++)
+    uvsocks_metrics_printf (metrics,
+                            "%s{%s,step=\"%s\",quantile=\"0.5\"} %.6f\n"
+                            "%s{%s,step=\"%s\",quantile=\"0.9\"} %.6f\n"
+                            "%s{%s,step=\"%s\",quantile=\"0.99\"} %.6f\n"
+                            "%s{%s,step=\"%s\",quantile=\"0.999\"} %.6f\n"
+                            "%s_sum{%s,step=\"%s\"} %.6f\n"
+                            "%s_count{%s,step=\"%s\"} %llu\n",
+                            name, labels, uvsocks_metrics_latency_names[l],
+                            latency->p50 / 1e6,
+                            name, labels, uvsocks_metrics_latency_names[l],
+                            latency->p90 / 1e6,
+                            name, labels, uvsocks_metrics_latency_names[l],
+                            latency->p99 / 1e6,
+                            name, labels, uvsocks_metrics_latency_names[l],
+                            latency->p999 / 1e6,
+                            name, labels, uvsocks_metrics_latency_names[l],
+                            latency->sum / 1e6,
+                            name, labels, uvsocks_metrics_latency_names[l],
+                            (unsigned long long) latency->count);
+}
+
+static void
+uvsocks_metrics_render_real (UvSocksMetrics *metrics)
+{
+  char labels[UVSOCKS_METRICS_LABEL_MAX];
+  UvSocksStats *stats;
+  int t;
+  int s;
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_tunnels",
+                          "Tunnels configured.",
+                          "gauge");
+  uvsocks_metrics_printf (metrics, "uvsocks_tunnels %d\n", metrics->n_tunnels);
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_accepts_total",
+                          "Connections accepted by the local listener.",
+                          "counter");
+  for (t = 0, stats = metrics->stats; t < metrics->n_tunnels; t++, stats++)
+    {
+      uvsocks_metrics_label (labels, sizeof (labels), &metrics->params[t], t);
+      uvsocks_metrics_printf (metrics,
+                              "uvsocks_accepts_total{%s} %llu\n",
+                              labels,
+                              (unsigned long long) stats->accepts);
+    }
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_bytes_total",
+                          "Bytes relayed, in from the proxy or out to it.",
+                          "counter");
+  for (t = 0, stats = metrics->stats; t < metrics->n_tunnels; t++, stats++)
+    {
+      uvsocks_metrics_label (labels, sizeof (labels), &metrics->params[t], t);
+      uvsocks_metrics_printf (metrics,
+                              "uvsocks_bytes_total{%s,direction=\"in\"} %llu\n"
+                              "uvsocks_bytes_total{%s,direction=\"out\"} %llu\n",
+                              labels,
+                              (unsigned long long) stats->bytes_in,
+                              labels,
+                              (unsigned long long) stats->bytes_out);
+    }
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_throttles_total",
+                          "Times a session stopped reading at a bandwidth cap.",
+                          "counter");
+  for (t = 0, stats = metrics->stats; t < metrics->n_tunnels; t++, stats++)
+    {
+      uvsocks_metrics_label (labels, sizeof (labels), &metrics->params[t], t);
+      uvsocks_metrics_printf (metrics,
+                              "uvsocks_throttles_total{%s,direction=\"in\"} %llu\n"
+                              "uvsocks_throttles_total{%s,direction=\"out\"} %llu\n",
+                              labels,
+                              (unsigned long long)
+                              stats->throttles[UVSOCKS_DIRECTION_IN],
+                              labels,
+                              (unsigned long long)
+                              stats->throttles[UVSOCKS_DIRECTION_OUT]);
+    }
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_throttled_seconds_total",
+                          "Time sessions spent held back by bandwidth caps.",
+                          "counter");
+  for (t = 0, stats = metrics->stats; t < metrics->n_tunnels; t++, stats++)
+    {
+      uvsocks_metrics_label (labels, sizeof (labels), &metrics->params[t], t);
+      uvsocks_metrics_printf (metrics,
+                              "uvsocks_throttled_seconds_total{%s,direction=\"in\"} %.6f\n"
+                              "uvsocks_throttled_seconds_total{%s,direction=\"out\"} %.6f\n",
+                              labels,
+                              stats->throttle_usec[UVSOCKS_DIRECTION_IN] / 1e6,
+                              labels,
+                              stats->throttle_usec[UVSOCKS_DIRECTION_OUT] / 1e6);
+    }
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_errors_total",
+                          "Error statuses reported.",
+                          "counter");
+  for (t = 0, stats = metrics->stats; t < metrics->n_tunnels; t++, stats++)
+    {
+      uvsocks_metrics_label (labels, sizeof (labels), &metrics->params[t], t);
+      uvsocks_metrics_printf (metrics,
+                              "uvsocks_errors_total{%s} %llu\n",
+                              labels,
+                              (unsigned long long) stats->errors);
+    }
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_sessions",
+                          "Sessions currently in each stage.",
+                          "gauge");
+  for (t = 0, stats = metrics->stats; t < metrics->n_tunnels; t++, stats++)
+    {
+      uvsocks_metrics_label (labels, sizeof (labels), &metrics->params[t], t);
+      for (s = 0; s < UVSOCKS_STAGE_MAX; s++)
+        uvsocks_metrics_printf (metrics,
+                                "uvsocks_sessions{%s,stage=\"%s\"} %llu\n",
+                                labels,
+                                uvsocks_get_stage_string (s),
+                                (unsigned long long) stats->active[s]);
+    }
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_session_failures_total",
+                          "Sessions lost before reaching the tunnel stage.",
+                          "counter");
+  for (t = 0, stats = metrics->stats; t < metrics->n_tunnels; t++, stats++)
+    {
+      uvsocks_metrics_label (labels, sizeof (labels), &metrics->params[t], t);
+      for (s = 0; s < UVSOCKS_STAGE_MAX; s++)
+        if (s != UVSOCKS_STAGE_TUNNEL)
+          uvsocks_metrics_printf (metrics,
+                                  "uvsocks_session_failures_total{%s,stage=\"%s\"} %llu\n",
+                                  labels,
+                                  uvsocks_get_stage_string (s),
+                                  (unsigned long long) stats->failures[s]);
+    }
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_handshake_seconds",
+                          "Time from accept until the tunnel is up.",
+                          "summary");
+  for (t = 0, stats = metrics->stats; t < metrics->n_tunnels; t++, stats++)
+    {
+      uvsocks_metrics_label (labels, sizeof (labels), &metrics->params[t], t);
+      uvsocks_metrics_printf (metrics,
+                              "uvsocks_handshake_seconds_sum{%s} %.6f\n"
+                              "uvsocks_handshake_seconds_count{%s} %llu\n",
+                              labels,
+                              stats->handshake_usec / 1e6,
+                              labels,
+                              (unsigned long long) stats->handshakes);
+    }
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_setup_seconds",
+                          "Time taken by each step of setting up a session.",
+                          "summary");
+  for (t = 0; t < metrics->n_tunnels; t++)
+    {
+      uvsocks_metrics_label (labels, sizeof (labels), &metrics->params[t], t);
+      uvsocks_metrics_latency (metrics,
+                               "uvsocks_setup_seconds",
+                               labels,
+                               &metrics->latency[t * UVSOCKS_LATENCY_MAX]);
+    }
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_upstream_setup_seconds",
+                          "Time taken by each step through each proxy.",
+                          "summary");
+  for (t = 0; t < metrics->n_hops; t++)
+    {
+      snprintf (labels, sizeof (labels), "hop=\"%d\"", t);
+      uvsocks_metrics_latency (metrics,
+                               "uvsocks_upstream_setup_seconds",
+                               labels,
+                               &metrics->hop_latency[t * UVSOCKS_LATENCY_MAX]);
+    }
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_queue_delay_seconds",
+                          "Time reads and accepts of a priority class waited for their turn.",
+                          "summary");
+  for (t = 0; t < UVSOCKS_PRIORITY_MAX; t++)
+    {
+      const UvSocksLatencyStats *delay = &metrics->queue_delay[t];
+
+      uvsocks_metrics_printf (metrics,
+                              "uvsocks_queue_delay_seconds{priority=\"%d\",quantile=\"0.5\"} %.6f\n"
+                              "uvsocks_queue_delay_seconds{priority=\"%d\",quantile=\"0.9\"} %.6f\n"
+                              "uvsocks_queue_delay_seconds{priority=\"%d\",quantile=\"0.99\"} %.6f\n"
+                              "uvsocks_queue_delay_seconds{priority=\"%d\",quantile=\"0.999\"} %.6f\n"
+                              "uvsocks_queue_delay_seconds_sum{priority=\"%d\"} %.6f\n"
+                              "uvsocks_queue_delay_seconds_count{priority=\"%d\"} %llu\n",
+                              t, delay->p50 / 1e6,
+                              t, delay->p90 / 1e6,
+                              t, delay->p99 / 1e6,
+                              t, delay->p999 / 1e6,
+                              t, delay->sum / 1e6,
+                              t, (unsigned long long) delay->count);
+    }
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_upstream_dials",
+                          "Forward sessions connecting to the first proxy or in their handshake.",
+                          "gauge");
+  uvsocks_metrics_printf (metrics,
+                          "uvsocks_upstream_dials %llu\n",
+                          (unsigned long long) metrics->admission.dialing);
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_admission_queue",
+                          "Accepted connections waiting for their turn to dial.",
+                          "gauge");
+  uvsocks_metrics_printf (metrics,
+                          "uvsocks_admission_queue %llu\n",
+                          (unsigned long long) metrics->admission.waiting);
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_admission_shed_total",
+                          "Connections closed for want of a turn to dial.",
+                          "counter");
+  uvsocks_metrics_printf (metrics,
+                          "uvsocks_admission_shed_total %llu\n",
+                          (unsigned long long) metrics->admission.shed);
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_admission_wait_seconds",
+                          "Time connections waited for their turn to dial.",
+                          "summary");
+  uvsocks_metrics_printf (metrics,
+                          "uvsocks_admission_wait_seconds{quantile=\"0.5\"} %.6f\n"
+                          "uvsocks_admission_wait_seconds{quantile=\"0.9\"} %.6f\n"
+                          "uvsocks_admission_wait_seconds{quantile=\"0.99\"} %.6f\n"
+                          "uvsocks_admission_wait_seconds{quantile=\"0.999\"} %.6f\n"
+                          "uvsocks_admission_wait_seconds_sum %.6f\n"
+                          "uvsocks_admission_wait_seconds_count %llu\n",
+                          metrics->admission.wait.p50 / 1e6,
+                          metrics->admission.wait.p90 / 1e6,
+                          metrics->admission.wait.p99 / 1e6,
+                          metrics->admission.wait.p999 / 1e6,
+                          metrics->admission.wait.sum / 1e6,
+                          (unsigned long long) metrics->admission.wait.count);
+
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_memory_bytes",
+                          "Bytes allocated by uvsocks.",
+                          "gauge");
+  uvsocks_metrics_printf (metrics,
+                          "uvsocks_memory_bytes %llu\n",
+                          (unsigned long long) metrics->memory.bytes);
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_memory_peak_bytes",
+                          "The most bytes allocated by uvsocks at once.",
+                          "gauge");
+  uvsocks_metrics_printf (metrics,
+                          "uvsocks_memory_peak_bytes %llu\n",
+                          (unsigned long long) metrics->memory.peak);
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_memory_limit_bytes",
+                          "Bytes uvsocks may allocate, 0 for no limit.",
+                          "gauge");
+  uvsocks_metrics_printf (metrics,
+                          "uvsocks_memory_limit_bytes %llu\n",
+                          (unsigned long long) metrics->memory.limit);
+  uvsocks_metrics_family (metrics,
+                          "uvsocks_memory_refused_total",
+                          "Allocations that failed or would have passed the limit.",
+                          "counter");
+  uvsocks_metrics_printf (metrics,
+                          "uvsocks_memory_refused_total %llu\n",
+                          (unsigned long long) metrics->memory.refused);
+}
+
+static int
+uvsocks_metrics_render (UvSocksMetrics *metrics)
+{
+  int t;
+
+  int l;
+
+  for (t = 0; t < metrics->n_tunnels; t++)
+    for (l = 0; l < UVSOCKS_LATENCY_MAX; l++)
+      uvsocks_get_latency (metrics->socks, t, -1, l,
+                           &metrics->latency[t * UVSOCKS_LATENCY_MAX + l]);
+
+  for (t = 0; t < metrics->n_hops; t++)
+    for (l = 0; l < UVSOCKS_LATENCY_MAX; l++)
+      uvsocks_get_latency (metrics->socks, -1, t, l,
+                           &metrics->hop_latency[t * UVSOCKS_LATENCY_MAX + l]);
+
+  for (t = 0; t < UVSOCKS_PRIORITY_MAX; t++)
+    uvsocks_get_queue_delay (metrics->socks, t, &metrics->queue_delay[t]);
+  uvsocks_get_admission (metrics->socks, &metrics->admission);
+  uvsocks_get_memory (metrics->socks, &metrics->memory);
+
+  while (1)
+    {
+      size_t size;
+      char *buf;
+
+      metrics->buf_len = 0;
+      uvsocks_metrics_render_real (metrics);
+      if (metrics->buf_len < metrics->buf_size)
+        return 0;
+
+      size = metrics->buf_size;
+      while (size <= metrics->buf_len)
+        size *= 2;
+
+      buf = realloc (metrics->buf, size);
+      if (!buf)
+        return 1;
+
+      metrics->buf = buf;
+      metrics->buf_size = size;
+    }
+}
+
+static void
+uvsocks_metrics_written (uv_write_t *req,
+                         int         status)
+{
+  UvSocksMetricsClient *client = req->data;
+
+  if (!uv_is_closing ((uv_handle_t *) &client->tcp))
+    uv_close ((uv_handle_t *) &client->tcp, uvsocks_metrics_close_client);
+}
+
+static void
+uvsocks_metrics_reply (UvSocksMetricsClient *client,
+                       const char           *reply,
+                       size_t                reply_len)
+{
+  uv_buf_t buf;
+
+  uv_read_stop ((uv_stream_t *) &client->tcp);
+
+  buf = uv_buf_init ((char *) reply, (unsigned int) reply_len);
+  client->write_req.data = client;
+  if (uv_write (&client->write_req,
+                (uv_stream_t *) &client->tcp,
+                &buf,
+                1,
+                uvsocks_metrics_written))
+    uv_close ((uv_handle_t *) &client->tcp, uvsocks_metrics_close_client);
+}
+
+/* From the loop of uvsocks: takes its counters, bytes of open sessions
+   included, and the params the labels are made of, and wakes the scrape
+   once all are in. */
+static void
+uvsocks_metrics_snapshot (UvSocks            *socks,
+                          int                 tunnel,
+                          int                 n_tunnels,
+                          const UvSocksStats *stats,
+                          const UvSocksParam *params,
+                          void               *data)
+{
+  UvSocksMetrics *metrics = data;
+
+  if (n_tunnels == 0)
+    {
+      uv_async_send (&metrics->snapshot_async);
+      return;
+    }
+
+  memcpy (&metrics->stats[tunnel], stats, n_tunnels * sizeof (UvSocksStats));
+  memcpy (&metrics->params[tunnel],
+          params,
+          n_tunnels * sizeof (UvSocksParam));
+}
+
+static void
+uvsocks_metrics_snapshot_async (uv_async_t *handle)
+{
+  UvSocksMetrics *metrics = handle->data;
+  UvSocksMetricsClient *client = metrics->scraping;
+  uv_buf_t bufs[2];
+  int head_len;
+
+  metrics->snapshotting = 0;
+  metrics->scraping = NULL;
+  if (metrics->close)
+    {
+      uvsocks_metrics_free_real (metrics);
+      return;
+    }
+
+  /* the client went meanwhile */
+  if (!client)
+    {
+      metrics->buf_busy = 0;
+      return;
+    }
+
+  if (uvsocks_metrics_render (metrics))
+    {
+      client->rendered = 0;
+      metrics->buf_busy = 0;
+      uvsocks_metrics_reply (client,
+                             uvsocks_metrics_busy_reply,
+                             sizeof (uvsocks_metrics_busy_reply) - 1);
+      return;
+    }
+
+  /* the request is no longer needed, so its buffer holds the reply head */
+  head_len = snprintf (client->buf,
+                       sizeof (client->buf),
+                       "HTTP/1.1 200 OK\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %lu\r\n"
+                       "Connection: close\r\n\r\n",
+                       (unsigned long) metrics->buf_len);
+
+  bufs[0] = uv_buf_init (client->buf, (unsigned int) head_len);
+  bufs[1] = uv_buf_init (metrics->buf, (unsigned int) metrics->buf_len);
+  client->write_req.data = client;
+  if (uv_write (&client->write_req,
+                (uv_stream_t *) &client->tcp,
+                bufs,
+                2,
+                uvsocks_metrics_written))
+    uv_close ((uv_handle_t *) &client->tcp, uvsocks_metrics_close_client);
+}
+
+static void
+uvsocks_metrics_scrape (UvSocksMetricsClient *client)
+{
+  UvSocksMetrics *metrics = client->metrics;
+
+  if (metrics->buf_busy || metrics->snapshotting)
+    {
+      uvsocks_metrics_reply (client,
+                             uvsocks_metrics_busy_reply,
+                             sizeof (uvsocks_metrics_busy_reply) - 1);
+      return;
+    }
+
+  metrics->buf_busy = 1;
+  metrics->snapshotting = 1;
+  metrics->scraping = client;
+  client->rendered = 1;
+  uv_read_stop ((uv_stream_t *) &client->tcp);
+
+  uvsocks_snapshot (metrics->socks, uvsocks_metrics_snapshot, metrics);
+}
+
+static void
+uvsocks_metrics_alloc_buffer (uv_handle_t *handle,
+                              size_t       suggested_size,
+                              uv_buf_t    *buf)
+{
+  UvSocksMetricsClient *client = handle->data;
+
+  buf->base = &client->buf[client->len];
+  buf->len = (unsigned int) (sizeof (client->buf) - client->len);
+}
+
+static void
+uvsocks_metrics_read (uv_stream_t    *stream,
+                      ssize_t         nread,
+                      const uv_buf_t *buf)
+{
+  UvSocksMetricsClient *client = stream->data;
+  int head_len;
+
+  if (nread == 0)
+    return;
+
+  if (nread < 0)
+    {
+      uv_close ((uv_handle_t *) stream, uvsocks_metrics_close_client);
+      return;
+    }
+
+  client->len += nread;
+
+  head_len = http_parse_head (client->buf, client->len, &client->scan);
+  if (head_len == 0 && client->len < sizeof (client->buf))
+    return;
+
+  if (head_len <= 0)
+    uvsocks_metrics_reply (client,
+                           uvsocks_metrics_bad_request_reply,
+                           sizeof (uvsocks_metrics_bad_request_reply) - 1);
+  else if (head_len < 4 || memcmp (client->buf, "GET ", 4) != 0)
+    uvsocks_metrics_reply (client,
+                           uvsocks_metrics_method_reply,
+                           sizeof (uvsocks_metrics_method_reply) - 1);
+  else
+    uvsocks_metrics_scrape (client);
+}
+
+static void
+uvsocks_metrics_new_connection (uv_stream_t *stream,
+                                int          status)
+{
+  UvSocksMetrics *metrics = stream->data;
+  UvSocksMetricsClient *client;
+
+  if (status < 0)
+    return;
+
+  client = calloc (sizeof (UvSocksMetricsClient), 1);
+  if (!client)
+    return;
+
+  client->metrics = metrics;
+  client->tcp.data = client;
+  uv_tcp_init (metrics->loop, &client->tcp);
+
+  client->next = metrics->clients;
+  if (client->next)
+    client->next->prev = &client->next;
+  client->prev = &metrics->clients;
+  metrics->clients = client;
+
+  if (uv_accept (stream, (uv_stream_t *) &client->tcp) ||
+      uv_read_start ((uv_stream_t *) &client->tcp,
+                     uvsocks_metrics_alloc_buffer,
+                     uvsocks_metrics_read))
+    uv_close ((uv_handle_t *) &client->tcp, uvsocks_metrics_close_client);
+}
+
+UvSocksMetrics *
+uvsocks_metrics_new (void       *uv_loop,
+                     UvSocks    *socks,
+                     const char *host,
+                     int         port)
+{
+  UvSocksMetrics *metrics;
+  struct sockaddr_storage addr;
+
+  if (!uv_loop || !socks || !host || port < 0 || port > 65535)
+    return NULL;
+
+  if (uv_ip4_addr (host, port, (struct sockaddr_in *) &addr) &&
+      uv_ip6_addr (host, port, (struct sockaddr_in6 *) &addr))
+    return NULL;
+
+  metrics = calloc (sizeof (UvSocksMetrics), 1);
+  if (!metrics)
+    return NULL;
+
+  metrics->loop = uv_loop;
+  metrics->socks = socks;
+  metrics->n_tunnels = uvsocks_get_n_tunnels (socks);
+  metrics->stats = calloc (sizeof (UvSocksStats), metrics->n_tunnels);
+  metrics->params = calloc (sizeof (UvSocksParam), metrics->n_tunnels);
+  metrics->latency = calloc (sizeof (UvSocksLatencyStats),
+                             metrics->n_tunnels * UVSOCKS_LATENCY_MAX);
+  metrics->n_hops = uvsocks_get_n_hops (socks);
+  metrics->hop_latency = calloc (sizeof (UvSocksLatencyStats),
+                                 metrics->n_hops * UVSOCKS_LATENCY_MAX);
+  metrics->buf_size = UVSOCKS_METRICS_BUF_MIN;
+  metrics->buf = malloc (metrics->buf_size);
+  if (!metrics->stats || !metrics->params || !metrics->latency ||
+      !metrics->hop_latency || !metrics->buf)
+    {
+      free (metrics->stats);
+      free (metrics->params);
+      free (metrics->latency);
+      free (metrics->hop_latency);
+      free (metrics->buf);
+      free (metrics);
+      return NULL;
+    }
+
+  uv_async_init (metrics->loop,
+                 &metrics->snapshot_async,
+                 uvsocks_metrics_snapshot_async);
+  metrics->snapshot_async.data = metrics;
+
+  uv_tcp_init (metrics->loop, &metrics->server);
+  metrics->server.data = metrics;
+  if (uv_tcp_bind (&metrics->server, (const struct sockaddr *) &addr, 0) ||
+      uv_listen ((uv_stream_t *) &metrics->server,
+                 16,
+                 uvsocks_metrics_new_connection))
+    {
+      uv_close ((uv_handle_t *) &metrics->server,
+                uvsocks_metrics_close_server);
+      return NULL;
+    }
+
+  return metrics;
+}
+
+void
+uvsocks_metrics_free (UvSocksMetrics *metrics)
+{
+  UvSocksMetricsClient *client;
+
+  if (!metrics)
+    return;
+
+  for (client = metrics->clients; client; client = client->next)
+    if (!uv_is_closing ((uv_handle_t *) &client->tcp))
+      uv_close ((uv_handle_t *) &client->tcp, uvsocks_metrics_close_client);
+
+  uv_close ((uv_handle_t *) &metrics->server, uvsocks_metrics_close_server);
+}
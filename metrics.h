@@ -0,0 +1,26 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "uvsocks.h"
+
+typedef struct _UvSocksMetrics UvSocksMetrics;
+
+/* Serves the counters of uvsocks in the Prometheus text format to HTTP GET
+   requests on host:port.  uv_loop is the loop the listener runs on; it need
+   not be the loop of uvsocks, which copies the counters of a scrape with
+   uvsocks_snapshot () a batch at a time. */
+UvSocksMetrics *
+uvsocks_metrics_new (void       *uv_loop,
+                     UvSocks    *uvsocks,
+                     const char *host,
+                     int         port);
+
+/* Closes the listener and any scrape in progress.  Must be called before
+   uvsocks_free (), from the thread running uv_loop. */
+void
+uvsocks_metrics_free (UvSocksMetrics *metrics);
+
+#endif /* __METRICS_H__ */
@@ -0,0 +1,45 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/* USDT probes of the uvsocks provider, built in with ./configure
+   --enable-usdt.  An enabled build costs a nop a probe until a tracer
+   attaches; otherwise they compile to nothing and their arguments are not
+   evaluated.  Probes and their arguments:
+
+     session_create  (session, tunnel)
+     session_free    (session, tunnel, stage, bytes)
+     stage           (session, old stage, new stage)
+     read            (session, from_proxy, nread)
+     try_write       (session, to_client, length, result)
+     write_queued    (session, to_client, length)
+     dns_start       (session, host, port)
+     dns_end         (session, status)
+     connect_start   (session, hop)
+     connect_end     (session, status)
+
+   session is the serial number of the session, or 0 once it is gone.
+   Example bpftrace scripts are in tools/. */
+
+#ifdef UVSOCKS_USDT
+
+#include <sys/sdt.h>
+
+#define UVSOCKS_PROBE2(name, a, b)                                      \
+  DTRACE_PROBE2 (uvsocks, name, a, b)
+#define UVSOCKS_PROBE3(name, a, b, c)                                   \
+  DTRACE_PROBE3 (uvsocks, name, a, b, c)
+#define UVSOCKS_PROBE4(name, a, b, c, d)                                \
+  DTRACE_PROBE4 (uvsocks, name, a, b, c, d)
+
+#else
+
+#define UVSOCKS_PROBE2(name, a, b)              do { } while (0)
+#define UVSOCKS_PROBE3(name, a, b, c)           do { } while (0)
+#define UVSOCKS_PROBE4(name, a, b, c, d)        do { } while (0)
+
+#endif
+
+#endif /* __PROBES_H__ */
@@ -0,0 +1,371 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#include "socks5.h"
+#include <string.h>
+
+/* Length of an ATYP ADDR PORT tail starting at data[0], 0 if incomplete. */
+static int
+socks5_address_length (const unsigned char *p,
+                       size_t               len)
+{
+  if (len < 1)
+    return 0;
+
+  switch (p[0])
+    {
+    case 0x01:
+      return 1 + 4 + 2;
+    case 0x03:
+      if (len < 2)
+        return 0;
+      if (p[1] == 0)
+        return -1;
+      return 1 + 1 + p[1] + 2;
+    case 0x04:
+      return 1 + 16 + 2;
+    }
+
+  return -1;
+}
+
+int
+socks5_server_parse_greeting (const char *data,
+                              size_t      len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+
+  if (len < 2)
+    return 0;
+
+  if (p[0] != 0x05 || p[1] == 0)
+    return -1;
+
+  if (len < 2 + (size_t) p[1])
+    return 0;
+
+  return 2 + p[1];
+}
+
+int
+socks5_server_parse_request (const char *data,
+                             size_t      len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  int length;
+
+  if (len < 4)
+    return 0;
+
+  if (p[0] != 0x05 || p[2] != 0x00)
+    return -1;
+
+  length = socks5_address_length (&p[3], len - 3);
+  if (length <= 0)
+    return length;
+
+  if (len < 3 + (size_t) length)
+    return 0;
+
+  return 3 + length;
+}
+
+int
+socks5_parse_reply (const char *data,
+                    size_t      len)
+{
+  const unsigned char *p = (const unsigned char *) data;
+  int length;
+
+  if (len < 4)
+    return 0;
+
+  if (p[0] != 0x05)
+    return -1;
+
+  length = socks5_address_length (&p[3], len - 3);
+  if (length <= 0)
+    return length;
+
+  if (len < 3 + (size_t) length)
+    return 0;
+
+  return 3 + length;
+}
+
+/* Parses a dotted quad strictly, as inet_pton does for AF_INET. */
+static int
+socks5_parse_ipv4 (const char    *host,
+                   unsigned char *addr)
+{
+  int i;
+
+  for (i = 0; i < 4; i++)
+    {
+      int value;
+      int digits;
+
+      value = 0;
+      for (digits = 0; host[digits] >= '0' && host[digits] <= '9'; digits++)
+        {
+          if (digits == 3 || (digits == 1 && value == 0))
+            return -1;
+          value = value * 10 + (host[digits] - '0');
+        }
+      if (digits == 0 || value > 255)
+        return -1;
+
+      addr[i] = (unsigned char) value;
+      host += digits;
+      if (*host != (i < 3 ? '.' : '\0'))
+        return -1;
+      host++;
+    }
+
+  return 0;
+}
+
+int
+socks5_client_greeting (char          *buf,
+                        size_t         size,
+                        unsigned char  method)
+{
+  if (size < 3)
+    return -1;
+
+  buf[0] = 0x05;
+  buf[1] = 0x01;
+  buf[2] = (char) method;
+  return 3;
+}
+
+int
+socks5_client_auth (char       *buf,
+                    size_t      size,
+                    const char *user,
+                    const char *password)
+{
+  size_t user_len = strlen (user);
+  size_t password_len = strlen (password);
+
+  if (user_len > 255 || password_len > 255 ||
+      size < 3 + user_len + password_len)
+    return -1;
+
+  buf[0] = 0x01;
+  buf[1] = (char) user_len;
+  memcpy (&buf[2], user, user_len);
+  buf[2 + user_len] = (char) password_len;
+  memcpy (&buf[3 + user_len], password, password_len);
+  return (int) (3 + user_len + password_len);
+}
+
+int
+socks5_client_request (char          *buf,
+                       size_t         size,
+                       unsigned char  command,
+                       const char    *host,
+                       int            port)
+{
+  unsigned char ipv4[4];
+  size_t host_len;
+  size_t len;
+
+  if (port < 0 || port > 0xffff || size < 4)
+    return -1;
+
+  buf[0] = 0x05;
+  buf[1] = (char) command;
+  buf[2] = 0x00;
+  if (socks5_parse_ipv4 (host, ipv4) == 0)
+    {
+      if (size < 4 + 4 + 2)
+        return -1;
+      buf[3] = 0x01;
+      memcpy (&buf[4], ipv4, 4);
+      len = 4 + 4;
+    }
+  else
+    {
+      host_len = strlen (host);
+      if (host_len == 0 || host_len > 255 || size < 5 + host_len + 2)
+        return -1;
+      buf[3] = 0x03;
+      buf[4] = (char) host_len;
+      memcpy (&buf[5], host, host_len);
+      len = 5 + host_len;
+    }
+
+  buf[len++] = (char) (port >> 8);
+  buf[len++] = (char) port;
+  return (int) len;
+}
+
+void
+socks5_client_init (Socks5Client  *client,
+                    unsigned char  method)
+{
+  client->state = SOCKS5_CLIENT_METHOD;
+  client->error = SOCKS5_CLIENT_ERROR_NONE;
+  client->method = method;
+  client->len = 0;
+  client->done = 0;
+  client->version = 0;
+  client->code = 0;
+  client->atyp = 0;
+  client->addr = NULL;
+  client->addr_len = 0;
+  client->port = 0;
+}
+
+/* Length of the packet being decoded as far as its first bytes tell, or
+   -1 when they cannot start a valid one. */
+static int
+socks5_client_need (const Socks5Client *client)
+{
+  int length;
+
+  if (client->state != SOCKS5_CLIENT_REPLY)
+    return 2;
+
+  if (client->len < 4)
+    return 4;
+
+  length = socks5_address_length (&client->packet[3], client->len - 3);
+  if (length < 0)
+    return -1;
+  if (length == 0)
+    return 5;
+  return 3 + length;
+}
+
+static Socks5ClientEvent
+socks5_client_fail (Socks5Client      *client,
+                    Socks5ClientError  error)
+{
+  client->state = SOCKS5_CLIENT_FAILED;
+  client->error = error;
+  client->version = client->packet[0];
+  client->code = client->len > 1 ? client->packet[1] : 0;
+  return SOCKS5_CLIENT_ERROR;
+}
+
+/* Fails the packet as soon as its first two bytes say so, so a refusal
+   is seen even when the proxy closes right behind it. */
+static int
+socks5_client_check (Socks5Client *client)
+{
+  const unsigned char *p = client->packet;
+
+  if (client->len < 2)
+    return 0;
+
+  switch (client->state)
+    {
+    case SOCKS5_CLIENT_METHOD:
+      if (p[0] != 0x05 || p[1] != client->method)
+        return SOCKS5_CLIENT_ERROR_METHOD;
+      break;
+    case SOCKS5_CLIENT_AUTH:
+      if (p[0] != 0x01 || p[1] != 0x00)
+        return SOCKS5_CLIENT_ERROR_AUTH;
+      break;
+    case SOCKS5_CLIENT_REPLY:
+      if (p[0] != 0x05 || p[1] != 0x00)
+        return SOCKS5_CLIENT_ERROR_REPLY;
+      break;
+    default:
+      break;
+    }
+
+  return 0;
+}
+
+Socks5ClientEvent
+socks5_client_decode (Socks5Client *client,
+                      const char   *data,
+                      size_t        len,
+                      size_t       *consumed)
+{
+  const unsigned char *p = client->packet;
+  size_t used;
+  int need;
+  int error;
+
+  *consumed = 0;
+  if (client->state == SOCKS5_CLIENT_FAILED)
+    return SOCKS5_CLIENT_ERROR;
+
+  if (client->done)
+    {
+      client->len = 0;
+      client->done = 0;
+    }
+
+  used = 0;
+  for (;;)
+    {
+      size_t n;
+
+      need = socks5_client_need (client);
+      if (need < 0)
+        {
+          *consumed = used;
+          return socks5_client_fail (client, SOCKS5_CLIENT_ERROR_PROTOCOL);
+        }
+      if (client->len == (size_t) need)
+        break;
+
+      if (used == len)
+        {
+          *consumed = used;
+          return SOCKS5_CLIENT_NEED_MORE;
+        }
+
+      n = need - client->len;
+      if (n > len - used)
+        n = len - used;
+      memcpy (&client->packet[client->len], &data[used], n);
+      client->len += n;
+      used += n;
+
+      error = socks5_client_check (client);
+      if (error)
+        {
+          *consumed = used;
+          return socks5_client_fail (client, error);
+        }
+    }
+
+  *consumed = used;
+  client->done = 1;
+  client->version = p[0];
+  client->code = p[1];
+
+  switch (client->state)
+    {
+    case SOCKS5_CLIENT_METHOD:
+      client->state = client->method == 0x02 ? SOCKS5_CLIENT_AUTH :
+                                               SOCKS5_CLIENT_REPLY;
+      return SOCKS5_CLIENT_METHOD_DONE;
+    case SOCKS5_CLIENT_AUTH:
+      client->state = SOCKS5_CLIENT_REPLY;
+      return SOCKS5_CLIENT_AUTH_DONE;
+    default:
+      break;
+    }
+
+  client->atyp = p[3];
+  if (p[3] == 0x03)
+    {
+      client->addr = &p[5];
+      client->addr_len = p[4];
+    }
+  else
+    {
+      client->addr = &p[4];
+      client->addr_len = p[3] == 0x01 ? 4 : 16;
+    }
+  client->port = (p[need - 2] << 8) | p[need - 1];
+  return SOCKS5_CLIENT_REPLY_DONE;
+}
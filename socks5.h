@@ -0,0 +1,116 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifndef __SOCKS5_H__
+#define __SOCKS5_H__
+
+#include <stddef.h>
+
+/* The parsers below never allocate and never keep state between calls: they
+   are handed everything buffered so far and return the length of the
+   complete packet at the head of it, 0 when more bytes are needed, or -1
+   when the input can never become a valid packet. */
+
+int
+socks5_server_parse_greeting (const char *data,
+                              size_t      len);
+
+int
+socks5_server_parse_request (const char *data,
+                             size_t      len);
+
+int
+socks5_parse_reply (const char *data,
+                    size_t      len);
+
+/* The client side of the protocol: encoders that write one packet into a
+   caller buffer and return its length, or -1 when it does not fit or an
+   argument is out of range; and a decoder fed the replies as they arrive,
+   in pieces of any size, that keeps the packet it is in the middle of and
+   never allocates. */
+
+#define SOCKS5_PACKET_MAX       (4 + 1 + 255 + 2)
+
+typedef enum _Socks5ClientState
+{
+  SOCKS5_CLIENT_METHOD,
+  SOCKS5_CLIENT_AUTH,
+  SOCKS5_CLIENT_REPLY,
+  SOCKS5_CLIENT_FAILED,
+} Socks5ClientState;
+
+typedef enum _Socks5ClientEvent
+{
+  SOCKS5_CLIENT_NEED_MORE,
+  SOCKS5_CLIENT_METHOD_DONE,
+  SOCKS5_CLIENT_AUTH_DONE,
+  SOCKS5_CLIENT_REPLY_DONE,
+  SOCKS5_CLIENT_ERROR,
+} Socks5ClientEvent;
+
+typedef enum _Socks5ClientError
+{
+  SOCKS5_CLIENT_ERROR_NONE,
+  SOCKS5_CLIENT_ERROR_METHOD,
+  SOCKS5_CLIENT_ERROR_AUTH,
+  SOCKS5_CLIENT_ERROR_REPLY,
+  SOCKS5_CLIENT_ERROR_PROTOCOL,
+} Socks5ClientError;
+
+typedef struct _Socks5Client Socks5Client;
+struct _Socks5Client
+{
+  Socks5ClientState     state;
+  Socks5ClientError     error;
+  unsigned char         method;
+
+  /* the packet being decoded; once a reply is done, its fields */
+  unsigned char         packet[SOCKS5_PACKET_MAX];
+  size_t                len;
+  int                   done;
+  unsigned char         version;
+  unsigned char         code;
+  unsigned char         atyp;
+  const unsigned char  *addr;
+  size_t                addr_len;
+  int                   port;
+};
+
+int
+socks5_client_greeting (char          *buf,
+                        size_t         size,
+                        unsigned char  method);
+
+int
+socks5_client_auth (char       *buf,
+                    size_t      size,
+                    const char *user,
+                    const char *password);
+
+int
+socks5_client_request (char          *buf,
+                       size_t         size,
+                       unsigned char  command,
+                       const char    *host,
+                       int            port);
+
+/* Starts decoding the answers to a greeting offering method: the method
+   reply, the authentication reply when method needs one, then replies. */
+void
+socks5_client_init (Socks5Client  *client,
+                    unsigned char  method);
+
+/* Takes bytes from data up to the end of the packet being decoded, stores
+   how many in *consumed, and tells what that packet turned out to be.  The
+   decoder then expects the next packet in line; after a reply, another
+   reply, as a BIND sends two.  A finished packet stays in client->packet,
+   and the fields of a reply in client, until the next call.  After
+   SOCKS5_CLIENT_ERROR, client->error, version and code tell why, and it
+   takes nothing more until the next socks5_client_init. */
+Socks5ClientEvent
+socks5_client_decode (Socks5Client *client,
+                      const char   *data,
+                      size_t        len,
+                      size_t       *consumed);
+
+#endif /* __SOCKS5_H__ */
@@ -0,0 +1,103 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#include "uvsocks.h"
+#include "trace.h"
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+static const char *
+decode_event (uint16_t event)
+{
+  if (event == TRACE_EVENT_STAGE)
+    return "stage";
+  return uvsocks_get_status_string (event);
+}
+
+static int
+decode_file (const char *path)
+{
+  TraceHeader header;
+  TraceRecord record;
+  uint64_t    first;
+  uint64_t    n;
+  FILE       *file;
+
+  file = fopen (path, "rb");
+  if (!file)
+    {
+      fprintf (stderr, "uvsocks-trace: failed to open %s\n", path);
+      return 1;
+    }
+
+  if (fread (&header, sizeof (header), 1, file) != 1 ||
+      memcmp (header.magic, TRACE_MAGIC, sizeof (header.magic)))
+    {
+      fprintf (stderr, "uvsocks-trace: %s is not a trace\n", path);
+      fclose (file);
+      return 1;
+    }
+  if (header.version != TRACE_VERSION ||
+      header.record_size != sizeof (TraceRecord))
+    {
+      fprintf (stderr,
+               "uvsocks-trace: %s has version %u, record size %u\n",
+               path, header.version, header.record_size);
+      fclose (file);
+      return 1;
+    }
+
+  printf ("# %s: %" PRIu64 " records, %" PRIu64 " lost\n",
+          path, header.count, header.lost);
+  printf ("# %12s %8s %6s %-18s %-24s %10s %s\n",
+          "usec", "session", "tunnel", "stage", "event", "bytes", "error");
+
+  first = 0;
+  for (n = 0; n < header.count; n++)
+    {
+      if (fread (&record, sizeof (record), 1, file) != 1)
+        {
+          fprintf (stderr, "uvsocks-trace: %s is truncated after %" PRIu64
+                   " records\n", path, n);
+          fclose (file);
+          return 1;
+        }
+      if (n == 0)
+        first = record.time;
+
+      printf ("%14" PRIu64 " %8u %6u %-18s %-24s %10u %s\n",
+              (record.time - first) / 1000,
+              record.session,
+              record.tunnel,
+              uvsocks_get_stage_string (record.stage),
+              decode_event (record.event),
+              record.bytes,
+              record.error ? uv_err_name (record.error) : "-");
+    }
+
+  fclose (file);
+  return 0;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  int ret;
+  int i;
+
+  if (argc < 2)
+    {
+      fprintf (stderr, "Usage: %s trace_file...\n", argv[0]);
+      return 1;
+    }
+
+  ret = 0;
+  for (i = 1; i < argc; i++)
+    ret |= decode_file (argv[i]);
+
+  return ret;
+}
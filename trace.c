@@ -0,0 +1,162 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifdef _MSC_VER
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+#endif
+
+#include "trace.h"
+#include <uv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined (__GNUC__) || defined (__clang__)
+#define TRACE_HEAD_GET(c)     __atomic_load_n (&(c), __ATOMIC_ACQUIRE)
+#define TRACE_HEAD_SET(c, v)  __atomic_store_n (&(c), (v), __ATOMIC_RELEASE)
+#define TRACE_FENCE_ACQUIRE() __atomic_thread_fence (__ATOMIC_ACQUIRE)
+#else
+#define TRACE_HEAD_GET(c)     (*(volatile uint64_t *) &(c))
+#define TRACE_HEAD_SET(c, v)  (*(volatile uint64_t *) &(c) = (v))
+#define TRACE_FENCE_ACQUIRE() MemoryBarrier ()
+#endif
+
+struct _Trace
+{
+  uint64_t     head;          /* records written so far */
+  uint64_t     mask;
+  TraceRecord *records;
+  UvSocksAlloc *alloc;
+};
+
+Trace *
+trace_new (unsigned int  n_records,
+           UvSocksAlloc *alloc)
+{
+  Trace *trace;
+  uint64_t size;
+
+  size = 1;
+  while (size < n_records)
+    size <<= 1;
+
+  trace = uvsocks_alloc_calloc (alloc, 1, sizeof (Trace));
+  if (!trace)
+    return NULL;
+
+  trace->records = uvsocks_alloc_calloc (alloc,
+                                         (size_t) size,
+                                         sizeof (TraceRecord));
+  if (!trace->records)
+    {
+      uvsocks_alloc_free (trace);
+      return NULL;
+    }
+  trace->mask = size - 1;
+  trace->alloc = alloc;
+
+  return trace;
+}
+
+void
+trace_free (Trace *trace)
+{
+  if (!trace)
+    return;
+
+  uvsocks_alloc_free (trace->records);
+  uvsocks_alloc_free (trace);
+}
+
+void
+trace_record (Trace    *trace,
+              uint64_t  time,
+              uint32_t  session,
+              int       event,
+              int       stage,
+              int       tunnel,
+              uint64_t  bytes,
+              int       error)
+{
+  TraceRecord *record;
+  uint64_t head;
+
+  head = trace->head;
+  record = &trace->records[head & trace->mask];
+  record->time = time;
+  record->session = session;
+  record->tunnel = (uint32_t) tunnel;
+  record->bytes = (uint32_t) (bytes < UINT32_MAX ? bytes : UINT32_MAX);
+  record->error = error;
+  record->event = (uint16_t) event;
+  record->stage = (uint8_t) stage;
+
+  /* publishes the record to dumps */
+  TRACE_HEAD_SET (trace->head, head + 1);
+}
+
+int
+trace_dump (Trace      *trace,
+            const char *path)
+{
+  TraceHeader header;
+  TraceRecord *copy;
+  uint64_t size;
+  uint64_t start;
+  uint64_t end;
+  uint64_t first;
+  uint64_t i;
+  FILE *file;
+  int ret;
+
+  if (!trace || !path)
+    return -1;
+
+  size = trace->mask + 1;
+  copy = uvsocks_alloc_malloc (trace->alloc,
+                               (size_t) size * sizeof (TraceRecord));
+  if (!copy)
+    return -1;
+
+  end = TRACE_HEAD_GET (trace->head);
+  start = end > size ? end - size : 0;
+  for (i = start; i < end; i++)
+    copy[i - start] = trace->records[i & trace->mask];
+
+  /* the writer may have lapped the oldest records meanwhile, and may be
+     halfway through the one after the last it published */
+  TRACE_FENCE_ACQUIRE ();
+  first = TRACE_HEAD_GET (trace->head);
+  first = first >= size ? first - size + 1 : 0;
+  if (first < start)
+    first = start;
+  if (first > end)
+    first = end;
+
+  memcpy (header.magic, TRACE_MAGIC, sizeof (header.magic));
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof (TraceRecord);
+  header.count = end - first;
+  header.lost = first;
+
+  ret = -1;
+  file = fopen (path, "wb");
+  if (file)
+    {
+      if (fwrite (&header, sizeof (header), 1, file) == 1 &&
+          (header.count == 0 ||
+           fwrite (&copy[first - start],
+                   sizeof (TraceRecord),
+                   (size_t) header.count,
+                   file) == header.count))
+        ret = 0;
+      if (fclose (file) != 0)
+        ret = -1;
+    }
+
+  uvsocks_alloc_free (copy);
+
+  return ret;
+}
@@ -0,0 +1,70 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "alloc.h"
+#include <stdint.h>
+
+#define TRACE_MAGIC           "UVSTRACE"
+#define TRACE_VERSION         2
+
+/* event of a record that is a stage change rather than a status; no
+   status has this value, UVSOCKS_OK included */
+#define TRACE_EVENT_STAGE     0xffff
+
+typedef struct _TraceRecord TraceRecord;
+struct _TraceRecord
+{
+  uint64_t time;              /* uv_hrtime () */
+  uint32_t session;           /* serial number of the session, 0 for none */
+  uint32_t tunnel;            /* index of the tunnel */
+  uint32_t bytes;             /* bytes the session relayed so far */
+  int32_t  error;             /* libuv error behind the event, or 0 */
+  uint16_t event;             /* status, or TRACE_EVENT_STAGE */
+  uint8_t  stage;             /* stage the session is in after the event */
+  uint8_t  pad[5];
+};
+
+/* A dump is this header followed by count records, oldest first, all in
+   the byte order of the machine that wrote them. */
+typedef struct _TraceHeader TraceHeader;
+struct _TraceHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t count;
+  uint64_t lost;              /* older records already overwritten */
+};
+
+/* A ring of the last records.  Only one thread may write to it; any may
+   dump it at the same time. */
+typedef struct _Trace Trace;
+
+/* n_records is rounded up to a power of two.  The records, and the copy
+   of them a dump takes, come from alloc. */
+Trace *
+trace_new (unsigned int  n_records,
+           UvSocksAlloc *alloc);
+
+void
+trace_free (Trace *trace);
+
+void
+trace_record (Trace    *trace,
+              uint64_t  time,
+              uint32_t  session,
+              int       event,
+              int       stage,
+              int       tunnel,
+              uint64_t  bytes,
+              int       error);
+
+/* Writes the records still in the ring to path.  Returns 0 on success. */
+int
+trace_dump (Trace      *trace,
+            const char *path);
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,929 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+/* An io_uring relay engine for established sessions.  Each relay is one
+   direction of a session: a multishot receive on its source picks buffers
+   from a provided buffer ring of its own, and what was received goes out
+   in order as a chain of linked sends, one chain at a time.  Buffers go
+   back to the ring as their send completes, so a receiver whose peer falls
+   behind runs out of buffers and waits, which is the backpressure.
+
+   Submissions are gathered over a loop iteration and made in one
+   io_uring_enter () from a uv_prepare_t; completions are read when the
+   eventfd registered with the ring wakes a uv_poll_t. */
+
+#include "uring.h"
+#include <stdlib.h>
+
+#ifdef UVSOCKS_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define UVSOCKS_URING_SQ_ENTRIES      256
+#define UVSOCKS_URING_CQ_ENTRIES      4096
+
+/* buffers a relay splits its buffer into; a power of two */
+#define UVSOCKS_URING_BUFS            8
+
+/* relays open at once, each with a buffer group of its own */
+#define UVSOCKS_URING_RELAY_MAX       4096
+
+/* the buffer group of the receive tried by uvsocks_uring_probe () */
+#define UVSOCKS_URING_PROBE_BGID      0xffff
+
+/* what completed, in the low bits of user_data; relays are aligned to
+   more than that */
+#define UVSOCKS_URING_OP_RECV         0
+#define UVSOCKS_URING_OP_SEND         1
+#define UVSOCKS_URING_OP_CLOSE        2
+#define UVSOCKS_URING_OP_MASK         3
+
+typedef struct _UvSocksUringQueued UvSocksUringQueued;
+struct _UvSocksUringQueued
+{
+  unsigned short         bid;
+  unsigned int           len;
+};
+
+struct _UvSocksUringRelay
+{
+  UvSocksUring          *uring;
+  int                    from_fd;
+  int                    to_fd;
+  char                  *buf;
+  size_t                 buf_size;      /* of each of the buffers */
+
+  struct io_uring_buf_ring *ring;
+  unsigned short         ring_tail;
+  unsigned short         bgid;
+
+  /* buffers received, oldest first; the first n_sending are being sent */
+  UvSocksUringQueued     queue[UVSOCKS_URING_BUFS];
+  int                    queue_head;
+  int                    n_queued;
+  int                    n_sending;
+  size_t                 buffered;
+
+  int                    receiving;
+  int                    eof;
+  int                    stopped;
+  int                    closing;
+  int                    n_ops;         /* submitted and not completed */
+
+  /* relays whose cancel found the submission queue full */
+  UvSocksUringRelay     *next_cancel;
+
+  UvSocksUringFunc       func;
+  void                 (*close_func) (void *data);
+  void                  *data;
+};
+
+struct _UvSocksUring
+{
+  uv_loop_t             *loop;
+  UvSocksAlloc          *alloc;
+  int                    fd;
+  int                    event_fd;
+  uv_poll_t              poll;
+  uv_prepare_t           prepare;
+  int                    n_handles;
+
+  void                  *ring_map;
+  size_t                 ring_map_size;
+  struct io_uring_sqe   *sqes;
+  size_t                 sqes_size;
+
+  unsigned int          *sq_head;
+  unsigned int          *sq_tail;
+  unsigned int          *sq_flags;
+  unsigned int           sq_mask;
+  unsigned int           sq_entries;
+  unsigned int           sq_local_tail;
+
+  unsigned int          *cq_head;
+  unsigned int          *cq_tail;
+  unsigned int           cq_mask;
+  struct io_uring_cqe   *cqes;
+
+  int                    n_relays;
+  UvSocksUringRelay     *cancels;
+  unsigned short         free_bgids[UVSOCKS_URING_RELAY_MAX];
+  int                    n_free_bgids;
+
+  int                    close;
+  void                 (*func) (void *data);
+  void                  *data;
+};
+
+static void
+uvsocks_uring_relay_cancel (UvSocksUringRelay *relay);
+
+static int
+uvsocks_uring_enter (int          fd,
+                     unsigned int to_submit,
+                     unsigned int min_complete,
+                     unsigned int flags)
+{
+  int ret;
+
+  do
+    ret = (int) syscall (__NR_io_uring_enter,
+                         fd, to_submit, min_complete, flags, NULL, 0);
+  while (ret < 0 && errno == EINTR);
+
+  return ret < 0 ? -errno : ret;
+}
+
+static int
+uvsocks_uring_register (int           fd,
+                        unsigned int  opcode,
+                        void         *arg,
+                        unsigned int  nr_args)
+{
+  int ret;
+
+  ret = (int) syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+  return ret < 0 ? -errno : ret;
+}
+
+/* Hands the kernel what was queued since the last call. */
+static int
+uvsocks_uring_submit (UvSocksUring *uring)
+{
+  unsigned int pending;
+
+  __atomic_store_n (uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+  pending = uring->sq_local_tail -
+            __atomic_load_n (uring->sq_head, __ATOMIC_ACQUIRE);
+  if (!pending)
+    return 0;
+
+  return uvsocks_uring_enter (uring->fd, pending, 0, 0);
+}
+
+static void
+uvsocks_uring_prepare (uv_prepare_t *handle)
+{
+  UvSocksUring *uring = handle->data;
+
+  while (uring->cancels)
+    {
+      UvSocksUringRelay *relay = uring->cancels;
+
+      uring->cancels = relay->next_cancel;
+      relay->next_cancel = NULL;
+      uvsocks_uring_relay_cancel (relay);
+      if (uring->cancels == relay)
+        break;
+    }
+
+  /* whatever the kernel refused is tried again next iteration */
+  if (uvsocks_uring_submit (uring) >= 0 && !uring->cancels)
+    uv_prepare_stop (&uring->prepare);
+}
+
+/* Returns a cleared entry to fill, submitted with the rest before the loop
+   next waits, or NULL when the queue is full and the kernel takes none. */
+static struct io_uring_sqe *
+uvsocks_uring_get_sqe (UvSocksUring *uring)
+{
+  struct io_uring_sqe *sqe;
+
+  if (uring->sq_local_tail -
+      __atomic_load_n (uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries)
+    {
+      uvsocks_uring_submit (uring);
+      if (uring->sq_local_tail -
+          __atomic_load_n (uring->sq_head, __ATOMIC_ACQUIRE) >=
+          uring->sq_entries)
+        return NULL;
+    }
+
+  sqe = &uring->sqes[uring->sq_local_tail & uring->sq_mask];
+  memset (sqe, 0, sizeof (*sqe));
+  uring->sq_local_tail++;
+  uv_prepare_start (&uring->prepare, uvsocks_uring_prepare);
+
+  return sqe;
+}
+
+static unsigned int
+uvsocks_uring_sq_space (UvSocksUring *uring)
+{
+  return uring->sq_entries -
+         (uring->sq_local_tail -
+          __atomic_load_n (uring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+static void
+uvsocks_uring_recycle (UvSocksUringRelay *relay,
+                       unsigned short     bid)
+{
+  struct io_uring_buf *buf;
+
+  buf = &relay->ring->bufs[relay->ring_tail & (UVSOCKS_URING_BUFS - 1)];
+  buf->addr = (uint64_t) (uintptr_t) &relay->buf[bid * relay->buf_size];
+  buf->len = (uint32_t) relay->buf_size;
+  buf->bid = bid;
+  relay->ring_tail++;
+  __atomic_store_n (&relay->ring->tail, relay->ring_tail, __ATOMIC_RELEASE);
+}
+
+static int
+uvsocks_uring_recv (UvSocksUringRelay *relay)
+{
+  struct io_uring_sqe *sqe;
+
+  sqe = uvsocks_uring_get_sqe (relay->uring);
+  if (!sqe)
+    return UV_ENOBUFS;
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = relay->from_fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = relay->bgid;
+  sqe->user_data = (uint64_t) (uintptr_t) relay | UVSOCKS_URING_OP_RECV;
+  relay->receiving = 1;
+  relay->n_ops++;
+
+  return 0;
+}
+
+/* Sends everything received as one chain, unless a chain is out: linked
+   sends run one after the other, so the bytes stay in order. */
+static int
+uvsocks_uring_send (UvSocksUringRelay *relay)
+{
+  UvSocksUring *uring = relay->uring;
+  unsigned int n;
+  unsigned int i;
+
+  if (relay->n_sending || !relay->n_queued)
+    return 0;
+
+  n = relay->n_queued;
+  if (uvsocks_uring_sq_space (uring) < n)
+    uvsocks_uring_submit (uring);
+  if (uvsocks_uring_sq_space (uring) < n)
+    n = uvsocks_uring_sq_space (uring);
+  if (!n)
+    return UV_ENOBUFS;
+
+  for (i = 0; i < n; i++)
+    {
+      UvSocksUringQueued *queued;
+      struct io_uring_sqe *sqe;
+
+      queued = &relay->queue[(relay->queue_head + i) & (UVSOCKS_URING_BUFS - 1)];
+      sqe = uvsocks_uring_get_sqe (uring);
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = relay->to_fd;
+      sqe->addr = (uint64_t) (uintptr_t) &relay->buf[queued->bid * relay->buf_size];
+      sqe->len = queued->len;
+      sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+      if (i + 1 < n)
+        sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = (uint64_t) (uintptr_t) relay | UVSOCKS_URING_OP_SEND;
+      relay->n_sending++;
+      relay->n_ops++;
+    }
+
+  return 0;
+}
+
+static void
+uvsocks_uring_stop (UvSocksUringRelay *relay,
+                    int                error)
+{
+  if (relay->stopped || relay->closing)
+    return;
+
+  relay->stopped = 1;
+  relay->func (relay, error, relay->data);
+}
+
+/* Sends what was received, and receives again unless the source is done
+   or every buffer waits to be sent, in which case the next send to
+   complete does. */
+static void
+uvsocks_uring_continue (UvSocksUringRelay *relay)
+{
+  int ret;
+
+  ret = uvsocks_uring_send (relay);
+  if (!ret && relay->eof)
+    {
+      if (!relay->n_queued)
+        uvsocks_uring_stop (relay, UV_EOF);
+      return;
+    }
+  if (!ret && !relay->receiving && relay->n_queued < UVSOCKS_URING_BUFS)
+    ret = uvsocks_uring_recv (relay);
+  if (ret)
+    uvsocks_uring_stop (relay, ret);
+}
+
+static void
+uvsocks_uring_received (UvSocksUringRelay *relay,
+                        int                res,
+                        unsigned int       flags)
+{
+  if (!(flags & IORING_CQE_F_MORE))
+    {
+      relay->receiving = 0;
+      relay->n_ops--;
+    }
+
+  if (relay->closing || relay->stopped)
+    return;
+
+  if (res > 0)
+    {
+      UvSocksUringQueued *queued;
+      int q;
+
+      q = (relay->queue_head + relay->n_queued) & (UVSOCKS_URING_BUFS - 1);
+      queued = &relay->queue[q];
+      queued->bid = (unsigned short) (flags >> IORING_CQE_BUFFER_SHIFT);
+      queued->len = (unsigned int) res;
+      relay->n_queued++;
+      relay->buffered += res;
+    }
+  else if (res == 0)
+    relay->eof = 1;
+  else if (res != -ENOBUFS)
+    {
+      uvsocks_uring_stop (relay, res);
+      return;
+    }
+
+  uvsocks_uring_continue (relay);
+}
+
+static void
+uvsocks_uring_sent (UvSocksUringRelay *relay,
+                    int                res)
+{
+  UvSocksUringQueued *queued;
+
+  relay->n_ops--;
+  if (relay->closing || relay->stopped)
+    return;
+
+  queued = &relay->queue[relay->queue_head];
+  if (res != (int) queued->len)
+    {
+      /* MSG_WAITALL sends it all unless the socket failed */
+      uvsocks_uring_stop (relay, res < 0 ? res : UV_EPIPE);
+      return;
+    }
+
+  relay->queue_head = (relay->queue_head + 1) & (UVSOCKS_URING_BUFS - 1);
+  relay->n_queued--;
+  relay->n_sending--;
+  relay->buffered -= res;
+  uvsocks_uring_recycle (relay, queued->bid);
+  relay->func (relay, res, relay->data);
+  if (relay->closing)
+    return;
+
+  uvsocks_uring_continue (relay);
+}
+
+static void
+uvsocks_uring_close_handle (uv_handle_t *handle)
+{
+  UvSocksUring *uring = handle->data;
+
+  if (--uring->n_handles > 0)
+    return;
+
+  close (uring->event_fd);
+  munmap (uring->sqes, uring->sqes_size);
+  munmap (uring->ring_map, uring->ring_map_size);
+  close (uring->fd);
+  if (uring->func)
+    uring->func (uring->data);
+  uvsocks_alloc_free (uring);
+}
+
+static void
+uvsocks_uring_free_check (UvSocksUring *uring)
+{
+  if (!uring->close || uring->n_relays > 0 || uring->n_handles > 0)
+    return;
+
+  uring->n_handles = 2;
+  uv_close ((uv_handle_t *) &uring->poll, uvsocks_uring_close_handle);
+  uv_close ((uv_handle_t *) &uring->prepare, uvsocks_uring_close_handle);
+}
+
+static void
+uvsocks_uring_relay_unregister (UvSocksUringRelay *relay)
+{
+  UvSocksUring *uring = relay->uring;
+  struct io_uring_buf_reg reg;
+
+  memset (&reg, 0, sizeof (reg));
+  reg.bgid = relay->bgid;
+  uvsocks_uring_register (uring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+}
+
+static void
+uvsocks_uring_relay_free (UvSocksUringRelay *relay)
+{
+  UvSocksUring *uring = relay->uring;
+
+  uvsocks_uring_relay_unregister (relay);
+  uring->free_bgids[uring->n_free_bgids++] = relay->bgid;
+  uvsocks_alloc_free (relay->ring);
+
+  if (--uring->n_relays == 0)
+    uv_unref ((uv_handle_t *) &uring->poll);
+
+  if (relay->close_func)
+    relay->close_func (relay->data);
+  uvsocks_alloc_free (relay);
+
+  uvsocks_uring_free_check (uring);
+}
+
+static void
+uvsocks_uring_complete (UvSocksUring        *uring,
+                        struct io_uring_cqe *cqe)
+{
+  UvSocksUringRelay *relay;
+
+  relay = (UvSocksUringRelay *) (uintptr_t) (cqe->user_data &
+                                             ~(uint64_t) UVSOCKS_URING_OP_MASK);
+  switch (cqe->user_data & UVSOCKS_URING_OP_MASK)
+    {
+    case UVSOCKS_URING_OP_RECV:
+      uvsocks_uring_received (relay, cqe->res, cqe->flags);
+      break;
+    case UVSOCKS_URING_OP_SEND:
+      uvsocks_uring_sent (relay, cqe->res);
+      break;
+    default:
+      relay->n_ops--;
+      break;
+    }
+
+  if (relay->closing && relay->n_ops == 0)
+    uvsocks_uring_relay_free (relay);
+}
+
+static void
+uvsocks_uring_reap (UvSocksUring *uring)
+{
+  do
+    {
+      unsigned int head;
+      unsigned int tail;
+
+      head = *uring->cq_head;
+      tail = __atomic_load_n (uring->cq_tail, __ATOMIC_ACQUIRE);
+      while (head != tail)
+        {
+          struct io_uring_cqe cqe;
+
+          /* copied, so the slot can go back before the callbacks run */
+          cqe = uring->cqes[head & uring->cq_mask];
+          head++;
+          __atomic_store_n (uring->cq_head, head, __ATOMIC_RELEASE);
+          uvsocks_uring_complete (uring, &cqe);
+          tail = __atomic_load_n (uring->cq_tail, __ATOMIC_ACQUIRE);
+        }
+
+      /* completions the ring had no room for wait in the kernel */
+      if (!(__atomic_load_n (uring->sq_flags, __ATOMIC_ACQUIRE) &
+            IORING_SQ_CQ_OVERFLOW))
+        break;
+    }
+  while (uvsocks_uring_enter (uring->fd, 0, 0, IORING_ENTER_GETEVENTS) >= 0);
+}
+
+static void
+uvsocks_uring_poll (uv_poll_t *handle,
+                    int        status,
+                    int        events)
+{
+  UvSocksUring *uring = handle->data;
+  uint64_t count;
+
+  if (status < 0)
+    return;
+
+  while (read (uring->event_fd, &count, sizeof (count)) < 0 && errno == EINTR)
+    ;
+  uvsocks_uring_reap (uring);
+}
+
+/* Waits for the next completion while nothing else uses the ring. */
+static int
+uvsocks_uring_wait (UvSocksUring        *uring,
+                    struct io_uring_cqe *cqe)
+{
+  unsigned int head;
+
+  head = *uring->cq_head;
+  if (head == __atomic_load_n (uring->cq_tail, __ATOMIC_ACQUIRE) &&
+      uvsocks_uring_enter (uring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0)
+    return -1;
+
+  *cqe = uring->cqes[head & uring->cq_mask];
+  __atomic_store_n (uring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/* Checks that the kernel takes a multishot receive into a provided buffer
+   ring, which older kernels refuse with EINVAL. */
+static int
+uvsocks_uring_probe (UvSocksUring *uring)
+{
+  struct io_uring_buf_reg reg;
+  struct io_uring_buf_ring *ring;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe cqe;
+  char buf[64];
+  int sv[2];
+  int ok;
+
+  ring = uvsocks_alloc_aligned (uring->alloc, getpagesize (), getpagesize ());
+  if (!ring)
+    return -1;
+  memset (ring, 0, getpagesize ());
+  ring->bufs[0].addr = (uint64_t) (uintptr_t) buf;
+  ring->bufs[0].len = sizeof (buf);
+  ring->tail = 1;
+
+  memset (&reg, 0, sizeof (reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) ring;
+  reg.ring_entries = 1;
+  reg.bgid = UVSOCKS_URING_PROBE_BGID;
+  if (uvsocks_uring_register (uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+    {
+      uvsocks_alloc_free (ring);
+      return -1;
+    }
+
+  ok = 0;
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == 0)
+    {
+      if (write (sv[1], "", 1) == 1)
+        {
+          sqe = uvsocks_uring_get_sqe (uring);
+          sqe->opcode = IORING_OP_RECV;
+          sqe->fd = sv[0];
+          sqe->ioprio = IORING_RECV_MULTISHOT;
+          sqe->flags = IOSQE_BUFFER_SELECT;
+          sqe->buf_group = UVSOCKS_URING_PROBE_BGID;
+          sqe->user_data = 1;
+          uvsocks_uring_submit (uring);
+
+          if (uvsocks_uring_wait (uring, &cqe) == 0 &&
+              cqe.res == 1 &&
+              (cqe.flags & IORING_CQE_F_BUFFER) &&
+              (cqe.flags & IORING_CQE_F_MORE))
+            ok = 1;
+
+          /* the receive is still armed when it worked */
+          if (ok)
+            {
+              sqe = uvsocks_uring_get_sqe (uring);
+              sqe->opcode = IORING_OP_ASYNC_CANCEL;
+              sqe->addr = 1;
+              sqe->user_data = 2;
+              uvsocks_uring_submit (uring);
+              if (uvsocks_uring_wait (uring, &cqe) ||
+                  uvsocks_uring_wait (uring, &cqe))
+                ok = 0;
+            }
+        }
+      close (sv[0]);
+      close (sv[1]);
+    }
+
+  memset (&reg, 0, sizeof (reg));
+  reg.bgid = UVSOCKS_URING_PROBE_BGID;
+  uvsocks_uring_register (uring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+  uvsocks_alloc_free (ring);
+
+  return ok ? 0 : -1;
+}
+
+static int
+uvsocks_uring_map (UvSocksUring           *uring,
+                   struct io_uring_params *params)
+{
+  size_t sq_size;
+  size_t cq_size;
+  char *map;
+  unsigned int *array;
+  unsigned int i;
+
+  sq_size = params->sq_off.array + params->sq_entries * sizeof (unsigned int);
+  cq_size = params->cq_off.cqes +
+            params->cq_entries * sizeof (struct io_uring_cqe);
+  uring->ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+  map = mmap (NULL, uring->ring_map_size, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+  if (map == MAP_FAILED)
+    return -1;
+  uring->ring_map = map;
+
+  uring->sqes_size = params->sq_entries * sizeof (struct io_uring_sqe);
+  uring->sqes = mmap (NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED)
+    {
+      munmap (uring->ring_map, uring->ring_map_size);
+      return -1;
+    }
+
+  uring->sq_head = (unsigned int *) (map + params->sq_off.head);
+  uring->sq_tail = (unsigned int *) (map + params->sq_off.tail);
+  uring->sq_flags = (unsigned int *) (map + params->sq_off.flags);
+  uring->sq_mask = *(unsigned int *) (map + params->sq_off.ring_mask);
+  uring->sq_entries = params->sq_entries;
+  uring->sq_local_tail = *uring->sq_tail;
+
+  /* entries are always used in ring order */
+  array = (unsigned int *) (map + params->sq_off.array);
+  for (i = 0; i < params->sq_entries; i++)
+    array[i] = i;
+
+  uring->cq_head = (unsigned int *) (map + params->cq_off.head);
+  uring->cq_tail = (unsigned int *) (map + params->cq_off.tail);
+  uring->cq_mask = *(unsigned int *) (map + params->cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe *) (map + params->cq_off.cqes);
+
+  return 0;
+}
+
+UvSocksUring *
+uvsocks_uring_new (void         *uv_loop,
+                   UvSocksAlloc *alloc)
+{
+  struct io_uring_params params;
+  UvSocksUring *uring;
+  int i;
+
+  uring = uvsocks_alloc_calloc (alloc, 1, sizeof (*uring));
+  if (!uring)
+    return NULL;
+
+  uring->loop = uv_loop;
+  uring->alloc = alloc;
+  uring->event_fd = -1;
+  memset (&params, 0, sizeof (params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+  params.cq_entries = UVSOCKS_URING_CQ_ENTRIES;
+  uring->fd = (int) syscall (__NR_io_uring_setup,
+                             UVSOCKS_URING_SQ_ENTRIES,
+                             &params);
+  if (uring->fd < 0)
+    {
+      uvsocks_alloc_free (uring);
+      return NULL;
+    }
+
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_NODROP) ||
+      uvsocks_uring_map (uring, &params))
+    {
+      close (uring->fd);
+      uvsocks_alloc_free (uring);
+      return NULL;
+    }
+
+  /* the handles exist before the probe, which queues through them */
+  uv_prepare_init (uring->loop, &uring->prepare);
+  uring->prepare.data = uring;
+  uring->event_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (uring->event_fd < 0 ||
+      uvsocks_uring_probe (uring) ||
+      uvsocks_uring_register (uring->fd, IORING_REGISTER_EVENTFD,
+                              &uring->event_fd, 1) ||
+      uv_poll_init (uring->loop, &uring->poll, uring->event_fd))
+    {
+      uv_prepare_stop (&uring->prepare);
+      uring->n_handles = 1;
+      uring->close = 1;
+      uv_close ((uv_handle_t *) &uring->prepare, uvsocks_uring_close_handle);
+      return NULL;
+    }
+  uv_prepare_stop (&uring->prepare);
+
+  uring->poll.data = uring;
+  uv_poll_start (&uring->poll, UV_READABLE, uvsocks_uring_poll);
+  uv_unref ((uv_handle_t *) &uring->poll);
+
+  for (i = 0; i < UVSOCKS_URING_RELAY_MAX; i++)
+    uring->free_bgids[i] = (unsigned short) (UVSOCKS_URING_RELAY_MAX - 1 - i);
+  uring->n_free_bgids = UVSOCKS_URING_RELAY_MAX;
+
+  return uring;
+}
+
+void
+uvsocks_uring_free (UvSocksUring  *uring,
+                    void         (*func) (void *data),
+                    void          *data)
+{
+  if (!uring)
+    return;
+
+  uring->close = 1;
+  uring->func = func;
+  uring->data = data;
+  uvsocks_uring_free_check (uring);
+}
+
+UvSocksUringRelay *
+uvsocks_uring_relay_new (UvSocksUring     *uring,
+                         int               from_fd,
+                         int               to_fd,
+                         char             *buf,
+                         size_t            size,
+                         UvSocksUringFunc  func,
+                         void             *data)
+{
+  UvSocksUringRelay *relay;
+  struct io_uring_buf_reg reg;
+  int i;
+
+  if (!uring || uring->close || !uring->n_free_bgids ||
+      size < UVSOCKS_URING_BUFS)
+    return NULL;
+
+  relay = uvsocks_alloc_calloc (uring->alloc, 1, sizeof (*relay));
+  if (!relay)
+    return NULL;
+
+  relay->ring = uvsocks_alloc_aligned (uring->alloc,
+                                       getpagesize (),
+                                       UVSOCKS_URING_BUFS *
+                                       sizeof (struct io_uring_buf));
+  if (!relay->ring)
+    {
+      uvsocks_alloc_free (relay);
+      return NULL;
+    }
+  memset (relay->ring, 0, UVSOCKS_URING_BUFS * sizeof (struct io_uring_buf));
+
+  relay->uring = uring;
+  relay->from_fd = from_fd;
+  relay->to_fd = to_fd;
+  relay->buf = buf;
+  relay->buf_size = size / UVSOCKS_URING_BUFS;
+  relay->bgid = uring->free_bgids[--uring->n_free_bgids];
+  relay->func = func;
+  relay->data = data;
+
+  memset (&reg, 0, sizeof (reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) relay->ring;
+  reg.ring_entries = UVSOCKS_URING_BUFS;
+  reg.bgid = relay->bgid;
+  if (uvsocks_uring_register (uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+    goto fail;
+
+  for (i = 0; i < UVSOCKS_URING_BUFS; i++)
+    uvsocks_uring_recycle (relay, (unsigned short) i);
+
+  if (uvsocks_uring_recv (relay))
+    {
+      uvsocks_uring_relay_unregister (relay);
+      goto fail;
+    }
+
+  if (uring->n_relays++ == 0)
+    uv_ref ((uv_handle_t *) &uring->poll);
+
+  return relay;
+
+fail:
+  uring->free_bgids[uring->n_free_bgids++] = relay->bgid;
+  uvsocks_alloc_free (relay->ring);
+  uvsocks_alloc_free (relay);
+  return NULL;
+}
+
+size_t
+uvsocks_uring_relay_buffered (UvSocksUringRelay *relay)
+{
+  return relay->buffered;
+}
+
+/* Cancels every operation of the relay still out, or completes a no-op
+   when there are none, so the relay is always freed from a completion. */
+static void
+uvsocks_uring_relay_cancel (UvSocksUringRelay *relay)
+{
+  UvSocksUring *uring = relay->uring;
+  struct io_uring_sqe *sqe;
+  int recv;
+  int send;
+
+  /* before any of these, every operation out is the receive or a send */
+  recv = relay->receiving;
+  send = relay->n_ops > relay->receiving;
+  if (uvsocks_uring_sq_space (uring) < 2)
+    uvsocks_uring_submit (uring);
+  if (uvsocks_uring_sq_space (uring) < 2)
+    {
+      relay->next_cancel = uring->cancels;
+      uring->cancels = relay;
+      uv_prepare_start (&uring->prepare, uvsocks_uring_prepare);
+      return;
+    }
+
+  if (recv)
+    {
+      sqe = uvsocks_uring_get_sqe (uring);
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = (uint64_t) (uintptr_t) relay | UVSOCKS_URING_OP_RECV;
+      sqe->user_data = (uint64_t) (uintptr_t) relay | UVSOCKS_URING_OP_CLOSE;
+      relay->n_ops++;
+    }
+  if (send)
+    {
+      sqe = uvsocks_uring_get_sqe (uring);
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+      sqe->addr = (uint64_t) (uintptr_t) relay | UVSOCKS_URING_OP_SEND;
+      sqe->user_data = (uint64_t) (uintptr_t) relay | UVSOCKS_URING_OP_CLOSE;
+      relay->n_ops++;
+    }
+  if (!recv && !send)
+    {
+      sqe = uvsocks_uring_get_sqe (uring);
+      sqe->opcode = IORING_OP_NOP;
+      sqe->user_data = (uint64_t) (uintptr_t) relay | UVSOCKS_URING_OP_CLOSE;
+      relay->n_ops++;
+    }
+}
+
+void
+uvsocks_uring_relay_close (UvSocksUringRelay  *relay,
+                           void              (*close_func) (void *data))
+{
+  if (relay->closing)
+    return;
+
+  relay->closing = 1;
+  relay->close_func = close_func;
+  uvsocks_uring_relay_cancel (relay);
+}
+
+#else
+
+UvSocksUring *
+uvsocks_uring_new (void         *uv_loop,
+                   UvSocksAlloc *alloc)
+{
+  return NULL;
+}
+
+void
+uvsocks_uring_free (UvSocksUring  *uring,
+                    void         (*func) (void *data),
+                    void          *data)
+{
+}
+
+UvSocksUringRelay *
+uvsocks_uring_relay_new (UvSocksUring     *uring,
+                         int               from_fd,
+                         int               to_fd,
+                         char             *buf,
+                         size_t            size,
+                         UvSocksUringFunc  func,
+                         void             *data)
+{
+  return NULL;
+}
+
+size_t
+uvsocks_uring_relay_buffered (UvSocksUringRelay *relay)
+{
+  return 0;
+}
+
+void
+uvsocks_uring_relay_close (UvSocksUringRelay  *relay,
+                           void              (*close_func) (void *data))
+{
+}
+
+#endif /* UVSOCKS_IO_URING */
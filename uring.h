@@ -0,0 +1,60 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+   vim: set autoindent expandtab shiftwidth=2 softtabstop=2 tabstop=2: */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "alloc.h"
+#include <uv.h>
+
+typedef struct _UvSocksUring UvSocksUring;
+typedef struct _UvSocksUringRelay UvSocksUringRelay;
+
+/* Called with n bytes a relay passed on, or with a libuv error once it
+   stopped: UV_EOF when its source was shut down. */
+typedef void (*UvSocksUringFunc) (UvSocksUringRelay *relay,
+                                  ssize_t            n,
+                                  void              *data);
+
+/* Sets up an io_uring whose completions are picked up by uv_loop through
+   an eventfd.  Returns NULL when uvsocks was built without io_uring
+   (configure --enable-io-uring) or the kernel lacks multishot receives and
+   provided buffer rings, which need Linux 6.0.  The ring and its relays
+   are allocated from alloc, their buffer rings page aligned. */
+UvSocksUring *
+uvsocks_uring_new (void         *uv_loop,
+                   UvSocksAlloc *alloc);
+
+/* Waits for every relay to be closed, then closes the ring and calls func
+   with data. */
+void
+uvsocks_uring_free (UvSocksUring  *uring,
+                    void         (*func) (void *data),
+                    void          *data);
+
+/* Passes whatever arrives on from_fd on to to_fd, receiving into buf split
+   into buffers the kernel picks from, until func is told it stopped.
+   Returns NULL when the ring has no room for another relay, in which case
+   the caller relays some other way.  Nothing else may read from_fd or
+   write to_fd meanwhile. */
+UvSocksUringRelay *
+uvsocks_uring_relay_new (UvSocksUring     *uring,
+                         int               from_fd,
+                         int               to_fd,
+                         char             *buf,
+                         size_t            size,
+                         UvSocksUringFunc  func,
+                         void             *data);
+
+/* Bytes received and not yet sent on. */
+size_t
+uvsocks_uring_relay_buffered (UvSocksUringRelay *relay);
+
+/* Cancels what the relay has in flight; func is no longer called, and
+   close_func is called with the data of the relay, never from within this
+   call, once the kernel is done with its buffer. */
+void
+uvsocks_uring_relay_close (UvSocksUringRelay  *relay,
+                           void              (*close_func) (void *data));
+
+#endif /* __URING_H__ */
@@ -22,7 +22,15 @@
 #endif
 
 #include "uvsocks.h"
+#include "alloc.h"
 #include "aqueue.h"
+#include "socks5.h"
+#include "http.h"
+#include "histogram.h"
+#include "trace.h"
+#include "admin.h"
+#include "uring.h"
+#include "probes.h"
 #include <uv.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -32,6 +40,16 @@
 
 #ifdef linux
 #include <sys/prctl.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <errno.h>
+#include <unistd.h>
+#if defined (SO_ZEROCOPY) && defined (MSG_ZEROCOPY)
+#define UVSOCKS_ZEROCOPY 1
+#endif
+#endif
+
+#ifndef _WIN32
 #include <unistd.h>
 #endif
 
@@ -39,6 +57,39 @@
 
 #define UVSOCKS_BUF_MAX (1024 * 512)
 
+/* links start on one, for the fields read on every relayed read */
+#define UVSOCKS_CACHE_LINE 64
+
+/* a link sending with MSG_ZEROCOPY stops reading once read_buf has less
+   room than a read, and its sends are dropped when the kernel has held on
+   to them this long after the session went */
+#define UVSOCKS_ZEROCOPY_ROOM (64 * 1024)
+#define UVSOCKS_ZEROCOPY_LINGER 10000
+
+/* the smallest quantum worth scheduling, as libuv reads up to this much */
+#define UVSOCKS_QUANTUM_MIN (64 * 1024)
+
+/* with priorities: the quantum when none is set, how many deferred links
+   a round of the loop lets read again, and how long, in nanoseconds, a
+   deferred link or connection waits at most for higher classes */
+#define UVSOCKS_QUANTUM_PRIORITY (256 * 1024)
+#define UVSOCKS_PRIORITY_ROUND 8
+#define UVSOCKS_PRIORITY_WAIT_MAX (100 * 1000000ULL)
+
+/* the smallest burst of a bandwidth cap, and the timer wheel links held
+   back by one wait on: a second's worth of 4 ms ticks */
+#define UVSOCKS_BURST_MIN (16 * 1024)
+#define UVSOCKS_WHEEL_SLOTS 256
+#define UVSOCKS_WHEEL_TICK 4
+
+/* startup: how many reverse tunnels may wait for their BIND reply at once,
+   and how many listeners one round of the loop brings up */
+#define UVSOCKS_START_MAX 64
+#define UVSOCKS_START_BATCH 256
+
+/* how often listeners holding a connection for want of memory retry */
+#define UVSOCKS_MEMORY_RETRY_MSEC 50
+
 #ifndef UV_BUF_LEN
 #ifdef _WIN32
 #define UV_BUF_LEN(x) ((ULONG)(x))
@@ -79,22 +130,104 @@ typedef enum _UvSocksCmd
   UVSOCKS_CMD_UDP_ASSOCIATE = 0x03,
 } UvSocksCmd;
 
-typedef enum _UvSocksStage
-{
-  UVSOCKS_STAGE_NONE                = 0x00,
-  UVSOCKS_STAGE_HANDSHAKE           = 0x01,
-  UVSOCKS_STAGE_AUTHENTICATE        = 0x02,
-  UVSOCKS_STAGE_ESTABLISH           = 0x03,
-  UVSOCKS_STAGE_BIND                = 0x04,
-  UVSOCKS_STAGE_TUNNEL              = 0x05,
-} UvSocksStage;
+/* Counters are written only by the loop thread and read from any other, so
+   relaxed loads and stores are enough; on common targets they are plain
+   moves.  Each tunnel's counters are bracketed by a sequence count so a
+   reader can take a consistent copy without a lock. */
+#if defined (__GNUC__) || defined (__clang__)
+#define UVSOCKS_COUNTER_GET(c)          __atomic_load_n (&(c), __ATOMIC_RELAXED)
+#define UVSOCKS_COUNTER_SET(c, v)       __atomic_store_n (&(c), (v), __ATOMIC_RELAXED)
+#define UVSOCKS_SEQ_GET(c)              __atomic_load_n (&(c), __ATOMIC_ACQUIRE)
+#define UVSOCKS_SEQ_SET(c, v)           __atomic_store_n (&(c), (v), __ATOMIC_RELEASE)
+#define UVSOCKS_FENCE_ACQUIRE()         __atomic_thread_fence (__ATOMIC_ACQUIRE)
+#define UVSOCKS_FENCE_RELEASE()         __atomic_thread_fence (__ATOMIC_RELEASE)
+#define UVSOCKS_POINTER_GET(p)          __atomic_load_n (&(p), __ATOMIC_ACQUIRE)
+#define UVSOCKS_POINTER_SET(p, v)       __atomic_store_n (&(p), (v), __ATOMIC_RELEASE)
+#else
+#define UVSOCKS_COUNTER_GET(c)          (*(volatile uint64_t *) &(c))
+#define UVSOCKS_COUNTER_SET(c, v)       (*(volatile uint64_t *) &(c) = (v))
+#define UVSOCKS_SEQ_GET(c)              (*(volatile unsigned int *) &(c))
+#define UVSOCKS_SEQ_SET(c, v)           (*(volatile unsigned int *) &(c) = (v))
+#define UVSOCKS_FENCE_ACQUIRE()         MemoryBarrier ()
+#define UVSOCKS_FENCE_RELEASE()         MemoryBarrier ()
+#define UVSOCKS_POINTER_GET(p)          (*(void *volatile *) &(p))
+#define UVSOCKS_POINTER_SET(p, v)       (*(void *volatile *) &(p) = (v))
+#endif
+
+#define UVSOCKS_COUNTER_ADD(c, n)       UVSOCKS_COUNTER_SET ((c), (c) + (n))
+
+#define UVSOCKS_STATS_BEGIN(t)                                  \
+  do {                                                          \
+    UVSOCKS_COUNTER_SET ((t)->stats_seq, (t)->stats_seq + 1);   \
+    UVSOCKS_FENCE_RELEASE ();                                   \
+  } while (0)
+#define UVSOCKS_STATS_END(t)                                    \
+  UVSOCKS_SEQ_SET ((t)->stats_seq, (t)->stats_seq + 1)
 
 #define UVSOCKS_SESSION_MAX           16
+#define UVSOCKS_EVENT_BATCH_MAX       32
+#define UVSOCKS_EVENT_QUEUE_MAX       64
+#define UVSOCKS_TRACE_RECORDS         4096
+#define UVSOCKS_HOP_MAX               8
+
+/* tunnels uvsocks_snapshot () copies per loop iteration */
+#define UVSOCKS_SNAPSHOT_BATCH        64
+
+#define UVSOCKS_FIELD_LEN(type, field) (sizeof (((type *) 0)->field) - 1)
+
+/* greeting, authentication and the largest request the codec encodes */
+#define UVSOCKS_HOP_PACKET_MAX                                          \
+  (3 +                                                                  \
+   3 + UVSOCKS_FIELD_LEN (UvSocksHop, user) +                           \
+   UVSOCKS_FIELD_LEN (UvSocksHop, password) +                           \
+   SOCKS5_PACKET_MAX)
+
+/* storage for either kind of stream a link or listener may use */
+typedef union _UvSocksStream UvSocksStream;
+union _UvSocksStream
+{
+  uv_stream_t            stream;
+  uv_tcp_t               tcp;
+  uv_pipe_t              pipe;
+};
 
 typedef struct _UvSocksTunnel UvSocksTunnel;
 typedef struct _UvSocksSession UvSocksSession;
 typedef struct _UvSocksSessionLink UvSocksSessionLink;
 
+/* A port a forward tunnel listens on, offset ports past the first one of
+   its range.  The rest of the tunnel is shared by all its ports. */
+typedef struct _UvSocksListener UvSocksListener;
+struct _UvSocksListener
+{
+  UvSocksStream          stream;
+  UvSocksTunnel         *tunnel;
+  int                    offset;
+  int                    open;
+
+  /* while higher priority classes go first, the listener may hold a
+     connection unaccepted since accept_time, on the list of the class */
+  UvSocksListener       *accept_next;
+  UvSocksListener      **accept_prev;
+  uint64_t               accept_time;
+
+  /* holds a connection until there is memory for its session */
+  int                    memory_wait;
+
+  /* a Unix domain socket closed by a handover, bound again on resuming */
+  int                    released;
+};
+
+/* A token bucket enforcing a UvSocksRate; rate is 0 when uncapped. */
+typedef struct _UvSocksBucket UvSocksBucket;
+struct _UvSocksBucket
+{
+  uint64_t               rate;
+  double                 burst;
+  double                 tokens;
+  uint64_t               time;
+};
+
 typedef void (*UvSocksDnsResolveFunc) (UvSocksSessionLink *link,
                                        struct addrinfo    *resolved);
 
@@ -108,17 +241,61 @@ struct _UvSocksDnsResolve
 
 struct _UvSocksSessionLink
 {
-  UvSocks               *socks;
-  UvSocksTunnel         *tunnel;
+  /* all uvsocks_relay_read touches on a read, kept within the first
+     cache line of the link: the stream read and the one relayed to, the
+     bytes relayed out of read_buf, which reach the tunnel counters when
+     the session goes, and how much of its quantum is left this round */
+  uv_stream_t           *read_stream;
+  uv_stream_t           *relay_to;
   UvSocksSession        *session;
-
-  uv_tcp_t              *read_tcp;
-  char                   read_buf[UVSOCKS_BUF_MAX];
   size_t                 read_buf_len;
+  uint64_t               bytes;
+  uint32_t               serial;
+  int                    from_proxy;
+  char                   zerocopy;
+  char                   shaped;
+  int                    deficit;
+
+  UvSocks               *socks;
+  UvSocksTunnel         *tunnel;
   UvSocksSessionLink    *write_link;
   uv_write_t             write_req;
 
+  /* the relay of a tunneling link when io_uring relays it */
+  UvSocksUringRelay     *uring;
+
+  /* MSG_ZEROCOPY: the socket sent to, or a duplicate of it once the
+     session went, the sends the kernel has yet to release, which pin
+     read_buf up to zc_len, and the list of links waiting on releases */
+  int                    zc_fd;
+  uint32_t               zc_pending;
+  size_t                 zc_len;
+  int                    zc_stopped;
+  int                    write_pending;
+  uint64_t               zc_deadline;
+  UvSocksSessionLink    *zc_next;
+  UvSocksSessionLink   **zc_prev;
+
+  /* the links of a priority class that used up their quantum, waiting
+     since sched_time for their next turn */
+  UvSocksSessionLink    *sched_next;
+  UvSocksSessionLink   **sched_prev;
+  uint64_t               sched_time;
+
+  /* the caps of the session and the tunnel in the direction read, and
+     while they hold the link back, its slot on the timer wheel */
+  UvSocksBucket          bucket;
+  UvSocksBucket         *tunnel_bucket;
+  uint64_t               throttle_time;
+  uint64_t               wheel_due;
+  UvSocksSessionLink    *wheel_next;
+  UvSocksSessionLink   **wheel_prev;
+
   UvSocksDnsResolve      dns_resolve;
+  int                    dns_pending;
+  uint64_t               time;
+
+  char                   read_buf[UVSOCKS_BUF_MAX];
 };
 
 struct _UvSocksSession
@@ -127,9 +304,44 @@ struct _UvSocksSession
   UvSocksTunnel         *tunnel;
 
   int                    id;
+  uint32_t               serial;
+  UvSocksSession        *serial_next;
   UvSocksStage           stage;
   UvSocksSessionLink    *socks_link;
   UvSocksSessionLink    *local_link;
+  int                    hop;
+  uint64_t               hop_time;
+  uint64_t               start_time;
+  uint64_t               stage_time;
+  int                    stage_hop;
+  Socks5Client           codec;
+
+  /* a reverse tunnel coming up, counted in start_pending until its BIND
+     is answered or it fails */
+  int                    starting;
+
+  /* whether an error status counted it in the failures of its stage */
+  int                    failed;
+
+  /* how far past the first port of its tunnel the listener accepting it
+     is */
+  int                    port_offset;
+
+  /* admission: dialing the first proxy, counted in dials, or waiting for
+     its turn since admit_time, on the list of the uvsocks */
+  int                    dialing;
+  uint64_t               admit_time;
+  UvSocksSession        *admit_next;
+  UvSocksSession       **admit_prev;
+
+  /* frontend sessions: the CONNECT request to send upstream, and how many
+     bytes at the head of the local read_buf belong to the frontend protocol
+     rather than to the tunnel */
+  char                  *request;
+  size_t                 request_len;
+  size_t                 request_consumed;
+  size_t                 request_scan;
+  char                   request_buf[HTTP_SOCKS5_REQUEST_MAX];
 };
 
 struct _UvSocksTunnel
@@ -137,34 +349,208 @@ struct _UvSocksTunnel
   UvSocks               *socks;
   UvSocksParam           param;
 
-  uv_tcp_t              *listen_tcp;
+  /* forward tunnels: one listener per port, once started; reverse ones:
+     whether a handover closed the session waiting for the peer */
+  UvSocksListener       *listeners;
+  int                    released;
   int                    n_sessions;
-  UvSocksSession        *sessions[UVSOCKS_SESSION_MAX];
+  int                    max_sessions;
+  UvSocksSession       **sessions;
+
+  unsigned int           stats_seq;
+  UvSocksStats           stats;
+
+  /* UVSOCKS_LATENCY_MAX histograms, allocated with the first value so
+     that tunnels never used take no room for them */
+  Histogram             *latency;
+
+  /* the hop and latency UVSOCKS_OK_SOCKS_HOP last reported, copied into
+     the params it goes out with */
+  int                    hop;
+  int                    hop_latency;
+
+  UvSocksBucket          buckets[UVSOCKS_DIRECTION_MAX];
+
+  /* statuses reported this coalescing interval, indexed by event bit, and
+     how often each repeated since, the last time from the port at offset */
+  uint64_t               events_seen;
+  unsigned int           events_repeated[64];
+  UvSocksStatus          events_status[64];
+  int                    events_offset[64];
+};
+
+typedef struct _UvSocksEvent UvSocksEvent;
+struct _UvSocksEvent
+{
+  UvSocksTunnel         *tunnel;
+  UvSocksStatus          status;
+  UvSocksParam           param;
+};
+
+typedef struct _UvSocksEventBatch UvSocksEventBatch;
+struct _UvSocksEventBatch
+{
+  int                    n_events;
+  UvSocksEvent           events[UVSOCKS_EVENT_BATCH_MAX];
+};
+
+/* A socket given to listen on, by the address it is bound to. */
+typedef struct _UvSocksListenFd UvSocksListenFd;
+struct _UvSocksListenFd
+{
+  uint16_t               port;          /* network order, 0 unless IPv4 */
+  uint32_t               addr;
+  int                    fd;            /* -1 once a port took it */
+};
+
+typedef struct _UvSocksHop UvSocksHop;
+struct _UvSocksHop
+{
+  char                   host[64];
+  int                    port;
+  char                   user[64];
+  char                   password[64];
+
+  Histogram              latency[UVSOCKS_LATENCY_MAX];
 };
 
 struct _UvSocks
 {
+  UvSocksAlloc           alloc;
+  int                    memory_waiting;
+  uv_timer_t             memory_timer;
+
   int                    self_loop;
   uv_loop_t             *loop;
   AQueue                *queue;
   uv_async_t             async;
   uv_thread_t            thread;
 
-  char                   host[64];
-  int                    port;
-  char                   user[64];
-  char                   password[64];
+  int                    n_hops;
+  UvSocksHop             hops[UVSOCKS_HOP_MAX];
+  int                    pipelined;
   int                    n_tunnels;
   UvSocksTunnel         *tunnels;
+  int                    n_links;
+  int                    n_listeners;
+
+  /* tunnels are brought up a batch at a time: the next one to start and
+     its next port, those before which only what a handover released is
+     started again, the reverse ones yet to be bound, and the handle
+     resuming the rest */
+  int                    start_next;
+  int                    start_port;
+  int                    start_resume;
+  int                    start_pending;
+  uv_idle_t              start_idle;
+  int                    started;
+
+  /* the sockets to listen on instead of binding, sorted by port */
+  UvSocksListenFd       *listen_fds;
+  int                    n_listen_fds;
+
+  /* being replaced: nothing more is started, func gets the listeners once
+     the admin socket is gone, and draining ends by the deadline at last */
+  int                    handover;
+  UvSocksHandoverFunc    handover_func;
+  void                  *handover_data;
+  int                    draining;
+  int                    drained;
+  int                    drain_handle;
+  uv_timer_t             drain_timer;
 
   UvSocksStatusFunc      callback_func;
   void                  *callback_data;
   int                    close;
+
+  UvSocksOptions         options;
+  int                    n_handles;
+  uv_timer_t             events_timer;
+  uv_check_t             events_check;
+  uv_idle_t              events_idle;
+  AQueue                *events;
+  uv_thread_t            events_thread;
+  UvSocksEventBatch     *events_batch;
+
+  uint32_t               n_serials;
+  Trace                 *trace;
+
+  /* the sessions in a tunnel's table, hashed by serial for
+     uvsocks_kill_session () into mask + 1 chains, or none yet */
+  UvSocksSession       **serials;
+  uint32_t               serials_mask;
+  uint32_t               n_serial_sessions;
+
+  char                   admin_path[128];
+  UvSocksAdmin          *admin;
+
+  int                    io_uring;
+  UvSocksUring          *uring;
+
+  size_t                 zerocopy_min;
+  int                    zerocopy_handles;
+  uv_check_t             zerocopy_check;
+  uv_timer_t             zerocopy_timer;
+  UvSocksSessionLink    *zerocopy_links;
+
+  int                    quantum;
+  int                    sched_handle;
+  int                    sched_round;
+  int                    sched_n;
+  uv_check_t             sched_check;
+  uv_idle_t              sched_idle;
+  UvSocksSessionLink    *sched_links[UVSOCKS_PRIORITY_MAX];
+  UvSocksSessionLink   **sched_tail[UVSOCKS_PRIORITY_MAX];
+  UvSocksListener       *accept_listeners[UVSOCKS_PRIORITY_MAX];
+  UvSocksListener      **accept_tail[UVSOCKS_PRIORITY_MAX];
+  Histogram              queue_delay[UVSOCKS_PRIORITY_MAX];
+
+  int                    wheel_handle;
+  int                    wheel_n;
+  uint64_t               wheel_tick;
+  uv_timer_t             wheel_timer;
+  UvSocksSessionLink    *wheel[UVSOCKS_WHEEL_SLOTS];
+
+  /* at most max_dials forward sessions dial the first proxy at once; the
+     others wait their turn in order, at most max_waiting of them and for
+     max_wait_msec each, read from any thread like the tunnel counters */
+  int                    max_dials;
+  int                    max_waiting;
+  int                    max_wait_msec;
+  uint64_t               dials;
+  uint64_t               waiting;
+  uint64_t               shed;
+  Histogram              admit_wait;
+  UvSocksSession        *admit_sessions;
+  UvSocksSession       **admit_tail;
+  int                    admit_handle;
+  uv_timer_t             admit_timer;
 };
 
 typedef void (*UvSocksFunc) (UvSocks *socks,
                              void    *data);
 
+typedef struct _UvSocksHandover UvSocksHandover;
+struct _UvSocksHandover
+{
+  UvSocksHandoverFunc    func;
+  void                  *data;
+};
+
+/* A uvsocks_snapshot () going through the tunnels from cursor on, a batch
+   per message; queued is set while the next message carries it on. */
+typedef struct _UvSocksSnapshot UvSocksSnapshot;
+struct _UvSocksSnapshot
+{
+  UvSocks               *socks;
+  UvSocksSnapshotFunc    func;
+  void                  *data;
+  int                    cursor;
+  int                    queued;
+  UvSocksStats           stats[UVSOCKS_SNAPSHOT_BATCH];
+  UvSocksParam           params[UVSOCKS_SNAPSHOT_BATCH];
+};
+
 typedef struct _UvSocksMessage UvSocksMessage;
 struct _UvSocksMessage
 {
@@ -177,15 +563,42 @@ typedef struct _UvSocksPacketReq UvSocksPacketReq;
 struct _UvSocksPacketReq
 {
   uv_write_t   req;
-  uv_buf_t     buf;
+  uv_buf_t     bufs[2];
+  unsigned int n_bufs;
   UvSocksStage stage;
 };
 
+static const char uvsocks_frontend_greeting_reply[] = { 0x05, UVSOCKS_AUTH_NONE };
+static const char uvsocks_frontend_no_method_reply[] = { 0x05, (char) 0xff };
+static const char uvsocks_frontend_failure_reply[] =
+  { 0x05, 0x01, 0x00, UVSOCKS_ADDR_TYPE_IPV4, 0, 0, 0, 0, 0, 0 };
+static const char uvsocks_frontend_command_reply[] =
+  { 0x05, 0x07, 0x00, UVSOCKS_ADDR_TYPE_IPV4, 0, 0, 0, 0, 0, 0 };
+
+static const char uvsocks_http_established_reply[] =
+  "HTTP/1.1 200 Connection established\r\n\r\n";
+static const char uvsocks_http_bad_request_reply[] =
+  "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+static const char uvsocks_http_method_reply[] =
+  "HTTP/1.1 405 Method Not Allowed\r\nAllow: CONNECT\r\nConnection: close\r\n\r\n";
+static const char uvsocks_http_bad_gateway_reply[] =
+  "HTTP/1.1 502 Bad Gateway\r\nConnection: close\r\n\r\n";
+
 static void
 uvsocks_read (uv_stream_t    *stream,
               ssize_t         nread,
               const uv_buf_t *buf);
 
+static void
+uvsocks_message_free (void *element)
+{
+  UvSocksMessage *msg = element;
+
+  if (msg->destroy_data)
+    msg->destroy_data (msg->data);
+  uvsocks_alloc_free (msg);
+}
+
 static void
 uvsocks_receive_async (uv_async_t *handle)
 {
@@ -200,14 +613,11 @@ uvsocks_receive_async (uv_async_t *handle)
         break;
 
       msg->func (socks, msg->data);
-
-      if (msg->destroy_data)
-        msg->destroy_data (msg->data);
-      free (msg);
+      uvsocks_message_free (msg);
     }
 }
 
-static void
+static int
 uvsocks_send_async (UvSocks      *socks,
                     UvSocksFunc   func,
                     void         *data,
@@ -215,15 +625,16 @@ uvsocks_send_async (UvSocks      *socks,
 {
   UvSocksMessage *msg;
 
-  msg = malloc (sizeof (*msg));
+  msg = uvsocks_alloc_malloc (&socks->alloc, sizeof (*msg));
   if (!msg)
-    return;
+    return 1;
 
   msg->func = func;
   msg->data = data;
   msg->destroy_data = destroy_data;
   aqueue_push (socks->queue, msg);
   uv_async_send (&socks->async);
+  return 0;
 }
 
 static void
@@ -234,6 +645,38 @@ uvsocks_thread_main (void *arg)
   uv_run (socks->loop, UV_RUN_DEFAULT);
 }
 
+static void
+uvsocks_events_thread_main (void *arg)
+{
+  UvSocks *socks = arg;
+  UvSocksEventBatch *batch;
+  int i;
+
+  /* a NULL batch asks to quit */
+  while ((batch = aqueue_pop (socks->events)) != NULL)
+    {
+      for (i = 0; i < batch->n_events; i++)
+        socks->callback_func (socks,
+                              batch->events[i].status,
+                              &batch->events[i].param,
+                              socks->callback_data);
+      uvsocks_alloc_free (batch);
+    }
+}
+
+static void
+uvsocks_events_timer (uv_timer_t *handle);
+
+static void
+uvsocks_events_check (uv_check_t *handle);
+
+void
+uvsocks_options_init (UvSocksOptions *options)
+{
+  memset (options, 0, sizeof (*options));
+  options->event_mask = UVSOCKS_EVENT_ALL;
+}
+
 UvSocks *
 uvsocks_new (void              *uv_loop,
              const char        *host,
@@ -244,6 +687,30 @@ uvsocks_new (void              *uv_loop,
              UvSocksParam      *params,
              UvSocksStatusFunc  callback_func,
              void              *callback_data)
+{
+  return uvsocks_new_full (uv_loop,
+                           host,
+                           port,
+                           user,
+                           password,
+                           n_params,
+                           params,
+                           NULL,
+                           callback_func,
+                           callback_data);
+}
+
+UvSocks *
+uvsocks_new_full (void                 *uv_loop,
+                  const char           *host,
+                  int                   port,
+                  const char           *user,
+                  const char           *password,
+                  int                   n_params,
+                  UvSocksParam         *params,
+                  const UvSocksOptions *options,
+                  UvSocksStatusFunc     callback_func,
+                  void                 *callback_data)
 {
   UvSocks *socks;
   UvSocksTunnel *tunnels;
@@ -258,40 +725,88 @@ uvsocks_new (void              *uv_loop,
   if (n_params <= 0)
     goto fail_parameter;
 
+  if (options && options->coalesce_msec < 0)
+    goto fail_parameter;
+
   for (i = 0; i < n_params; i++)
     {
-      if (params[i].destination_port < 0 ||
-          params[i].destination_port > 65535 ||
-          params[i].listen_port < 0 ||
+      if (params[i].destination_port > 65535 ||
           params[i].listen_port > 65535)
         goto fail_parameter;
 
+      /* forward tunnels may listen on, and reverse tunnels connect to, a
+         Unix domain socket */
+      if (params[i].listen_port < 0 &&
+          (!params[i].is_forward ||
+           params[i].listen_port != UVSOCKS_PORT_STREAMLOCAL))
+        goto fail_parameter;
+
+      if (params[i].destination_port < 0 &&
+          (params[i].is_forward ||
+           params[i].destination_port != UVSOCKS_PORT_STREAMLOCAL))
+        goto fail_parameter;
+
       if (params[i].destination_host == NULL ||
           params[i].listen_host == NULL)
         goto fail_parameter;
+
+      if (params[i].frontend != UVSOCKS_FRONTEND_NONE &&
+          !params[i].is_forward)
+        goto fail_parameter;
+
+      if (params[i].priority < 0 ||
+          params[i].priority >= UVSOCKS_PRIORITY_MAX)
+        goto fail_parameter;
+
+      /* a range takes as many ports from a port given in full */
+      if (params[i].n_ports < 0 || params[i].n_ports > 65535)
+        goto fail_parameter;
+      if (params[i].n_ports > 1 &&
+          (!params[i].is_forward ||
+           params[i].listen_port <= 0 ||
+           params[i].listen_port + params[i].n_ports - 1 > 65535))
+        goto fail_parameter;
+      if (params[i].range_destination && params[i].n_ports > 1 &&
+          (params[i].frontend != UVSOCKS_FRONTEND_NONE ||
+           params[i].destination_port <= 0 ||
+           params[i].destination_port + params[i].n_ports - 1 > 65535))
+        goto fail_parameter;
     }
 
-  socks = calloc (sizeof (UvSocks), 1);
+  socks = uvsocks_alloc_new (options ? options->allocator : NULL,
+                             options ? options->memory_limit : 0,
+                             sizeof (UvSocks),
+                             offsetof (UvSocks, alloc));
   if (!socks)
     return NULL;
 
-  tunnels = calloc (sizeof (UvSocksTunnel), n_params);
-  if (!tunnels)
+  tunnels = uvsocks_alloc_calloc (&socks->alloc, n_params, sizeof (UvSocksTunnel));
+  socks->queue = aqueue_new (128, &socks->alloc);
+  if (!uv_loop)
+    socks->loop = uvsocks_alloc_malloc (&socks->alloc, sizeof (*socks->loop));
+  else
+    socks->loop = uv_loop;
+  if (options && options->threaded && callback_func)
+    /* one slot more than ever used for batches, for the NULL one */
+    socks->events = aqueue_new (UVSOCKS_EVENT_QUEUE_MAX + 1, &socks->alloc);
+  if (!tunnels || !socks->queue || !socks->loop ||
+      (options && options->threaded && callback_func && !socks->events))
     {
-      free (socks);
+      aqueue_destroy (socks->events, NULL);
+      aqueue_destroy (socks->queue, NULL);
+      if (!uv_loop)
+        uvsocks_alloc_free (socks->loop);
+      uvsocks_alloc_free (tunnels);
+      uvsocks_alloc_free (socks);
       return NULL;
     }
 
   if (!uv_loop)
     {
       socks->self_loop = 1;
-      socks->loop = malloc (sizeof (*socks->loop));
       uv_loop_init (socks->loop);
     }
-  else
-    socks->loop = uv_loop;
 
-  socks->queue = aqueue_new (128);
   uv_async_init (socks->loop, &socks->async, uvsocks_receive_async);
   socks->async.data = socks;
 
@@ -301,16 +816,47 @@ uvsocks_new (void              *uv_loop,
       memcpy (&tunnels[i].param, &params[i], sizeof (UvSocksParam));
     }
 
-  strlcpy (socks->host, host, sizeof (socks->host));
-  socks->port = port;
-  strlcpy (socks->user, user, sizeof (socks->user));
-  strlcpy (socks->password, password, sizeof (socks->password));
+  strlcpy (socks->hops[0].host, host, sizeof (socks->hops[0].host));
+  socks->hops[0].port = port;
+  strlcpy (socks->hops[0].user, user, sizeof (socks->hops[0].user));
+  strlcpy (socks->hops[0].password, password, sizeof (socks->hops[0].password));
+  socks->n_hops = 1;
 
   socks->n_tunnels = n_params;
   socks->tunnels = tunnels;
   socks->callback_func = callback_func;
   socks->callback_data = callback_data;
 
+  if (options)
+    memcpy (&socks->options, options, sizeof (UvSocksOptions));
+  else
+    uvsocks_options_init (&socks->options);
+
+  if (socks->options.trace_records >= 0)
+    socks->trace = trace_new (socks->options.trace_records > 0 ?
+                              (unsigned int) socks->options.trace_records :
+                              UVSOCKS_TRACE_RECORDS,
+                              &socks->alloc);
+
+  uv_timer_init (socks->loop, &socks->events_timer);
+  socks->events_timer.data = socks;
+  uv_check_init (socks->loop, &socks->events_check);
+  socks->events_check.data = socks;
+  uv_idle_init (socks->loop, &socks->events_idle);
+  socks->events_idle.data = socks;
+  uv_idle_init (socks->loop, &socks->start_idle);
+  socks->start_idle.data = socks;
+  uv_timer_init (socks->loop, &socks->memory_timer);
+  socks->memory_timer.data = socks;
+  socks->n_handles = 5;
+
+  if (socks->events)
+    uv_thread_create (&socks->events_thread,
+                      uvsocks_events_thread_main,
+                      socks);
+  else
+    socks->options.threaded = 0;
+
   if (socks->self_loop)
     uv_thread_create (&socks->thread, uvsocks_thread_main, socks);
 
@@ -327,11 +873,179 @@ fail_parameter:
   return NULL;
 }
 
+static uint64_t
+uvsocks_session_bytes (UvSocksSession *session)
+{
+  uint64_t bytes = 0;
+
+  if (session->socks_link)
+    bytes += session->socks_link->bytes;
+  if (session->local_link)
+    bytes += session->local_link->bytes;
+
+  return bytes;
+}
+
+static void
+uvsocks_record_latency (UvSocksSession *session,
+                        int             hop,
+                        UvSocksLatency  latency,
+                        uint64_t        start,
+                        uint64_t        now)
+{
+  UvSocksTunnel *tunnel = session->tunnel;
+  uint64_t usec;
+
+  usec = (now - start) / 1000;
+  histogram_record (&session->socks->hops[hop].latency[latency], usec);
+
+  if (!tunnel->latency)
+    {
+      Histogram *histograms;
+
+      histograms = uvsocks_alloc_calloc (&tunnel->socks->alloc,
+                                         UVSOCKS_LATENCY_MAX,
+                                         sizeof (Histogram));
+      if (!histograms)
+        return;
+      UVSOCKS_POINTER_SET (tunnel->latency, histograms);
+    }
+  histogram_record (&tunnel->latency[latency], usec);
+}
+
+static void
+uvsocks_admit_done (UvSocksSession *session);
+
 static void
 uvsocks_session_set_stage (UvSocksSession *session,
                            UvSocksStage    stage)
 {
+  UvSocksTunnel *tunnel = session->tunnel;
+  uint64_t now;
+
+  /* a stage is entered once its request is written, or once the reply of
+     the previous stage arrives when pipelined, and left with its reply */
+  now = uv_hrtime ();
+  switch (session->stage)
+    {
+    case UVSOCKS_STAGE_HANDSHAKE:
+      uvsocks_record_latency (session, session->stage_hop,
+                              UVSOCKS_LATENCY_GREETING,
+                              session->stage_time, now);
+      break;
+    case UVSOCKS_STAGE_AUTHENTICATE:
+      uvsocks_record_latency (session, session->stage_hop,
+                              UVSOCKS_LATENCY_AUTH,
+                              session->stage_time, now);
+      break;
+    case UVSOCKS_STAGE_ESTABLISH:
+      uvsocks_record_latency (session, session->stage_hop,
+                              UVSOCKS_LATENCY_REPLY,
+                              session->stage_time, now);
+      break;
+    default:
+      break;
+    }
+  session->stage_time = now;
+  session->stage_hop = session->hop;
+
+  UVSOCKS_PROBE3 (stage, session->serial, session->stage, stage);
+
+  if (session->socks->trace)
+    trace_record (session->socks->trace,
+                  now,
+                  session->serial,
+                  TRACE_EVENT_STAGE,
+                  stage,
+                  (int) (tunnel - session->socks->tunnels),
+                  uvsocks_session_bytes (session),
+                  0);
+
+  UVSOCKS_STATS_BEGIN (tunnel);
+  UVSOCKS_COUNTER_ADD (tunnel->stats.active[session->stage], -1);
+  UVSOCKS_COUNTER_ADD (tunnel->stats.active[stage], 1);
+  if (stage == UVSOCKS_STAGE_TUNNEL && tunnel->param.is_forward)
+    {
+      UVSOCKS_COUNTER_ADD (tunnel->stats.handshakes, 1);
+      UVSOCKS_COUNTER_ADD (tunnel->stats.handshake_usec,
+                           (uv_hrtime () - session->start_time) / 1000);
+    }
+  UVSOCKS_STATS_END (tunnel);
+
   session->stage = stage;
+
+  /* set up, which leaves another its turn to dial */
+  if (stage == UVSOCKS_STAGE_TUNNEL)
+    uvsocks_admit_done (session);
+}
+
+static void
+uvsocks_bucket_init (UvSocksBucket     *bucket,
+                     const UvSocksRate *rate,
+                     uint64_t           now)
+{
+  bucket->rate = rate->bytes_per_sec;
+  bucket->burst = rate->burst ? (double) rate->burst :
+                                rate->bytes_per_sec / 10.0;
+  if (bucket->burst < UVSOCKS_BURST_MIN)
+    bucket->burst = UVSOCKS_BURST_MIN;
+  bucket->tokens = bucket->burst;
+  bucket->time = now;
+}
+
+static void
+uvsocks_bucket_refill (UvSocksBucket *bucket,
+                       uint64_t       now)
+{
+  if (!bucket->rate)
+    return;
+
+  bucket->tokens += bucket->rate * ((now - bucket->time) / 1e9);
+  if (bucket->tokens > bucket->burst)
+    bucket->tokens = bucket->burst;
+  bucket->time = now;
+}
+
+/* Milliseconds until bucket holds enough to be worth reading for again:
+   a hundredth of a second's worth, or its burst when that is less. */
+static uint64_t
+uvsocks_bucket_wait (const UvSocksBucket *bucket)
+{
+  double need;
+
+  if (!bucket->rate)
+    return 0;
+
+  need = bucket->rate / 100.0;
+  if (need > bucket->burst)
+    need = bucket->burst;
+  if (need < 1)
+    need = 1;
+  if (bucket->tokens >= need)
+    return 0;
+
+  return (uint64_t) ((need - bucket->tokens) * 1000 / bucket->rate) + 1;
+}
+
+/* How much of size a capped link may read now: never more than its own
+   bucket and that of its tunnel hold, so a cap is kept to the byte. */
+static size_t
+uvsocks_link_allowance (UvSocksSessionLink *link,
+                        size_t              size)
+{
+  uint64_t now = uv_hrtime ();
+  double tokens;
+
+  uvsocks_bucket_refill (&link->bucket, now);
+  uvsocks_bucket_refill (link->tunnel_bucket, now);
+
+  tokens = (double) size;
+  if (link->bucket.rate && link->bucket.tokens < tokens)
+    tokens = link->bucket.tokens;
+  if (link->tunnel_bucket->rate && link->tunnel_bucket->tokens < tokens)
+    tokens = link->tunnel_bucket->tokens;
+
+  return tokens < 1 ? 0 : (size_t) tokens;
 }
 
 static void
@@ -345,6 +1059,8 @@ uvsocks_alloc_buffer (uv_handle_t *handle,
   size = UVSOCKS_BUF_MAX - link->read_buf_len;
   if (size > suggested_size)
     size = suggested_size;
+  if (link->shaped)
+    size = uvsocks_link_allowance (link, size);
 
   if (size <= 0)
     return;
@@ -353,19 +1069,65 @@ uvsocks_alloc_buffer (uv_handle_t *handle,
   buf->len = UV_BUF_LEN (size);
 }
 
+static void
+uvsocks_events_push (UvSocks *socks);
+
+/* How many ports tunnel listens on, one unless it forwards a range. */
+static int
+uvsocks_tunnel_ports (UvSocksTunnel *tunnel)
+{
+  return tunnel->param.n_ports > 1 ? tunnel->param.n_ports : 1;
+}
+
+/* Closes the sockets given to listen on that no port took. */
+static void
+uvsocks_close_listen_fds (UvSocks *socks)
+{
+#ifndef _WIN32
+  int i;
+
+  for (i = 0; i < socks->n_listen_fds; i++)
+    if (socks->listen_fds[i].fd >= 0)
+      close (socks->listen_fds[i].fd);
+#endif
+
+  uvsocks_alloc_free (socks->listen_fds);
+  socks->listen_fds = NULL;
+  socks->n_listen_fds = 0;
+}
+
 static void
 uvsocks_free_handle_real (uv_handle_t *handle)
 {
   UvSocks *socks = handle->data;
+  int t;
+
+  if (socks->options.threaded)
+    {
+      uvsocks_events_push (socks);
+      aqueue_push (socks->events, NULL);
+      uv_thread_join (&socks->events_thread);
+      aqueue_destroy (socks->events, NULL);
+    }
 
   if (socks->self_loop)
     {
       uv_loop_close (socks->loop);
-      free (socks->loop);
+      uvsocks_alloc_free (socks->loop);
     }
 
-  free (socks->tunnels);
-  free (socks);
+  for (t = 0; t < socks->n_tunnels; t++)
+    {
+      uvsocks_alloc_free (socks->tunnels[t].sessions);
+      uvsocks_alloc_free (socks->tunnels[t].listeners);
+      uvsocks_alloc_free (socks->tunnels[t].latency);
+    }
+  uvsocks_alloc_free (socks->serials);
+  uvsocks_alloc_free (socks->tunnels);
+  uvsocks_close_listen_fds (socks);
+  trace_free (socks->trace);
+  aqueue_destroy (socks->queue, uvsocks_message_free);
+  uvsocks_alloc_free (socks);
 }
 
 static void
@@ -380,9 +1142,11 @@ uvsocks_free_check (UvSocks *socks)
 {
   int t;
 
+  if (socks->n_links > 0 || socks->n_handles > 0 || socks->n_listeners > 0)
+    return;
+
   for (t = 0; t < socks->n_tunnels; t++)
-    if (socks->tunnels[t].listen_tcp ||
-        socks->tunnels[t].n_sessions > 0)
+    if (socks->tunnels[t].n_sessions > 0)
       return;
 
   if (socks->self_loop)
@@ -394,6 +1158,66 @@ uvsocks_free_check (UvSocks *socks)
   uv_close ((uv_handle_t *) &socks->async, uvsocks_free_handle_real);
 }
 
+/* Hashes session in by its serial, doubling the chains once there are
+   as many sessions; they stay as they are when there is no memory. */
+static int
+uvsocks_serial_add (UvSocks        *socks,
+                    UvSocksSession *session)
+{
+  UvSocksSession **chain;
+
+  if (socks->n_serial_sessions >= socks->serials_mask + 1 || !socks->serials)
+    {
+      UvSocksSession **serials;
+      uint32_t mask;
+      uint32_t i;
+
+      mask = socks->serials ? socks->serials_mask * 2 + 1 :
+                              UVSOCKS_SESSION_MAX - 1;
+      serials = uvsocks_alloc_calloc (&socks->alloc,
+                                      (size_t) mask + 1,
+                                      sizeof (*serials));
+      if (!serials && !socks->serials)
+        return 1;
+
+      if (serials)
+        {
+          for (i = 0; socks->serials && i <= socks->serials_mask; i++)
+            while (socks->serials[i])
+              {
+                UvSocksSession *moved = socks->serials[i];
+
+                socks->serials[i] = moved->serial_next;
+                moved->serial_next = serials[moved->serial & mask];
+                serials[moved->serial & mask] = moved;
+              }
+          uvsocks_alloc_free (socks->serials);
+          socks->serials = serials;
+          socks->serials_mask = mask;
+        }
+    }
+
+  chain = &socks->serials[session->serial & socks->serials_mask];
+  session->serial_next = *chain;
+  *chain = session;
+  socks->n_serial_sessions++;
+
+  return 0;
+}
+
+static void
+uvsocks_serial_remove (UvSocks        *socks,
+                       UvSocksSession *session)
+{
+  UvSocksSession **chain;
+
+  chain = &socks->serials[session->serial & socks->serials_mask];
+  while (*chain != session)
+    chain = &(*chain)->serial_next;
+  *chain = session->serial_next;
+  socks->n_serial_sessions--;
+}
+
 static int
 uvsocks_add_session (UvSocksTunnel  *tunnel,
                      UvSocksSession *session)
@@ -401,19 +1225,42 @@ uvsocks_add_session (UvSocksTunnel  *tunnel,
   int id;
 
   id = -1;
-  {
-    int s;
+  if (tunnel->n_sessions < tunnel->max_sessions)
+    {
+      int s;
 
-    for (s = 0; s < UVSOCKS_SESSION_MAX; s++)
-      if (tunnel->sessions[s] == NULL)
-        {
-          id = s;
-          break;
-        }
-  }
+      for (s = 0; s < tunnel->max_sessions; s++)
+        if (tunnel->sessions[s] == NULL)
+          {
+            id = s;
+            break;
+          }
+    }
+  else
+    {
+      UvSocksSession **sessions;
+      int max_sessions;
+
+      max_sessions = tunnel->max_sessions ? tunnel->max_sessions * 2 :
+                                            UVSOCKS_SESSION_MAX;
+      sessions = uvsocks_alloc_realloc (&tunnel->socks->alloc,
+                                        tunnel->sessions,
+                                        max_sessions * sizeof (*tunnel->sessions));
+      if (!sessions)
+        return 1;
+
+      memset (&sessions[tunnel->max_sessions],
+              0,
+              (max_sessions - tunnel->max_sessions) * sizeof (*sessions));
+      id = tunnel->max_sessions;
+      tunnel->sessions = sessions;
+      tunnel->max_sessions = max_sessions;
+    }
 
-  if (id < 0 ||
-      tunnel->n_sessions >= UVSOCKS_SESSION_MAX)
+  if (id < 0)
+    return 1;
+
+  if (uvsocks_serial_add (tunnel->socks, session))
     return 1;
 
   session->socks = tunnel->socks;
@@ -425,13 +1272,99 @@ uvsocks_add_session (UvSocksTunnel  *tunnel,
   return 0;
 }
 
+static void
+uvsocks_start_idle (uv_idle_t *handle);
+
+/* The reverse tunnel of session is bound or failed, which leaves room for
+   another to start. */
+static void
+uvsocks_start_done (UvSocksSession *session)
+{
+  UvSocks *socks = session->socks;
+
+  if (!session->starting)
+    return;
+
+  session->starting = 0;
+  socks->start_pending--;
+  if (!socks->close &&
+      !socks->handover &&
+      socks->start_next < socks->n_tunnels)
+    uv_idle_start (&socks->start_idle, uvsocks_start_idle);
+}
+
 static void
 uvsocks_free_session (UvSocksTunnel  *tunnel,
                       UvSocksSession *session)
 {
-  tunnel->n_sessions--;
-  tunnel->sessions[session->id] = NULL;
-  free (session);
+  UVSOCKS_PROBE4 (session_free,
+                  session->serial,
+                  (int) (tunnel - session->socks->tunnels),
+                  session->stage,
+                  uvsocks_session_bytes (session));
+
+  UVSOCKS_STATS_BEGIN (tunnel);
+  UVSOCKS_COUNTER_ADD (tunnel->stats.active[session->stage], -1);
+  UVSOCKS_STATS_END (tunnel);
+
+  uvsocks_start_done (session);
+  uvsocks_admit_done (session);
+
+  if (session->id >= 0)
+    {
+      uvsocks_serial_remove (tunnel->socks, session);
+      tunnel->n_sessions--;
+      tunnel->sessions[session->id] = NULL;
+    }
+  uvsocks_alloc_free (session);
+}
+
+/* Sets up one of the links of a new session: the local one relays out
+   to the proxy, the one from_proxy relays back in. */
+static void
+uvsocks_link_init (UvSocksSession     *session,
+                   UvSocksSessionLink *link,
+                   UvSocksTunnel      *tunnel,
+                   int                 from_proxy)
+{
+  UvSocksDirection direction = from_proxy ? UVSOCKS_DIRECTION_IN
+                                          : UVSOCKS_DIRECTION_OUT;
+
+  link->read_stream = NULL;
+  link->relay_to = NULL;
+  link->session = session;
+  link->read_buf_len = 0;
+  link->bytes = 0;
+  link->serial = 0;
+  link->from_proxy = from_proxy;
+  link->zerocopy = 0;
+  link->shaped = 0;
+  link->deficit = tunnel->socks->quantum ? tunnel->socks->quantum : INT_MAX;
+  link->socks = tunnel->socks;
+  link->tunnel = tunnel;
+  link->write_link = NULL;
+  link->uring = NULL;
+  link->zc_fd = -1;
+  link->zc_pending = 0;
+  link->zc_len = 0;
+  link->zc_stopped = 0;
+  link->write_pending = 0;
+  link->zc_deadline = 0;
+  link->zc_next = NULL;
+  link->zc_prev = NULL;
+  link->sched_next = NULL;
+  link->sched_prev = NULL;
+  link->sched_time = 0;
+  uvsocks_bucket_init (&link->bucket,
+                       &tunnel->param.session_rate[direction],
+                       uv_hrtime ());
+  link->tunnel_bucket = &tunnel->buckets[direction];
+  link->throttle_time = 0;
+  link->wheel_due = 0;
+  link->wheel_next = NULL;
+  link->wheel_prev = NULL;
+  link->dns_pending = 0;
+  link->time = 0;
 }
 
 static UvSocksSession *
@@ -441,23 +1374,32 @@ uvsocks_create_session (UvSocksTunnel *tunnel)
   UvSocksSessionLink *local;
   UvSocksSessionLink *socks;
 
-  session = calloc (sizeof (UvSocksSession), 1);
-  if (!session)
-    return NULL;
+  session = uvsocks_alloc_calloc (&tunnel->socks->alloc,
+                                  1,
+                                  sizeof (UvSocksSession));
+  local = uvsocks_alloc_aligned (&tunnel->socks->alloc,
+                                 UVSOCKS_CACHE_LINE,
+                                 sizeof (*session->local_link));
+  socks = uvsocks_alloc_aligned (&tunnel->socks->alloc,
+                                 UVSOCKS_CACHE_LINE,
+                                 sizeof (*session->local_link));
+  if (!session || !local || !socks)
+    {
+      uvsocks_alloc_free (session);
+      uvsocks_alloc_free (local);
+      uvsocks_alloc_free (socks);
+      return NULL;
+    }
 
-  local = malloc (sizeof (*session->local_link));
-  local->read_tcp = NULL;
-  local->read_buf_len = 0;
-  local->socks = tunnel->socks;
-  local->tunnel = tunnel;
-  local->session = session;
+  uvsocks_link_init (session, local, tunnel, 0);
+  uvsocks_link_init (session, socks, tunnel, 1);
 
-  socks = malloc (sizeof (*session->local_link));
-  socks->read_tcp = NULL;
-  socks->read_buf_len = 0;
-  socks->socks = tunnel->socks;
-  socks->tunnel = tunnel;
-  socks->session = session;
+  session->socks = tunnel->socks;
+  session->tunnel = tunnel;
+  session->id = -1;
+  session->serial = ++tunnel->socks->n_serials;
+  local->serial = session->serial;
+  socks->serial = session->serial;
 
   local->write_link = socks;
   socks->write_link = local;
@@ -465,683 +1407,3815 @@ uvsocks_create_session (UvSocksTunnel *tunnel)
   session->local_link = local;
   session->socks_link = socks;
 
-  uvsocks_session_set_stage (session, UVSOCKS_STAGE_NONE);
+  session->stage = UVSOCKS_STAGE_NONE;
+  session->start_time = uv_hrtime ();
+  UVSOCKS_PROBE2 (session_create,
+                  session->serial,
+                  (int) (tunnel - tunnel->socks->tunnels));
+  UVSOCKS_STATS_BEGIN (tunnel);
+  UVSOCKS_COUNTER_ADD (tunnel->stats.active[UVSOCKS_STAGE_NONE], 1);
+  UVSOCKS_STATS_END (tunnel);
 
   return session;
 }
 
+static int
+uvsocks_link_read_start (UvSocksSessionLink *link);
+
 static void
-uvsocks_close_handle_link (uv_handle_t *handle)
+uvsocks_drain_check (UvSocks *socks);
+
+/* Frees a link whose session went once the kernel is done with its
+   read_buf: its handle is closed, its io_uring relay cancelled and its
+   MSG_ZEROCOPY sends released. */
+static void
+uvsocks_link_free (UvSocksSessionLink *link)
 {
-  UvSocksSessionLink *link = handle->data;
   UvSocks *socks = link->socks;
 
-  free (handle);
-  free (link);
+  if (link->read_stream || link->uring || link->zc_pending)
+    return;
+
+  uvsocks_alloc_free (link);
+  socks->n_links--;
 
   if (socks->close)
     uvsocks_free_check (socks);
+  else if (socks->draining)
+    uvsocks_drain_check (socks);
+}
+
+static void
+uvsocks_close_handle_link (uv_handle_t *handle)
+{
+  UvSocksSessionLink *link = handle->data;
+
+  uvsocks_alloc_free (handle);
+  link->read_stream = NULL;
+  uvsocks_link_free (link);
 }
 
+static void
+uvsocks_start_local_server (UvSocks         *socks,
+                            UvSocksListener *listener);
+
 static void
 uvsocks_close_handle_listen (uv_handle_t *handle)
 {
-  UvSocksTunnel  *tunnel = handle->data;
-  UvSocks *socks = tunnel->socks;
+  UvSocksListener *listener = handle->data;
+  UvSocks *socks = listener->tunnel->socks;
 
- free (handle);
- tunnel->listen_tcp = NULL;
+  listener->open = 0;
+  socks->n_listeners--;
 
   if (socks->close)
     uvsocks_free_check (socks);
+  else if (listener->released && !socks->handover)
+    {
+      /* resumed before it was closed */
+      listener->released = 0;
+      uvsocks_start_local_server (socks, listener);
+    }
 }
 
 static void
 uvsocks_close_handle (uv_handle_t *handle)
 {
-  free (handle);
+  uvsocks_alloc_free (handle);
 }
 
 static void
-uvsocks_remove_session (UvSocksTunnel  *tunnel,
-                        UvSocksSession *session)
+uvsocks_wheel_timer (uv_timer_t *handle);
+
+static void
+uvsocks_wheel_insert (UvSocksSessionLink *link,
+                      uint64_t            due)
 {
-  UvSocksSessionLink *local;
-  UvSocksSessionLink *socks;
+  UvSocksSessionLink **slot = &link->socks->wheel[due % UVSOCKS_WHEEL_SLOTS];
+
+  link->wheel_due = due;
+  link->wheel_next = *slot;
+  if (link->wheel_next)
+    link->wheel_next->wheel_prev = &link->wheel_next;
+  link->wheel_prev = slot;
+  *slot = link;
+}
 
-  if (!session)
+static void
+uvsocks_wheel_unlist (UvSocksSessionLink *link)
+{
+  UvSocks *socks = link->socks;
+  UvSocksTunnel *tunnel = link->tunnel;
+
+  if (!link->wheel_prev)
     return;
 
-  local = session->socks_link;
-  socks = session->local_link;
+  *link->wheel_prev = link->wheel_next;
+  if (link->wheel_next)
+    link->wheel_next->wheel_prev = link->wheel_prev;
+  link->wheel_next = NULL;
+  link->wheel_prev = NULL;
 
-  if (socks->read_tcp &&
-      !uv_is_closing ((const uv_handle_t *)socks->read_tcp))
-    uv_close ((uv_handle_t *) socks->read_tcp,
-              uvsocks_close_handle_link);
+  if (--socks->wheel_n == 0)
+    uv_timer_stop (&socks->wheel_timer);
 
-  session->socks_link = NULL;
+  UVSOCKS_STATS_BEGIN (tunnel);
+  UVSOCKS_COUNTER_ADD (tunnel->stats.throttle_usec[link->from_proxy],
+                       (uv_hrtime () - link->throttle_time) / 1000);
+  UVSOCKS_STATS_END (tunnel);
+}
+
+/* The buckets of a capped link ran dry: it stops reading and waits on the
+   wheel until they hold enough again.  The wheel turns on one timer, and
+   only while some link waits on it. */
+static void
+uvsocks_link_throttle (UvSocksSessionLink *link)
+{
+  UvSocks *socks = link->socks;
+  UvSocksTunnel *tunnel = link->tunnel;
+  uint64_t wait;
+  uint64_t wait_tunnel;
+  uint64_t now;
 
-  if (local->read_tcp &&
-      !uv_is_closing ((const uv_handle_t *)local->read_tcp))
-    uv_close ((uv_handle_t *) local->read_tcp,
-              uvsocks_close_handle_link);
+  uv_read_stop (link->read_stream);
+  if (link->wheel_prev)
+    return;
 
-  session->local_link = NULL;
+  now = uv_hrtime ();
+  uvsocks_bucket_refill (&link->bucket, now);
+  uvsocks_bucket_refill (link->tunnel_bucket, now);
+  wait = uvsocks_bucket_wait (&link->bucket);
+  wait_tunnel = uvsocks_bucket_wait (link->tunnel_bucket);
+  if (wait < wait_tunnel)
+    wait = wait_tunnel;
 
-  uvsocks_free_session (tunnel, session);
+  if (!socks->wheel_n++)
+    {
+      socks->wheel_tick = uv_now (socks->loop) / UVSOCKS_WHEEL_TICK;
+      uv_timer_start (&socks->wheel_timer,
+                      uvsocks_wheel_timer,
+                      UVSOCKS_WHEEL_TICK,
+                      UVSOCKS_WHEEL_TICK);
+    }
+
+  link->throttle_time = now;
+  uvsocks_wheel_insert (link,
+                        (uv_now (socks->loop) + wait + UVSOCKS_WHEEL_TICK - 1) /
+                        UVSOCKS_WHEEL_TICK);
+
+  UVSOCKS_STATS_BEGIN (tunnel);
+  UVSOCKS_COUNTER_ADD (tunnel->stats.throttles[link->from_proxy], 1);
+  UVSOCKS_STATS_END (tunnel);
 }
 
+/* Reads again, unless another link of the tunnel took the tokens first or
+   a write or the kernel still holds read_buf. */
 static void
-uvsocks_remove_tunnel (UvSocks  *socks,
-                       void     *data)
+uvsocks_link_unthrottle (UvSocksSessionLink *link)
 {
-  int t;
-  int s;
-  int tunnels;
-  int sessions;
+  uvsocks_wheel_unlist (link);
 
-  tunnels = socks->n_tunnels;
-  for (t = 0; t < tunnels; t++)
+  if (!uvsocks_link_allowance (link, 1))
+    uvsocks_link_throttle (link);
+  else if (!link->write_pending && !link->zc_stopped)
+    uvsocks_link_read_start (link);
+}
+
+static void
+uvsocks_wheel_timer (uv_timer_t *handle)
+{
+  UvSocks *socks = handle->data;
+  uint64_t now;
+  uint64_t tick;
+
+  now = uv_now (socks->loop) / UVSOCKS_WHEEL_TICK;
+
+  /* a loop late by more than a turn visits each slot once */
+  tick = socks->wheel_tick;
+  if (now - tick >= UVSOCKS_WHEEL_SLOTS)
+    tick = now - UVSOCKS_WHEEL_SLOTS + 1;
+
+  for (; tick <= now && socks->wheel_n > 0; tick++)
     {
-      if (socks->tunnels[t].listen_tcp)
-        uv_close ((uv_handle_t *) socks->tunnels[t].listen_tcp,
-                  uvsocks_close_handle_listen);
+      UvSocksSessionLink *link;
+      UvSocksSessionLink *next;
 
-      sessions = socks->tunnels[t].n_sessions;
-      for (s = 0; s < sessions; s++)
-        uvsocks_remove_session (&socks->tunnels[t],
-                                socks->tunnels[t].sessions[s]);
+      /* a link put back on the slot goes in front, out of the way */
+      for (link = socks->wheel[tick % UVSOCKS_WHEEL_SLOTS]; link; link = next)
+        {
+          next = link->wheel_next;
+          if (link->wheel_due <= now)
+            uvsocks_link_unthrottle (link);
+        }
     }
+
+  socks->wheel_tick = now + 1;
 }
 
-void
-uvsocks_free (UvSocks *socks)
+/* Takes n bytes relayed by a capped link out of its buckets. */
+static void
+uvsocks_link_charge (UvSocksSessionLink *link,
+                     size_t              n)
 {
-  if (!socks)
-    return;
+  int dry = 0;
 
-  socks->close = 1;
+  if (link->bucket.rate)
+    {
+      link->bucket.tokens -= n;
+      dry |= link->bucket.tokens < 1;
+    }
 
-  if (socks->self_loop)
+  if (link->tunnel_bucket->rate)
     {
-      uvsocks_send_async (socks, uvsocks_remove_tunnel, NULL, NULL);
-      uv_thread_join (&socks->thread);
-      uv_close ((uv_handle_t *) &socks->async, NULL);
-      uvsocks_free_handle_real ((uv_handle_t *) &socks->async);
+      link->tunnel_bucket->tokens -= n;
+      dry |= link->tunnel_bucket->tokens < 1;
     }
-  else
-    uvsocks_remove_tunnel (socks, NULL);
+
+  if (dry)
+    uvsocks_link_throttle (link);
+}
+
+/* Counts n bytes relayed out of link.  The tunnel counters, shared by
+   all its sessions and read by other threads, are left alone until the
+   session goes; uvsocks_get_tunnels () adds the links still open. */
+static inline void
+uvsocks_link_count (UvSocksSessionLink *link,
+                    size_t              n)
+{
+  link->bytes += n;
+  if (link->shaped)
+    uvsocks_link_charge (link, n);
 }
 
 static void
-uvsocks_set_status (UvSocksTunnel *tunnel,
-                    UvSocksStatus  status)
+uvsocks_uring_closed (void *data)
 {
-  UvSocks *socks = tunnel->socks;
+  UvSocksSessionLink *link = data;
 
-  if (socks->callback_func)
-    socks->callback_func (socks,
-                          status,
-                          &tunnel->param,
-                          socks->callback_data);
+  link->uring = NULL;
+  uvsocks_link_free (link);
 }
 
 static void
-uvsocks_dns_resolved (uv_getaddrinfo_t  *resolver,
-                      int                status,
-                      struct addrinfo   *resolved)
+uvsocks_sched_check (uv_check_t *handle);
+
+static void
+uvsocks_local_accept (UvSocksListener *listener);
+
+static void
+uvsocks_sched_queued (UvSocks *socks)
 {
-  UvSocksSessionLink *link = resolver->data;
+  if (!socks->sched_n++)
+    uv_check_start (&socks->sched_check, uvsocks_sched_check);
+}
 
-  if (status < 0)
+static void
+uvsocks_sched_dequeued (UvSocks *socks)
+{
+  if (--socks->sched_n == 0)
     {
-      uvsocks_set_status (link->tunnel, UVSOCKS_ERROR_DNS_RESOLVED);
-      uvsocks_remove_session (link->tunnel, link->session);
+      uv_check_stop (&socks->sched_check);
+      uv_idle_stop (&socks->sched_idle);
+    }
+}
 
-      uv_freeaddrinfo (resolved);
+static void
+uvsocks_sched_unlist (UvSocksSessionLink *link)
+{
+  UvSocks *socks = link->socks;
+  int priority = link->tunnel->param.priority;
+
+  if (!link->sched_prev)
+    return;
+
+  *link->sched_prev = link->sched_next;
+  if (link->sched_next)
+    link->sched_next->sched_prev = link->sched_prev;
+  else
+    socks->sched_tail[priority] = link->sched_prev;
+  link->sched_next = NULL;
+  link->sched_prev = NULL;
+
+  uvsocks_sched_dequeued (socks);
+}
+
+/* A tunneling link used up its quantum: it stops reading until every other
+   link ready in this round of the loop had its turn.  Without a quantum,
+   the deficit only starts over. */
+static void
+uvsocks_sched_defer (UvSocksSessionLink *link)
+{
+  UvSocks *socks = link->socks;
+  int priority = link->tunnel->param.priority;
+
+  if (!socks->sched_handle)
+    {
+      link->deficit = INT_MAX;
       return;
     }
 
-  if (link->dns_resolve.func)
-    link->dns_resolve.func (link, resolved);
+  if (link->sched_prev)
+    return;
 
-  uv_freeaddrinfo (resolved);
+  uv_read_stop (link->read_stream);
+  uvsocks_sched_queued (socks);
+
+  link->sched_time = uv_hrtime ();
+  link->sched_next = NULL;
+  link->sched_prev = socks->sched_tail[priority];
+  *socks->sched_tail[priority] = link;
+  socks->sched_tail[priority] = &link->sched_next;
 }
 
 static void
-uvsocks_dns_resolve (UvSocks              *socks,
-                     const char           *host,
-                     const int             port,
-                     UvSocksDnsResolveFunc func,
-                     void                 *data)
+uvsocks_accept_unlist (UvSocksListener *listener)
 {
-  UvSocksSessionLink *link = data;
+  UvSocks *socks = listener->tunnel->socks;
+  int priority = listener->tunnel->param.priority;
 
-  struct addrinfo hints;
-  int status;
-  char s[128];
+  if (!listener->accept_prev)
+    return;
 
-  sprintf (s, "%i", port);
+  *listener->accept_prev = listener->accept_next;
+  if (listener->accept_next)
+    listener->accept_next->accept_prev = listener->accept_prev;
+  else
+    socks->accept_tail[priority] = listener->accept_prev;
+  listener->accept_next = NULL;
+  listener->accept_prev = NULL;
 
-  hints.ai_family = PF_INET;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_protocol = IPPROTO_TCP;
-  hints.ai_flags = 0;
+  uvsocks_sched_dequeued (socks);
+}
 
+/* Whether a higher priority class than that of tunnel has links waiting
+   for their turn, which is what a saturated loop looks like from here:
+   they have more to relay than rounds of the loop let them. */
+static int
+uvsocks_sched_busy (UvSocksTunnel *tunnel)
+{
+  UvSocks *socks = tunnel->socks;
+  int p;
 
-  link->dns_resolve.data = data;
-  link->dns_resolve.func = func;
-  link->dns_resolve.getaddrinfo.data = link;
+  if (!socks->sched_handle)
+    return 0;
 
-  status = uv_getaddrinfo (link->socks->loop,
-                           &link->dns_resolve.getaddrinfo,
-                           uvsocks_dns_resolved,
-                           host,
-                           s,
-                           &hints);
-  if (status)
-    {
-      uvsocks_set_status (link->tunnel, UVSOCKS_ERROR_DNS_ADDRINFO);
-      uvsocks_remove_session (link->tunnel, link->session);
-    }
+  for (p = tunnel->param.priority + 1; p < UVSOCKS_PRIORITY_MAX; p++)
+    if (socks->sched_links[p])
+      return 1;
+
+  return 0;
 }
 
+/* Leaves the connection listener has unaccepted, and the listener paused
+   meanwhile, until uvsocks_sched_check gives the class of its tunnel its
+   turn. */
 static void
-uvsocks_free_packet_after_set_stage (uv_write_t *req,
-                                     int         status)
+uvsocks_accept_defer (UvSocksListener *listener)
 {
-  UvSocksPacketReq *wr = (UvSocksPacketReq *) req;
-  UvSocksSession *session = req->data;
+  UvSocks *socks = listener->tunnel->socks;
+  int priority = listener->tunnel->param.priority;
+
+  if (listener->accept_prev)
+    return;
 
-  uvsocks_session_set_stage (session, wr->stage);
+  uvsocks_sched_queued (socks);
 
-  free (wr);
+  listener->accept_time = uv_hrtime ();
+  listener->accept_next = NULL;
+  listener->accept_prev = socks->accept_tail[priority];
+  *socks->accept_tail[priority] = listener;
+  socks->accept_tail[priority] = &listener->accept_next;
 }
 
+/* Only keeps the loop from blocking in its poll while a class waits. */
 static void
-uvsocks_connected (uv_connect_t *connect,
-                   int           status)
+uvsocks_sched_idle (uv_idle_t *handle)
 {
-  UvSocksSessionLink *link = connect->data;
-  if (status < 0)
-    {
-      uvsocks_set_status (link->tunnel, UVSOCKS_ERROR_TCP_CONNECTED);
-      uvsocks_remove_session (link->tunnel, link->session);
-      free (connect);
-      return;
-    }
-
-  uvsocks_set_status (link->tunnel, UVSOCKS_OK_TCP_CONNECTED);
+}
 
-  if (link->read_tcp == link->session->socks_link->read_tcp)
+/* Deficit round robin over the links with data to relay: after each poll
+   of the loop, the links deferred in it get another quantum, in the order
+   they ran out, and read again unless a write or the kernel still holds
+   their read_buf.  A link that never uses up its quantum in one round
+   carries what is left over to the next, so it is deferred at most once
+   for every quantum it relays.
+
+   With priorities, a round lets only sched_round deferred links read
+   again, taken from the highest class down, which keeps rounds short for
+   links that are not deferred, and a class gets what higher ones left.
+   Connections of a class are accepted while the round has room left;
+   whatever waited UVSOCKS_PRIORITY_WAIT_MAX goes regardless.  sched_idle
+   keeps the loop from blocking while anything waits. */
+static void
+uvsocks_sched_check (uv_check_t *handle)
+{
+  UvSocks *socks = handle->data;
+  uint64_t now;
+  int round;
+  int held;
+  int p;
+
+  now = uv_hrtime ();
+  round = socks->sched_round ? socks->sched_round : INT_MAX;
+  held = 0;
+  for (p = UVSOCKS_PRIORITY_MAX - 1; p >= 0; p--)
     {
-      UvSocksPacketReq *wr;
-      char buf[100];
-      size_t buf_size;
+      UvSocksSessionLink *link;
+      UvSocksListener *listener;
 
-      buf_size = 0;
-      buf[buf_size++] = 0x05;
-      buf[buf_size++] = 0x01;
-      buf[buf_size++] = UVSOCKS_AUTH_PASSWD;
+      while ((link = socks->sched_links[p]) != NULL &&
+             (round > 0 || now - link->sched_time >= UVSOCKS_PRIORITY_WAIT_MAX))
+        {
+          uvsocks_sched_unlist (link);
+          histogram_record (&socks->queue_delay[p],
+                            (now - link->sched_time) / 1000);
+          link->deficit += socks->quantum;
+          if (link->deficit > socks->quantum)
+            link->deficit = socks->quantum;
+          round--;
+
+          if (link->read_stream && !link->write_pending && !link->zc_stopped)
+            uvsocks_link_read_start (link);
+        }
 
-      wr = (UvSocksPacketReq *) malloc (sizeof *wr);
-      wr->req.data = link->session;
-      wr->buf = uv_buf_init (buf, (unsigned int) buf_size);
-      wr->stage = UVSOCKS_STAGE_HANDSHAKE;
+      while ((listener = socks->accept_listeners[p]) != NULL &&
+             (round > 0 || now - listener->accept_time >= UVSOCKS_PRIORITY_WAIT_MAX))
+        {
+          uvsocks_accept_unlist (listener);
+          histogram_record (&socks->queue_delay[p],
+                            (now - listener->accept_time) / 1000);
+          uvsocks_local_accept (listener);
+        }
 
-      uv_write ((uv_write_t *) wr,
-                (uv_stream_t *) link->read_tcp,
-                &wr->buf,
-                1,
-                uvsocks_free_packet_after_set_stage);
+      held |= socks->sched_links[p] || socks->accept_listeners[p];
     }
+
+  if (held)
+    uv_idle_start (&socks->sched_idle, uvsocks_sched_idle);
   else
-    uvsocks_session_set_stage (link->session, UVSOCKS_STAGE_TUNNEL);
+    uv_idle_stop (&socks->sched_idle);
+}
 
-  if (uv_read_start ((uv_stream_t *) link->read_tcp,
-                     uvsocks_alloc_buffer,
-                     uvsocks_read))
-    {
-      uvsocks_set_status (link->tunnel, UVSOCKS_ERROR_TCP_READ_START);
-      uvsocks_remove_session (link->tunnel, link->session);
-      free (connect);
-      return;
-    }
+/* A link outlives its session while its handle is closing, its io_uring
+   relay is being cancelled, its MSG_ZEROCOPY sends are in flight or its
+   resolver is still running; whichever callback comes last frees it. */
+static void
+uvsocks_release_link (UvSocksSessionLink *link)
+{
+  link->session = NULL;
+  uvsocks_sched_unlist (link);
+  uvsocks_wheel_unlist (link);
 
-  if (link->socks->close ||
-      uvsocks_add_session (link->tunnel, link->session))
+  if (link->uring)
+    uvsocks_uring_relay_close (link->uring, uvsocks_uring_closed);
+
+  if (link->read_stream)
     {
-      uvsocks_set_status (link->tunnel, UVSOCKS_ERROR_TCP_CREATE_SESSION);
-      uvsocks_remove_session (link->tunnel, link->session);
-      free (connect);
+      if (!uv_is_closing ((const uv_handle_t *) link->read_stream))
+        uv_close ((uv_handle_t *) link->read_stream,
+                  uvsocks_close_handle_link);
       return;
     }
 
-  free (connect);
+  if (!link->dns_pending)
+    uvsocks_alloc_free (link);
 }
 
+#ifdef UVSOCKS_ZEROCOPY
 static void
-uvsocks_connect_real (UvSocksSessionLink *link,
-                      struct addrinfo    *resolved)
+uvsocks_close_handle_zerocopy (uv_handle_t *handle)
 {
-  uv_connect_t *connect;
+  UvSocks *socks = handle->data;
 
-  connect = malloc (sizeof (*connect));
-  if (!connect)
-    {
-      uvsocks_set_status (link->tunnel, UVSOCKS_ERROR);
-      uvsocks_remove_session (link->tunnel, link->session);
-      return;
-    }
+  socks->n_handles--;
+  uvsocks_free_check (socks);
+}
 
-  link->read_tcp = malloc (sizeof (*link->read_tcp));
-  if (!link->read_tcp)
-    {
-      uvsocks_set_status (link->tunnel, UVSOCKS_ERROR);
-      uvsocks_remove_session (link->tunnel, link->session);
-      free (connect);
-      return;
-    }
+static void
+uvsocks_zerocopy_check (uv_check_t *handle);
 
-  link->read_tcp->data = link;
-  connect->data = link;
+static void
+uvsocks_zerocopy_timer (uv_timer_t *handle);
 
-  uv_tcp_init (link->socks->loop, link->read_tcp);
-  uv_tcp_connect (connect,
-                  link->read_tcp,
-                  (const struct sockaddr *)resolved->ai_addr,
-                  uvsocks_connected);
+/* Lets MSG_ZEROCOPY be turned on for links from now on. */
+static void
+uvsocks_zerocopy_init (UvSocks *socks)
+{
+  uv_check_init (socks->loop, &socks->zerocopy_check);
+  uv_timer_init (socks->loop, &socks->zerocopy_timer);
+  socks->zerocopy_check.data = socks;
+  socks->zerocopy_timer.data = socks;
+  socks->zerocopy_handles = 1;
+  socks->n_handles += 2;
 }
 
+/* Closes what uvsocks_zerocopy_init set up once the UvSocks is being freed
+   and no link waits on the kernel any more. */
 static void
-uvsocks_read_start_after_free_packet (uv_write_t *req,
-                                      int         status)
+uvsocks_zerocopy_close_check (UvSocks *socks)
 {
-  UvSocksSessionLink *link = container_of (req, UvSocksSessionLink, write_req);
+  if (!socks->close || socks->zerocopy_links || !socks->zerocopy_handles)
+    return;
 
-  link->read_buf_len = 0;
-  if (link->read_tcp)
-    uv_read_start ((uv_stream_t *) link->read_tcp,
-                   uvsocks_alloc_buffer,
-                   uvsocks_read);
+  socks->zerocopy_handles = 0;
+  uv_close ((uv_handle_t *) &socks->zerocopy_check,
+            uvsocks_close_handle_zerocopy);
+  uv_close ((uv_handle_t *) &socks->zerocopy_timer,
+            uvsocks_close_handle_zerocopy);
 }
 
+/* Notifications are picked up after every poll of the loop, and every
+   millisecond should the loop find nothing else to wake up for. */
 static void
-uvsocks_read (uv_stream_t    *stream,
-              ssize_t         nread,
-              const uv_buf_t *buf_)
+uvsocks_zerocopy_list (UvSocksSessionLink *link)
 {
-  UvSocksSessionLink *link = stream->data;
-  UvSocksSession *session = link->session;
-  UvSocksTunnel *tunnel = link->tunnel;
   UvSocks *socks = link->socks;
-  char *data;
-  size_t consume;
 
-  if (nread < 0)
+  if (link->zc_prev)
+    return;
+
+  if (!socks->zerocopy_links)
     {
-      uvsocks_set_status (tunnel, UVSOCKS_ERROR_TCP_SOCKS_READ);
-      uvsocks_remove_session (tunnel, session);
-      return;
+      uv_check_start (&socks->zerocopy_check, uvsocks_zerocopy_check);
+      uv_timer_start (&socks->zerocopy_timer, uvsocks_zerocopy_timer, 1, 1);
     }
-  if (nread == 0)
+
+  link->zc_next = socks->zerocopy_links;
+  if (link->zc_next)
+    link->zc_next->zc_prev = &link->zc_next;
+  link->zc_prev = &socks->zerocopy_links;
+  socks->zerocopy_links = link;
+}
+
+static void
+uvsocks_zerocopy_unlist (UvSocksSessionLink *link)
+{
+  UvSocks *socks = link->socks;
+
+  if (!link->zc_prev)
     return;
 
-  link->read_buf_len += nread;
-  data = link->read_buf;
-  consume = 0;
-  do
+  *link->zc_prev = link->zc_next;
+  if (link->zc_next)
+    link->zc_next->zc_prev = link->zc_prev;
+  link->zc_next = NULL;
+  link->zc_prev = NULL;
+
+  if (!socks->zerocopy_links)
     {
-      size_t pkt_len;
+      uv_check_stop (&socks->zerocopy_check);
+      uv_timer_stop (&socks->zerocopy_timer);
+    }
+}
 
-      pkt_len = 0;
-      switch (session->stage)
-        {
+/* The kernel released every send of link: read_buf is free again. */
+static void
+uvsocks_zerocopy_done (UvSocksSessionLink *link)
+{
+  UvSocks *socks = link->socks;
+
+  uvsocks_zerocopy_unlist (link);
+  link->zc_len = 0;
+
+  if (!link->session)
+    {
+      close (link->zc_fd);
+      link->zc_fd = -1;
+      uvsocks_link_free (link);
+    }
+  else if (!link->write_pending)
+    {
+      link->read_buf_len = 0;
+      if (link->zc_stopped && link->read_stream)
+        uvsocks_link_read_start (link);
+      link->zc_stopped = 0;
+    }
+  else
+    link->zc_stopped = 0;
+
+  uvsocks_zerocopy_close_check (socks);
+}
+
+/* Reads the notifications of released sends off the error queue of the
+   socket link sends to.  Where the kernel had to copy after all, as it
+   does for loopback, link goes back to plain sends. */
+static void
+uvsocks_link_zerocopy_drain (UvSocksSessionLink *link)
+{
+  char control[CMSG_SPACE (sizeof (struct sock_extended_err) +
+                           sizeof (struct sockaddr_in6))];
+
+  while (link->zc_pending > 0)
+    {
+      struct msghdr msg;
+      struct cmsghdr *cmsg;
+
+      memset (&msg, 0, sizeof (msg));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof (control);
+      if (recvmsg (link->zc_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        break;
+
+      for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+        {
+          struct sock_extended_err *err;
+          uint32_t n;
+
+          if (cmsg->cmsg_len < CMSG_LEN (sizeof (*err)))
+            continue;
+
+          err = (struct sock_extended_err *) CMSG_DATA (cmsg);
+          if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+            continue;
+
+          /* sends ee_info to ee_data, counted from the first */
+          n = err->ee_data - err->ee_info + 1;
+          link->zc_pending -= n < link->zc_pending ? n : link->zc_pending;
+          if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            link->zerocopy = 0;
+        }
+    }
+
+  if (!link->zc_pending)
+    uvsocks_zerocopy_done (link);
+}
+
+static void
+uvsocks_zerocopy_drain (UvSocks *socks)
+{
+  UvSocksSessionLink *link;
+  UvSocksSessionLink *next;
+
+  for (link = socks->zerocopy_links; link; link = next)
+    {
+      next = link->zc_next;
+      uvsocks_link_zerocopy_drain (link);
+    }
+}
+
+static void
+uvsocks_zerocopy_check (uv_check_t *handle)
+{
+  uvsocks_zerocopy_drain (handle->data);
+}
+
+/* Also resets the connections of sessions gone for longer than
+   UVSOCKS_ZEROCOPY_LINGER, whose peer stopped taking data: that drops
+   the sends and with them the last hold on read_buf. */
+static void
+uvsocks_zerocopy_timer (uv_timer_t *handle)
+{
+  UvSocks *socks = handle->data;
+  UvSocksSessionLink *link;
+  UvSocksSessionLink *next;
+  uint64_t now;
+
+  uvsocks_zerocopy_drain (socks);
+
+  now = uv_now (socks->loop);
+  for (link = socks->zerocopy_links; link; link = next)
+    {
+      struct linger linger = { 1, 0 };
+
+      next = link->zc_next;
+      if (link->session || now < link->zc_deadline)
+        continue;
+
+      setsockopt (link->zc_fd, SOL_SOCKET, SO_LINGER,
+                  &linger, sizeof (linger));
+      link->zc_pending = 0;
+      uvsocks_zerocopy_done (link);
+    }
+}
+
+/* Turns on MSG_ZEROCOPY for the socket a tunneling link relays to. */
+static void
+uvsocks_link_zerocopy_start (UvSocksSessionLink *link)
+{
+  uv_os_fd_t fd;
+  int one = 1;
+
+  if (!link->socks->zerocopy_handles ||
+      link->zc_fd >= 0 ||
+      link->relay_to->type != UV_TCP ||
+      uv_fileno ((uv_handle_t *) link->relay_to, &fd) ||
+      setsockopt (fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof (one)))
+    return;
+
+  link->zc_fd = fd;
+  link->zerocopy = 1;
+}
+
+/* The session of link is going while the kernel still sends out of its
+   read_buf: keeps the socket open, with the data queued on it, until the
+   sends are released. */
+static void
+uvsocks_link_zerocopy_hold (UvSocksSessionLink *link)
+{
+  int fd;
+
+  if (!link->zc_pending)
+    return;
+
+  fd = dup (link->zc_fd);
+  if (fd < 0)
+    {
+      /* what is left to send may go out of reused memory */
+      uvsocks_zerocopy_unlist (link);
+      link->zc_pending = 0;
+      uvsocks_zerocopy_close_check (link->socks);
+      return;
+    }
+
+  link->zc_fd = fd;
+  link->zc_deadline = uv_now (link->socks->loop) + UVSOCKS_ZEROCOPY_LINGER;
+}
+#else
+static void
+uvsocks_zerocopy_init (UvSocks *socks)
+{
+}
+
+static void
+uvsocks_zerocopy_close_check (UvSocks *socks)
+{
+}
+
+static void
+uvsocks_link_zerocopy_start (UvSocksSessionLink *link)
+{
+}
+
+static void
+uvsocks_link_zerocopy_hold (UvSocksSessionLink *link)
+{
+}
+#endif
+
+static void
+uvsocks_free_packet (uv_write_t *req,
+                     int         status)
+{
+  uvsocks_alloc_free (req);
+}
+
+/* Replies to a frontend client.  The reply almost always fits in the socket
+   buffer, so only a short write costs a request, plus a copy of the rest
+   when the bytes do not outlive this call. */
+static void
+uvsocks_frontend_reply (UvSocksSession *session,
+                        const char     *reply,
+                        size_t          reply_len,
+                        int             copy)
+{
+  UvSocksPacketReq *wr;
+  uv_stream_t *stream;
+  uv_buf_t buf;
+  int ret;
+
+  stream = session->local_link->read_stream;
+  if (!stream || uv_is_closing ((const uv_handle_t *) stream))
+    return;
+
+  buf = uv_buf_init ((char *) reply, (unsigned int) reply_len);
+  ret = uv_try_write (stream, &buf, 1);
+  UVSOCKS_PROBE4 (try_write, session->serial, 1, reply_len, ret);
+  if (ret == (int) reply_len)
+    return;
+  if (ret < 0)
+    {
+      if (ret != UV_ENOSYS && ret != UV_EAGAIN)
+        return;
+      ret = 0;
+    }
+  UVSOCKS_PROBE3 (write_queued, session->serial, 1, reply_len - ret);
+
+  wr = (UvSocksPacketReq *) uvsocks_alloc_malloc (&session->socks->alloc,
+                                                  sizeof *wr +
+                                                  (copy ? reply_len - ret : 0));
+  if (!wr)
+    return;
+
+  if (copy)
+    {
+      memcpy (&wr[1], &reply[ret], reply_len - ret);
+      reply = (const char *) &wr[1];
+      reply_len -= ret;
+      ret = 0;
+    }
+
+  wr->bufs[0] = uv_buf_init ((char *) &reply[ret], (unsigned int) (reply_len - ret));
+  uv_write ((uv_write_t *) wr,
+            stream,
+            wr->bufs,
+            1,
+            uvsocks_free_packet);
+}
+
+/* Answers a frontend client whose CONNECT failed upstream with code rep. */
+static void
+uvsocks_frontend_fail (UvSocksSession *session,
+                       int             rep)
+{
+  char reply[sizeof (uvsocks_frontend_failure_reply)];
+
+  session->request = NULL;
+
+  if (session->tunnel->param.frontend == UVSOCKS_FRONTEND_HTTP)
+    {
+      uvsocks_frontend_reply (session,
+                              uvsocks_http_bad_gateway_reply,
+                              sizeof (uvsocks_http_bad_gateway_reply) - 1,
+                              0);
+      return;
+    }
+
+  memcpy (reply,
+          uvsocks_frontend_failure_reply,
+          sizeof (uvsocks_frontend_failure_reply));
+  reply[1] = (char) rep;
+  uvsocks_frontend_reply (session, reply, sizeof (reply), 1);
+}
+
+/* Answers a frontend client whose CONNECT succeeded with the upstream
+   reply. */
+static void
+uvsocks_frontend_succeed (UvSocksSession *session,
+                          const char     *reply,
+                          size_t          reply_len)
+{
+  if (session->tunnel->param.frontend == UVSOCKS_FRONTEND_HTTP)
+    uvsocks_frontend_reply (session,
+                            uvsocks_http_established_reply,
+                            sizeof (uvsocks_http_established_reply) - 1,
+                            0);
+  else
+    uvsocks_frontend_reply (session, reply, reply_len, 1);
+}
+
+static void
+uvsocks_remove_session (UvSocksTunnel  *tunnel,
+                        UvSocksSession *session)
+{
+  UvSocksSessionLink *local;
+  UvSocksSessionLink *socks;
+
+  if (!session)
+    return;
+
+  /* a frontend client still waiting for its CONNECT reply */
+  if (session->request)
+    uvsocks_frontend_fail (session, 0x01);
+
+  local = session->socks_link;
+  socks = session->local_link;
+
+  UVSOCKS_STATS_BEGIN (tunnel);
+  UVSOCKS_COUNTER_ADD (tunnel->stats.bytes_in, local->bytes);
+  UVSOCKS_COUNTER_ADD (tunnel->stats.bytes_out, socks->bytes);
+  UVSOCKS_STATS_END (tunnel);
+
+  uvsocks_link_zerocopy_hold (local);
+  uvsocks_link_zerocopy_hold (socks);
+
+  uvsocks_release_link (socks);
+  session->socks_link = NULL;
+
+  uvsocks_release_link (local);
+  session->local_link = NULL;
+
+  uvsocks_free_session (tunnel, session);
+}
+
+static void
+uvsocks_events_summarize (UvSocks *socks);
+
+static void
+uvsocks_close_handle_events (uv_handle_t *handle)
+{
+  UvSocks *socks = handle->data;
+
+  socks->n_handles--;
+  uvsocks_free_check (socks);
+}
+
+static void
+uvsocks_close_admin (void *data)
+{
+  UvSocks *socks = data;
+
+  socks->n_handles--;
+  uvsocks_free_check (socks);
+}
+
+static void
+uvsocks_close_uring (void *data)
+{
+  UvSocks *socks = data;
+
+  socks->n_handles--;
+  uvsocks_free_check (socks);
+}
+
+/* Stops listener listening, dropping a connection it held back. */
+static void
+uvsocks_close_listener (UvSocksListener *listener)
+{
+  UvSocks *socks = listener->tunnel->socks;
+
+  uvsocks_accept_unlist (listener);
+  if (listener->memory_wait)
+    {
+      listener->memory_wait = 0;
+      socks->memory_waiting--;
+    }
+
+  if (listener->open && !uv_is_closing ((uv_handle_t *) &listener->stream))
+    uv_close ((uv_handle_t *) &listener->stream, uvsocks_close_handle_listen);
+}
+
+static void
+uvsocks_remove_tunnel (UvSocks  *socks,
+                       void     *data)
+{
+  int t;
+  int s;
+  int tunnels;
+
+  if (socks->admin)
+    {
+      uvsocks_admin_free (socks->admin, uvsocks_close_admin, socks);
+      socks->admin = NULL;
+    }
+
+  /* report what was held back; from now on statuses go out at once */
+  uvsocks_events_summarize (socks);
+  socks->options.coalesce_msec = 0;
+  uv_close ((uv_handle_t *) &socks->events_timer, uvsocks_close_handle_events);
+  uv_close ((uv_handle_t *) &socks->events_check, uvsocks_close_handle_events);
+  uv_close ((uv_handle_t *) &socks->events_idle, uvsocks_close_handle_events);
+  uv_close ((uv_handle_t *) &socks->start_idle, uvsocks_close_handle_events);
+  uv_close ((uv_handle_t *) &socks->memory_timer, uvsocks_close_handle_events);
+  if (socks->sched_handle)
+    {
+      uv_close ((uv_handle_t *) &socks->sched_check,
+                uvsocks_close_handle_events);
+      uv_close ((uv_handle_t *) &socks->sched_idle,
+                uvsocks_close_handle_events);
+    }
+
+  tunnels = socks->n_tunnels;
+  for (t = 0; t < tunnels; t++)
+    {
+      UvSocksTunnel *tunnel = &socks->tunnels[t];
+      int p;
+
+      for (p = 0; tunnel->listeners && p < uvsocks_tunnel_ports (tunnel); p++)
+        uvsocks_close_listener (&tunnel->listeners[p]);
+
+      for (s = 0; s < tunnel->max_sessions; s++)
+        uvsocks_remove_session (tunnel, tunnel->sessions[s]);
+    }
+
+  /* closed once the relays of the sessions just removed are */
+  if (socks->uring)
+    {
+      uvsocks_uring_free (socks->uring, uvsocks_close_uring, socks);
+      socks->uring = NULL;
+    }
+
+  /* likewise once the kernel released their MSG_ZEROCOPY sends */
+  uvsocks_zerocopy_close_check (socks);
+
+  if (socks->wheel_handle)
+    uv_close ((uv_handle_t *) &socks->wheel_timer, uvsocks_close_handle_events);
+  if (socks->drain_handle)
+    uv_close ((uv_handle_t *) &socks->drain_timer, uvsocks_close_handle_events);
+  if (socks->admit_handle)
+    uv_close ((uv_handle_t *) &socks->admit_timer, uvsocks_close_handle_events);
+
+  /* nothing may be left to close */
+  uvsocks_free_check (socks);
+}
+
+void
+uvsocks_free (UvSocks *socks)
+{
+  if (!socks)
+    return;
+
+  socks->close = 1;
+
+  if (socks->self_loop)
+    {
+      uvsocks_send_async (socks, uvsocks_remove_tunnel, NULL, NULL);
+      uv_thread_join (&socks->thread);
+      uv_close ((uv_handle_t *) &socks->async, NULL);
+      uvsocks_free_handle_real ((uv_handle_t *) &socks->async);
+    }
+  else
+    uvsocks_remove_tunnel (socks, NULL);
+}
+
+/* Hands the batch being filled to the callback thread, or drops it when
+   the thread is too far behind. */
+static void
+uvsocks_events_push (UvSocks *socks)
+{
+  UvSocksEventBatch *batch = socks->events_batch;
+  int i;
+
+  if (!batch)
+    return;
+
+  socks->events_batch = NULL;
+
+  /* only the loop thread pushes, so the queue cannot fill up meanwhile */
+  if (aqueue_get_length (socks->events) < UVSOCKS_EVENT_QUEUE_MAX &&
+      aqueue_push (socks->events, batch) == 0)
+    return;
+
+  for (i = 0; i < batch->n_events; i++)
+    {
+      UvSocksTunnel *tunnel = batch->events[i].tunnel;
+
+      UVSOCKS_STATS_BEGIN (tunnel);
+      UVSOCKS_COUNTER_ADD (tunnel->stats.events_dropped, 1);
+      UVSOCKS_STATS_END (tunnel);
+    }
+  uvsocks_alloc_free (batch);
+}
+
+/* Statuses queued during a loop iteration go out together at its end. */
+static void
+uvsocks_events_check (uv_check_t *handle)
+{
+  UvSocks *socks = handle->data;
+
+  uvsocks_events_push (socks);
+  uv_check_stop (handle);
+  uv_idle_stop (&socks->events_idle);
+}
+
+/* Only keeps the loop from waiting in poll before the check runs, for the
+   statuses of timers and close callbacks, which come before it. */
+static void
+uvsocks_events_idle (uv_idle_t *handle)
+{
+}
+
+/* Copies the params of tunnel as reported with status, count times: the
+   ports moved to those offset ports past them in a range, the last hop
+   reported, and a reverse tunnel bound on the last proxy. */
+static void
+uvsocks_param_report (UvSocksTunnel *tunnel,
+                      UvSocksStatus  status,
+                      int            count,
+                      int            offset,
+                      UvSocksParam  *param)
+{
+  UvSocks *socks = tunnel->socks;
+
+  memcpy (param, &tunnel->param, sizeof (UvSocksParam));
+  param->count = count;
+  param->hop = tunnel->hop;
+  param->hop_latency = tunnel->hop_latency;
+  param->listen_port += offset;
+  if (param->range_destination)
+    param->destination_port += offset;
+  if (status == UVSOCKS_OK_SOCKS_BIND)
+    strlcpy (param->listen_host,
+             socks->hops[socks->n_hops - 1].host,
+             sizeof (param->listen_host));
+}
+
+static void
+uvsocks_deliver_status (UvSocksTunnel *tunnel,
+                        UvSocksStatus  status,
+                        int            count,
+                        int            offset)
+{
+  UvSocks *socks = tunnel->socks;
+  UvSocksEventBatch *batch;
+  UvSocksEvent *event;
+
+  if (!socks->options.threaded)
+    {
+      UvSocksParam param;
+
+      uvsocks_param_report (tunnel, status, count, offset, &param);
+      socks->callback_func (socks, status, &param, socks->callback_data);
+      return;
+    }
+
+  batch = socks->events_batch;
+  if (!batch)
+    {
+      batch = uvsocks_alloc_malloc (&socks->alloc, sizeof (UvSocksEventBatch));
+      if (!batch)
+        {
+          UVSOCKS_STATS_BEGIN (tunnel);
+          UVSOCKS_COUNTER_ADD (tunnel->stats.events_dropped, 1);
+          UVSOCKS_STATS_END (tunnel);
+          return;
+        }
+
+      batch->n_events = 0;
+      socks->events_batch = batch;
+
+      /* once closing, the last batch is pushed on free */
+      if (!socks->close)
+        {
+          uv_check_start (&socks->events_check, uvsocks_events_check);
+          uv_idle_start (&socks->events_idle, uvsocks_events_idle);
+        }
+    }
+
+  event = &batch->events[batch->n_events++];
+  event->tunnel = tunnel;
+  event->status = status;
+  uvsocks_param_report (tunnel, status, count, offset, &event->param);
+
+  if (batch->n_events == UVSOCKS_EVENT_BATCH_MAX)
+    uvsocks_events_push (socks);
+}
+
+static void
+uvsocks_events_summarize (UvSocks *socks)
+{
+  int t;
+  int i;
+
+  for (t = 0; t < socks->n_tunnels; t++)
+    {
+      UvSocksTunnel *tunnel = &socks->tunnels[t];
+
+      if (!tunnel->events_seen)
+        continue;
+
+      tunnel->events_seen = 0;
+      for (i = 0; i < 64; i++)
+        if (tunnel->events_repeated[i] > 0)
+          {
+            int count = (int) tunnel->events_repeated[i];
+
+            tunnel->events_repeated[i] = 0;
+            uvsocks_deliver_status (tunnel,
+                                    tunnel->events_status[i],
+                                    count,
+                                    tunnel->events_offset[i]);
+          }
+    }
+}
+
+static void
+uvsocks_events_timer (uv_timer_t *handle)
+{
+  uvsocks_events_summarize (handle->data);
+}
+
+static int
+uvsocks_event_index (UvSocksStatus status)
+{
+  if (status >= UVSOCKS_ERROR_SOCKS_COMMAND)
+    return 59;
+  if (status >= UVSOCKS_ERROR)
+    return 32 + (status & 0x3f);
+  return status;
+}
+
+static void
+uvsocks_set_status_real (UvSocksTunnel  *tunnel,
+                         UvSocksSession *session,
+                         UvSocksStatus   status,
+                         int             error,
+                         int             offset)
+{
+  UvSocks *socks = tunnel->socks;
+  uint64_t bit;
+  int index;
+
+  if (socks->trace)
+    trace_record (socks->trace,
+                  uv_hrtime (),
+                  session ? session->serial : 0,
+                  status,
+                  session ? session->stage : UVSOCKS_STAGE_NONE,
+                  (int) (tunnel - socks->tunnels),
+                  session ? uvsocks_session_bytes (session) : 0,
+                  error);
+
+  /* a session failing short of its tunnel counts once, in the stage it
+     failed in; those closed on purpose report no error */
+  if (status >= UVSOCKS_ERROR)
+    {
+      UVSOCKS_STATS_BEGIN (tunnel);
+      UVSOCKS_COUNTER_ADD (tunnel->stats.errors, 1);
+      if (session && !session->failed &&
+          session->stage != UVSOCKS_STAGE_TUNNEL)
+        {
+          UVSOCKS_COUNTER_ADD (tunnel->stats.failures[session->stage], 1);
+          session->failed = 1;
+        }
+      UVSOCKS_STATS_END (tunnel);
+    }
+
+  if (!socks->callback_func)
+    return;
+
+  index = uvsocks_event_index (status);
+  bit = (uint64_t) 1 << index;
+  if (!(socks->options.event_mask & bit))
+    return;
+
+  /* the first time in an interval goes out, repeats wait for the timer */
+  if (socks->options.coalesce_msec > 0)
+    {
+      if (tunnel->events_seen & bit)
+        {
+          tunnel->events_repeated[index]++;
+          tunnel->events_status[index] = status;
+          tunnel->events_offset[index] = offset;
+          return;
+        }
+      tunnel->events_seen |= bit;
+    }
+
+  uvsocks_deliver_status (tunnel, status, 1, offset);
+}
+
+static void
+uvsocks_set_status (UvSocksTunnel *tunnel,
+                    UvSocksStatus  status)
+{
+  uvsocks_set_status_real (tunnel, NULL, status, 0, 0);
+}
+
+/* Reports a status of the port listener listens on. */
+static void
+uvsocks_listener_set_status (UvSocksListener *listener,
+                             UvSocksStatus    status)
+{
+  uvsocks_set_status_real (listener->tunnel, NULL, status, 0, listener->offset);
+}
+
+/* Reports a status of session, with the libuv error that caused it. */
+static void
+uvsocks_session_set_status (UvSocksSession *session,
+                            UvSocksStatus   status,
+                            int             error)
+{
+  uvsocks_set_status_real (session->tunnel,
+                           session,
+                           status,
+                           error,
+                           session->port_offset);
+}
+
+static void
+uvsocks_dns_resolved (uv_getaddrinfo_t  *resolver,
+                      int                status,
+                      struct addrinfo   *resolved)
+{
+  UvSocksSessionLink *link = resolver->data;
+
+  link->dns_pending = 0;
+  if (!link->session)
+    {
+      UVSOCKS_PROBE2 (dns_end, 0, status);
+      uvsocks_release_link (link);
+      uv_freeaddrinfo (resolved);
+      return;
+    }
+
+  UVSOCKS_PROBE2 (dns_end, link->session->serial, status);
+
+  if (status < 0)
+    {
+      uvsocks_session_set_status (link->session,
+                                  UVSOCKS_ERROR_DNS_RESOLVED,
+                                  status);
+      uvsocks_remove_session (link->tunnel, link->session);
+
+      uv_freeaddrinfo (resolved);
+      return;
+    }
+
+  if (link == link->session->socks_link)
+    uvsocks_record_latency (link->session, 0, UVSOCKS_LATENCY_DNS,
+                            link->time, uv_hrtime ());
+
+  if (link->dns_resolve.func)
+    link->dns_resolve.func (link, resolved);
+
+  uv_freeaddrinfo (resolved);
+}
+
+static void
+uvsocks_dns_resolve (UvSocks              *socks,
+                     const char           *host,
+                     const int             port,
+                     UvSocksDnsResolveFunc func,
+                     void                 *data)
+{
+  UvSocksSessionLink *link = data;
+
+  struct addrinfo hints;
+  int status;
+  char s[128];
+
+  sprintf (s, "%i", port);
+
+  hints.ai_family = PF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  hints.ai_flags = 0;
+
+
+  link->dns_resolve.data = data;
+  link->dns_resolve.func = func;
+  link->dns_resolve.getaddrinfo.data = link;
+  link->time = uv_hrtime ();
+
+  UVSOCKS_PROBE3 (dns_start, link->session->serial, host, port);
+
+  status = uv_getaddrinfo (link->socks->loop,
+                           &link->dns_resolve.getaddrinfo,
+                           uvsocks_dns_resolved,
+                           host,
+                           s,
+                           &hints);
+  if (status)
+    {
+      uvsocks_session_set_status (link->session,
+                                  UVSOCKS_ERROR_DNS_ADDRINFO,
+                                  status);
+      uvsocks_remove_session (link->tunnel, link->session);
+      return;
+    }
+
+  link->dns_pending = 1;
+}
+
+static void
+uvsocks_free_packet_after_set_stage (uv_write_t *req,
+                                     int         status)
+{
+  UvSocksPacketReq *wr = (UvSocksPacketReq *) req;
+  UvSocksSessionLink *link = req->data;
+
+  if (link->session)
+    uvsocks_session_set_stage (link->session, wr->stage);
+
+  uvsocks_alloc_free (wr);
+}
+
+/* Packs the packet hop sends to move into stage into the size bytes at
+   buf, returning its length or -1 when it does not fit.  A frontend
+   request is not copied: it is returned in extra for the caller to write
+   as is. */
+static int
+uvsocks_pack_stage (UvSocksSession *session,
+                    int             hop,
+                    UvSocksStage    stage,
+                    char           *buf,
+                    size_t          size,
+                    uv_buf_t       *extra)
+{
+  UvSocks *socks = session->socks;
+  UvSocksTunnel *tunnel = session->tunnel;
+
+  switch (stage)
+    {
+    case UVSOCKS_STAGE_HANDSHAKE:
+      return socks5_client_greeting (buf, size, UVSOCKS_AUTH_PASSWD);
+    case UVSOCKS_STAGE_AUTHENTICATE:
+      return socks5_client_auth (buf,
+                                 size,
+                                 socks->hops[hop].user,
+                                 socks->hops[hop].password);
+    case UVSOCKS_STAGE_ESTABLISH:
+      if (hop < socks->n_hops - 1)
+        return socks5_client_request (buf,
+                                      size,
+                                      UVSOCKS_CMD_CONNECT,
+                                      socks->hops[hop + 1].host,
+                                      socks->hops[hop + 1].port);
+
+      if (session->request)
+        {
+          *extra = uv_buf_init (session->request,
+                                (unsigned int) session->request_len);
+          return 0;
+        }
+
+      if (tunnel->param.is_forward)
+        return socks5_client_request (buf,
+                                      size,
+                                      UVSOCKS_CMD_CONNECT,
+                                      tunnel->param.destination_host,
+                                      tunnel->param.destination_port +
+                                      (tunnel->param.range_destination ?
+                                       session->port_offset : 0));
+      return socks5_client_request (buf,
+                                    size,
+                                    UVSOCKS_CMD_BIND,
+                                    tunnel->param.listen_host,
+                                    tunnel->param.listen_port);
+    default:
+      break;
+    }
+
+  return 0;
+}
+
+/* Sends the packet moving the current hop into stage, which the session
+   enters once it is written.  Pipelined sessions instead send the whole
+   chain right after connecting and walk the stages as replies arrive. */
+static int
+uvsocks_send_stage (UvSocksSession *session,
+                    UvSocksStage    stage)
+{
+  static const UvSocksStage hop_stages[] =
+    {
+      UVSOCKS_STAGE_HANDSHAKE,
+      UVSOCKS_STAGE_AUTHENTICATE,
+      UVSOCKS_STAGE_ESTABLISH,
+    };
+  UvSocks *socks = session->socks;
+  UvSocksPacketReq *wr;
+  uv_buf_t extra;
+  char *buf;
+  size_t buf_size;
+  size_t size;
+  int length;
+  int hop;
+  int i;
+
+  /* a greeting opens a hop, so its replies decode from the start */
+  if (stage == UVSOCKS_STAGE_HANDSHAKE)
+    socks5_client_init (&session->codec, UVSOCKS_AUTH_PASSWD);
+
+  if (socks->pipelined &&
+      (stage != UVSOCKS_STAGE_HANDSHAKE || session->hop > 0))
+    {
+      uvsocks_session_set_stage (session, stage);
+      return 0;
+    }
+
+  size = socks->n_hops * UVSOCKS_HOP_PACKET_MAX;
+  wr = (UvSocksPacketReq *) uvsocks_alloc_malloc (&socks->alloc,
+                                                  sizeof *wr + size);
+  if (!wr)
+    return UV_ENOMEM;
+
+  buf = (char *) &wr[1];
+  buf_size = 0;
+  extra = uv_buf_init (NULL, 0);
+  if (socks->pipelined)
+    {
+      for (hop = session->hop; hop < socks->n_hops; hop++)
+        for (i = 0; i < (int) (sizeof (hop_stages) / sizeof (hop_stages[0])); i++)
+          {
+            length = uvsocks_pack_stage (session, hop, hop_stages[i],
+                                         &buf[buf_size], size - buf_size,
+                                         &extra);
+            if (length < 0)
+              {
+                uvsocks_alloc_free (wr);
+                return UV_EINVAL;
+              }
+            buf_size += length;
+          }
+      uvsocks_session_set_stage (session, stage);
+    }
+  else
+    {
+      length = uvsocks_pack_stage (session, session->hop, stage,
+                                   buf, size, &extra);
+      if (length < 0)
+        {
+          uvsocks_alloc_free (wr);
+          return UV_EINVAL;
+        }
+      buf_size = length;
+    }
+
+  wr->req.data = session->socks_link;
+  wr->n_bufs = 0;
+  if (buf_size > 0)
+    wr->bufs[wr->n_bufs++] = uv_buf_init (buf, (unsigned int) buf_size);
+  if (extra.len > 0)
+    wr->bufs[wr->n_bufs++] = extra;
+  wr->stage = stage;
+
+  return uv_write ((uv_write_t *) wr,
+                   session->socks_link->read_stream,
+                   wr->bufs,
+                   wr->n_bufs,
+                   socks->pipelined ? uvsocks_free_packet :
+                                      uvsocks_free_packet_after_set_stage);
+}
+
+/* Reports how long the current hop took from greeting to CONNECT reply. */
+static void
+uvsocks_hop_done (UvSocksSession *session)
+{
+  UvSocksTunnel *tunnel = session->tunnel;
+  uint64_t now;
+
+  now = uv_hrtime ();
+  if (session->socks->n_hops > 1)
+    {
+      tunnel->hop = session->hop;
+      tunnel->hop_latency = (int) ((now - session->hop_time) / 1000);
+      uvsocks_session_set_status (session, UVSOCKS_OK_SOCKS_HOP, 0);
+    }
+  session->hop_time = now;
+}
+
+static int
+uvsocks_socks_read_start (UvSocksSession *session);
+
+static void
+uvsocks_connected (uv_connect_t *connect,
+                   int           status)
+{
+  UvSocksSessionLink *link = connect->data;
+
+  if (!link->session)
+    {
+      UVSOCKS_PROBE2 (connect_end, 0, status);
+      uvsocks_alloc_free (connect);
+      return;
+    }
+
+  UVSOCKS_PROBE2 (connect_end, link->session->serial, status);
+
+  if (status < 0)
+    {
+      uvsocks_session_set_status (link->session,
+                                  UVSOCKS_ERROR_TCP_CONNECTED,
+                                  status);
+      uvsocks_remove_session (link->tunnel, link->session);
+      uvsocks_alloc_free (connect);
+      return;
+    }
+
+  uvsocks_session_set_status (link->session, UVSOCKS_OK_TCP_CONNECTED, 0);
+
+  if (link->read_stream == link->session->socks_link->read_stream)
+    {
+      uvsocks_record_latency (link->session, 0, UVSOCKS_LATENCY_CONNECT,
+                              link->time, uv_hrtime ());
+      link->session->hop = 0;
+      link->session->hop_time = uv_hrtime ();
+      if (uvsocks_send_stage (link->session, UVSOCKS_STAGE_HANDSHAKE))
+        {
+          uvsocks_session_set_status (link->session, UVSOCKS_ERROR, 0);
+          uvsocks_remove_session (link->tunnel, link->session);
+          uvsocks_alloc_free (connect);
+          return;
+        }
+    }
+  else
+    {
+      uvsocks_session_set_stage (link->session, UVSOCKS_STAGE_TUNNEL);
+      if (uvsocks_socks_read_start (link->session))
+        {
+          uvsocks_session_set_status (link->session,
+                                      UVSOCKS_ERROR_TCP_READ_START,
+                                      0);
+          uvsocks_remove_session (link->tunnel, link->session);
+          uvsocks_alloc_free (connect);
+          return;
+        }
+    }
+
+  if (uvsocks_link_read_start (link))
+    {
+      uvsocks_session_set_status (link->session,
+                                  UVSOCKS_ERROR_TCP_READ_START,
+                                  0);
+      uvsocks_remove_session (link->tunnel, link->session);
+      uvsocks_alloc_free (connect);
+      return;
+    }
+
+  if (link->socks->close ||
+      (link->session->id < 0 &&
+       uvsocks_add_session (link->tunnel, link->session)))
+    {
+      uvsocks_session_set_status (link->session,
+                                  UVSOCKS_ERROR_TCP_CREATE_SESSION,
+                                  0);
+      uvsocks_remove_session (link->tunnel, link->session);
+      uvsocks_alloc_free (connect);
+      return;
+    }
+
+  uvsocks_alloc_free (connect);
+}
+
+static void
+uvsocks_connect_real (UvSocksSessionLink *link,
+                      struct addrinfo    *resolved)
+{
+  uv_connect_t *connect;
+
+  connect = uvsocks_alloc_malloc (&link->socks->alloc, sizeof (*connect));
+  if (!connect)
+    {
+      uvsocks_session_set_status (link->session, UVSOCKS_ERROR, 0);
+      uvsocks_remove_session (link->tunnel, link->session);
+      return;
+    }
+
+  link->read_stream = uvsocks_alloc_malloc (&link->socks->alloc,
+                                            sizeof (UvSocksStream));
+  if (!link->read_stream)
+    {
+      uvsocks_session_set_status (link->session, UVSOCKS_ERROR, 0);
+      uvsocks_remove_session (link->tunnel, link->session);
+      uvsocks_alloc_free (connect);
+      return;
+    }
+
+  link->read_stream->data = link;
+  connect->data = link;
+
+  uv_tcp_init (link->socks->loop, (uv_tcp_t *) link->read_stream);
+  link->socks->n_links++;
+  link->time = uv_hrtime ();
+  UVSOCKS_PROBE2 (connect_start, link->session->serial, link->session->hop);
+  uv_tcp_connect (connect,
+                  (uv_tcp_t *) link->read_stream,
+                  (const struct sockaddr *)resolved->ai_addr,
+                  uvsocks_connected);
+}
+
+/* Connects the local link of a reverse tunnel to a Unix domain socket. */
+static void
+uvsocks_connect_pipe (UvSocksSessionLink *link,
+                      const char         *path)
+{
+  uv_connect_t *connect;
+
+  connect = uvsocks_alloc_malloc (&link->socks->alloc, sizeof (*connect));
+  if (!connect)
+    {
+      uvsocks_session_set_status (link->session, UVSOCKS_ERROR, 0);
+      uvsocks_remove_session (link->tunnel, link->session);
+      return;
+    }
+
+  link->read_stream = uvsocks_alloc_malloc (&link->socks->alloc,
+                                            sizeof (UvSocksStream));
+  if (!link->read_stream)
+    {
+      uvsocks_session_set_status (link->session, UVSOCKS_ERROR, 0);
+      uvsocks_remove_session (link->tunnel, link->session);
+      uvsocks_alloc_free (connect);
+      return;
+    }
+
+  link->read_stream->data = link;
+  connect->data = link;
+
+  uv_pipe_init (link->socks->loop, (uv_pipe_t *) link->read_stream, 0);
+  link->socks->n_links++;
+  UVSOCKS_PROBE2 (connect_start, link->session->serial, link->session->hop);
+  uv_pipe_connect (connect,
+                   (uv_pipe_t *) link->read_stream,
+                   path,
+                   uvsocks_connected);
+}
+
+static void
+uvsocks_read_start_after_free_packet (uv_write_t *req,
+                                      int         status)
+{
+  UvSocksSessionLink *link = container_of (req, UvSocksSessionLink, write_req);
+
+  if (status == UV_ECANCELED)
+    return;
+
+  /* whatever MSG_ZEROCOPY sends still pin stays put */
+  link->write_pending = 0;
+  link->read_buf_len = link->zc_len;
+  if (link->read_stream && !link->zc_stopped)
+    uvsocks_link_read_start (link);
+}
+
+/* The relay gave up on a link: the read failed, or so did the write to its
+   peer. */
+static void
+uvsocks_relay_fail (UvSocksSessionLink *link,
+                    int                 error)
+{
+  UvSocksSession *session = link->session;
+
+  uvsocks_session_set_status (session, UVSOCKS_ERROR_TCP_SOCKS_READ, error);
+  uvsocks_remove_session (link->tunnel, session);
+}
+
+/* The peer took only written bytes of what was read into base: queue the
+   rest and stop reading until it is out, as read_buf is reused. */
+static void
+uvsocks_relay_queue (UvSocksSessionLink *link,
+                     char               *base,
+                     size_t              len,
+                     int                 written)
+{
+  uv_buf_t buf;
+  int r;
+
+  if (written < 0)
+    {
+      if (written != UV_ENOSYS && written != UV_EAGAIN)
+        {
+          uvsocks_relay_fail (link, written);
+          return;
+        }
+      written = 0;
+    }
+
+  UVSOCKS_PROBE3 (write_queued, link->serial, link->from_proxy, len - written);
+  uvsocks_link_count (link, len);
+  uv_read_stop (link->read_stream);
+  link->write_pending = 1;
+  buf = uv_buf_init (&base[written], (unsigned int) (len - written));
+  r = uv_write (&link->write_req,
+                link->relay_to,
+                &buf,
+                1,
+                uvsocks_read_start_after_free_packet);
+  if (r)
+    uvsocks_relay_fail (link, r);
+}
+
+#ifdef UVSOCKS_ZEROCOPY
+/* Sends a read of at least zerocopy_min bytes with MSG_ZEROCOPY, straight
+   out of read_buf, which is not read into again below zc_len until the
+   kernel releases it.  Returns -1 when the kernel is out of memory to
+   track the send, for the read to be copied instead. */
+static int
+uvsocks_relay_zerocopy (UvSocksSessionLink *link,
+                        char               *base,
+                        size_t              len)
+{
+  ssize_t sent;
+
+  sent = send (link->zc_fd,
+               base,
+               len,
+               MSG_ZEROCOPY | MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (sent < 0)
+    {
+      if (errno == ENOBUFS)
+        return -1;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        uvsocks_relay_queue (link, base, len, UV_EAGAIN);
+      else
+        uvsocks_relay_fail (link, uv_translate_sys_error (errno));
+      return 0;
+    }
+
+  link->zc_pending++;
+  link->zc_len = (size_t) (base - link->read_buf) + len;
+  link->read_buf_len = link->zc_len;
+  if (UVSOCKS_BUF_MAX - link->zc_len < UVSOCKS_ZEROCOPY_ROOM)
+    link->zc_stopped = 1;
+  uvsocks_zerocopy_list (link);
+
+  if ((size_t) sent < len)
+    {
+      uvsocks_relay_queue (link, base, len, (int) sent);
+      return 0;
+    }
+
+  uvsocks_link_count (link, len);
+  if (link->zc_stopped)
+    uv_read_stop (link->read_stream);
+  return 0;
+}
+#else
+static int
+uvsocks_relay_zerocopy (UvSocksSessionLink *link,
+                        char               *base,
+                        size_t              len)
+{
+  return -1;
+}
+#endif
+
+/* Reads of a session in UVSOCKS_STAGE_TUNNEL.  Nothing is left to parse,
+   so this only passes each read on to the peer, touching the link alone
+   unless the peer falls behind. */
+static void
+uvsocks_relay_read (uv_stream_t    *stream,
+                    ssize_t         nread,
+                    const uv_buf_t *buf)
+{
+  UvSocksSessionLink *link = stream->data;
+  uv_buf_t out;
+  int ret;
+
+  UVSOCKS_PROBE3 (read, link->serial, link->from_proxy, nread);
+
+  if (nread <= 0)
+    {
+      /* uvsocks_alloc_buffer had no tokens to read for */
+      if (nread == UV_ENOBUFS && link->shaped)
+        uvsocks_link_throttle (link);
+      else if (nread < 0)
+        uvsocks_relay_fail (link, (int) nread);
+      return;
+    }
+
+  link->deficit -= (int) nread;
+  if (link->deficit <= 0)
+    uvsocks_sched_defer (link);
+
+  if (link->zerocopy &&
+      (size_t) nread >= link->socks->zerocopy_min &&
+      uvsocks_relay_zerocopy (link, buf->base, (size_t) nread) == 0)
+    return;
+
+  out = uv_buf_init (buf->base, (unsigned int) nread);
+  ret = uv_try_write (link->relay_to, &out, 1);
+  UVSOCKS_PROBE4 (try_write, link->serial, link->from_proxy, nread, ret);
+  if (ret == nread)
+    {
+      uvsocks_link_count (link, (size_t) nread);
+      return;
+    }
+
+  uvsocks_relay_queue (link, buf->base, (size_t) nread, ret);
+}
+
+#ifdef UVSOCKS_IO_URING
+static void
+uvsocks_uring_relayed (UvSocksUringRelay *relay,
+                       ssize_t            n,
+                       void              *data)
+{
+  UvSocksSessionLink *link = data;
+
+  if (n > 0)
+    uvsocks_link_count (link, (size_t) n);
+  else
+    uvsocks_relay_fail (link, (int) n);
+}
+
+/* Moves the relaying of link onto io_uring when the UvSocks has one.  A
+   write libuv still has queued to the peer would be overtaken, so such a
+   link stays with libuv. */
+static int
+uvsocks_link_uring_start (UvSocksSessionLink *link)
+{
+  uv_os_fd_t from_fd;
+  uv_os_fd_t to_fd;
+
+  if (!link->socks->uring ||
+      uv_stream_get_write_queue_size (link->relay_to) > 0 ||
+      uv_fileno ((uv_handle_t *) link->read_stream, &from_fd) ||
+      uv_fileno ((uv_handle_t *) link->relay_to, &to_fd))
+    return -1;
+
+  link->uring = uvsocks_uring_relay_new (link->socks->uring,
+                                         (int) from_fd,
+                                         (int) to_fd,
+                                         link->read_buf,
+                                         sizeof (link->read_buf),
+                                         uvsocks_uring_relayed,
+                                         link);
+  return link->uring ? 0 : -1;
+}
+#else
+static int
+uvsocks_link_uring_start (UvSocksSessionLink *link)
+{
+  return -1;
+}
+#endif
+
+/* Starts reading link, straight into the relay once its session is
+   tunneling. */
+static int
+uvsocks_link_read_start (UvSocksSessionLink *link)
+{
+  if (link->session && link->session->stage == UVSOCKS_STAGE_TUNNEL)
+    {
+      /* uvsocks_sched_check, or the wheel, starts it on its turn */
+      if (link->sched_prev || link->wheel_prev)
+        return 0;
+
+      /* io_uring reads whatever comes, so capped links stay with libuv */
+      link->relay_to = link->write_link->read_stream;
+      link->shaped = link->bucket.rate || link->tunnel_bucket->rate;
+      if (!link->shaped && uvsocks_link_uring_start (link) == 0)
+        return 0;
+
+      uvsocks_link_zerocopy_start (link);
+
+      return uv_read_start (link->read_stream,
+                            uvsocks_alloc_buffer,
+                            uvsocks_relay_read);
+    }
+
+  return uv_read_start (link->read_stream,
+                        uvsocks_alloc_buffer,
+                        uvsocks_read);
+}
+
+/* Writes the len bytes at base in read_buf of link to its peer, with
+   reading held off until they are out, as read_buf is read into again. */
+static int
+uvsocks_link_write_rest (UvSocksSessionLink *link,
+                         char               *base,
+                         size_t              len)
+{
+  uv_buf_t buf;
+  int r;
+
+  buf = uv_buf_init (base, (unsigned int) len);
+  uvsocks_link_count (link, len);
+  link->write_pending = 1;
+  r = uv_write (&link->write_req,
+                link->write_link->read_stream,
+                &buf,
+                1,
+                uvsocks_read_start_after_free_packet);
+  if (r)
+    link->write_pending = 0;
+
+  return r;
+}
+
+/* Starts relaying from the local link, first pushing upstream whatever the
+   client sent after its frontend request straight from read_buf. */
+static int
+uvsocks_local_read_start (UvSocksSession *session)
+{
+  UvSocksSessionLink *local = session->local_link;
+  size_t consumed;
+
+  consumed = session->request_consumed;
+  session->request = NULL;
+  session->request_len = 0;
+  session->request_consumed = 0;
+
+  if (local->read_buf_len > consumed)
+    return uvsocks_link_write_rest (local,
+                                    &local->read_buf[consumed],
+                                    local->read_buf_len - consumed);
+
+  local->read_buf_len = 0;
+  return uvsocks_link_read_start (local);
+}
+
+/* Resumes the proxy link of a reverse tunnel once its local end is up,
+   first passing on what arrived behind the final BIND reply. */
+static int
+uvsocks_socks_read_start (UvSocksSession *session)
+{
+  UvSocksSessionLink *link = session->socks_link;
+
+  if (link->read_buf_len > 0)
+    return uvsocks_link_write_rest (link, link->read_buf, link->read_buf_len);
+
+  return uvsocks_link_read_start (link);
+}
+
+static void
+uvsocks_admit_unlist (UvSocksSession *session)
+{
+  UvSocks *socks = session->socks;
+
+  if (!session->admit_prev)
+    return;
+
+  *session->admit_prev = session->admit_next;
+  if (session->admit_next)
+    session->admit_next->admit_prev = session->admit_prev;
+  else
+    socks->admit_tail = session->admit_prev;
+  session->admit_next = NULL;
+  session->admit_prev = NULL;
+
+  UVSOCKS_COUNTER_ADD (socks->waiting, -1);
+}
+
+/* Connects session to the first proxy. */
+static void
+uvsocks_dial (UvSocksSession *session)
+{
+  UvSocks *socks = session->socks;
+
+  session->dialing = 1;
+  UVSOCKS_COUNTER_ADD (socks->dials, 1);
+  uvsocks_dns_resolve (socks,
+                       socks->hops[0].host,
+                       socks->hops[0].port,
+                       uvsocks_connect_real,
+                       session->socks_link);
+}
+
+/* Closes session, which got no turn to dial. */
+static void
+uvsocks_admit_shed (UvSocksSession *session)
+{
+  UvSocks *socks = session->socks;
+
+  uvsocks_admit_unlist (session);
+  UVSOCKS_COUNTER_ADD (socks->shed, 1);
+  uvsocks_session_set_status (session, UVSOCKS_ERROR_TCP_OVERLOAD, 0);
+  uvsocks_remove_session (session->tunnel, session);
+}
+
+static void
+uvsocks_admit_timer (uv_timer_t *handle);
+
+/* Wakes up when the session waiting longest runs out of time. */
+static void
+uvsocks_admit_schedule (UvSocks *socks)
+{
+  uint64_t wait;
+  uint64_t waited;
+
+  if (!socks->admit_sessions ||
+      socks->max_wait_msec <= 0 ||
+      uv_is_active ((uv_handle_t *) &socks->admit_timer))
+    return;
+
+  wait = (uint64_t) socks->max_wait_msec * 1000000;
+  waited = uv_hrtime () - socks->admit_sessions->admit_time;
+  uv_timer_start (&socks->admit_timer,
+                  uvsocks_admit_timer,
+                  waited < wait ? (wait - waited + 999999) / 1000000 : 0,
+                  0);
+}
+
+static void
+uvsocks_admit_timer (uv_timer_t *handle)
+{
+  UvSocks *socks = handle->data;
+  uint64_t wait;
+  uint64_t now;
+
+  wait = (uint64_t) socks->max_wait_msec * 1000000;
+  now = uv_hrtime ();
+  while (socks->admit_sessions &&
+         now - socks->admit_sessions->admit_time >= wait)
+    uvsocks_admit_shed (socks->admit_sessions);
+
+  uvsocks_admit_schedule (socks);
+}
+
+/* Dials the first proxy for session, or lets it wait for its turn behind
+   those waiting already, or closes it when too many are. */
+static void
+uvsocks_admit (UvSocksSession *session)
+{
+  UvSocks *socks = session->socks;
+
+  if (socks->max_dials <= 0 ||
+      (socks->dials < (uint64_t) socks->max_dials && !socks->admit_sessions))
+    {
+      uvsocks_dial (session);
+      return;
+    }
+
+  /* at once, rather than after a wait it would not get through */
+  if (socks->max_waiting > 0 && socks->waiting >= (uint64_t) socks->max_waiting)
+    {
+      UVSOCKS_COUNTER_ADD (socks->shed, 1);
+      uvsocks_session_set_status (session, UVSOCKS_ERROR_TCP_OVERLOAD, 0);
+      uvsocks_remove_session (session->tunnel, session);
+      return;
+    }
+
+  session->admit_time = uv_hrtime ();
+  session->admit_next = NULL;
+  session->admit_prev = socks->admit_tail;
+  *socks->admit_tail = session;
+  socks->admit_tail = &session->admit_next;
+  UVSOCKS_COUNTER_ADD (socks->waiting, 1);
+
+  uvsocks_admit_schedule (socks);
+}
+
+/* The session is set up or gone: the next one waiting dials. */
+static void
+uvsocks_admit_done (UvSocksSession *session)
+{
+  UvSocks *socks = session->socks;
+  uint64_t now;
+
+  uvsocks_admit_unlist (session);
+  if (!session->dialing)
+    return;
+
+  session->dialing = 0;
+  UVSOCKS_COUNTER_ADD (socks->dials, -1);
+
+  now = uv_hrtime ();
+  while (!socks->close &&
+         socks->admit_sessions &&
+         socks->dials < (uint64_t) socks->max_dials)
+    {
+      UvSocksSession *next = socks->admit_sessions;
+
+      uvsocks_admit_unlist (next);
+      histogram_record (&socks->admit_wait, (now - next->admit_time) / 1000);
+      uvsocks_dial (next);
+    }
+}
+
+static void
+uvsocks_read (uv_stream_t    *stream,
+              ssize_t         nread,
+              const uv_buf_t *buf_)
+{
+  UvSocksSessionLink *link = stream->data;
+  UvSocksSession *session = link->session;
+  UvSocksTunnel *tunnel = link->tunnel;
+  UvSocks *socks = link->socks;
+  char *data;
+  size_t consume;
+  int resolve;
+  int held;
+
+  UVSOCKS_PROBE3 (read,
+                  session->serial,
+                  link == session->socks_link,
+                  nread);
+
+  if (nread < 0)
+    {
+      uvsocks_session_set_status (session,
+                                  UVSOCKS_ERROR_TCP_SOCKS_READ,
+                                  (int) nread);
+      uvsocks_remove_session (tunnel, session);
+      return;
+    }
+  if (nread == 0)
+    return;
+
+  link->read_buf_len += nread;
+  data = link->read_buf;
+  consume = 0;
+  resolve = 0;
+  held = 0;
+  do
+    {
+      size_t pkt_len;
+
+      pkt_len = 0;
+      switch (session->stage)
+        {
         case UVSOCKS_STAGE_NONE:
+        case UVSOCKS_STAGE_MAX:
+          break;
+        case UVSOCKS_STAGE_FRONTEND_GREETING:
+          {
+            int length;
+
+            length = socks5_server_parse_greeting (data, link->read_buf_len);
+            if (length == 0)
+              break;
+
+            if (length < 0 ||
+                !memchr (&data[2], UVSOCKS_AUTH_NONE, length - 2))
+              {
+                uvsocks_frontend_reply (session,
+                                        uvsocks_frontend_no_method_reply,
+                                        sizeof (uvsocks_frontend_no_method_reply),
+                                        0);
+                uvsocks_session_set_status (session,
+                                            UVSOCKS_ERROR_FRONTEND_HANDSHAKE,
+                                            0);
+                uvsocks_remove_session (tunnel, session);
+                return;
+              }
+            pkt_len = length;
+
+            uvsocks_frontend_reply (session,
+                                    uvsocks_frontend_greeting_reply,
+                                    sizeof (uvsocks_frontend_greeting_reply),
+                                    0);
+            uvsocks_session_set_stage (session, UVSOCKS_STAGE_FRONTEND_REQUEST);
+          }
+          break;
+        case UVSOCKS_STAGE_FRONTEND_REQUEST:
+          {
+            int length;
+
+            length = socks5_server_parse_request (data, link->read_buf_len);
+            if (length == 0)
+              break;
+
+            if (length < 0)
+              {
+                uvsocks_session_set_status (session,
+                                            UVSOCKS_ERROR_FRONTEND_REQUEST,
+                                            0);
+                uvsocks_remove_session (tunnel, session);
+                return;
+              }
+
+            if (data[1] != UVSOCKS_CMD_CONNECT)
+              {
+                uvsocks_frontend_reply (session,
+                                        uvsocks_frontend_command_reply,
+                                        sizeof (uvsocks_frontend_command_reply),
+                                        0);
+                uvsocks_session_set_status (session,
+                                            UVSOCKS_ERROR_FRONTEND_REQUEST,
+                                            0);
+                uvsocks_remove_session (tunnel, session);
+                return;
+              }
+
+            /* The client's request is already a valid upstream CONNECT: it
+               is left at the head of read_buf and written from there, and
+               the link stops reading until the tunnel is up. */
+            uv_read_stop (link->read_stream);
+            session->request = link->read_buf;
+            session->request_len = length;
+            session->request_consumed = length;
+            uvsocks_session_set_stage (session, UVSOCKS_STAGE_NONE);
+            resolve = 1;
+          }
+          break;
+        case UVSOCKS_STAGE_FRONTEND_HTTP:
+          {
+            int length;
+            int request_len;
+
+            length = http_parse_head (data,
+                                      link->read_buf_len,
+                                      &session->request_scan);
+            if (length == 0)
+              break;
+
+            request_len = length < 0 ? -1 :
+                          http_connect_to_socks5 (data,
+                                                  length,
+                                                  session->request_buf);
+            if (request_len < 0)
+              {
+                if (request_len == -2)
+                  uvsocks_frontend_reply (session,
+                                          uvsocks_http_method_reply,
+                                          sizeof (uvsocks_http_method_reply) - 1,
+                                          0);
+                else
+                  uvsocks_frontend_reply (session,
+                                          uvsocks_http_bad_request_reply,
+                                          sizeof (uvsocks_http_bad_request_reply) - 1,
+                                          0);
+                uvsocks_session_set_status (session,
+                                            UVSOCKS_ERROR_FRONTEND_REQUEST,
+                                            0);
+                uvsocks_remove_session (tunnel, session);
+                return;
+              }
+
+            /* The head stays in read_buf and is skipped, not copied, when
+               the tunnel starts; anything after it goes upstream as is. */
+            uv_read_stop (link->read_stream);
+            session->request = session->request_buf;
+            session->request_len = request_len;
+            session->request_consumed = length;
+            uvsocks_session_set_stage (session, UVSOCKS_STAGE_NONE);
+            resolve = 1;
+          }
           break;
         case UVSOCKS_STAGE_HANDSHAKE:
+        case UVSOCKS_STAGE_AUTHENTICATE:
+        case UVSOCKS_STAGE_ESTABLISH:
+        case UVSOCKS_STAGE_BIND:
           {
-            if (link->read_buf_len < 2)
+            Socks5Client *codec = &session->codec;
+            Socks5ClientEvent event;
+
+            event = socks5_client_decode (codec,
+                                          data,
+                                          link->read_buf_len,
+                                          &pkt_len);
+            if (event == SOCKS5_CLIENT_NEED_MORE)
               break;
 
-            if (data[0] != 0x05 ||
-                data[1] != UVSOCKS_AUTH_PASSWD)
-              {
-                uvsocks_set_status (tunnel, UVSOCKS_ERROR_SOCKS_HANDSHAKE);
-                uvsocks_remove_session (tunnel, session);
-                return;
-              }
-            pkt_len = 2;
+            if (event == SOCKS5_CLIENT_ERROR)
+              {
+                UvSocksStatus status;
+
+                switch (codec->error)
+                  {
+                  case SOCKS5_CLIENT_ERROR_AUTH:
+                    status = UVSOCKS_ERROR_SOCKS_AUTHENTICATION;
+                    break;
+                  case SOCKS5_CLIENT_ERROR_REPLY:
+                    if (session->request)
+                      uvsocks_frontend_fail (session, codec->code);
+                    status = UVSOCKS_ERROR_SOCKS_COMMAND +
+                             ((codec->version << 8) | codec->code);
+                    break;
+                  default:
+                    status = UVSOCKS_ERROR_SOCKS_HANDSHAKE;
+                    break;
+                  }
+
+                uvsocks_session_set_status (session, status, 0);
+                uvsocks_remove_session (tunnel, session);
+                return;
+              }
+
+            if (event == SOCKS5_CLIENT_METHOD_DONE ||
+                event == SOCKS5_CLIENT_AUTH_DONE)
+              {
+                if (uvsocks_send_stage (session,
+                                        event == SOCKS5_CLIENT_METHOD_DONE ?
+                                        UVSOCKS_STAGE_AUTHENTICATE :
+                                        UVSOCKS_STAGE_ESTABLISH))
+                  {
+                    uvsocks_session_set_status (session, UVSOCKS_ERROR, 0);
+                    uvsocks_remove_session (tunnel, session);
+                    return;
+                  }
+                break;
+              }
+
+            if (session->stage == UVSOCKS_STAGE_ESTABLISH)
+              uvsocks_hop_done (session);
+
+            /* this hop now relays to the next one, which gets its own
+               greeting over the same stream */
+            if (session->stage == UVSOCKS_STAGE_ESTABLISH &&
+                session->hop < socks->n_hops - 1)
+              {
+                session->hop++;
+                if (uvsocks_send_stage (session, UVSOCKS_STAGE_HANDSHAKE))
+                  {
+                    uvsocks_session_set_status (session, UVSOCKS_ERROR, 0);
+                    uvsocks_remove_session (tunnel, session);
+                    return;
+                  }
+                break;
+              }
+
+            if (session->stage == UVSOCKS_STAGE_ESTABLISH &&
+                tunnel->param.is_forward == 0)
+              {
+                tunnel->param.listen_port = codec->port;
+
+                uvsocks_session_set_status (session, UVSOCKS_OK_SOCKS_BIND, 0);
+                uvsocks_start_done (session);
+
+                uvsocks_session_set_stage (session, UVSOCKS_STAGE_BIND);
+                break;
+              }
+
+            /* Whatever the peer sends right behind the second reply must
+               wait for the local connection, not be parsed as a reply;
+               the connection starts once read_buf is settled. */
+            if (session->stage == UVSOCKS_STAGE_BIND &&
+                tunnel->param.is_forward == 0)
+              {
+                uv_read_stop (link->read_stream);
+                held = 1;
+                break;
+              }
+
+            uvsocks_session_set_status (session, UVSOCKS_OK_SOCKS_CONNECT, 0);
+
+            if (session->request)
+              uvsocks_frontend_succeed (session,
+                                        (const char *) codec->packet,
+                                        codec->len);
+
+            uvsocks_session_set_stage (session, UVSOCKS_STAGE_TUNNEL);
+            if (uvsocks_local_read_start (session))
+              {
+                uvsocks_session_set_status (session,
+                                            UVSOCKS_ERROR_TCP_READ_START,
+                                            0);
+                uvsocks_remove_session (tunnel, session);
+                return;
+              }
+          }
+          break;
+        case UVSOCKS_STAGE_TUNNEL:
+          {
+            int ret;
+            uv_buf_t buf;
+
+            buf = uv_buf_init (data, (uint32_t) link->read_buf_len);
+            ret = uv_try_write (link->write_link->read_stream, &buf, 1);
+            UVSOCKS_PROBE4 (try_write,
+                            session->serial,
+                            link == session->socks_link,
+                            buf.len,
+                            ret);
+            if (ret < 0)
+              {
+                if (ret == UV_ENOSYS || ret == UV_EAGAIN)
+                  {
+                    UVSOCKS_PROBE3 (write_queued,
+                                    session->serial,
+                                    link == session->socks_link,
+                                    buf.len);
+                    uv_read_stop (link->read_stream);
+                    ret = uvsocks_link_write_rest (link, data, buf.len);
+                    if (ret)
+                      {
+                        uvsocks_session_set_status (session,
+                                                    UVSOCKS_ERROR_TCP_SOCKS_READ,
+                                                    ret);
+                        uvsocks_remove_session (tunnel, session);
+                      }
+                    return;
+                  }
+
+                uvsocks_session_set_status (session,
+                                            UVSOCKS_ERROR_TCP_SOCKS_READ,
+                                            ret);
+                uvsocks_remove_session (tunnel, session);
+                return;
+              }
+            uvsocks_link_count (link, ret);
+            pkt_len = ret;
+          }
+          break;
+        }
+
+      if (pkt_len == 0)
+        break;
+
+      consume += pkt_len;
+      data += pkt_len;
+      link->read_buf_len -= pkt_len;
+    } while (link->read_buf_len > 0 && !held);
+
+  if (consume && link->read_buf_len)
+    memmove (link->read_buf, data, link->read_buf_len);
+
+  /* either call may fail at once and free the session */
+  if (held)
+    {
+      if (tunnel->param.destination_port == UVSOCKS_PORT_STREAMLOCAL)
+        uvsocks_connect_pipe (session->local_link,
+                              tunnel->param.destination_host);
+      else
+        uvsocks_dns_resolve (socks,
+                             tunnel->param.destination_host,
+                             tunnel->param.destination_port,
+                             uvsocks_connect_real,
+                             session->local_link);
+      return;
+    }
+
+  /* the handshake is over: hand this link's reads to the relay */
+  if (session->stage == UVSOCKS_STAGE_TUNNEL)
+    {
+      uv_read_stop (link->read_stream);
+      uvsocks_link_read_start (link);
+    }
+
+  if (resolve)
+    uvsocks_admit (session);
+}
+
+static void
+uvsocks_memory_timer (uv_timer_t *handle);
+
+/* Leaves the connection listener has waiting where libuv holds it, which
+   stops accepting on the listener, until the timer finds memory for its
+   session.  The status goes out once for each time it waits. */
+static void
+uvsocks_memory_wait (UvSocksListener *listener)
+{
+  UvSocks *socks = listener->tunnel->socks;
+
+  if (!listener->memory_wait)
+    {
+      listener->memory_wait = 1;
+      socks->memory_waiting++;
+      uvsocks_listener_set_status (listener, UVSOCKS_ERROR_TCP_CREATE_SESSION);
+    }
+
+  if (!uv_is_active ((uv_handle_t *) &socks->memory_timer))
+    uv_timer_start (&socks->memory_timer,
+                    uvsocks_memory_timer,
+                    UVSOCKS_MEMORY_RETRY_MSEC,
+                    0);
+}
+
+/* Accepts the connection listener has waiting. */
+static void
+uvsocks_local_accept (UvSocksListener *listener)
+{
+  UvSocksTunnel *tunnel = listener->tunnel;
+  UvSocks *socks = tunnel->socks;
+  uv_stream_t *stream = &listener->stream.stream;
+  UvSocksSession *session;
+  UvSocksSessionLink *local;
+  UvSocksSessionLink *link;
+  int r;
+
+  session = uvsocks_create_session (tunnel);
+  if (session)
+    {
+      session->local_link->read_stream =
+        uvsocks_alloc_malloc (&socks->alloc, sizeof (UvSocksStream));
+      if (!session->local_link->read_stream)
+        {
+          uvsocks_alloc_free (session->local_link);
+          uvsocks_alloc_free (session->socks_link);
+          uvsocks_free_session (tunnel, session);
+          session = NULL;
+        }
+    }
+  if (!session)
+    {
+      uvsocks_memory_wait (listener);
+      return;
+    }
+  if (listener->memory_wait)
+    {
+      listener->memory_wait = 0;
+      socks->memory_waiting--;
+    }
+  session->port_offset = listener->offset;
+
+  session->local_link->read_stream->data = session->local_link;
+
+  if (tunnel->param.listen_port == UVSOCKS_PORT_STREAMLOCAL)
+    uv_pipe_init (socks->loop, (uv_pipe_t *) session->local_link->read_stream, 0);
+  else
+    uv_tcp_init (socks->loop, (uv_tcp_t *) session->local_link->read_stream);
+  r = uv_accept (stream, session->local_link->read_stream);
+  if (r)
+    {
+      uvsocks_session_set_status (session, UVSOCKS_ERROR_TCP_ACCEPT, r);
+
+      /* neither link was counted or started yet */
+      local = session->local_link;
+      link = session->socks_link;
+      uv_close ((uv_handle_t *) local->read_stream, uvsocks_close_handle);
+      uvsocks_free_session (tunnel, session);
+      uvsocks_alloc_free (local);
+      uvsocks_alloc_free (link);
+      return;
+    }
+
+  socks->n_links++;
+  UVSOCKS_STATS_BEGIN (tunnel);
+  UVSOCKS_COUNTER_ADD (tunnel->stats.accepts, 1);
+  UVSOCKS_STATS_END (tunnel);
+
+  if (tunnel->param.session_limit > 0 &&
+      tunnel->n_sessions >= tunnel->param.session_limit)
+    {
+      uvsocks_session_set_status (session, UVSOCKS_ERROR_TCP_SESSION_LIMIT, 0);
+      uvsocks_remove_session (tunnel, session);
+      return;
+    }
+
+  uvsocks_session_set_status (session, UVSOCKS_OK_TCP_NEW_CONNECT, 0);
+
+  if (uvsocks_add_session (tunnel, session))
+    {
+      uvsocks_session_set_status (session, UVSOCKS_ERROR_TCP_CREATE_SESSION, 0);
+      uvsocks_remove_session (tunnel, session);
+      return;
+    }
+
+  if (tunnel->param.frontend != UVSOCKS_FRONTEND_NONE)
+    {
+      uvsocks_session_set_stage (session,
+                                 tunnel->param.frontend == UVSOCKS_FRONTEND_HTTP ?
+                                 UVSOCKS_STAGE_FRONTEND_HTTP :
+                                 UVSOCKS_STAGE_FRONTEND_GREETING);
+      if (uvsocks_link_read_start (session->local_link))
+        {
+          uvsocks_session_set_status (session, UVSOCKS_ERROR_TCP_READ_START, 0);
+          uvsocks_remove_session (tunnel, session);
+        }
+      return;
+    }
+
+  uvsocks_admit (session);
+}
+
+static void
+uvsocks_local_new_connection (uv_stream_t *stream,
+                              int          status)
+{
+  UvSocksListener *listener = stream->data;
+
+  if (status == -1)
+    {
+      uvsocks_listener_set_status (listener, UVSOCKS_ERROR_TCP_NEW_CONNECT);
+      return;
+    }
+
+  /* a lower class takes no new sessions while higher ones are busy */
+  if (uvsocks_sched_busy (listener->tunnel))
+    uvsocks_accept_defer (listener);
+  else
+    uvsocks_local_accept (listener);
+}
+
+/* Retries the listeners holding a connection for want of memory. */
+static void
+uvsocks_memory_timer (uv_timer_t *handle)
+{
+  UvSocks *socks = handle->data;
+  int t;
+  int p;
+
+  for (t = 0; t < socks->n_tunnels && socks->memory_waiting > 0; t++)
+    {
+      UvSocksTunnel *tunnel = &socks->tunnels[t];
+
+      for (p = 0; tunnel->listeners && p < uvsocks_tunnel_ports (tunnel); p++)
+        if (tunnel->listeners[p].memory_wait)
+          uvsocks_local_accept (&tunnel->listeners[p]);
+    }
+}
+
+static int
+uvsocks_listen_fd_compare (const void *a,
+                           const void *b)
+{
+  const UvSocksListenFd *x = a;
+  const UvSocksListenFd *y = b;
+
+  if (x->port != y->port)
+    return x->port < y->port ? -1 : 1;
+  if (x->addr != y->addr)
+    return x->addr < y->addr ? -1 : 1;
+  return 0;
+}
+
+/* The socket given to listen on that is bound to addr, if not taken. */
+static UvSocksListenFd *
+uvsocks_listen_fd (UvSocks                  *socks,
+                   const struct sockaddr_in *addr)
+{
+  UvSocksListenFd key;
+  UvSocksListenFd *found;
+
+  if (socks->n_listen_fds == 0 || addr->sin_port == 0)
+    return NULL;
+
+  key.port = addr->sin_port;
+  key.addr = addr->sin_addr.s_addr;
+  found = bsearch (&key,
+                   socks->listen_fds,
+                   socks->n_listen_fds,
+                   sizeof (UvSocksListenFd),
+                   uvsocks_listen_fd_compare);
+  if (!found || found->fd < 0)
+    return NULL;
+
+  return found;
+}
+
+/* Listens on the port of listener, on the socket given for it if any. */
+static void
+uvsocks_start_local_server (UvSocks         *socks,
+                            UvSocksListener *listener)
+{
+  UvSocksTunnel *tunnel = listener->tunnel;
+  UvSocksListenFd *listen_fd;
+  UvSocksStatus status;
+  struct sockaddr_in addr;
+  int r;
+
+  listener->stream.stream.data = listener;
+  listener->open = 1;
+  socks->n_listeners++;
+
+  if (tunnel->param.listen_port == UVSOCKS_PORT_STREAMLOCAL)
+    {
+      uv_pipe_init (socks->loop, &listener->stream.pipe, 0);
+      uvsocks_unlink_stale_socket (tunnel->param.listen_host);
+      r = uv_pipe_bind (&listener->stream.pipe, tunnel->param.listen_host);
+      if (r < 0)
+        {
+          status = UVSOCKS_ERROR_TCP_BIND;
+          goto fail;
+        }
+    }
+  else
+    {
+      uv_ip4_addr (tunnel->param.listen_host,
+                   tunnel->param.listen_port + listener->offset,
+                   &addr);
+      uv_tcp_init (socks->loop, &listener->stream.tcp);
+      listen_fd = uvsocks_listen_fd (socks, &addr);
+      if (listen_fd)
+        {
+          r = uv_tcp_open (&listener->stream.tcp, listen_fd->fd);
+          if (r == 0)
+            listen_fd->fd = -1;
+        }
+      else
+        r = uv_tcp_bind (&listener->stream.tcp,
+                         (const struct sockaddr *) &addr,
+                         0);
+      if (r < 0)
+        {
+          status = UVSOCKS_ERROR_TCP_BIND;
+          goto fail;
+        }
+
+      /* the port picked for port 0 */
+      if (tunnel->param.listen_port == 0)
+        {
+          struct sockaddr_in name;
+          int namelen;
+
+          namelen = sizeof (name);
+          uv_tcp_getsockname (&listener->stream.tcp,
+                              (struct sockaddr *) &name,
+                              &namelen);
+          tunnel->param.listen_port = ntohs (name.sin_port);
+        }
+    }
+
+  r = uv_listen (&listener->stream.stream, 16, uvsocks_local_new_connection);
+  if (r < 0)
+    {
+      status = UVSOCKS_ERROR_TCP_LISTEN;
+      goto fail;
+    }
+
+  uvsocks_listener_set_status (listener, UVSOCKS_OK_TCP_LOCAL_SERVER);
+
+  return;
+
+fail:
+
+  uvsocks_listener_set_status (listener, status);
+  uv_close ((uv_handle_t *) &listener->stream, uvsocks_close_handle_listen);
+}
 
+/* Brings up the tunnels from start_next on: up to a batch of listeners,
+   the ports of a range counting one each, and reverse tunnels while fewer
+   than UVSOCKS_START_MAX wait for their BIND.  The idle handle resumes
+   once this round is through, and uvsocks_start_done () once a reverse
+   tunnel leaves room. */
+static void
+uvsocks_start_tunnels (UvSocks *socks)
+{
+  int listeners;
+
+  listeners = 0;
+  while (socks->start_next < socks->n_tunnels &&
+         !socks->close &&
+         !socks->handover)
+    {
+      UvSocksTunnel *tunnel = &socks->tunnels[socks->start_next];
+      int resumed = socks->start_next < socks->start_resume;
+      UvSocksSession *session;
+
+      if (tunnel->param.is_forward)
+        {
+          int n_ports = uvsocks_tunnel_ports (tunnel);
+          if (!tunnel->listeners)
             {
-              UvSocksPacketReq *wr;
-              char buf[100];
-              size_t buf_size;
-              size_t length;
-
-              buf_size = 0;
-              buf[buf_size++] = 0x01;
-              length = strlen (socks->user);
-              buf[buf_size++] = (char) length;
-              memcpy (&buf[buf_size], socks->user, length);
-              buf_size += length;
-
-              length = strlen (socks->password);
-              buf[buf_size++] = (char) length;
-              memcpy (&buf[buf_size], socks->password, length);
-              buf_size += length;
-
-              wr = (UvSocksPacketReq *) malloc (sizeof *wr);
-              wr->req.data = session;
-              wr->buf = uv_buf_init (buf, (unsigned int) buf_size);
-              wr->stage = UVSOCKS_STAGE_AUTHENTICATE;
-
-              uv_write ((uv_write_t *) wr,
-                        (uv_stream_t *) session->socks_link->read_tcp,
-                        &wr->buf,
-                        1,
-                        uvsocks_free_packet_after_set_stage);
+              int p;
+
+              tunnel->listeners = uvsocks_alloc_calloc (&socks->alloc,
+                                                        n_ports,
+                                                        sizeof (UvSocksListener));
+              if (!tunnel->listeners)
+                {
+                  uvsocks_set_status (tunnel, UVSOCKS_ERROR_TCP_LOCAL_SERVER);
+                  socks->start_next++;
+                  continue;
+                }
+              for (p = 0; p < n_ports; p++)
+                {
+                  tunnel->listeners[p].tunnel = tunnel;
+                  tunnel->listeners[p].offset = p;
+                }
             }
-          }
-          break;
-        case UVSOCKS_STAGE_AUTHENTICATE:
-          {
-            if (link->read_buf_len < 2)
-              break;
 
-            if (data[0] != 0x01 ||
-                data[1] != UVSOCKS_AUTH_ALLOW)
-              {
-                uvsocks_set_status (tunnel, UVSOCKS_ERROR_SOCKS_AUTHENTICATION);
-                uvsocks_remove_session (tunnel, session);
-                return;
-              }
-            pkt_len = 2;
+          while (socks->start_port < n_ports && listeners < UVSOCKS_START_BATCH)
+            {
+              UvSocksListener *listener = &tunnel->listeners[socks->start_port];
+
+              socks->start_port++;
+              if (listener->open || (resumed && !listener->released))
+                continue;
+              listener->released = 0;
+              uvsocks_start_local_server (socks, listener);
+              listeners++;
+            }
+          if (socks->start_port < n_ports)
+            break;
+          socks->start_port = 0;
+          socks->start_next++;
+          continue;
+        }
+
+      if (resumed && !tunnel->released)
+        {
+          socks->start_next++;
+          continue;
+        }
+      if (socks->start_pending >= UVSOCKS_START_MAX)
+        break;
+      socks->start_next++;
+      tunnel->released = 0;
+
+      session = uvsocks_create_session (tunnel);
+      if (!session)
+        continue;
+
+      session->starting = 1;
+      socks->start_pending++;
+      uvsocks_dns_resolve (socks,
+                           socks->hops[0].host,
+                           socks->hops[0].port,
+                           uvsocks_connect_real,
+                           session->socks_link);
+    }
+
+  if (!socks->close &&
+      !socks->handover &&
+      socks->start_next < socks->n_tunnels &&
+      listeners >= UVSOCKS_START_BATCH)
+    uv_idle_start (&socks->start_idle, uvsocks_start_idle);
+  else
+    uv_idle_stop (&socks->start_idle);
+
+  if (!socks->started && socks->start_next >= socks->n_tunnels)
+    {
+      socks->started = 1;
+      uvsocks_close_listen_fds (socks);
+      uvsocks_set_status (&socks->tunnels[0], UVSOCKS_OK_STARTED);
+    }
+}
+
+static void
+uvsocks_start_idle (uv_idle_t *handle)
+{
+  uvsocks_start_tunnels (handle->data);
+}
+
+static void
+uvsocks_run_real (UvSocks  *socks,
+                  void     *data)
+{
+  int i;
+
+  if (socks->options.coalesce_msec > 0)
+    uv_timer_start (&socks->events_timer,
+                    uvsocks_events_timer,
+                    socks->options.coalesce_msec,
+                    socks->options.coalesce_msec);
+
+  if (socks->admin_path[0])
+    {
+      socks->admin = uvsocks_admin_new (socks->loop,
+                                        socks,
+                                        socks->admin_path,
+                                        &socks->alloc);
+      if (socks->admin)
+        socks->n_handles++;
+      else
+        uvsocks_set_status (&socks->tunnels[0], UVSOCKS_ERROR_ADMIN);
+    }
+
+  if (socks->zerocopy_min > 0)
+    uvsocks_zerocopy_init (socks);
+
+  for (i = 0; i < socks->n_tunnels; i++)
+    {
+      UvSocksTunnel *tunnel = &socks->tunnels[i];
+      int d;
+
+      for (d = 0; d < UVSOCKS_DIRECTION_MAX; d++)
+        {
+          uvsocks_bucket_init (&tunnel->buckets[d],
+                               &tunnel->param.tunnel_rate[d],
+                               uv_hrtime ());
+          if (!socks->wheel_handle &&
+              (tunnel->param.tunnel_rate[d].bytes_per_sec ||
+               tunnel->param.session_rate[d].bytes_per_sec))
+            {
+              uv_timer_init (socks->loop, &socks->wheel_timer);
+              socks->wheel_timer.data = socks;
+              socks->wheel_handle = 1;
+              socks->n_handles++;
+            }
+        }
+
+      /* priorities are kept by the scheduler */
+      if (tunnel->param.priority > 0)
+        {
+          if (!socks->quantum)
+            socks->quantum = UVSOCKS_QUANTUM_PRIORITY;
+          socks->sched_round = UVSOCKS_PRIORITY_ROUND;
+        }
+    }
+
+  if (socks->quantum > 0)
+    {
+      uv_check_init (socks->loop, &socks->sched_check);
+      socks->sched_check.data = socks;
+      uv_idle_init (socks->loop, &socks->sched_idle);
+      socks->sched_idle.data = socks;
+      for (i = 0; i < UVSOCKS_PRIORITY_MAX; i++)
+        {
+          socks->sched_tail[i] = &socks->sched_links[i];
+          socks->accept_tail[i] = &socks->accept_listeners[i];
+        }
+      socks->sched_handle = 1;
+      socks->n_handles += 2;
+    }
+
+  socks->admit_tail = &socks->admit_sessions;
+  if (socks->max_dials > 0)
+    {
+      uv_timer_init (socks->loop, &socks->admit_timer);
+      socks->admit_timer.data = socks;
+      socks->admit_handle = 1;
+      socks->n_handles++;
+    }
+
+  if (socks->io_uring)
+    {
+      socks->uring = uvsocks_uring_new (socks->loop, &socks->alloc);
+      if (socks->uring)
+        socks->n_handles++;
+      else
+        uvsocks_set_status (&socks->tunnels[0], UVSOCKS_ERROR_IO_URING);
+    }
+
+  uvsocks_start_tunnels (socks);
+}
+
+void
+uvsocks_run (UvSocks *socks)
+{
+  if (!socks)
+    return;
+
+  /* handles must be started from the thread running the loop */
+  if (socks->self_loop)
+    uvsocks_send_async (socks, uvsocks_run_real, NULL, NULL);
+  else
+    uvsocks_run_real (socks, NULL);
+}
+
+int
+uvsocks_set_admission (UvSocks *socks,
+                       int      max_dials,
+                       int      max_waiting,
+                       int      max_wait_msec)
+{
+  if (!socks || max_dials < 0 || max_waiting < 0 || max_wait_msec < 0)
+    return 1;
+
+  socks->max_dials = max_dials;
+  socks->max_waiting = max_waiting;
+  socks->max_wait_msec = max_wait_msec;
+
+  return 0;
+}
+
+int
+uvsocks_set_listen_fds (UvSocks   *socks,
+                        const int *fds,
+                        int        n_fds)
+{
+#ifndef _WIN32
+  int i;
+
+  if (!socks || n_fds < 0 || (n_fds > 0 && !fds) || socks->listen_fds)
+    return 1;
+
+  if (n_fds == 0)
+    return 0;
+
+  socks->listen_fds = uvsocks_alloc_calloc (&socks->alloc,
+                                            n_fds,
+                                            sizeof (UvSocksListenFd));
+  if (!socks->listen_fds)
+    return 1;
+
+  for (i = 0; i < n_fds; i++)
+    {
+      UvSocksListenFd *listen_fd = &socks->listen_fds[i];
+      struct sockaddr_in name;
+      socklen_t namelen;
+
+      listen_fd->fd = fds[i];
+      namelen = sizeof (name);
+      if (getsockname (fds[i], (struct sockaddr *) &name, &namelen) == 0 &&
+          name.sin_family == AF_INET)
+        {
+          listen_fd->port = name.sin_port;
+          listen_fd->addr = name.sin_addr.s_addr;
+        }
+    }
+  socks->n_listen_fds = n_fds;
+
+  /* looked up by the address of each port */
+  qsort (socks->listen_fds,
+         n_fds,
+         sizeof (UvSocksListenFd),
+         uvsocks_listen_fd_compare);
+
+  return 0;
+#else
+  return 1;
+#endif
+}
+
+/* Closes the reverse sessions no peer connected to yet, which frees the
+   ports they hold on the proxy. */
+static void
+uvsocks_release_reverse (UvSocks *socks)
+{
+  int t;
+  int s;
+
+  for (t = 0; t < socks->n_tunnels; t++)
+    {
+      UvSocksTunnel *tunnel = &socks->tunnels[t];
+
+      if (tunnel->param.is_forward)
+        continue;
+
+      for (s = 0; s < tunnel->max_sessions; s++)
+        {
+          UvSocksSession *session = tunnel->sessions[s];
+
+          if (session && !session->local_link->read_stream)
+            {
+              tunnel->released = 1;
+              uvsocks_remove_session (tunnel, session);
+            }
+        }
+    }
+}
+
+/* The admin socket is gone: the Unix domain sockets follow, and func gets
+   the TCP listeners, which are left open. */
+static void
+uvsocks_handover_listeners (UvSocks *socks)
+{
+  int *fds;
+  int n_fds;
+  int t;
+  int p;
+
+  uvsocks_release_reverse (socks);
+
+  fds = uvsocks_alloc_calloc (&socks->alloc,
+                              socks->n_listeners + 1,
+                              sizeof (int));
+  n_fds = fds ? 0 : -1;
+
+  for (t = 0; t < socks->n_tunnels; t++)
+    {
+      UvSocksTunnel *tunnel = &socks->tunnels[t];
+
+      for (p = 0; tunnel->listeners && p < uvsocks_tunnel_ports (tunnel); p++)
+        {
+          UvSocksListener *listener = &tunnel->listeners[p];
+          uv_os_fd_t fd;
+
+          if (!listener->open ||
+              uv_is_closing ((uv_handle_t *) &listener->stream))
+            continue;
+
+          /* libuv removes the path as it closes, and then it is free for
+             the other process to bind */
+          if (tunnel->param.listen_port == UVSOCKS_PORT_STREAMLOCAL)
+            {
+              listener->released = 1;
+              uvsocks_close_listener (listener);
+              continue;
+            }
+
+#ifndef _WIN32
+          if (fds && uv_fileno ((uv_handle_t *) &listener->stream, &fd) == 0)
+            fds[n_fds++] = fd;
+#endif
+        }
+    }
+
+  socks->handover_func (socks, fds, n_fds, socks->handover_data);
+  uvsocks_alloc_free (fds);
+}
+
+static void
+uvsocks_handover_admin (void *data)
+{
+  UvSocks *socks = data;
+
+  socks->n_handles--;
+  if (socks->close)
+    uvsocks_free_check (socks);
+  else
+    uvsocks_handover_listeners (socks);
+}
+
+static void
+uvsocks_handover_real (UvSocks  *socks,
+                       void     *data)
+{
+  UvSocksHandover *handover = data;
+
+  /* again when the other process failed to come up */
+  if (socks->close || socks->draining)
+    return;
+
+  socks->handover = 1;
+  socks->handover_func = handover->func;
+  socks->handover_data = handover->data;
+
+  /* its path is removed only once it closed, which must be before the
+     other process binds it */
+  if (socks->admin)
+    {
+      uvsocks_admin_free (socks->admin, uvsocks_handover_admin, socks);
+      socks->admin = NULL;
+      return;
+    }
+
+  uvsocks_handover_listeners (socks);
+}
+
+void
+uvsocks_handover (UvSocks             *socks,
+                  UvSocksHandoverFunc  func,
+                  void                *data)
+{
+  UvSocksHandover *handover;
+
+  if (!socks || !func)
+    return;
+
+  handover = uvsocks_alloc_malloc (&socks->alloc, sizeof (*handover));
+  if (!handover)
+    return;
+
+  handover->func = func;
+  handover->data = data;
+  uvsocks_send_async (socks,
+                      uvsocks_handover_real,
+                      handover,
+                      uvsocks_alloc_free);
+}
+
+static void
+uvsocks_resume_real (UvSocks  *socks,
+                     void     *data)
+{
+  if (socks->close || socks->draining || !socks->handover)
+    return;
+
+  socks->handover = 0;
+
+  if (!socks->admin && socks->admin_path[0])
+    {
+      socks->admin = uvsocks_admin_new (socks->loop,
+                                        socks,
+                                        socks->admin_path,
+                                        &socks->alloc);
+      if (socks->admin)
+        socks->n_handles++;
+      else
+        uvsocks_set_status (&socks->tunnels[0], UVSOCKS_ERROR_ADMIN);
+    }
+
+  /* over again: what was up before is skipped unless it was released, and
+     what was not goes on as before the handover */
+  socks->start_resume = socks->start_next;
+  socks->start_next = 0;
+  socks->start_port = 0;
+  uvsocks_start_tunnels (socks);
+}
+
+void
+uvsocks_resume (UvSocks *socks)
+{
+  if (!socks)
+    return;
+
+  uvsocks_send_async (socks, uvsocks_resume_real, NULL, NULL);
+}
+
+static void
+uvsocks_drain_check (UvSocks *socks)
+{
+  if (!socks->draining || socks->drained || socks->n_links > 0)
+    return;
+
+  socks->drained = 1;
+  if (socks->drain_handle)
+    uv_timer_stop (&socks->drain_timer);
+  uvsocks_set_status (&socks->tunnels[0], UVSOCKS_OK_DRAINED);
+}
+
+static void
+uvsocks_drain_timer (uv_timer_t *handle)
+{
+  UvSocks *socks = handle->data;
+
+  socks->drained = 1;
+  uvsocks_set_status (&socks->tunnels[0], UVSOCKS_OK_DRAINED);
+}
+
+static void
+uvsocks_drain_real (UvSocks  *socks,
+                    void     *data)
+{
+  int msec = (int) (intptr_t) data;
+  int t;
+  int p;
+
+  if (socks->close || socks->draining)
+    return;
+
+  socks->handover = 1;
+  socks->draining = 1;
+  uvsocks_release_reverse (socks);
+
+  for (t = 0; t < socks->n_tunnels; t++)
+    {
+      UvSocksTunnel *tunnel = &socks->tunnels[t];
+
+      for (p = 0; tunnel->listeners && p < uvsocks_tunnel_ports (tunnel); p++)
+        {
+          UvSocksListener *listener = &tunnel->listeners[p];
 
+          /* a connection held back is taken rather than dropped */
+          if (listener->open &&
+              (listener->accept_prev || listener->memory_wait))
             {
-              UvSocksPacketReq *wr;
-              char buf[100];
-              size_t buf_size;
-              unsigned short port;
-              struct sockaddr_in addr;
-
-                buf_size = 0;
-                buf[buf_size++] = 0x05;
-                buf[buf_size++] = tunnel->param.is_forward ? UVSOCKS_CMD_CONNECT :
-                                                             UVSOCKS_CMD_BIND;
-                buf[buf_size++] = 0x00;
-                buf[buf_size++] = UVSOCKS_ADDR_TYPE_IPV4;
-                if (tunnel->param.is_forward)
-                  {
-                    uv_ip4_addr (tunnel->param.destination_host,
-                                 tunnel->param.destination_port,
-                                 &addr);
-                    port = htons (tunnel->param.destination_port);
-                  }
-                else
-                  {
-                    uv_ip4_addr (tunnel->param.listen_host,
-                                 tunnel->param.listen_port,
-                                 &addr);
-                    port = htons (tunnel->param.listen_port);
-                  }
-                memcpy (&buf[buf_size], &addr.sin_addr.s_addr, 4);
-                buf_size += 4;
-                memcpy (&buf[buf_size], &port, 2);
-                buf_size += 2;
-
-                wr = (UvSocksPacketReq *) malloc (sizeof *wr);
-                wr->req.data = session;
-                wr->buf = uv_buf_init (buf, (unsigned int) buf_size);
-                wr->stage = UVSOCKS_STAGE_ESTABLISH;
-
-                uv_write ((uv_write_t *) wr,
-                          (uv_stream_t *) session->socks_link->read_tcp,
-                          &wr->buf,
-                          1,
-                          uvsocks_free_packet_after_set_stage);
+              uvsocks_accept_unlist (listener);
+              uvsocks_local_accept (listener);
             }
-          }
-          break;
-        case UVSOCKS_STAGE_ESTABLISH:
-        case UVSOCKS_STAGE_BIND:
-          {
-            if (link->read_buf_len < 10)
-              break;
+          uvsocks_close_listener (listener);
+        }
+    }
 
-            if (data[0] != 0x05 || data[1] != 0x00)
-              {
-                uint8_t *p = (uint8_t *) data;
+  if (msec > 0)
+    {
+      uv_timer_init (socks->loop, &socks->drain_timer);
+      socks->drain_timer.data = socks;
+      socks->drain_handle = 1;
+      socks->n_handles++;
+      uv_timer_start (&socks->drain_timer, uvsocks_drain_timer, msec, 0);
+    }
 
-                uvsocks_set_status (tunnel,
-                                    UVSOCKS_ERROR_SOCKS_COMMAND +
-                                    ((p[0] << 8) | p[1]));
-                uvsocks_remove_session (tunnel, session);
-                return;
-              }
-            pkt_len = 10;
+  uvsocks_drain_check (socks);
+}
 
-            if (session->stage == UVSOCKS_STAGE_ESTABLISH &&
-                tunnel->param.is_forward == 0)
-              {
-                int port;
+void
+uvsocks_drain (UvSocks *socks,
+               int      msec)
+{
+  if (!socks)
+    return;
 
-                memcpy (&port, &data[8], 2);
-                port = htons(port);
+  uvsocks_send_async (socks,
+                      uvsocks_drain_real,
+                      (void *) (intptr_t) msec,
+                      NULL);
+}
 
-                strlcpy (tunnel->param.listen_host,
-                         socks->host,
-                         sizeof (tunnel->param.listen_host));
-                tunnel->param.listen_port = port;
+int
+uvsocks_add_hop (UvSocks    *socks,
+                 const char *host,
+                 int         port,
+                 const char *user,
+                 const char *password)
+{
+  UvSocksHop *hop;
 
-                uvsocks_set_status (tunnel, UVSOCKS_OK_SOCKS_BIND);
+  if (!socks ||
+      host == NULL || user == NULL || password == NULL ||
+      port < 0 || port > 65535)
+    return -1;
 
-                uvsocks_session_set_stage (session, UVSOCKS_STAGE_BIND);
-                break;
-              }
+  if (socks->n_hops >= UVSOCKS_HOP_MAX)
+    return -1;
 
-            if (session->stage == UVSOCKS_STAGE_BIND &&
-                tunnel->param.is_forward == 0)
-              {
-                uvsocks_dns_resolve (socks,
-                                     tunnel->param.destination_host,
-                                     tunnel->param.destination_port,
-                                     uvsocks_connect_real,
-                                     session->local_link);
-                break;
-              }
+  hop = &socks->hops[socks->n_hops];
+  strlcpy (hop->host, host, sizeof (hop->host));
+  hop->port = port;
+  strlcpy (hop->user, user, sizeof (hop->user));
+  strlcpy (hop->password, password, sizeof (hop->password));
+  socks->n_hops++;
 
-            uvsocks_set_status (tunnel, UVSOCKS_OK_SOCKS_CONNECT);
+  return 0;
+}
 
-            uvsocks_session_set_stage (session, UVSOCKS_STAGE_TUNNEL);
-            if (uv_read_start ((uv_stream_t *) session->local_link->read_tcp,
-                               uvsocks_alloc_buffer,
-                               uvsocks_read))
-              {
-                uvsocks_set_status (tunnel, UVSOCKS_ERROR_TCP_READ_START);
-                uvsocks_remove_session (tunnel, session);
-                return;
-              }
-          }
-          break;
-        case UVSOCKS_STAGE_TUNNEL:
-          {
-            int ret;
-            uv_buf_t buf;
+void
+uvsocks_set_pipelined (UvSocks *socks,
+                       int      pipelined)
+{
+  if (!socks)
+    return;
 
-            buf = uv_buf_init (data, (uint32_t) link->read_buf_len);
-            ret = uv_try_write ((uv_stream_t*)link->write_link->read_tcp, &buf, 1);
-            if (ret < 0)
-              {
-                if (ret == UV_ENOSYS || ret == UV_EAGAIN)
-                  {
-                    uv_read_stop ((uv_stream_t *) link->read_tcp);
-                    uv_write (&link->write_req,
-                              (uv_stream_t *) (uv_stream_t*)link->write_link->read_tcp,
-                              &buf,
-                              1,
-                              uvsocks_read_start_after_free_packet);
-                    return;
-                  }
+  socks->pipelined = pipelined;
+}
 
-                uvsocks_set_status (tunnel, UVSOCKS_ERROR_TCP_SOCKS_READ);
-                uvsocks_remove_session (tunnel, session);
-                return;
-              }
-            pkt_len = ret;
-          }
-          break;
-        }
+void
+uvsocks_set_io_uring (UvSocks *socks,
+                      int      io_uring)
+{
+  if (!socks)
+    return;
 
-      if (pkt_len == 0)
-        break;
+  socks->io_uring = io_uring;
+}
 
-      consume += pkt_len;
-      data += pkt_len;
-      link->read_buf_len -= pkt_len;
-    } while (link->read_buf_len > 0);
+void
+uvsocks_set_quantum (UvSocks *socks,
+                     size_t   quantum)
+{
+  if (!socks)
+    return;
 
-  if (consume && link->read_buf_len)
-    memcpy (link->read_buf, data, link->read_buf_len);
+  if (quantum > INT_MAX / 2)
+    quantum = INT_MAX / 2;
+  else if (quantum > 0 && quantum < UVSOCKS_QUANTUM_MIN)
+    quantum = UVSOCKS_QUANTUM_MIN;
+  socks->quantum = (int) quantum;
+}
+
+void
+uvsocks_set_zerocopy (UvSocks *socks,
+                      size_t   min_bytes)
+{
+  if (!socks)
+    return;
+
+  socks->zerocopy_min = min_bytes;
+}
+
+int
+uvsocks_set_admin (UvSocks    *socks,
+                   const char *path)
+{
+  if (!socks || !path)
+    return -1;
+
+  if (strlcpy (socks->admin_path, path, sizeof (socks->admin_path)) >=
+      sizeof (socks->admin_path))
+    {
+      socks->admin_path[0] = '\0';
+      return -1;
+    }
+
+  return 0;
 }
 
 static void
-uvsocks_local_new_connection (uv_stream_t *stream,
-                              int          status)
+uvsocks_read_stats (UvSocksTunnel *tunnel,
+                    UvSocksStats  *stats)
 {
-  UvSocksTunnel *tunnel = stream->data;
-  UvSocks *socks = tunnel->socks;
-  UvSocksSession *session;
+  const uint64_t *src = (const uint64_t *) &tunnel->stats;
+  uint64_t *dst = (uint64_t *) stats;
+  unsigned int seq;
+  size_t i;
 
-  if (status == -1)
+  do
     {
-      uvsocks_set_status (tunnel, UVSOCKS_ERROR_TCP_NEW_CONNECT);
-      return;
+      do
+        seq = UVSOCKS_SEQ_GET (tunnel->stats_seq);
+      while (seq & 1);
+
+      for (i = 0; i < sizeof (UvSocksStats) / sizeof (uint64_t); i++)
+        dst[i] = UVSOCKS_COUNTER_GET (src[i]);
+
+      UVSOCKS_FENCE_ACQUIRE ();
     }
+  while (UVSOCKS_COUNTER_GET (tunnel->stats_seq) != seq);
+}
 
-  session = uvsocks_create_session (tunnel);
-  if (!session)
+int
+uvsocks_get_stats (UvSocks      *socks,
+                   int           tunnel,
+                   UvSocksStats *stats)
+{
+  UvSocksStats sum;
+  size_t i;
+  int t;
+
+  if (!socks || !stats || tunnel < -1 || tunnel >= socks->n_tunnels)
+    return 1;
+
+  if (tunnel >= 0)
     {
-      uvsocks_set_status (tunnel, UVSOCKS_ERROR_TCP_CREATE_SESSION);
-      return;
+      uvsocks_read_stats (&socks->tunnels[tunnel], stats);
+      return 0;
     }
 
-  session->local_link->read_tcp = malloc (sizeof (*session->local_link->read_tcp));
-  if (!session->local_link->read_tcp)
+  memset (stats, 0, sizeof (*stats));
+  for (t = 0; t < socks->n_tunnels; t++)
     {
-      uvsocks_set_status (tunnel, UVSOCKS_ERROR);
-      free (session);
-      return;
+      uvsocks_read_stats (&socks->tunnels[t], &sum);
+      for (i = 0; i < sizeof (UvSocksStats) / sizeof (uint64_t); i++)
+        ((uint64_t *) stats)[i] += ((uint64_t *) &sum)[i];
     }
 
-  session->local_link->read_tcp->data = session->local_link;
+  return 0;
+}
+
+int
+uvsocks_get_tunnels (UvSocks      *socks,
+                     int          *cursor,
+                     UvSocksStats *stats,
+                     UvSocksParam *params,
+                     int           n_tunnels)
+{
+  int n;
+
+  if (!socks || !cursor || *cursor < 0 || !stats)
+    return 0;
 
-  uv_tcp_init (socks->loop, session->local_link->read_tcp);
-  if (uv_accept (stream, (uv_stream_t *) session->local_link->read_tcp))
+  for (n = 0; n < n_tunnels && *cursor < socks->n_tunnels; n++, (*cursor)++)
     {
-      uvsocks_set_status (tunnel, UVSOCKS_ERROR_TCP_ACCEPT);
+      UvSocksTunnel *tunnel = &socks->tunnels[*cursor];
+      int s;
 
-      if (session->local_link->read_tcp)
-        uv_close ((uv_handle_t *) session->local_link->read_tcp,
-                  uvsocks_close_handle);
-      free (session);
-      return;
-    }
+      uvsocks_read_stats (tunnel, &stats[n]);
+      for (s = 0; s < tunnel->max_sessions; s++)
+        {
+          UvSocksSession *session = tunnel->sessions[s];
 
-  uvsocks_set_status (tunnel, UVSOCKS_OK_TCP_NEW_CONNECT);
+          if (!session)
+            continue;
 
-  uvsocks_dns_resolve (socks,
-                       socks->host,
-                       socks->port,
-                       uvsocks_connect_real,
-                       session->socks_link);
+          stats[n].bytes_in += session->socks_link->bytes;
+          stats[n].bytes_out += session->local_link->bytes;
+        }
+
+      if (params)
+        memcpy (&params[n], &tunnel->param, sizeof (UvSocksParam));
+    }
+
+  return n;
 }
 
 static void
-uvsocks_start_local_server (UvSocks       *socks,
-                            UvSocksTunnel *tunnel)
+uvsocks_snapshot_done (void *data)
 {
-  UvSocksStatus status;
-  struct sockaddr_in addr;
-  int r;
+  UvSocksSnapshot *snapshot = data;
 
-  tunnel->listen_tcp = malloc (sizeof (*tunnel->listen_tcp));
-  if (!tunnel->listen_tcp)
+  if (snapshot->queued)
     {
-      uvsocks_set_status (tunnel, UVSOCKS_ERROR_TCP_LOCAL_SERVER);
+      snapshot->queued = 0;
       return;
     }
 
-  tunnel->listen_tcp->data = tunnel;
+  snapshot->func (snapshot->socks,
+                  snapshot->cursor,
+                  0,
+                  NULL,
+                  NULL,
+                  snapshot->data);
+  uvsocks_alloc_free (snapshot);
+}
+
+static void
+uvsocks_snapshot_real (UvSocks  *socks,
+                       void     *data)
+{
+  UvSocksSnapshot *snapshot = data;
+  int tunnel = snapshot->cursor;
+  int n;
+
+  n = uvsocks_get_tunnels (socks,
+                           &snapshot->cursor,
+                           snapshot->stats,
+                           snapshot->params,
+                           UVSOCKS_SNAPSHOT_BATCH);
+  if (n == 0)
+    return;
+
+  snapshot->func (socks,
+                  tunnel,
+                  n,
+                  snapshot->stats,
+                  snapshot->params,
+                  snapshot->data);
+
+  /* the rest waits for the next loop iteration */
+  if (snapshot->cursor < socks->n_tunnels)
+    snapshot->queued = uvsocks_send_async (socks,
+                                           uvsocks_snapshot_real,
+                                           snapshot,
+                                           uvsocks_snapshot_done) == 0;
+}
 
-  uv_ip4_addr (tunnel->param.listen_host, tunnel->param.listen_port, &addr);
-  uv_tcp_init (socks->loop, tunnel->listen_tcp);
-  r = uv_tcp_bind (tunnel->listen_tcp, (const struct sockaddr *) &addr, 0);
-  if (r < 0)
+void
+uvsocks_snapshot (UvSocks             *socks,
+                  UvSocksSnapshotFunc  func,
+                  void                *data)
+{
+  UvSocksSnapshot *snapshot;
+
+  if (!socks || !func)
+    return;
+
+  snapshot = uvsocks_alloc_malloc (&socks->alloc, sizeof (*snapshot));
+  if (!snapshot)
     {
-      status = UVSOCKS_ERROR_TCP_BIND;
-      goto fail;
+      func (socks, 0, 0, NULL, NULL, data);
+      return;
     }
 
-  {
-    struct sockaddr_in name;
-    int namelen;
+  snapshot->socks = socks;
+  snapshot->func = func;
+  snapshot->data = data;
+  snapshot->cursor = 0;
+  snapshot->queued = 0;
+  if (uvsocks_send_async (socks,
+                          uvsocks_snapshot_real,
+                          snapshot,
+                          uvsocks_snapshot_done))
+    uvsocks_snapshot_done (snapshot);
+}
+
+int
+uvsocks_dump_trace (UvSocks    *socks,
+                    const char *path)
+{
+  if (!socks || !socks->trace)
+    return 1;
 
-    namelen = sizeof (name);
-    uv_tcp_getsockname (tunnel->listen_tcp, (struct sockaddr *) &name, &namelen);
-    tunnel->param.listen_port = ntohs (name.sin_port);
-  }
+  return trace_dump (socks->trace, path) ? 1 : 0;
+}
 
-  r = uv_listen ((uv_stream_t *) tunnel->listen_tcp, 16, uvsocks_local_new_connection);
-  if (r < 0)
+static void
+uvsocks_latency_stats (const Histogram     *histogram,
+                       UvSocksLatencyStats *stats)
+{
+  stats->count = histogram->count;
+  stats->sum = histogram->sum;
+  stats->max = histogram->max;
+  stats->p50 = histogram_percentile (histogram, 50.0);
+  stats->p90 = histogram_percentile (histogram, 90.0);
+  stats->p99 = histogram_percentile (histogram, 99.0);
+  stats->p999 = histogram_percentile (histogram, 99.9);
+}
+
+int
+uvsocks_get_latency (UvSocks             *socks,
+                     int                  tunnel,
+                     int                  hop,
+                     UvSocksLatency       latency,
+                     UvSocksLatencyStats *stats)
+{
+  Histogram histogram;
+  int t;
+
+  if (!socks || !stats ||
+      latency < 0 || latency >= UVSOCKS_LATENCY_MAX ||
+      tunnel < -1 || tunnel >= socks->n_tunnels ||
+      hop < -1 || hop >= socks->n_hops ||
+      (tunnel >= 0 && hop >= 0))
+    return 1;
+
+  memset (&histogram, 0, sizeof (histogram));
+  if (tunnel >= 0)
     {
-      status = UVSOCKS_ERROR_TCP_LISTEN;
-      goto fail;
+      const Histogram *histograms;
+
+      histograms = UVSOCKS_POINTER_GET (socks->tunnels[tunnel].latency);
+      if (histograms)
+        histogram_copy (&histogram, &histograms[latency]);
     }
+  else if (hop >= 0)
+    histogram_copy (&histogram, &socks->hops[hop].latency[latency]);
+  else
+    for (t = 0; t < socks->n_tunnels; t++)
+      {
+        const Histogram *histograms;
 
-  uvsocks_set_status (tunnel, UVSOCKS_OK_TCP_LOCAL_SERVER);
+        histograms = UVSOCKS_POINTER_GET (socks->tunnels[t].latency);
+        if (histograms)
+          histogram_merge (&histogram, &histograms[latency]);
+      }
 
-  return;
+  uvsocks_latency_stats (&histogram, stats);
 
-fail:
+  return 0;
+}
 
-  uvsocks_set_status (tunnel, status);
+int
+uvsocks_get_queue_delay (UvSocks             *socks,
+                         int                  priority,
+                         UvSocksLatencyStats *stats)
+{
+  Histogram histogram;
 
-  if (tunnel->listen_tcp)
-    uv_close ((uv_handle_t *) tunnel->listen_tcp,
-              uvsocks_close_handle_listen);
+  if (!socks || !stats || priority < 0 || priority >= UVSOCKS_PRIORITY_MAX)
+    return 1;
 
-  tunnel->listen_tcp = NULL;
+  histogram_copy (&histogram, &socks->queue_delay[priority]);
+  uvsocks_latency_stats (&histogram, stats);
 
-  return;
+  return 0;
 }
 
-void
-uvsocks_run (UvSocks *socks)
+int
+uvsocks_get_admission (UvSocks          *socks,
+                       UvSocksAdmission *admission)
 {
-  int i;
+  Histogram histogram;
+
+  if (!socks || !admission)
+    return 1;
+
+  admission->dialing = UVSOCKS_COUNTER_GET (socks->dials);
+  admission->waiting = UVSOCKS_COUNTER_GET (socks->waiting);
+  admission->shed = UVSOCKS_COUNTER_GET (socks->shed);
+  histogram_copy (&histogram, &socks->admit_wait);
+  uvsocks_latency_stats (&histogram, &admission->wait);
+
+  return 0;
+}
+
+int
+uvsocks_get_memory (UvSocks       *socks,
+                    UvSocksMemory *memory)
+{
+  if (!socks || !memory)
+    return 1;
 
+  uvsocks_alloc_get (&socks->alloc, memory);
+
+  return 0;
+}
+
+int
+uvsocks_set_memory_limit (UvSocks  *socks,
+                          uint64_t  limit)
+{
   if (!socks)
-    return;
+    return 1;
 
-  for (i = 0; i < socks->n_tunnels; i++)
-    if (socks->tunnels[i].param.is_forward)
-      uvsocks_start_local_server (socks, &socks->tunnels[i]);
-    else
-      {
-        UvSocksSession *session;
+  uvsocks_alloc_set_limit (&socks->alloc, limit);
 
-        session = uvsocks_create_session (&socks->tunnels[i]);
-        if (!session)
-          continue;
+  return 0;
+}
 
-        uvsocks_dns_resolve (socks,
-                             socks->host,
-                             socks->port,
-                             uvsocks_connect_real,
-                             session->socks_link);
+int
+uvsocks_get_sessions (UvSocks            *socks,
+                      int                 tunnel,
+                      int                *cursor,
+                      UvSocksSessionInfo *infos,
+                      int                 n_infos)
+{
+  UvSocksTunnel *t;
+  uint64_t now;
+  int n;
+
+  if (!socks || tunnel < 0 || tunnel >= socks->n_tunnels || !cursor)
+    return 0;
+
+  /* sessions keep their slot for life and the table only grows, so a
+     slot index stays a valid place to resume from */
+  t = &socks->tunnels[tunnel];
+  now = uv_hrtime ();
+  for (n = 0; n < n_infos && *cursor < t->max_sessions; (*cursor)++)
+    {
+      UvSocksSession *session = t->sessions[*cursor];
+      UvSocksSessionInfo *info;
+
+      if (!session)
+        continue;
+
+      info = &infos[n++];
+      info->id = session->serial;
+      info->tunnel = tunnel;
+      info->stage = session->stage;
+      info->hop = session->hop;
+      info->age_usec = (now - session->start_time) / 1000;
+      info->bytes_in = session->socks_link->bytes;
+      info->bytes_out = session->local_link->bytes;
+      info->buffered_in = session->socks_link->uring ?
+        uvsocks_uring_relay_buffered (session->socks_link->uring) :
+        session->socks_link->read_buf_len;
+      info->buffered_out = session->local_link->uring ?
+        uvsocks_uring_relay_buffered (session->local_link->uring) :
+        session->local_link->read_buf_len;
+    }
+
+  return n;
+}
+
+int
+uvsocks_kill_session (UvSocks  *socks,
+                      uint32_t  id)
+{
+  UvSocksSession *session;
+
+  if (!socks || !socks->serials)
+    return -1;
+
+  for (session = socks->serials[id & socks->serials_mask];
+       session;
+       session = session->serial_next)
+    if (session->serial == id)
+      {
+        uvsocks_remove_session (session->tunnel, session);
+        return 0;
       }
+
+  return -1;
+}
+
+int
+uvsocks_set_session_limit (UvSocks *socks,
+                           int      tunnel,
+                           int      limit)
+{
+  if (!socks || tunnel < 0 || tunnel >= socks->n_tunnels || limit < 0)
+    return -1;
+
+  if (!socks->tunnels[tunnel].param.is_forward)
+    return -1;
+
+  socks->tunnels[tunnel].param.session_limit = limit;
+
+  return 0;
+}
+
+int
+uvsocks_get_n_tunnels (UvSocks *socks)
+{
+  if (!socks)
+    return 0;
+
+  return socks->n_tunnels;
+}
+
+int
+uvsocks_get_n_hops (UvSocks *socks)
+{
+  if (!socks)
+    return 0;
+
+  return socks->n_hops;
+}
+
+const UvSocksParam *
+uvsocks_get_param (UvSocks *socks,
+                   int      tunnel)
+{
+  if (!socks || tunnel < 0 || tunnel >= socks->n_tunnels)
+    return NULL;
+
+  return &socks->tunnels[tunnel].param;
+}
+
+const char *
+uvsocks_get_stage_string (UvSocksStage stage)
+{
+  switch (stage)
+    {
+      case UVSOCKS_STAGE_NONE:
+        return "none";
+      case UVSOCKS_STAGE_HANDSHAKE:
+        return "handshake";
+      case UVSOCKS_STAGE_AUTHENTICATE:
+        return "authenticate";
+      case UVSOCKS_STAGE_ESTABLISH:
+        return "establish";
+      case UVSOCKS_STAGE_BIND:
+        return "bind";
+      case UVSOCKS_STAGE_TUNNEL:
+        return "tunnel";
+      case UVSOCKS_STAGE_FRONTEND_GREETING:
+        return "frontend greeting";
+      case UVSOCKS_STAGE_FRONTEND_REQUEST:
+        return "frontend request";
+      case UVSOCKS_STAGE_FRONTEND_HTTP:
+        return "frontend http";
+      case UVSOCKS_STAGE_MAX:
+        break;
+    }
+
+  return "unknown";
 }
 
 const char *
@@ -1161,6 +5235,12 @@ uvsocks_get_status_string (UvSocksStatus status)
         return "socks success: connect";
       case UVSOCKS_OK_SOCKS_BIND:
         return "socks success: bind";
+      case UVSOCKS_OK_SOCKS_HOP:
+        return "socks success: hop";
+      case UVSOCKS_OK_STARTED:
+        return "normal success: started";
+      case UVSOCKS_OK_DRAINED:
+        return "normal success: drained";
       case UVSOCKS_ERROR:
         return "normal error";
       case UVSOCKS_ERROR_PARAMETERS:
@@ -1179,6 +5259,14 @@ uvsocks_get_status_string (UvSocksStatus status)
         return "tcp error: create session";
       case UVSOCKS_ERROR_TCP_ACCEPT:
         return "tcp error: accept";
+      case UVSOCKS_ERROR_TCP_SESSION_LIMIT:
+        return "tcp error: session limit";
+      case UVSOCKS_ERROR_ADMIN:
+        return "admin error: listen";
+      case UVSOCKS_ERROR_IO_URING:
+        return "io_uring error: unavailable";
+      case UVSOCKS_ERROR_TCP_OVERLOAD:
+        return "tcp error: overload";
       case UVSOCKS_ERROR_DNS_RESOLVED:
         return "dns error: resolved";
       case UVSOCKS_ERROR_DNS_ADDRINFO:
@@ -1197,6 +5285,10 @@ uvsocks_get_status_string (UvSocksStatus status)
         return "socks error: authentication";
       case UVSOCKS_ERROR_SOCKS_CMD_BIND:
         return "socks error: bind";
+      case UVSOCKS_ERROR_FRONTEND_HANDSHAKE:
+        return "frontend error: handshake";
+      case UVSOCKS_ERROR_FRONTEND_REQUEST:
+        return "frontend error: request";
       case UVSOCKS_ERROR_SOCKS_COMMAND:
         return "socks error: command";
     }
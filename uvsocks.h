@@ -4,8 +4,14 @@
 #ifndef __UVSOCKS_H__
 #define __UVSOCKS_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct _UvSocks UvSocks;
 
+/* Port value meaning the host field is really a Unix domain socket path. */
+#define UVSOCKS_PORT_STREAMLOCAL (-2)
+
 typedef enum _UvSocksStatus UvSocksStatus;
 enum _UvSocksStatus
 {
@@ -15,6 +21,9 @@ enum _UvSocksStatus
   UVSOCKS_OK_TCP_CONNECTED              = 0x0003,
   UVSOCKS_OK_SOCKS_CONNECT              = 0x0004,
   UVSOCKS_OK_SOCKS_BIND                 = 0x0005,
+  UVSOCKS_OK_SOCKS_HOP                  = 0x0006,
+  UVSOCKS_OK_STARTED                    = 0x0007,
+  UVSOCKS_OK_DRAINED                    = 0x0008,
   UVSOCKS_ERROR                         = 0x1001,
   UVSOCKS_ERROR_PARAMETERS              = 0x1002,
   UVSOCKS_ERROR_TCP_LOCAL_SERVER        = 0x1003,
@@ -24,6 +33,12 @@ enum _UvSocksStatus
   UVSOCKS_ERROR_TCP_NEW_CONNECT         = 0x1007,
   UVSOCKS_ERROR_TCP_CREATE_SESSION      = 0x1008,
   UVSOCKS_ERROR_TCP_ACCEPT              = 0x1009,
+  UVSOCKS_ERROR_TCP_SESSION_LIMIT       = 0x100a,
+  UVSOCKS_ERROR_ADMIN                   = 0x100b,
+  UVSOCKS_ERROR_IO_URING                = 0x100c,
+  UVSOCKS_ERROR_TCP_OVERLOAD            = 0x100d,
+  UVSOCKS_ERROR_FRONTEND_HANDSHAKE      = 0x100e,
+  UVSOCKS_ERROR_FRONTEND_REQUEST        = 0x100f,
   UVSOCKS_ERROR_DNS_RESOLVED            = 0x1010,
   UVSOCKS_ERROR_DNS_ADDRINFO            = 0x1011,
   UVSOCKS_ERROR_TCP_CONNECTED           = 0x1012,
@@ -36,14 +51,206 @@ enum _UvSocksStatus
   UVSOCKS_ERROR_SOCKS_COMMAND           = 0x1019, /* must be the last */
 };
 
+/* The bit of a status in UvSocksOptions.event_mask.  Successes use the
+   low half and errors the high half; every command error shares one bit. */
+#define UVSOCKS_EVENT(status)                                           \
+  ((uint64_t) 1 << ((status) >= UVSOCKS_ERROR_SOCKS_COMMAND ? 59 :      \
+                    (status) >= UVSOCKS_ERROR ? 32 + ((status) & 0x3f) : \
+                    (status)))
+#define UVSOCKS_EVENT_ALL       (~(uint64_t) 0)
+#define UVSOCKS_EVENT_ERRORS    (~(uint64_t) 0 << 32)
+
+typedef enum _UvSocksFrontend UvSocksFrontend;
+enum _UvSocksFrontend
+{
+  UVSOCKS_FRONTEND_NONE                 = 0, /* fixed destination */
+  UVSOCKS_FRONTEND_SOCKS5               = 1, /* destination from the client */
+  UVSOCKS_FRONTEND_HTTP                 = 2, /* HTTP CONNECT proxy */
+};
+
+typedef enum _UvSocksStage UvSocksStage;
+enum _UvSocksStage
+{
+  UVSOCKS_STAGE_NONE                    = 0x00, /* resolving and connecting */
+  UVSOCKS_STAGE_HANDSHAKE               = 0x01,
+  UVSOCKS_STAGE_AUTHENTICATE            = 0x02,
+  UVSOCKS_STAGE_ESTABLISH               = 0x03,
+  UVSOCKS_STAGE_BIND                    = 0x04,
+  UVSOCKS_STAGE_TUNNEL                  = 0x05,
+  UVSOCKS_STAGE_FRONTEND_GREETING       = 0x06,
+  UVSOCKS_STAGE_FRONTEND_REQUEST        = 0x07,
+  UVSOCKS_STAGE_FRONTEND_HTTP           = 0x08,
+  UVSOCKS_STAGE_MAX                     = 0x09, /* must be the last */
+};
+
+/* Which way bytes go through a tunnel. */
+typedef enum _UvSocksDirection UvSocksDirection;
+enum _UvSocksDirection
+{
+  UVSOCKS_DIRECTION_OUT                 = 0, /* client to proxy */
+  UVSOCKS_DIRECTION_IN                  = 1, /* proxy to client */
+  UVSOCKS_DIRECTION_MAX                 = 2, /* must be the last */
+};
+
+/* A bandwidth cap: bytes_per_sec on average, 0 for none, with up to burst
+   bytes going at once after a lull.  A burst of 0 stands for a tenth of a
+   second's worth; bursts are raised to 16 KiB. */
+typedef struct _UvSocksRate UvSocksRate;
+struct _UvSocksRate
+{
+  uint64_t         bytes_per_sec;
+  uint64_t         burst;
+};
+
+/* How many priority classes tunnels are sorted into. */
+#define UVSOCKS_PRIORITY_MAX 4
+
 typedef struct _UvSocksParam UvSocksParam;
 struct _UvSocksParam
 {
-  int    is_forward;
-  char   destination_host[64];
-  int    destination_port;
-  char   listen_host[64];
-  int    listen_port;
+  int              is_forward;
+  UvSocksFrontend  frontend;
+  char             destination_host[128];
+  int              destination_port;
+  char             listen_host[128];
+  int              listen_port;
+
+  /* forward tunnels: how many sessions may be open at once, 0 for any
+     number; see uvsocks_set_session_limit () */
+  int              session_limit;
+
+  /* set before UVSOCKS_OK_SOCKS_HOP: the hop that completed its CONNECT and
+     how long it took since the previous hop, in microseconds */
+  int              hop;
+  int              hop_latency;
+
+  /* set before every status: how many times it happened since last
+     reported, which is above 1 only for coalesced summaries */
+  int              count;
+
+  /* bandwidth caps, indexed by UvSocksDirection, of all the sessions of
+     the tunnel together and of each of them.  A session reading past
+     either stops reading until enough time has passed. */
+  UvSocksRate      tunnel_rate[UVSOCKS_DIRECTION_MAX];
+  UvSocksRate      session_rate[UVSOCKS_DIRECTION_MAX];
+
+  /* the priority class of the tunnel, 0, the default, to
+     UVSOCKS_PRIORITY_MAX - 1.  While sessions of a higher class have more
+     to relay than their quantum, the sessions of lower classes wait with
+     their reads and forward tunnels of lower classes with their accepts;
+     see uvsocks_set_quantum () */
+  int              priority;
+
+  /* forward tunnels: how many ports from listen_port on are listened on,
+     0 or 1 for just the one.  A connection to the port n past listen_port
+     goes to destination_port + n when range_destination is set, and to
+     destination_port otherwise; statuses of the tunnel report the ports
+     of the listener they come from in place of the first ones. */
+  int              n_ports;
+  int              range_destination;
+};
+
+/* Counters of one tunnel, or the sum over all of them.  Every member is a
+   uint64_t. */
+typedef struct _UvSocksStats UvSocksStats;
+struct _UvSocksStats
+{
+  uint64_t         bytes_in;                    /* proxy to client */
+  uint64_t         bytes_out;                   /* client to proxy */
+  uint64_t         accepts;                     /* local connections */
+  uint64_t         errors;                      /* error statuses reported */
+  uint64_t         handshakes;                  /* forward sessions set up */
+  uint64_t         handshake_usec;              /* their total setup time */
+  uint64_t         events_dropped;              /* statuses never delivered */
+  uint64_t         failures[UVSOCKS_STAGE_MAX]; /* sessions failed in a stage */
+  uint64_t         active[UVSOCKS_STAGE_MAX];   /* sessions now in a stage */
+  uint64_t         throttles[UVSOCKS_DIRECTION_MAX]; /* reads held by a cap */
+  uint64_t         throttle_usec[UVSOCKS_DIRECTION_MAX]; /* time held */
+};
+
+/* Steps of setting up a session whose duration is recorded. */
+typedef enum _UvSocksLatency UvSocksLatency;
+enum _UvSocksLatency
+{
+  UVSOCKS_LATENCY_DNS                   = 0, /* resolving the first proxy */
+  UVSOCKS_LATENCY_CONNECT               = 1, /* TCP connect to it */
+  UVSOCKS_LATENCY_GREETING              = 2, /* method selection */
+  UVSOCKS_LATENCY_AUTH                  = 3, /* user/password */
+  UVSOCKS_LATENCY_REPLY                 = 4, /* CONNECT or BIND reply */
+  UVSOCKS_LATENCY_MAX                   = 5, /* must be the last */
+};
+
+/* Durations of one step in microseconds.  Percentiles are kept to within
+   about 6%. */
+typedef struct _UvSocksLatencyStats UvSocksLatencyStats;
+struct _UvSocksLatencyStats
+{
+  uint64_t         count;
+  uint64_t         sum;
+  uint64_t         max;
+  uint64_t         p50;
+  uint64_t         p90;
+  uint64_t         p99;
+  uint64_t         p999;
+};
+
+/* A session as seen from the loop thread.  Bytes count what was relayed so
+   far and buffered what was read but not yet written on. */
+typedef struct _UvSocksSessionInfo UvSocksSessionInfo;
+struct _UvSocksSessionInfo
+{
+  uint32_t         id;                          /* unique in an UvSocks */
+  int              tunnel;
+  UvSocksStage     stage;
+  int              hop;                         /* proxy being set up */
+  uint64_t         age_usec;
+  uint64_t         bytes_in;                    /* proxy to client */
+  uint64_t         bytes_out;                   /* client to proxy */
+  uint64_t         buffered_in;
+  uint64_t         buffered_out;
+};
+
+/* Where the memory of a uvsocks comes from, e.g. an arena of the
+   application.  malloc and aligned_alloc work as the C ones and free is
+   given the size of the block too; each is passed data.  aligned_alloc
+   may be NULL, in which case aligned blocks are cut out of larger ones
+   from malloc; otherwise free must take blocks from either.  Memory that
+   libuv allocates itself, such as that of getaddrinfo (), is not
+   included. */
+typedef struct _UvSocksAllocator UvSocksAllocator;
+struct _UvSocksAllocator
+{
+  void            *(*malloc) (size_t  size,
+                              void   *data);
+  void             (*free) (void   *ptr,
+                            size_t  size,
+                            void   *data);
+  void            *(*aligned_alloc) (size_t  alignment,
+                                     size_t  size,
+                                     void   *data);
+  void              *data;
+};
+
+/* What a uvsocks has allocated, in bytes of the blocks given by its
+   allocator. */
+typedef struct _UvSocksMemory UvSocksMemory;
+struct _UvSocksMemory
+{
+  uint64_t         bytes;                       /* allocated now */
+  uint64_t         peak;                        /* the most at once */
+  uint64_t         limit;                       /* 0 for none */
+  uint64_t         refused;                     /* allocations that failed */
+};
+
+/* Admission of forward sessions to the first proxy, see
+   uvsocks_set_admission (). */
+typedef struct _UvSocksAdmission UvSocksAdmission;
+struct _UvSocksAdmission
+{
+  uint64_t         dialing;             /* connecting or in their handshake */
+  uint64_t         waiting;             /* accepted, waiting for their turn */
+  uint64_t         shed;                /* closed for want of a turn */
+  UvSocksLatencyStats wait;             /* how long those admitted waited */
 };
 
 typedef void (*UvSocksStatusFunc) (UvSocks       *uvsocks,
@@ -51,6 +258,57 @@ typedef void (*UvSocksStatusFunc) (UvSocks       *uvsocks,
                                    UvSocksParam  *param,
                                    void          *data);
 
+/* Called from the loop thread with the n_fds listening sockets handed over
+   by uvsocks_handover (), or with none and n_fds -1 when there was no
+   memory to collect them. */
+typedef void (*UvSocksHandoverFunc) (UvSocks   *uvsocks,
+                                     const int *fds,
+                                     int        n_fds,
+                                     void      *data);
+
+/* Called from the loop thread by uvsocks_snapshot () with n_tunnels
+   tunnels from index tunnel on, as uvsocks_get_tunnels () copies them, and
+   then once with n_tunnels 0 and both NULL.  The arrays are only valid
+   during the call. */
+typedef void (*UvSocksSnapshotFunc) (UvSocks            *uvsocks,
+                                     int                 tunnel,
+                                     int                 n_tunnels,
+                                     const UvSocksStats *stats,
+                                     const UvSocksParam *params,
+                                     void               *data);
+
+typedef struct _UvSocksOptions UvSocksOptions;
+struct _UvSocksOptions
+{
+  /* UVSOCKS_EVENT () bits of the statuses passed to the callback */
+  uint64_t         event_mask;
+
+  /* when above 0, only the first of repeated statuses of a tunnel is
+     reported at once and the repeats are summed up every coalesce_msec */
+  int              coalesce_msec;
+
+  /* calls the callback from a thread of its own, which is handed statuses
+     in batches; batches are dropped while it is too far behind */
+  int              threaded;
+
+  /* records kept of the last session events, 0 for the default of 4096
+     or -1 to keep none; see uvsocks_dump_trace () */
+  int              trace_records;
+
+  /* allocates all memory of the uvsocks, the UvSocks itself included,
+     when not NULL; the functions are copied */
+  const UvSocksAllocator *allocator;
+
+  /* bytes the uvsocks may have allocated at once, 0 for any number; see
+     uvsocks_set_memory_limit () */
+  uint64_t         memory_limit;
+};
+
+/* Fills options with the defaults: every status, reported at once from the
+   loop thread. */
+void
+uvsocks_options_init (UvSocksOptions *options);
+
 UvSocks *
 uvsocks_new (void              *uv_loop,
              const char        *host,
@@ -62,12 +320,253 @@ uvsocks_new (void              *uv_loop,
              UvSocksStatusFunc  callback_func,
              void              *callback_data);
 
+UvSocks *
+uvsocks_new_full (void                 *uv_loop,
+                  const char           *host,
+                  int                   port,
+                  const char           *user,
+                  const char           *password,
+                  int                   n_params,
+                  UvSocksParam         *params,
+                  const UvSocksOptions *options,
+                  UvSocksStatusFunc     callback_func,
+                  void                 *callback_data);
+
+/* Appends a proxy reached through the previous one.  The proxy given to
+   uvsocks_new () is hop 0.  Must be called before uvsocks_run (). */
+int
+uvsocks_add_hop (UvSocks    *uvsocks,
+                 const char *host,
+                 int         port,
+                 const char *user,
+                 const char *password);
+
+/* Sends greeting, authentication and CONNECT for every hop in one write
+   instead of waiting for each reply.  Must be called before uvsocks_run (). */
+void
+uvsocks_set_pipelined (UvSocks *uvsocks,
+                       int      pipelined);
+
+/* Serves the admin commands described in admin.h on the Unix domain
+   socket, or named pipe, at path, from the loop of uvsocks.  A failure to
+   listen is reported as UVSOCKS_ERROR_ADMIN on the first tunnel.  Must be
+   called before uvsocks_run (). */
+int
+uvsocks_set_admin (UvSocks    *uvsocks,
+                   const char *path);
+
+/* Relays sessions through io_uring once they are established, leaving
+   their handshakes to libuv.  When uvsocks was built without it or the
+   kernel cannot, UVSOCKS_ERROR_IO_URING is reported on the first tunnel
+   and sessions are relayed by libuv.  Must be called before
+   uvsocks_run (). */
+void
+uvsocks_set_io_uring (UvSocks *uvsocks,
+                      int      io_uring);
+
+/* Shares the loop fairly between busy sessions with deficit round robin:
+   a relaying link that read quantum bytes in one round of the loop stops
+   reading until the others ready in that round had their turn.  quantum
+   is raised to 64 KiB, a single read; 0, the default, lets a link read
+   for as long as data is there.  Links relayed by io_uring are not
+   scheduled.  Tunnels with a priority above 0 need the scheduler, and
+   get a quantum of 256 KiB when none is set.  Must be called before
+   uvsocks_run (). */
+void
+uvsocks_set_quantum (UvSocks *uvsocks,
+                     size_t   quantum);
+
+/* Sends reads of at least min_bytes relayed by libuv with MSG_ZEROCOPY,
+   out of the read buffer of the link, which waits for the kernel to
+   release the pages before reading into them again; 0 turns it off.
+   Smaller reads, sockets that refuse it, connections the kernel ends up
+   copying for anyway, such as loopback ones, and systems without it are
+   sent as before.  Must be called before uvsocks_run (). */
+void
+uvsocks_set_zerocopy (UvSocks *uvsocks,
+                      size_t   min_bytes);
+
+/* Lets at most max_dials forward sessions connect to the first proxy and
+   go through their handshake at once, 0 for any number.  The clients
+   accepted past it wait in the order they came, and they are closed
+   rather than dialed when max_waiting are waiting already, or when they
+   waited max_wait_msec, reported as UVSOCKS_ERROR_TCP_OVERLOAD; 0 sets
+   no bound.  A SOCKS5 or HTTP client waits with its request read.
+   Reverse tunnels are started as before.  Must be called before
+   uvsocks_run (). */
+int
+uvsocks_set_admission (UvSocks *uvsocks,
+                       int      max_dials,
+                       int      max_waiting,
+                       int      max_wait_msec);
+
+/* Listens on the sockets in fds, such as those inherited from the process
+   being replaced, rather than binding anew: the port of a forward tunnel
+   takes the socket bound to its address, when there is one.  Those no port
+   took are closed once every tunnel was started.  Not on Windows.  Must be
+   called before uvsocks_run (). */
+int
+uvsocks_set_listen_fds (UvSocks   *uvsocks,
+                        const int *fds,
+                        int        n_fds);
+
+/* Brings the tunnels up from the loop: a few hundred listeners per round
+   of it, and reverse tunnels while fewer than 64 wait for their BIND
+   reply, each reporting its status once it is up.  UVSOCKS_OK_STARTED is
+   reported on the first tunnel once every tunnel was started. */
 void
 uvsocks_run (UvSocks *uvsocks);
 
+/* Readies uvsocks to be replaced by another process.  What two processes
+   cannot share is given up first: the admin socket, the Unix domain
+   sockets listened on, and reverse tunnels still waiting for their peer.
+   Then func gets the sockets of the TCP listeners, which go on accepting
+   until uvsocks_drain ().  Tunnels not started yet are left to the other
+   process.  Not on Windows.  Safe to call from any thread. */
+void
+uvsocks_handover (UvSocks             *uvsocks,
+                  UvSocksHandoverFunc  func,
+                  void                *data);
+
+/* Takes uvsocks back after the process it was handed over to failed to
+   come up: the admin socket, the Unix domain sockets and the reverse
+   tunnels given up are started again, as are tunnels not started yet.
+   Does nothing once draining.  Safe to call from any thread. */
+void
+uvsocks_resume (UvSocks *uvsocks);
+
+/* Stops accepting and lets the open sessions finish.  UVSOCKS_OK_DRAINED
+   is reported on the first tunnel once the last one closed, or after msec,
+   0 for no deadline, with the rest left for uvsocks_free () to close.
+   Safe to call from any thread. */
+void
+uvsocks_drain (UvSocks *uvsocks,
+               int      msec);
+
 void
 uvsocks_free (UvSocks *uvsocks);
 
+/* Copies the counters of the tunnel at index tunnel of the params given to
+   uvsocks_new (), or their sum when tunnel is -1.  The bytes of a session
+   are only counted once it closed; uvsocks_get_tunnels () and
+   uvsocks_snapshot () count those of open ones too.  Safe to call from any
+   thread; the loop thread is never blocked. */
+int
+uvsocks_get_stats (UvSocks      *uvsocks,
+                   int           tunnel,
+                   UvSocksStats *stats);
+
+/* Copies the counters of the tunnels from index *cursor on, with the bytes
+   relayed so far by their open sessions, into stats, and their params into
+   params unless NULL, at most n_tunnels of them; *cursor is then advanced
+   past them.  Returns how many were copied, 0 once past the end.  Must be
+   called from the thread running the loop of uvsocks. */
+int
+uvsocks_get_tunnels (UvSocks      *uvsocks,
+                     int          *cursor,
+                     UvSocksStats *stats,
+                     UvSocksParam *params,
+                     int           n_tunnels);
+
+/* Has func called with every tunnel from the loop thread, a batch of them
+   per loop iteration so that thousands of tunnels do not hold up the
+   relay.  The last call comes from uvsocks_free () instead when uvsocks is
+   freed first.  Safe to call from any thread. */
+void
+uvsocks_snapshot (UvSocks             *uvsocks,
+                  UvSocksSnapshotFunc  func,
+                  void                *data);
+
+/* Writes the most recent session events recorded by the loop to path, for
+   uvsocks-trace to print.  Safe to call from any thread; the loop is not
+   stopped while the records are copied. */
+int
+uvsocks_dump_trace (UvSocks    *uvsocks,
+                    const char *path);
+
+/* Reads the durations of a setup step for the tunnel at index tunnel, or
+   through the proxy at index hop (0 is the one given to uvsocks_new ()),
+   or over all tunnels when both are -1.  Safe to call from any thread. */
+int
+uvsocks_get_latency (UvSocks             *uvsocks,
+                     int                  tunnel,
+                     int                  hop,
+                     UvSocksLatency       latency,
+                     UvSocksLatencyStats *stats);
+
+/* Reads how long the deferred reads and accepts of the tunnels of a
+   priority class waited for their turn, in microseconds.  Safe to call
+   from any thread. */
+int
+uvsocks_get_queue_delay (UvSocks             *uvsocks,
+                         int                  priority,
+                         UvSocksLatencyStats *stats);
+
+/* Reads the state of admission to the first proxy, with how long the
+   sessions admitted waited in microseconds.  Safe to call from any
+   thread. */
+int
+uvsocks_get_admission (UvSocks          *uvsocks,
+                       UvSocksAdmission *admission);
+
+/* Reads how much memory uvsocks has allocated.  Safe to call from any
+   thread. */
+int
+uvsocks_get_memory (UvSocks       *uvsocks,
+                    UvSocksMemory *memory);
+
+/* Caps the memory of uvsocks at limit bytes, 0 for no cap.  Allocations
+   past it fail as if the allocator had, which refuses new connections and
+   sessions, reported as UVSOCKS_ERROR_TCP_CREATE_SESSION, and drops
+   statuses of the threaded callback; what is allocated already is kept.
+   Safe to call from any thread. */
+int
+uvsocks_set_memory_limit (UvSocks  *uvsocks,
+                          uint64_t  limit);
+
+/* Copies the sessions of the tunnel at index tunnel into infos, at most
+   n_infos of them, starting from *cursor, which is then advanced past
+   them; start with *cursor at 0.  Returns how many were copied, 0 once
+   past the end.  A session open through all the calls is seen exactly
+   once.  Must be called from the thread running the loop of uvsocks. */
+int
+uvsocks_get_sessions (UvSocks            *uvsocks,
+                      int                 tunnel,
+                      int                *cursor,
+                      UvSocksSessionInfo *infos,
+                      int                 n_infos);
+
+/* Closes the session with the given id.  Must be called from the thread
+   running the loop of uvsocks. */
+int
+uvsocks_kill_session (UvSocks  *uvsocks,
+                      uint32_t  id);
+
+/* Sets how many sessions a forward tunnel may have open at once, 0 for any
+   number.  Connections accepted past it are closed and reported as
+   UVSOCKS_ERROR_TCP_SESSION_LIMIT; open sessions are left alone.  Must be
+   called from the thread running the loop of uvsocks. */
+int
+uvsocks_set_session_limit (UvSocks *uvsocks,
+                           int      tunnel,
+                           int      limit);
+
+int
+uvsocks_get_n_tunnels (UvSocks *uvsocks);
+
+int
+uvsocks_get_n_hops (UvSocks *uvsocks);
+
+/* The parameters of a tunnel as given to uvsocks_new ().  The strings never
+   change; the ports of a reverse tunnel are updated once it is bound, and
+   only its UVSOCKS_OK_SOCKS_BIND status names the proxy as listen_host. */
+const UvSocksParam *
+uvsocks_get_param (UvSocks *uvsocks,
+                   int      tunnel);
+
+const char *
+uvsocks_get_stage_string (UvSocksStage stage);
+
 const char *
 uvsocks_get_status_string (UvSocksStatus status);
 